@@ -0,0 +1,64 @@
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+use cash_gb::cpu::{Cpu, CB_INSTRUCTION_TABLE, INSTRUCTION_TABLE};
+
+const ROUNDS: usize = 4096;
+
+fn opcodes() -> Vec<u8> {
+    // xorshift so the branch predictor can't learn the stream
+    let mut state = 0x2545f491u32;
+    (0..0x10000)
+        .map(|_| {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            state as u8
+        })
+        .collect()
+}
+
+fn bench(name: &str, opcodes: &[u8], decode: impl Fn(u8) -> u8) -> Duration {
+    let start = Instant::now();
+    let mut sum = 0u8;
+    for _ in 0..ROUNDS {
+        for byte in opcodes {
+            sum = sum.wrapping_add(decode(black_box(*byte)));
+        }
+    }
+    black_box(sum);
+    let elapsed = start.elapsed();
+    let decodes = (ROUNDS * opcodes.len()) as f64;
+    println!(
+        "{:<12} {:>8.3} ns/decode",
+        name,
+        elapsed.as_nanos() as f64 / decodes
+    );
+    elapsed
+}
+
+fn main() {
+    let opcodes = opcodes();
+
+    let matched = bench("match", &opcodes, |byte| {
+        Cpu::get_instruction(&byte).operand_bytes()
+    });
+    let table = bench("table", &opcodes, |byte| {
+        INSTRUCTION_TABLE[byte as usize].operand_bytes()
+    });
+    println!(
+        "base speedup: {:.2}x",
+        matched.as_secs_f64() / table.as_secs_f64()
+    );
+
+    let matched = bench("cb match", &opcodes, |byte| {
+        Cpu::get_cb_instruction(&byte).operand_bytes()
+    });
+    let table = bench("cb table", &opcodes, |byte| {
+        CB_INSTRUCTION_TABLE[byte as usize].operand_bytes()
+    });
+    println!(
+        "cb speedup: {:.2}x",
+        matched.as_secs_f64() / table.as_secs_f64()
+    );
+}
@@ -0,0 +1,159 @@
+use std::hint::black_box;
+use std::sync::Arc;
+use std::time::Instant;
+
+use cash_gb::cart::{Cart, CartImage, NINTENDO_LOGO};
+use cash_gb::cpu::{Cpu, Engine, CYCLES_PER_FRAME};
+use cash_gb::ppu::RenderPolicy;
+use cash_gb::read_image;
+use cash_gb::replay::{self, InputLog};
+
+/// Frames per workload, ten seconds of emulated time.
+const FRAMES: u32 = 600;
+/// Frames a real DMG shows per second.
+const DMG_FPS: f64 = 59.73;
+
+/// A 32KiB ROM only cart with a valid header running `code` from 0x150.
+fn test_rom(code: &[u8]) -> Arc<CartImage> {
+    let mut rom = vec![0; 0x8000];
+    // every interrupt handler just returns
+    for vector in (0x40..=0x60).step_by(8) {
+        rom[vector] = 0xd9;
+    }
+    rom[0x100..0x104].copy_from_slice(&[0x00, 0xc3, 0x50, 0x01]);
+    rom[0x104..0x134].copy_from_slice(&NINTENDO_LOGO);
+    rom[0x134..0x13c].copy_from_slice(b"CASHBNCH");
+    rom[0x14d] = rom[0x134..0x14d]
+        .iter()
+        .fold(0u8, |sum, byte| sum.wrapping_sub(*byte).wrapping_sub(1));
+    rom[0x150..0x150 + code.len()].copy_from_slice(code);
+    CartImage::new(rom.into()).expect("bench rom header")
+}
+
+fn bench(name: &str, image: &Arc<CartImage>, engine: Engine, policy: RenderPolicy) {
+    let mut cpu = Cpu::new(Cart::from_image(image.clone()));
+    cpu.set_engine(engine);
+    cpu.set_render_policy(policy);
+    // warm up, and let the block cache fill
+    cpu.run_frame();
+
+    let instructions = cpu.instructions();
+    let start = Instant::now();
+    for _ in 0..FRAMES {
+        black_box(cpu.run_frame());
+    }
+    let elapsed = start.elapsed().as_secs_f64();
+    let instructions = (cpu.instructions() - instructions) as f64;
+
+    println!(
+        "{:<32} {:>10.2} Minstr/s {:>10.1} frames/s {:>8.1}x",
+        format!("{} {:?} {:?}", name, engine, policy),
+        instructions / elapsed / 1e6,
+        FRAMES as f64 / elapsed,
+        FRAMES as f64 / elapsed / DMG_FPS,
+    );
+}
+
+/// Real gameplay: the recorded session `log` replayed flat out.
+fn bench_replay(image: &Arc<CartImage>, log: &InputLog, engine: Engine) {
+    let mut cpu = Cpu::new(Cart::from_image(image.clone()));
+    cpu.set_engine(engine);
+    let start = Instant::now();
+    let report = match replay::replay(&mut cpu, log) {
+        Ok(report) => report,
+        Err(error) => return println!("replay failed: {}", error),
+    };
+    let elapsed = start.elapsed().as_secs_f64();
+    let frames = report.cycles as f64 / CYCLES_PER_FRAME as f64;
+
+    println!(
+        "{:<32} {:>10.2} Minstr/s {:>10.1} frames/s {:>8.1}x",
+        format!("replay {:?}", engine),
+        report.instructions as f64 / elapsed / 1e6,
+        frames / elapsed,
+        frames / elapsed / DMG_FPS,
+    );
+}
+
+/// The same log on both engines at once with a memory hash check a frame,
+/// what a nightly determinism run costs.
+fn bench_lockstep(image: &Arc<CartImage>, log: &InputLog) {
+    let new = |engine| {
+        let mut cpu = Cpu::new(Cart::from_image(image.clone()));
+        cpu.set_engine(engine);
+        cpu
+    };
+    let (mut reference, mut candidate) = (new(Engine::Interpreter), new(Engine::BlockCache));
+    let start = Instant::now();
+    let report = match replay::lockstep(&mut reference, &mut candidate, log, CYCLES_PER_FRAME) {
+        Ok(report) => report,
+        Err(error) => return println!("lockstep failed: {}", error),
+    };
+    let elapsed = start.elapsed().as_secs_f64();
+    let frames = report.cycles as f64 / CYCLES_PER_FRAME as f64;
+
+    println!(
+        "{:<32} {:>10} checks    {:>10.1} frames/s {:>8.1}x",
+        "lockstep",
+        report.checks,
+        frames / elapsed,
+        frames / elapsed / DMG_FPS,
+    );
+}
+
+fn main() {
+    let mut workloads = vec![
+        (
+            "alu",
+            // ld c,3; loop: add a,c; sbc a,c; daa; sub e; inc e; adc a,5; jr loop
+            test_rom(&[
+                0x0e, 0x03, 0x81, 0x99, 0x27, 0x93, 0x1c, 0xce, 0x05, 0x18, 0xf7,
+            ]),
+        ),
+        (
+            "memory",
+            // ld hl,c000; ld de,d000
+            // loop: ld a,(hl); inc a; ld (hl),a; ld (de),a; inc l; inc e; jr loop
+            test_rom(&[
+                0x21, 0x00, 0xc0, 0x11, 0x00, 0xd0, 0x7e, 0x3c, 0x77, 0x12, 0x2c, 0x1c, 0x18, 0xf8,
+            ]),
+        ),
+        (
+            "halt",
+            // ld a,1; ld (ffff),a; ei; loop: halt; jr loop
+            test_rom(&[0x3e, 0x01, 0xea, 0xff, 0xff, 0xfb, 0x76, 0x18, 0xfd]),
+        ),
+    ];
+
+    // full frames of a real game or test rom, e.g. dmg_test_prog_ver1.gb
+    match std::env::var("CASH_GB_BENCH_ROM") {
+        Ok(path) => match read_image(&path) {
+            Ok(image) => workloads.push(("rom", image)),
+            Err(error) => println!("skipping {}: {}", path, error),
+        },
+        Err(_) => println!("set CASH_GB_BENCH_ROM to also bench a rom"),
+    }
+
+    for (name, image) in &workloads {
+        for engine in [Engine::Interpreter, Engine::BlockCache] {
+            bench(name, image, engine, RenderPolicy::Always);
+        }
+        bench(name, image, Engine::Interpreter, RenderPolicy::Never);
+    }
+
+    // an input log recorded on the CASH_GB_BENCH_ROM rom
+    let Ok(path) = std::env::var("CASH_GB_BENCH_REPLAY") else {
+        return println!("set CASH_GB_BENCH_REPLAY to also replay an input log");
+    };
+    let log = std::fs::File::open(&path).and_then(|mut file| InputLog::read_from(&mut file));
+    match (workloads.last(), log) {
+        (Some(("rom", image)), Ok(log)) => {
+            for engine in [Engine::Interpreter, Engine::BlockCache] {
+                bench_replay(image, &log, engine);
+            }
+            bench_lockstep(image, &log);
+        }
+        (_, Err(error)) => println!("skipping {}: {}", path, error),
+        _ => println!("skipping {}: needs CASH_GB_BENCH_ROM", path),
+    }
+}
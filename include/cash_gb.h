@@ -0,0 +1,95 @@
+/* C ABI of the cash-gb core, built as a cdylib by `cargo build --release`.
+ *
+ * Instances are run in batches, one call steps the whole batch and writes
+ * frames and observed ram bytes straight into arrays the caller allocated
+ * once. A ROM image is mapped once and shared by every instance made from
+ * it, each instance only owns its own ram.
+ *
+ * Functions returning int32_t return CASH_GB_OK or a negative error code.
+ * Nothing is thread safe on the caller's side: a batch runs its instances on
+ * threads of its own but is used from one thread at a time. */
+
+#ifndef CASH_GB_H
+#define CASH_GB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CASH_GB_OK 0
+#define CASH_GB_NULL (-1)
+#define CASH_GB_BAD_INDEX (-2)
+#define CASH_GB_BUFFER_TOO_SMALL (-3)
+#define CASH_GB_BAD_STATE (-4)
+#define CASH_GB_WRONG_CART (-5)
+#define CASH_GB_MID_INSTRUCTION (-6)
+
+#define CASH_GB_SCREEN_WIDTH 160
+#define CASH_GB_SCREEN_HEIGHT 144
+/* bytes of one frame in the frame_out of cash_gb_batch_run_frames */
+#define CASH_GB_FRAME_BYTES (CASH_GB_SCREEN_WIDTH * CASH_GB_SCREEN_HEIGHT)
+
+/* button bits of the masks in the inputs of cash_gb_batch_run_frames */
+#define CASH_GB_RIGHT 0x01
+#define CASH_GB_LEFT 0x02
+#define CASH_GB_UP 0x04
+#define CASH_GB_DOWN 0x08
+#define CASH_GB_A 0x10
+#define CASH_GB_B 0x20
+#define CASH_GB_SELECT 0x40
+#define CASH_GB_START 0x80
+
+typedef struct CashGbImage CashGbImage;
+typedef struct CashGbBatch CashGbBatch;
+
+/* A validated ROM, NULL if it can't be read or isn't a valid cart. Batches
+ * keep their image alive, it can be freed as soon as they're made. */
+CashGbImage *cash_gb_image_open(const char *path);
+CashGbImage *cash_gb_image_from_bytes(const uint8_t *rom, size_t len);
+void cash_gb_image_free(CashGbImage *image);
+
+/* Powers on count instances of image, run on up to threads threads or one
+ * per core for 0. */
+CashGbBatch *cash_gb_batch_new(const CashGbImage *image, size_t count, size_t threads);
+void cash_gb_batch_free(CashGbBatch *batch);
+size_t cash_gb_batch_len(const CashGbBatch *batch);
+
+/* Draws every nth frame, 0 for none and 1 for all. Timing is exact either
+ * way, skipped frames leave the last drawn one in place. */
+int32_t cash_gb_batch_render_every(CashGbBatch *batch, uint32_t every);
+
+/* Picks the addresses whose bytes cash_gb_batch_run_frames reports, in this
+ * order. Banked memory reads through whichever bank the game selected. */
+int32_t cash_gb_batch_observe(CashGbBatch *batch, const uint16_t *addrs, size_t count);
+
+/* Runs frames frames of every instance.
+ *
+ * inputs:    len * frames button masks, instance by instance, each held
+ *            for its frame, or NULL to leave the buttons as they are
+ * frame_out: len * CASH_GB_FRAME_BYTES DMG shades, 0 white to 3 black, of
+ *            each instance's last drawn frame, or NULL
+ * ram_out:   len * observed count bytes, or NULL
+ *
+ * where len is cash_gb_batch_len. */
+int32_t cash_gb_batch_run_frames(CashGbBatch *batch, uint32_t frames, const uint8_t *inputs,
+                                 uint8_t *frame_out, uint8_t *ram_out);
+
+/* Bytes a save state of any instance of the batch needs. */
+size_t cash_gb_state_size(const CashGbBatch *batch);
+int32_t cash_gb_save_state(const CashGbBatch *batch, size_t index, uint8_t *buf, size_t len);
+/* Takes a state of the same cart saved by any instance of any batch. A state
+ * that isn't one, or holds a value no save could have written, gives
+ * CASH_GB_BAD_STATE and leaves the instance as it was. */
+int32_t cash_gb_load_state(CashGbBatch *batch, size_t index, const uint8_t *buf, size_t len);
+
+/* Copies instance from over every other instance of the batch. */
+int32_t cash_gb_batch_fork(CashGbBatch *batch, size_t from);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
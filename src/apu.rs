@@ -0,0 +1,534 @@
+use crate::ring::Producer;
+use crate::state::{StateError, StateReader, StateWriter, APU_OFFSET};
+
+/// T-cycles per second, channel timers count in these
+const T_CLOCK: u64 = 1 << 22;
+
+// offsets from 0xff10
+const NR10: usize = 0x00;
+const NR30: usize = 0x0a;
+const NR43: usize = 0x12;
+const NR50: usize = 0x14;
+const NR51: usize = 0x15;
+const NR52: usize = 0x16;
+const WAVE: usize = 0x20;
+
+/// Bits that read back as 1, write only and unused ones.
+#[rustfmt::skip]
+const READ_MASK: [u8; 0x30] = [
+    0x80, 0x3f, 0x00, 0xff, 0xbf, // NR10..NR14
+    0xff, 0x3f, 0x00, 0xff, 0xbf, // NR20..NR24
+    0x7f, 0xff, 0x9f, 0xff, 0xbf, // NR30..NR34
+    0xff, 0xff, 0x00, 0x00, 0xbf, // NR40..NR44
+    0x00, 0x00, 0x70, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // wave ram
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+];
+
+const DUTY: [u8; 4] = [0b0000_0001, 0b1000_0001, 0b1000_0111, 0b0111_1110];
+
+/// One of the four voices. Every channel keeps its registers at
+/// `base..base + 5` so the common parts are handled by index.
+#[derive(Clone, Copy, Default)]
+struct Channel {
+    on: bool,
+    length: u16,
+    volume: u8,
+    envelope_timer: u8,
+    /// T-cycles to the next step of the waveform
+    timer: u32,
+    /// duty step or wave sample, unused by noise
+    position: u8,
+}
+
+/// The frequency sweep of channel 1.
+#[derive(Clone, Copy, Default)]
+struct Sweep {
+    timer: u8,
+    enabled: bool,
+    shadow: u16,
+}
+
+struct Output {
+    samples: Producer<i16>,
+    rate: u64,
+    /// progress towards the next sample, in units of `rate` per T-cycle
+    phase: u64,
+    buffer: Vec<i16>,
+}
+
+/// The four sound channels.
+///
+/// What games can observe, the length counters and sweep switching
+/// channels off, is clocked by the frame sequencer the bus schedules off
+/// DIV. Samples are only made when an output is attached, and then in
+/// batches: everything between two register writes or sequencer steps is
+/// rendered in one go with the registers fixed.
+pub(crate) struct Apu {
+    registers: [u8; 0x30],
+    channels: [Channel; 4],
+    sweep: Sweep,
+    lfsr: u16,
+    /// frame sequencer step the next tick runs
+    sequencer: u8,
+    /// cycle samples have been rendered up to
+    synced: u64,
+    output: Option<Output>,
+}
+
+impl Apu {
+    /// Powered on, as the boot rom leaves it.
+    pub fn new() -> Self {
+        let mut registers = [0; 0x30];
+        registers[NR52] = 0x80;
+        Self {
+            registers,
+            channels: [Channel::default(); 4],
+            sweep: Sweep::default(),
+            lfsr: 0x7fff,
+            sequencer: 0,
+            synced: 0,
+            output: None,
+        }
+    }
+
+    pub fn powered(&self) -> bool {
+        self.registers[NR52] & 0x80 != 0
+    }
+
+    /// Reads 0xff10..=0xff3f.
+    pub fn read(&self, addr: u16) -> u8 {
+        let index = (addr - 0xff10) as usize;
+        if index == NR52 {
+            let on = self
+                .channels
+                .iter()
+                .rev()
+                .fold(0, |bits, c| bits << 1 | c.on as u8);
+            return self.registers[NR52] & 0x80 | READ_MASK[NR52] | on;
+        }
+        self.registers[index] | READ_MASK[index]
+    }
+
+    /// Writes 0xff10..=0xff3f, rendering everything before it under the old
+    /// settings first.
+    pub fn write(&mut self, now: u64, addr: u16, value: u8) {
+        self.render(now);
+        let index = (addr - 0xff10) as usize;
+        if index >= WAVE {
+            self.registers[index] = value;
+            return;
+        }
+        if index == NR52 {
+            return self.set_power(value & 0x80 != 0);
+        }
+        if !self.powered() {
+            return;
+        }
+
+        self.registers[index] = value;
+        if index >= NR50 {
+            return;
+        }
+        let (channel, register) = (index / 5, index % 5);
+        match (channel, register) {
+            (_, 1) => {
+                let max = max_length(channel);
+                let value = if channel == 2 { value } else { value & 0x3f };
+                self.channels[channel].length = max - value as u16;
+            }
+            (_, 2) | (2, 0) if !self.dac(channel) => self.channels[channel].on = false,
+            (_, 4) if value & 0x80 != 0 => self.trigger(channel),
+            _ => (),
+        }
+    }
+
+    fn set_power(&mut self, on: bool) {
+        if on == self.powered() {
+            return;
+        }
+        if on {
+            self.sequencer = 0;
+        } else {
+            // wave ram is the only thing that survives
+            self.registers[..WAVE].fill(0);
+            self.channels = [Channel::default(); 4];
+            self.sweep = Sweep::default();
+        }
+        self.registers[NR52] = (on as u8) << 7;
+    }
+
+    fn dac(&self, channel: usize) -> bool {
+        match channel {
+            2 => self.registers[NR30] & 0x80 != 0,
+            _ => self.registers[channel * 5 + 2] & 0xf8 != 0,
+        }
+    }
+
+    fn frequency(&self, channel: usize) -> u16 {
+        let base = channel * 5;
+        (self.registers[base + 4] as u16 & 0x07) << 8 | self.registers[base + 3] as u16
+    }
+
+    /// T-cycles between steps of the waveform.
+    fn period(&self, channel: usize) -> u32 {
+        match channel {
+            0 | 1 => (2048 - self.frequency(channel) as u32) * 4,
+            2 => (2048 - self.frequency(channel) as u32) * 2,
+            _ => {
+                let nr43 = self.registers[NR43];
+                let divisor = match nr43 & 0x07 {
+                    0 => 8,
+                    code => code as u32 * 16,
+                };
+                divisor << (nr43 >> 4)
+            }
+        }
+    }
+
+    fn trigger(&mut self, channel: usize) {
+        let envelope = self.registers[channel * 5 + 2];
+        let period = self.period(channel);
+        let dac = self.dac(channel);
+        let state = &mut self.channels[channel];
+        state.on = dac;
+        if state.length == 0 {
+            state.length = max_length(channel);
+        }
+        state.volume = envelope >> 4;
+        state.envelope_timer = envelope & 0x07;
+        state.timer = period;
+        match channel {
+            0 => {
+                let nr10 = self.registers[NR10];
+                self.sweep.shadow = self.frequency(0);
+                self.sweep.timer = sweep_period(nr10);
+                self.sweep.enabled = nr10 & 0x77 != 0;
+                if nr10 & 0x07 != 0 {
+                    self.sweep_frequency();
+                }
+            }
+            2 => state.position = 0,
+            3 => self.lfsr = 0x7fff,
+            _ => (),
+        }
+    }
+
+    /// The next swept frequency, switching channel 1 off on overflow.
+    fn sweep_frequency(&mut self) -> u16 {
+        let nr10 = self.registers[NR10];
+        let delta = self.sweep.shadow >> (nr10 & 0x07);
+        let frequency = match nr10 & 0x08 != 0 {
+            true => self.sweep.shadow.wrapping_sub(delta),
+            false => self.sweep.shadow + delta,
+        };
+        if frequency > 0x7ff {
+            self.channels[0].on = false;
+        }
+        frequency
+    }
+
+    /// Runs one step of the 512Hz frame sequencer, falling edges of DIV bit
+    /// 4 clock it.
+    pub fn clock_sequencer(&mut self, now: u64) {
+        if !self.powered() {
+            return;
+        }
+        self.render(now);
+        let step = self.sequencer;
+        self.sequencer = (step + 1) & 0x07;
+
+        if step & 0x01 == 0 {
+            for channel in 0..4 {
+                let enabled = self.registers[channel * 5 + 4] & 0x40 != 0;
+                let state = &mut self.channels[channel];
+                if enabled && state.length > 0 {
+                    state.length -= 1;
+                    state.on &= state.length > 0;
+                }
+            }
+        }
+        if step == 2 || step == 6 {
+            self.clock_sweep();
+        }
+        if step == 7 {
+            for channel in [0, 1, 3] {
+                let envelope = self.registers[channel * 5 + 2];
+                let state = &mut self.channels[channel];
+                if envelope & 0x07 == 0 || state.envelope_timer == 0 {
+                    continue;
+                }
+                state.envelope_timer -= 1;
+                if state.envelope_timer == 0 {
+                    state.envelope_timer = envelope & 0x07;
+                    match envelope & 0x08 != 0 {
+                        true if state.volume < 15 => state.volume += 1,
+                        false if state.volume > 0 => state.volume -= 1,
+                        _ => (),
+                    }
+                }
+            }
+        }
+    }
+
+    fn clock_sweep(&mut self) {
+        self.sweep.timer = self.sweep.timer.saturating_sub(1);
+        if self.sweep.timer > 0 {
+            return;
+        }
+        let nr10 = self.registers[NR10];
+        self.sweep.timer = sweep_period(nr10);
+        if !self.sweep.enabled || nr10 & 0x70 == 0 {
+            return;
+        }
+        let frequency = self.sweep_frequency();
+        if frequency <= 0x7ff && nr10 & 0x07 != 0 {
+            self.sweep.shadow = frequency;
+            self.registers[0x03] = frequency as u8;
+            self.registers[0x04] = self.registers[0x04] & !0x07 | (frequency >> 8) as u8;
+            self.sweep_frequency();
+        }
+    }
+
+    /// Starts making samples at `rate` Hz into `samples`. Whatever doesn't
+    /// fit in the ring is dropped, the emulation never waits for audio.
+    pub fn attach(&mut self, now: u64, samples: Producer<i16>, rate: u32) {
+        self.synced = now;
+        self.output = Some(Output {
+            samples,
+            rate: rate.max(1) as u64,
+            phase: 0,
+            buffer: vec![],
+        });
+    }
+
+    pub fn detach(&mut self) -> Option<Producer<i16>> {
+        self.output.take().map(|output| output.samples)
+    }
+
+    /// Renders interleaved stereo samples up to `now`. Without an output
+    /// this is free, the waveforms only matter to what's heard.
+    pub fn render(&mut self, now: u64) {
+        let cycles = now.saturating_sub(self.synced);
+        self.synced = now;
+        let Some(mut output) = self.output.take() else {
+            return;
+        };
+
+        let mut remaining = cycles * 4;
+        output.buffer.clear();
+        while remaining > 0 {
+            let until_sample = (T_CLOCK - output.phase).div_ceil(output.rate);
+            let step = until_sample.min(remaining);
+            self.advance(step as u32);
+            remaining -= step;
+            output.phase += step * output.rate;
+            if output.phase >= T_CLOCK {
+                output.phase -= T_CLOCK;
+                let (left, right) = self.mix();
+                output.buffer.extend_from_slice(&[left, right]);
+            }
+        }
+        output.samples.push_slice(&output.buffer);
+        self.output = Some(output);
+    }
+
+    /// Moves every playing waveform on by `cycles` T-cycles.
+    fn advance(&mut self, cycles: u32) {
+        for channel in 0..4 {
+            if !self.channels[channel].on {
+                continue;
+            }
+            let period = self.period(channel);
+            let state = &mut self.channels[channel];
+            let steps = match cycles < state.timer {
+                true => {
+                    state.timer -= cycles;
+                    continue;
+                }
+                false => {
+                    let over = cycles - state.timer;
+                    state.timer = period - over % period;
+                    1 + over / period
+                }
+            };
+            match channel {
+                0 | 1 => state.position = ((state.position as u32 + steps) & 0x07) as u8,
+                2 => state.position = ((state.position as u32 + steps) & 0x1f) as u8,
+                // clock shifts of 14 and 15 stop the noise
+                _ if self.registers[NR43] >> 4 >= 14 => (),
+                _ => {
+                    let narrow = self.registers[NR43] & 0x08 != 0;
+                    for _ in 0..steps {
+                        let bit = (self.lfsr ^ self.lfsr >> 1) & 1;
+                        self.lfsr = self.lfsr >> 1 | bit << 14;
+                        if narrow {
+                            self.lfsr = self.lfsr & !0x40 | bit << 6;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /// The 0..=15 level a channel is putting out.
+    fn level(&self, channel: usize) -> u8 {
+        let state = &self.channels[channel];
+        match channel {
+            0 | 1 => {
+                let duty = DUTY[self.registers[channel * 5 + 1] as usize >> 6];
+                (duty >> state.position & 1) * state.volume
+            }
+            2 => {
+                let byte = self.registers[WAVE + state.position as usize / 2];
+                let sample = if state.position & 1 == 0 {
+                    byte >> 4
+                } else {
+                    byte & 0x0f
+                };
+                match self.registers[0x0c] >> 5 & 0x03 {
+                    0 => 0,
+                    shift => sample >> (shift - 1),
+                }
+            }
+            _ => (!self.lfsr & 1) as u8 * state.volume,
+        }
+    }
+
+    fn mix(&self) -> (i16, i16) {
+        let (mut left, mut right) = (0i32, 0i32);
+        let panning = self.registers[NR51];
+        for channel in 0..4 {
+            if !self.channels[channel].on || !self.dac(channel) {
+                continue;
+            }
+            let level = self.level(channel) as i32 * 2 - 15;
+            if panning & 0x10 << channel != 0 {
+                left += level;
+            }
+            if panning & 0x01 << channel != 0 {
+                right += level;
+            }
+        }
+        let volume = self.registers[NR50];
+        let left = left * ((volume >> 4 & 0x07) as i32 + 1);
+        let right = right * ((volume & 0x07) as i32 + 1);
+        // four channels at full volume just fit
+        ((left * 64) as i16, (right * 64) as i16)
+    }
+
+    pub fn save_state(&self, w: &mut StateWriter) {
+        w.seek(APU_OFFSET);
+        w.bytes(&self.registers);
+        for channel in &self.channels {
+            w.bool(channel.on);
+            w.u16(channel.length);
+            w.u8(channel.volume);
+            w.u8(channel.envelope_timer);
+            w.u32(channel.timer);
+            w.u8(channel.position);
+        }
+        w.u8(self.sweep.timer);
+        w.bool(self.sweep.enabled);
+        w.u16(self.sweep.shadow);
+        w.u16(self.lfsr);
+        w.u8(self.sequencer);
+    }
+
+    /// Turns down channel state no register writes could lead to, the
+    /// waveforms shift and index by it.
+    pub fn check_state(&self, r: &mut StateReader) -> Result<(), StateError> {
+        r.seek(APU_OFFSET + 0x30);
+        for channel in 0..4 {
+            r.u8_in(0..=1)?;
+            r.u16_in(0..=max_length(channel))?;
+            r.u8_in(0..=0x0f)?;
+            r.u8_in(0..=0x07)?;
+            r.u32();
+            match channel {
+                0 | 1 => r.u8_in(0..=0x07)?,
+                2 => r.u8_in(0..=0x1f)?,
+                _ => r.u8(),
+            };
+        }
+        r.u8_in(0..=8)?;
+        r.u8_in(0..=1)?;
+        r.u16_in(0..=0x7ff)?;
+        r.u16_in(0..=0x7fff)?;
+        r.u8_in(0..=0x07)?;
+        Ok(())
+    }
+
+    pub fn load_state(&mut self, r: &mut StateReader, now: u64) {
+        r.seek(APU_OFFSET);
+        self.registers = r.array();
+        for channel in &mut self.channels {
+            channel.on = r.bool();
+            channel.length = r.u16();
+            channel.volume = r.u8();
+            channel.envelope_timer = r.u8();
+            channel.timer = r.u32();
+            channel.position = r.u8();
+        }
+        self.sweep.timer = r.u8();
+        self.sweep.enabled = r.bool();
+        self.sweep.shadow = r.u16();
+        self.lfsr = r.u16();
+        self.sequencer = r.u8();
+        self.synced = now;
+    }
+
+    /// Copies the machine state, the output stays where it is.
+    pub fn clone_state_from(&mut self, other: &Apu, now: u64) {
+        self.registers = other.registers;
+        self.channels = other.channels;
+        self.sweep = other.sweep;
+        self.lfsr = other.lfsr;
+        self.sequencer = other.sequencer;
+        self.synced = now;
+    }
+}
+
+fn max_length(channel: usize) -> u16 {
+    if channel == 2 {
+        256
+    } else {
+        64
+    }
+}
+
+/// A sweep period of 0 still counts down from 8.
+fn sweep_period(nr10: u8) -> u8 {
+    match nr10 >> 4 & 0x07 {
+        0 => 8,
+        period => period,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::ring;
+
+    #[test]
+    fn renders_a_fast_square_at_a_low_rate() {
+        // the highest frequency steps the duty every 4 T-cycles, at this
+        // rate 253 of them to a sample
+        const RATE: u32 = 4145;
+        let (producer, mut consumer) = ring::channel(1 << 14);
+        let mut apu = Apu::new();
+        apu.attach(0, producer, RATE);
+        apu.write(0, 0xff24, 0x77);
+        apu.write(0, 0xff25, 0x11);
+        apu.write(0, 0xff11, 0x80);
+        apu.write(0, 0xff12, 0xf0);
+        apu.write(0, 0xff13, 0xff);
+        apu.write(0, 0xff14, 0x87);
+        apu.render(T_CLOCK / 4);
+
+        let mut samples = vec![0; 1 << 14];
+        let len = consumer.pop_slice(&mut samples);
+        assert_eq!(len, RATE as usize * 2);
+        assert!(samples[..len].iter().all(|s| s.abs() == 15 * 8 * 64));
+    }
+}
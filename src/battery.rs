@@ -0,0 +1,184 @@
+use std::{
+    fs::{File, OpenOptions},
+    io::{self, Read, Seek, SeekFrom, Write},
+    ops::{Deref, DerefMut},
+    path::Path,
+};
+
+use crate::mmap::MmapMut;
+
+/// When battery backed ram is forced out to its save file.
+///
+/// The ram is a shared mapping of the file whatever the policy, so every
+/// write the game makes is in the page cache straight away and survives the
+/// process exiting. The policy only decides when to wait for it to reach the
+/// disk, every policy also does so once the cart is dropped. Where files
+/// can't be mapped the ram is a copy of the file instead, and the policy
+/// decides when it's written back.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FlushPolicy {
+    OnExit,
+    /// Every so many M-cycles of emulated time.
+    Periodic(u64),
+    /// Whenever the game write protects its ram through the mapper, which is
+    /// what most of them do once a save is complete.
+    OnRamDisable,
+}
+
+/// Cart ram, either plain memory, a mapped save file or a copy of one.
+pub(crate) enum Sram {
+    Volatile(Vec<u8>),
+    Battery {
+        map: MmapMut,
+        policy: FlushPolicy,
+        /// holds the lock on the save file, unmapped before it's dropped
+        _file: File,
+    },
+    /// a save file read into memory, written back by `flush`
+    Buffered {
+        ram: Vec<u8>,
+        policy: FlushPolicy,
+        file: File,
+    },
+}
+
+impl Sram {
+    pub fn new(len: usize) -> Self {
+        Sram::Volatile(vec![0; len])
+    }
+
+    /// Maps `len` bytes of the save file at `path`, creating it if needed.
+    /// Anything the file holds past `len`, like an appended clock, is kept.
+    ///
+    /// The file is locked for as long as the ram lives. Two carts on one
+    /// shared mapping would race each other's writes, so a file another
+    /// cart has open, in this process or any other, is refused. Where the
+    /// file can't be mapped it's read into memory instead.
+    pub fn open(path: &Path, len: usize, policy: FlushPolicy) -> io::Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(path)?;
+        if file.try_lock().is_err() {
+            return Err(io::Error::new(
+                io::ErrorKind::WouldBlock,
+                "save file is in use by another cart",
+            ));
+        }
+        match MmapMut::open(&file, len) {
+            Ok(map) => Ok(Sram::Battery {
+                map,
+                policy,
+                _file: file,
+            }),
+            Err(_) => Sram::buffered(file, len, policy),
+        }
+    }
+
+    /// Reads the first `len` bytes of the locked `file`, zero past its end.
+    fn buffered(mut file: File, len: usize, policy: FlushPolicy) -> io::Result<Self> {
+        let mut ram = Vec::with_capacity(len);
+        (&mut file).take(len as u64).read_to_end(&mut ram)?;
+        ram.resize(len, 0);
+        Ok(Sram::Buffered { ram, policy, file })
+    }
+
+    pub fn policy(&self) -> Option<FlushPolicy> {
+        match self {
+            Sram::Volatile(_) => None,
+            Sram::Battery { policy, .. } | Sram::Buffered { policy, .. } => Some(*policy),
+        }
+    }
+
+    pub fn flush(&self) -> io::Result<()> {
+        match self {
+            Sram::Volatile(_) => Ok(()),
+            Sram::Battery { map, .. } => map.flush(),
+            Sram::Buffered { ram, file, .. } => {
+                let mut file = file;
+                file.seek(SeekFrom::Start(0))?;
+                file.write_all(ram)?;
+                file.sync_data()
+            }
+        }
+    }
+}
+
+impl Deref for Sram {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            Sram::Volatile(ram) | Sram::Buffered { ram, .. } => ram,
+            Sram::Battery { map, .. } => map,
+        }
+    }
+}
+
+impl DerefMut for Sram {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        match self {
+            Sram::Volatile(ram) | Sram::Buffered { ram, .. } => ram,
+            Sram::Battery { map, .. } => map,
+        }
+    }
+}
+
+impl Drop for Sram {
+    fn drop(&mut self) {
+        // nothing is left to report an error to
+        let _ = self.flush();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn save_file_is_opened_once() {
+        let path = std::env::temp_dir().join(format!("cash-gb-test-{}.sav", std::process::id()));
+        let first = Sram::open(&path, 0x2000, FlushPolicy::OnExit).unwrap();
+        assert!(Sram::open(&path, 0x2000, FlushPolicy::OnExit).is_err());
+        drop(first);
+        let mut again = Sram::open(&path, 0x2000, FlushPolicy::OnExit).unwrap();
+        again[0] = 0x42;
+        drop(again);
+        assert_eq!(std::fs::read(&path).unwrap()[0], 0x42);
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn unmapped_save_file_is_written_back() {
+        let path = std::env::temp_dir().join(format!("cash-gb-test-{}.buf", std::process::id()));
+        // a clock appended past the ram has to survive the write back
+        std::fs::write(&path, [0x11, 0x22, 0x33, 0x44]).unwrap();
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(&path)
+            .unwrap();
+        let mut ram = Sram::buffered(file, 2, FlushPolicy::OnExit).unwrap();
+        assert_eq!(*ram, [0x11, 0x22]);
+        ram[1] = 0x42;
+        ram.flush().unwrap();
+        assert_eq!(std::fs::read(&path).unwrap(), [0x11, 0x42, 0x33, 0x44]);
+
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(&path)
+            .unwrap();
+        let mut ram = Sram::buffered(file, 6, FlushPolicy::OnExit).unwrap();
+        assert_eq!(*ram, [0x11, 0x42, 0x33, 0x44, 0x00, 0x00]);
+        ram[5] = 0x55;
+        drop(ram);
+        assert_eq!(
+            std::fs::read(&path).unwrap(),
+            [0x11, 0x42, 0x33, 0x44, 0, 0x55]
+        );
+        std::fs::remove_file(&path).unwrap();
+    }
+}
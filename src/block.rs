@@ -0,0 +1,148 @@
+use std::collections::HashMap;
+use std::hash::{BuildHasherDefault, Hasher};
+use std::ops::Range;
+
+use crate::bus::PageSet;
+use crate::cpu::{Handler, Instruction};
+
+/// Longest straight line run decoded into a single block.
+pub(crate) const MAX_BLOCK_LEN: usize = 64;
+/// Decoded ops kept before the whole cache is dropped and rebuilt, stale
+/// blocks leave their ops behind until then.
+const MAX_OPS: usize = 1 << 20;
+const RECENT_SIZE: usize = 256;
+const NO_KEY: u32 = u32::MAX;
+
+/// A pre-decoded instruction, CB prefixed ones are folded into one op.
+#[derive(Clone, Copy)]
+pub(crate) struct Op {
+    /// kept for tracing and profiling, `handler` is what runs
+    pub instruction: Instruction,
+    /// the last opcode byte, the CB one of a prefixed op
+    pub opcode: u8,
+    pub handler: Handler,
+    pub cycles: u8,
+    /// opcode bytes to step over before running it, operands are still read
+    /// by the handler
+    pub opcode_len: u8,
+}
+
+/// Blocks are keyed by `bank << 16 | address` so each bank of a switchable
+/// region gets its own, and hold a range of the shared op buffer.
+pub(crate) struct BlockCache {
+    ops: Vec<Op>,
+    start: usize,
+    /// direct mapped by address in front of the map, most loops never get
+    /// past it
+    recent: [(u32, u32, u32); RECENT_SIZE],
+    blocks: HashMap<u32, (u32, u32), BuildHasherDefault<KeyHasher>>,
+    /// blocks decoded from ram, with the first and last page they cover
+    ram_blocks: Vec<(u32, u8, u8)>,
+}
+
+impl BlockCache {
+    pub fn new() -> Self {
+        Self {
+            ops: vec![],
+            start: 0,
+            recent: [(NO_KEY, 0, 0); RECENT_SIZE],
+            blocks: HashMap::default(),
+            ram_blocks: vec![],
+        }
+    }
+
+    #[inline(always)]
+    pub fn get(&mut self, key: u32) -> Option<Range<usize>> {
+        let slot = key as usize % RECENT_SIZE;
+        let (recent, start, end) = self.recent[slot];
+        if recent == key {
+            return Some(start as usize..end as usize);
+        }
+        let &(start, end) = self.blocks.get(&key)?;
+        self.recent[slot] = (key, start, end);
+        Some(start as usize..end as usize)
+    }
+
+    #[inline(always)]
+    pub fn op(&self, index: usize) -> Op {
+        self.ops[index]
+    }
+
+    /// Starts decoding a new block, ops pushed from here on belong to it.
+    pub fn begin(&mut self) {
+        if self.ops.len() > MAX_OPS {
+            self.clear();
+        }
+        self.start = self.ops.len();
+    }
+
+    pub fn push(&mut self, op: Op) {
+        self.ops.push(op);
+    }
+
+    /// Ops pushed since `begin`.
+    pub fn pending(&self) -> usize {
+        self.ops.len() - self.start
+    }
+
+    /// Files the pending ops under `key`. Blocks read from ram pass the pages
+    /// they were decoded from so writes there can drop them.
+    pub fn finish(&mut self, key: u32, ram_pages: Option<(u8, u8)>) -> Option<Range<usize>> {
+        if self.pending() == 0 {
+            return None;
+        }
+        let (start, end) = (self.start as u32, self.ops.len() as u32);
+        self.blocks.insert(key, (start, end));
+        if let Some((first, last)) = ram_pages {
+            self.ram_blocks.push((key, first, last));
+        }
+        Some(self.start..self.ops.len())
+    }
+
+    /// Drops every ram block covering one of `pages`.
+    pub fn invalidate(&mut self, pages: PageSet) {
+        let blocks = &mut self.blocks;
+        self.ram_blocks.retain(|&(key, first, last)| {
+            let hit = (first..=last).any(|page| pages.contains(page));
+            if hit {
+                blocks.remove(&key);
+            }
+            !hit
+        });
+        self.recent.fill((NO_KEY, 0, 0));
+    }
+
+    pub fn clear(&mut self) {
+        self.ops.clear();
+        self.start = 0;
+        self.recent.fill((NO_KEY, 0, 0));
+        self.blocks.clear();
+        self.ram_blocks.clear();
+    }
+}
+
+/// The keys are already unique integers, a single multiply spreads them
+/// well enough and is far cheaper than SipHash on the dispatch path.
+#[derive(Default)]
+pub(crate) struct KeyHasher(u64);
+
+impl Hasher for KeyHasher {
+    fn finish(&self) -> u64 {
+        self.0
+    }
+
+    fn write(&mut self, bytes: &[u8]) {
+        for byte in bytes {
+            self.write_u64(*byte as u64);
+        }
+    }
+
+    fn write_u32(&mut self, value: u32) {
+        self.write_u64(value as u64);
+    }
+
+    fn write_u64(&mut self, value: u64) {
+        let hash = (self.0 ^ value).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+        self.0 = hash ^ (hash >> 32);
+    }
+}
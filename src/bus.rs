@@ -0,0 +1,1034 @@
+use std::{io, mem, ptr, slice};
+
+use crate::apu::Apu;
+use crate::battery::FlushPolicy;
+use crate::cart::Cart;
+use crate::cpu::Interrupt;
+use crate::hash::{xxh64, MemoryHash};
+use crate::joypad::Joypad;
+use crate::ppu::{Mode, Ppu};
+use crate::ring::Producer;
+use crate::scheduler::{Event, Scheduler};
+use crate::state::{
+    DirtyPages, StateError, StateReader, StateWriter, BUS_OFFSET, CART_RAM_OFFSET, DMA_OFFSET,
+    H_RAM_OFFSET, IO_OFFSET, OAM_OFFSET, SERIAL_OFFSET, STATE_PAGE_SIZE, V_RAM_OFFSET,
+    W_RAM_OFFSET,
+};
+use crate::timer::Timer;
+use crate::trace::trace;
+
+const PAGE_SIZE: usize = 0x100;
+const PAGE_COUNT: usize = 0x100;
+/// M-cycles to shift out a byte on the internal 8192Hz clock
+const SERIAL_CYCLES: u64 = 1024;
+/// M-cycles an OAM DMA keeps OAM locked for
+const OAM_DMA_CYCLES: u64 = 160;
+/// single speed M-cycles the cpu waits per 16 byte block of HDMA
+const HDMA_BLOCK_CYCLES: u64 = 8;
+/// M-cycles the cpu pauses for while the clock switches speed
+const SPEED_SWITCH_CYCLES: u64 = 2050;
+
+// CGB io register indexes
+const KEY1: usize = 0x4d;
+const HDMA1: usize = 0x51;
+const HDMA2: usize = 0x52;
+const HDMA3: usize = 0x53;
+const HDMA4: usize = 0x54;
+const HDMA5: usize = 0x55;
+
+/// Direct pointers to the start of a 256 byte page of backing memory, a null
+/// pointer sends the access down the slow path to the handlers. Writable
+/// pages also carry the save state page they land in for dirty tracking.
+#[derive(Clone, Copy)]
+struct Page {
+    read: *const u8,
+    write: *mut u8,
+    state_page: u16,
+}
+
+impl Page {
+    const UNMAPPED: Page = Page {
+        read: ptr::null(),
+        write: ptr::null_mut(),
+        state_page: 0,
+    };
+}
+
+pub struct Bus {
+    pages: [Page; PAGE_COUNT],
+    cart: Cart,
+    v_ram: Box<[[u8; 0x2000]; 2]>,
+    v_ram_bank: u8,
+    w_ram: Box<[[u8; 0x1000]; 8]>,
+    w_ram_bank: u8,
+    oam: [u8; 0xa0],
+    io_registers: [u8; 0x80],
+    h_ram: [u8; 0x80],
+    ie: u8,
+    ppu: Ppu,
+    timer: Timer,
+    apu: Apu,
+    joypad: Joypad,
+    /// bytes sent over the link cable while capturing, nothing is ever on
+    /// the other end
+    serial_output: Option<Vec<u8>>,
+    scheduler: Scheduler,
+    /// cycle count as of the last sync, writes are timed against it
+    now: u64,
+    dirty: DirtyPages,
+    /// pages the block cache has decoded code from, kept off the fast write
+    /// path so writes to them can be caught
+    code_pages: PageSet,
+    code_written: PageSet,
+    code_event: bool,
+    /// whether the cart runs on a CGB, which is what KEY1 and HDMA need
+    cgb: bool,
+    /// cpu cycle of the last speed switch and the slow clock as of then
+    switched_at: u64,
+    slow_at: u64,
+    /// M-cycles DMA has held the cpu off the bus for that it hasn't waited
+    stall: u64,
+}
+
+// SAFETY: the page pointers only ever point into memory owned by the bus
+// itself (or the shared, read only rom), so moving it between threads moves
+// everything they point at along with it
+unsafe impl Send for Bus {}
+
+impl Bus {
+    pub fn new(cart: Cart) -> Self {
+        let cgb = cart.image().header().cgb();
+        let mut bus = Self {
+            pages: [Page::UNMAPPED; PAGE_COUNT],
+            cart,
+            v_ram: Box::new([[0; 0x2000]; 2]),
+            v_ram_bank: 0,
+            w_ram: Box::new([[0; 0x1000]; 8]),
+            w_ram_bank: 1,
+            oam: [0; 0xa0],
+            io_registers: [0; 0x80],
+            h_ram: [0; 0x80],
+            ie: 0,
+            ppu: Ppu::new(),
+            timer: Timer::new(),
+            apu: Apu::new(),
+            joypad: Joypad::new(),
+            serial_output: None,
+            scheduler: Scheduler::new(),
+            now: 0,
+            dirty: DirtyPages::CLEAN,
+            code_pages: PageSet::EMPTY,
+            code_written: PageSet::EMPTY,
+            code_event: false,
+            cgb,
+            switched_at: 0,
+            slow_at: 0,
+            stall: 0,
+        };
+
+        // no HDMA running
+        bus.io_registers[HDMA5] = 0xff;
+        bus.remap();
+        bus.schedule_apu();
+        bus.schedule_battery();
+        bus
+    }
+
+    #[inline(always)]
+    pub fn read(&self, addr: u16) -> u8 {
+        let page = self.pages[(addr >> 8) as usize];
+        if page.read.is_null() {
+            return self.read_slow(addr);
+        }
+        // SAFETY: mapped pages always point at PAGE_SIZE bytes of memory owned
+        // by the bus, and are remapped whenever that memory is re-banked.
+        unsafe { *page.read.add(addr as usize & (PAGE_SIZE - 1)) }
+    }
+
+    #[inline(always)]
+    pub fn write(&mut self, addr: u16, value: u8) {
+        let page = self.pages[(addr >> 8) as usize];
+        if page.write.is_null() {
+            return self.write_slow(addr, value);
+        }
+        // SAFETY: see read
+        unsafe { *page.write.add(addr as usize & (PAGE_SIZE - 1)) = value }
+        self.dirty.mark(page.state_page);
+    }
+
+    /// The cycle of the last sync.
+    pub(crate) fn now(&self) -> u64 {
+        self.now
+    }
+
+    /// Brings everything clocked alongside the cpu up to `now`, running any
+    /// events that came due.
+    #[inline(always)]
+    pub(crate) fn sync(&mut self, now: u64) {
+        debug_assert!(now >= self.now, "bus synced backwards");
+        self.now = now;
+        if now >= self.scheduler.next() {
+            self.run_events(now);
+        }
+    }
+
+    #[cold]
+    fn run_events(&mut self, now: u64) {
+        while let Some(event) = self.scheduler.pop(now) {
+            match event {
+                Event::Ppu => {
+                    self.advance_ppu();
+                    self.schedule_ppu();
+                }
+                Event::Timer => {
+                    if let Some(at) = self.timer.overflow_at() {
+                        self.timer.overflow(at);
+                        self.request_interrupt(Interrupt::Timer);
+                    }
+                    self.schedule_timer();
+                }
+                Event::Serial => {
+                    self.io_registers[0x01] = 0xff;
+                    self.io_registers[0x02] &= 0x7f;
+                    self.request_interrupt(Interrupt::Serial);
+                }
+                Event::Apu => {
+                    self.apu.clock_sequencer(self.slow_clock(now));
+                    self.schedule_apu();
+                }
+                Event::Battery => {
+                    // a failed sync is retried next period, the data is safe
+                    // in the page cache meanwhile
+                    let _ = self.cart.flush_battery();
+                    self.schedule_battery();
+                }
+                // OAM unlocks
+                Event::Dma => (),
+            }
+        }
+    }
+
+    fn double_speed(&self) -> bool {
+        self.io_registers[KEY1] & 0x80 != 0
+    }
+
+    /// The clock the ppu and apu run on, which keeps counting single speed
+    /// M-cycles while the cpu, timer and serial port run at double speed.
+    #[inline(always)]
+    pub(crate) fn slow_clock(&self, now: u64) -> u64 {
+        debug_assert!(
+            now >= self.switched_at,
+            "clock went back past a speed switch"
+        );
+        self.slow_at + ((now - self.switched_at) >> self.double_speed() as u64)
+    }
+
+    /// The first cpu cycle `slow_clock` reads `slow` on.
+    pub(crate) fn cpu_clock(&self, slow: u64) -> u64 {
+        let elapsed = slow.saturating_sub(self.slow_at);
+        match slow {
+            Scheduler::NEVER => Scheduler::NEVER,
+            _ => self.switched_at + (elapsed << self.double_speed() as u64),
+        }
+    }
+
+    /// STOP with a switch armed in KEY1 flips the cpu between single and
+    /// double speed instead, returning whether it did. DIV resets and the
+    /// cpu waits while the clock settles.
+    pub(crate) fn switch_speed(&mut self) -> bool {
+        if !self.cgb || self.io_registers[KEY1] & 0x01 == 0 {
+            return false;
+        }
+        self.slow_at = self.slow_clock(self.now);
+        self.switched_at = self.now;
+        self.io_registers[KEY1] = (self.io_registers[KEY1] ^ 0x80) & 0x80;
+        self.timer.write(self.now, 0xff04, 0);
+        self.schedule_timer();
+        self.schedule_ppu();
+        self.schedule_apu();
+        self.stall += SPEED_SWITCH_CYCLES;
+        true
+    }
+
+    /// Whether DMA has held the cpu off the bus since the last `take_stall`.
+    #[inline(always)]
+    pub(crate) fn stalled(&self) -> bool {
+        self.stall != 0
+    }
+
+    pub(crate) fn take_stall(&mut self) -> u64 {
+        mem::take(&mut self.stall)
+    }
+
+    /// Runs the ppu up to now, moving a block of any HDMA at the start of
+    /// each HBlank it reaches.
+    fn advance_ppu(&mut self) {
+        let now = self.slow_clock(self.now);
+        // one mode change at a time while an HDMA runs, a catch up can pass
+        // several HBlanks and the lines after each have to see its block
+        while self.hdma_active() && self.ppu.next_event() <= now {
+            let drawing = self.ppu.mode() == Mode::Drawing;
+            let at = self.ppu.next_event();
+            self.ppu
+                .advance(at, &self.v_ram, &self.oam, &mut self.io_registers);
+            if drawing && self.ppu.mode() == Mode::HBlank {
+                self.hdma_step();
+            }
+        }
+        self.ppu
+            .advance(now, &self.v_ram, &self.oam, &mut self.io_registers);
+    }
+
+    fn oam_locked(&self) -> bool {
+        self.scheduler.at(Event::Dma) != Scheduler::NEVER
+    }
+
+    /// Copies the 160 bytes from `high` << 8 on into OAM in one go and
+    /// locks OAM for as long as the transfer takes, which hides that the
+    /// bytes didn't land one a cycle.
+    fn oam_dma(&mut self, high: u8) {
+        // past wram the source wraps back onto it
+        let high = if high >= 0xe0 { high - 0x20 } else { high };
+        let mut oam = [0; 0xa0];
+        self.read_block((high as u16) << 8, &mut oam);
+        self.oam = oam;
+        self.scheduler
+            .schedule(Event::Dma, self.now + OAM_DMA_CYCLES);
+    }
+
+    fn hdma_active(&self) -> bool {
+        self.io_registers[HDMA5] & 0x80 == 0
+    }
+
+    /// A write to HDMA5 starts a GDMA, copied whole while the cpu waits, or
+    /// an HDMA of a block per HBlank. Clearing bit 7 stops a running HDMA.
+    fn hdma_control(&mut self, value: u8) {
+        match (self.hdma_active(), value & 0x80 != 0) {
+            (true, false) => self.io_registers[HDMA5] |= 0x80,
+            (_, true) => {
+                self.io_registers[HDMA5] = value & 0x7f;
+                // nothing will start an HBlank that's already begun
+                if self.ppu.mode() == Mode::HBlank {
+                    self.hdma_step();
+                }
+            }
+            (false, false) => {
+                for _ in 0..=value & 0x7f {
+                    self.hdma_block();
+                }
+                self.io_registers[HDMA5] = 0xff;
+            }
+        }
+    }
+
+    /// One HBlank's worth of HDMA, ending it after the last block.
+    fn hdma_step(&mut self) {
+        self.hdma_block();
+        self.io_registers[HDMA5] = self.io_registers[HDMA5].checked_sub(1).unwrap_or(0xff);
+    }
+
+    /// Copies 16 bytes into vram and steps the address registers past them,
+    /// as the hardware does.
+    fn hdma_block(&mut self) {
+        let io = &self.io_registers;
+        let source = u16::from_be_bytes([io[HDMA1], io[HDMA2] & 0xf0]);
+        let dest = u16::from_be_bytes([io[HDMA3] & 0x1f, io[HDMA4] & 0xf0]);
+        let mut block = [0; 0x10];
+        self.read_block(source, &mut block);
+
+        let (bank, offset) = (self.v_ram_bank as usize, dest as usize);
+        self.v_ram[bank][offset..offset + 0x10].copy_from_slice(&block);
+        if offset < 0x1800 {
+            self.ppu.tile_written(bank, offset);
+        }
+        self.dirty
+            .mark(((V_RAM_OFFSET + bank * 0x2000 + offset) / STATE_PAGE_SIZE) as u16);
+
+        let io = &mut self.io_registers;
+        [io[HDMA1], io[HDMA2]] = source.wrapping_add(0x10).to_be_bytes();
+        [io[HDMA3], io[HDMA4]] = (dest + 0x10).to_be_bytes();
+        self.stall += HDMA_BLOCK_CYCLES << self.double_speed() as u64;
+    }
+
+    /// Fills `out` from `addr` on, with a single copy if the page is mapped.
+    /// The block can't cross into the next page.
+    fn read_block(&self, addr: u16, out: &mut [u8]) {
+        let offset = addr as usize & (PAGE_SIZE - 1);
+        debug_assert!(offset + out.len() <= PAGE_SIZE);
+        let page = self.pages[(addr >> 8) as usize];
+        if page.read.is_null() {
+            for (addr, byte) in (addr..).zip(out) {
+                *byte = self.read_slow(addr);
+            }
+            return;
+        }
+        // SAFETY: see read, the block stays within the page
+        out.copy_from_slice(unsafe { slice::from_raw_parts(page.read.add(offset), out.len()) });
+    }
+
+    /// The opcode at `addr` and the three bytes after it, for traces. One
+    /// copy out of the page unless they run past its end.
+    #[inline(always)]
+    pub(crate) fn read_code(&self, addr: u16) -> [u8; 4] {
+        let mut bytes = [0; 4];
+        match addr as usize & (PAGE_SIZE - 1) <= PAGE_SIZE - bytes.len() {
+            true => self.read_block(addr, &mut bytes),
+            false => bytes = [0, 1, 2, 3].map(|offset| self.read(addr.wrapping_add(offset))),
+        }
+        bytes
+    }
+
+    /// Cycle of the next scheduled event.
+    pub(crate) fn next_event(&self) -> u64 {
+        self.scheduler.next()
+    }
+
+    pub(crate) fn buttons(&self) -> u8 {
+        self.joypad.pressed()
+    }
+
+    /// Returns whether a line P1 selects went low, which is what both the
+    /// joypad interrupt and waking from STOP go by.
+    pub(crate) fn set_buttons(&mut self, pressed: u8) -> bool {
+        let fell = self.joypad.set(pressed);
+        if fell {
+            self.request_interrupt(Interrupt::Joypad);
+        }
+        fell
+    }
+
+    pub(crate) fn request_interrupt(&mut self, interrupt: Interrupt) {
+        self.io_registers[0x0f] |= interrupt as u8;
+    }
+
+    /// Interrupts both requested and enabled.
+    #[inline(always)]
+    pub(crate) fn pending_interrupts(&self) -> u8 {
+        self.ie & self.io_registers[0x0f] & 0x1f
+    }
+
+    pub(crate) fn acknowledge_interrupt(&mut self, interrupt: u8) {
+        self.io_registers[0x0f] &= !interrupt;
+    }
+
+    /// Starts or stops keeping what's sent over serial, stopping drops what
+    /// hasn't been taken.
+    pub(crate) fn capture_serial(&mut self, on: bool) {
+        if !on {
+            self.serial_output = None;
+        } else if self.serial_output.is_none() {
+            self.serial_output = Some(vec![]);
+        }
+    }
+
+    pub(crate) fn take_serial_output(&mut self) -> Vec<u8> {
+        self.serial_output
+            .as_mut()
+            .map(std::mem::take)
+            .unwrap_or_default()
+    }
+
+    fn schedule_timer(&mut self) {
+        let at = self.timer.overflow_at().unwrap_or(Scheduler::NEVER);
+        self.scheduler.schedule(Event::Timer, at);
+    }
+
+    fn schedule_ppu(&mut self) {
+        let at = self.cpu_clock(self.ppu.next_event());
+        self.scheduler.schedule(Event::Ppu, at);
+    }
+
+    /// Frame sequencer steps fall on DIV, nothing is due while powered off.
+    fn schedule_apu(&mut self) {
+        let at = match self.apu.powered() {
+            true => self.timer.next_apu_tick(self.now, self.double_speed()),
+            false => Scheduler::NEVER,
+        };
+        self.scheduler.schedule(Event::Apu, at);
+    }
+
+    fn schedule_battery(&mut self) {
+        if let Some(FlushPolicy::Periodic(period)) = self.cart.flush_policy() {
+            let at = self.now.saturating_add(period.max(1));
+            self.scheduler.schedule(Event::Battery, at);
+        }
+    }
+
+    pub(crate) fn attach_audio(&mut self, samples: Producer<i16>, rate: u32) {
+        self.apu.attach(self.slow_clock(self.now), samples, rate);
+    }
+
+    pub(crate) fn detach_audio(&mut self) -> Option<Producer<i16>> {
+        self.apu.render(self.slow_clock(self.now));
+        self.apu.detach()
+    }
+
+    pub(crate) fn flush_battery(&self) -> io::Result<()> {
+        self.cart.flush_battery()
+    }
+
+    pub(crate) fn ppu(&self) -> &Ppu {
+        &self.ppu
+    }
+
+    pub(crate) fn ppu_mut(&mut self) -> &mut Ppu {
+        &mut self.ppu
+    }
+
+    fn read_slow(&self, addr: u16) -> u8 {
+        match addr {
+            0x0000..=0x7fff | 0xa000..=0xbfff => self.cart.read(addr),
+            0xfe00..=0xfe9f if self.oam_locked() => 0xff,
+            0xfe00..=0xfe9f => self.oam[(addr - 0xfe00) as usize],
+            0xfea0..=0xfeff => {
+                trace!("accessing unusable memory: {}", addr);
+                0xff
+            }
+            0xff00 => self.joypad.read(),
+            0xff04..=0xff07 => self.timer.read(self.now, addr),
+            0xff10..=0xff3f => self.apu.read(addr),
+            0xff4d | 0xff51..=0xff55 if !self.cgb => 0xff,
+            0xff4d => self.io_registers[KEY1] | 0x7e,
+            // the address registers are write only
+            0xff51..=0xff54 => 0xff,
+            0xff01..=0xff7f => self.io_registers[(addr - 0xff00) as usize],
+            0xff80..=0xfffe => self.h_ram[(addr - 0xff80) as usize],
+            0xffff => self.ie,
+            // every other page is mapped directly
+            _ => unreachable!(),
+        }
+    }
+
+    fn write_slow(&mut self, addr: u16, value: u8) {
+        let page = (addr >> 8) as u8;
+        // io shares a page with hram but can never hold code
+        if self.code_pages.contains(page) && !(0xff00..=0xff7f).contains(&addr) {
+            self.code_pages.remove(page);
+            self.code_written.insert(page);
+            self.code_event = true;
+            // every cacheable ram page is mapped read/write through one pointer
+            let entry = &mut self.pages[page as usize];
+            entry.write = entry.read.cast_mut();
+            return self.write(addr, value);
+        }
+
+        match addr {
+            0x0000..=0x7fff | 0xa000..=0xbfff => {
+                // the MBC3 clock keeps real time, which is the ppu's speed
+                if self.cart.write(self.slow_clock(self.now), addr, value) {
+                    self.map_cart();
+                    self.mapping_changed();
+                }
+            }
+            // tile data, kept off the fast path so decoded tiles can be dropped
+            0x8000..=0x97ff => {
+                let (bank, offset) = (self.v_ram_bank as usize, (addr - 0x8000) as usize);
+                self.v_ram[bank][offset] = value;
+                self.ppu.tile_written(bank, offset);
+                self.dirty
+                    .mark(((V_RAM_OFFSET + bank * 0x2000 + offset) / STATE_PAGE_SIZE) as u16);
+            }
+            // echo ram mirrors wram, through the same protection and tracking
+            0xe000..=0xfdff => self.write(addr - 0x2000, value),
+            0xfe00..=0xfe9f if self.oam_locked() => trace!("ignoring OAM write during DMA"),
+            0xfe00..=0xfe9f => {
+                trace!("writing {:#x} to {:#x} OAM", value, addr);
+                self.oam[(addr - 0xfe00) as usize] = value;
+            }
+            0xfea0..=0xfeff => trace!("ignoring write to unusable address: {}", addr),
+            0xff00 => {
+                if self.joypad.write(value) {
+                    self.request_interrupt(Interrupt::Joypad);
+                }
+            }
+            0xff02 => {
+                self.io_registers[0x02] = value;
+                // only the internal clock can finish without a partner
+                if value & 0x81 == 0x81 {
+                    if let Some(output) = &mut self.serial_output {
+                        output.push(self.io_registers[0x01]);
+                    }
+                    let cycles = match value & 0x02 != 0 {
+                        true => SERIAL_CYCLES / 32,
+                        false => SERIAL_CYCLES,
+                    };
+                    self.scheduler.schedule(Event::Serial, self.now + cycles);
+                }
+            }
+            0xff04..=0xff07 => {
+                // resetting DIV with the sequencer's bit set is a falling edge
+                // too
+                let bit = 0x10 << self.double_speed() as u8;
+                if addr == 0xff04 && self.timer.read(self.now, addr) & bit != 0 {
+                    self.apu.clock_sequencer(self.slow_clock(self.now));
+                }
+                self.timer.write(self.now, addr, value);
+                self.schedule_timer();
+                self.schedule_apu();
+            }
+            0xff10..=0xff3f => {
+                self.apu.write(self.slow_clock(self.now), addr, value);
+                self.schedule_apu();
+            }
+            0xff40..=0xff45 | 0xff47..=0xff4b => {
+                self.advance_ppu();
+                self.ppu.write_register(
+                    self.slow_clock(self.now),
+                    (addr - 0xff00) as usize,
+                    value,
+                    &self.v_ram,
+                    &self.oam,
+                    &mut self.io_registers,
+                );
+                self.schedule_ppu();
+            }
+            0xff46 => {
+                self.io_registers[0x46] = value;
+                self.oam_dma(value);
+            }
+            0xff4d | 0xff51..=0xff55 if !self.cgb => (),
+            0xff4d => self.io_registers[KEY1] = self.io_registers[KEY1] & 0x80 | value & 0x01,
+            0xff55 => self.hdma_control(value),
+            0xff01..=0xff7f => {
+                self.io_registers[(addr - 0xff00) as usize] = value;
+                if addr == 0xff4f {
+                    self.v_ram_bank = value & 1;
+                    self.map_v_ram();
+                    self.mapping_changed();
+                }
+                if addr == 0xff70 {
+                    self.w_ram_bank = (value & 0x07).max(1);
+                    self.map_w_ram();
+                    self.mapping_changed();
+                }
+            }
+            0xff80..=0xfffe => self.h_ram[(addr - 0xff80) as usize] = value,
+            0xffff => self.ie = value,
+            _ => unreachable!(),
+        }
+    }
+
+    pub(crate) fn state_size(&self) -> usize {
+        self.cart.state_size()
+    }
+
+    /// Writes the sections in front of `V_RAM_OFFSET`.
+    pub(crate) fn save_state_header(&self, w: &mut StateWriter) {
+        w.seek(BUS_OFFSET);
+        w.u8(self.v_ram_bank);
+        w.u8(self.w_ram_bank);
+        w.u8(self.ie);
+        w.u64(self.switched_at);
+        w.u64(self.slow_at);
+        w.seek(IO_OFFSET);
+        w.bytes(&self.io_registers);
+        w.seek(H_RAM_OFFSET);
+        w.bytes(&self.h_ram);
+        w.seek(OAM_OFFSET);
+        w.bytes(&self.oam);
+        self.ppu.save_state(w);
+        self.timer.save_state(w);
+        self.apu.save_state(w);
+        self.joypad.save_state(w);
+        w.seek(SERIAL_OFFSET);
+        w.u64(self.scheduler.at(Event::Serial));
+        w.seek(DMA_OFFSET);
+        w.u64(self.scheduler.at(Event::Dma));
+        self.cart.save_state_header(w);
+    }
+
+    pub(crate) fn save_state_memory(&self, w: &mut StateWriter) {
+        w.seek(V_RAM_OFFSET);
+        w.bytes(self.v_ram.as_flattened());
+        w.seek(W_RAM_OFFSET);
+        w.bytes(self.w_ram.as_flattened());
+        self.cart.save_state_memory(w);
+    }
+
+    /// The current contents of a page from the memory sections of the state.
+    pub(crate) fn state_page(&self, page: usize) -> &[u8] {
+        let offset = page * STATE_PAGE_SIZE;
+        let memory = match offset {
+            V_RAM_OFFSET..W_RAM_OFFSET => &self.v_ram.as_flattened()[offset - V_RAM_OFFSET..],
+            W_RAM_OFFSET..CART_RAM_OFFSET => &self.w_ram.as_flattened()[offset - W_RAM_OFFSET..],
+            _ => &self.cart.ram()[offset - CART_RAM_OFFSET..],
+        };
+        &memory[..STATE_PAGE_SIZE]
+    }
+
+    pub(crate) fn memory_hash(&self) -> MemoryHash {
+        MemoryHash {
+            w_ram: xxh64(self.w_ram.as_flattened()),
+            v_ram: xxh64(self.v_ram.as_flattened()),
+            h_ram: xxh64(&self.h_ram),
+            io_registers: xxh64(&self.io_registers),
+            cart_ram: xxh64(self.cart.ram()),
+        }
+    }
+
+    /// Returns the state pages written since the last call.
+    pub(crate) fn take_dirty(&mut self) -> DirtyPages {
+        std::mem::replace(&mut self.dirty, DirtyPages::CLEAN)
+    }
+
+    /// Checks the state of a machine whose clock reads `now`.
+    pub(crate) fn check_state(&self, r: &mut StateReader, now: u64) -> Result<(), StateError> {
+        self.cart.check_state(r)?;
+        r.seek(BUS_OFFSET);
+        r.u8_in(0..=1)?;
+        r.u8_in(1..=7)?;
+        r.u8();
+        let offset = BUS_OFFSET + 3;
+        if r.u64() > now {
+            return Err(StateError::Corrupt { offset });
+        }
+        self.ppu.check_state(r)?;
+        self.timer.check_state(r, now)?;
+        self.apu.check_state(r)?;
+        self.joypad.check_state(r)
+    }
+
+    /// Restores everything but the cpu, whose clock already reads `now`.
+    pub(crate) fn load_state(&mut self, r: &mut StateReader, now: u64) {
+        self.now = now;
+        r.seek(BUS_OFFSET);
+        self.v_ram_bank = r.u8() & 1;
+        self.w_ram_bank = (r.u8() & 0x07).max(1);
+        self.ie = r.u8();
+        self.switched_at = r.u64();
+        self.slow_at = r.u64();
+        r.seek(IO_OFFSET);
+        self.io_registers = r.array();
+        r.seek(H_RAM_OFFSET);
+        self.h_ram = r.array();
+        r.seek(OAM_OFFSET);
+        self.oam = r.array();
+        self.ppu.load_state(r);
+        self.timer.load_state(r);
+        self.apu.load_state(r, self.slow_clock(now));
+        self.joypad.load_state(r);
+        r.seek(SERIAL_OFFSET);
+        self.scheduler.schedule(Event::Serial, r.u64());
+        r.seek(DMA_OFFSET);
+        self.scheduler.schedule(Event::Dma, r.u64());
+        self.stall = 0;
+        self.schedule_timer();
+        self.schedule_ppu();
+        self.schedule_apu();
+        self.schedule_battery();
+        r.seek(V_RAM_OFFSET);
+        self.v_ram
+            .as_flattened_mut()
+            .copy_from_slice(r.bytes(0x2000 * 2));
+        r.seek(W_RAM_OFFSET);
+        self.w_ram
+            .as_flattened_mut()
+            .copy_from_slice(r.bytes(0x1000 * 8));
+        self.cart.load_state(r);
+        self.forget_code();
+        self.remap();
+        self.dirty = DirtyPages::all(self.state_size());
+    }
+
+    /// Copies every piece of mutable state over from `other` without going
+    /// through a buffer, both buses have to be running the same image.
+    pub(crate) fn clone_state_from(&mut self, other: &Bus) -> Result<(), StateError> {
+        self.cart.clone_state_from(&other.cart)?;
+        self.v_ram_bank = other.v_ram_bank;
+        self.w_ram_bank = other.w_ram_bank;
+        self.ie = other.ie;
+        self.io_registers = other.io_registers;
+        self.h_ram = other.h_ram;
+        self.oam = other.oam;
+        self.ppu.clone_state_from(&other.ppu);
+        self.timer = other.timer;
+        self.switched_at = other.switched_at;
+        self.slow_at = other.slow_at;
+        let now = other.slow_clock(other.now);
+        self.apu.clone_state_from(&other.apu, now);
+        self.joypad = other.joypad;
+        self.scheduler
+            .schedule(Event::Serial, other.scheduler.at(Event::Serial));
+        self.scheduler
+            .schedule(Event::Dma, other.scheduler.at(Event::Dma));
+        self.stall = 0;
+        self.now = other.now;
+        self.schedule_timer();
+        self.schedule_ppu();
+        self.schedule_apu();
+        self.schedule_battery();
+        self.v_ram.copy_from_slice(&other.v_ram[..]);
+        self.w_ram.copy_from_slice(&other.w_ram[..]);
+        self.forget_code();
+        self.remap();
+        self.dirty = DirtyPages::all(self.state_size());
+        Ok(())
+    }
+
+    /// The bank and last address of the cacheable region holding `addr`, or
+    /// `None` if code there has to be interpreted.
+    pub(crate) fn code_region(&self, addr: u16) -> Option<(u16, u16)> {
+        match addr {
+            0x0000..=0x3fff => Some((self.cart.banks().rom0 as u16, 0x3fff)),
+            0x4000..=0x7fff => Some((self.cart.banks().rom1 as u16, 0x7fff)),
+            0xa000..=0xbfff => Some((self.cart.banks().ram? as u16, 0xbfff)),
+            0xc000..=0xcfff => Some((0, 0xcfff)),
+            0xd000..=0xdfff => Some((self.w_ram_bank as u16, 0xdfff)),
+            0xff80..=0xfffe => Some((0, 0xfffe)),
+            _ => None,
+        }
+    }
+
+    /// Sends writes to `first..=last` through the slow path until one of them
+    /// is written.
+    pub(crate) fn protect_code(&mut self, first: u8, last: u8) {
+        for page in first..=last {
+            self.code_pages.insert(page);
+            self.pages[page as usize].write = ptr::null_mut();
+        }
+    }
+
+    /// Set once protected code has been written or the memory map changed,
+    /// the running block can't be trusted past that point.
+    #[inline(always)]
+    pub(crate) fn code_event(&self) -> bool {
+        self.code_event
+    }
+
+    /// Returns the code pages written since the last call and clears the
+    /// event.
+    pub(crate) fn take_code_writes(&mut self) -> PageSet {
+        self.code_event = false;
+        std::mem::replace(&mut self.code_written, PageSet::EMPTY)
+    }
+
+    /// Treats all protected code as overwritten, for when memory is replaced
+    /// wholesale.
+    fn forget_code(&mut self) {
+        self.code_written.insert_all(self.code_pages);
+        self.code_pages = PageSet::EMPTY;
+        self.code_event = true;
+    }
+
+    fn mapping_changed(&mut self) {
+        self.code_event = true;
+        self.apply_code_protection();
+    }
+
+    fn apply_code_protection(&mut self) {
+        for page in self.code_pages.iter() {
+            self.pages[page as usize].write = ptr::null_mut();
+        }
+    }
+
+    fn remap(&mut self) {
+        self.map_cart();
+        self.map_v_ram();
+        self.map_w_ram();
+        self.apply_code_protection();
+    }
+
+    /// Points the cart pages at the banks the mapper selects, the banks are
+    /// always in range so this is just slicing.
+    fn map_cart(&mut self) {
+        // rom is read only, writes to it are mapper registers
+        let banks = self.cart.banks();
+        let rom = self.cart.rom();
+        map_read_only(
+            &mut self.pages[0x00..0x40],
+            &rom[banks.rom0 * 0x4000..][..0x4000],
+        );
+        map_read_only(
+            &mut self.pages[0x40..0x80],
+            &rom[banks.rom1 * 0x4000..][..0x4000],
+        );
+
+        // with no bank mapped the mapper sees the accesses, ram is disabled
+        // or a register like the MBC3 clock is there
+        match banks.ram {
+            Some(bank) => {
+                let ram = &mut self.cart.ram_mut()[bank * 0x2000..][..0x2000];
+                map_writable(
+                    &mut self.pages[0xa0..0xc0],
+                    ram,
+                    CART_RAM_OFFSET + bank * 0x2000,
+                );
+            }
+            None => self.pages[0xa0..0xc0].fill(Page::UNMAPPED),
+        }
+    }
+
+    fn map_v_ram(&mut self) {
+        let bank = self.v_ram_bank as usize;
+        map_read_only(&mut self.pages[0x80..0x98], &self.v_ram[bank][..0x1800]);
+        map_writable(
+            &mut self.pages[0x98..0xa0],
+            &mut self.v_ram[bank][0x1800..],
+            V_RAM_OFFSET + bank * 0x2000 + 0x1800,
+        );
+    }
+
+    fn map_w_ram(&mut self) {
+        let bank = self.w_ram_bank as usize;
+        map_writable(
+            &mut self.pages[0xc0..0xd0],
+            &mut self.w_ram[0],
+            W_RAM_OFFSET,
+        );
+        map_writable(
+            &mut self.pages[0xd0..0xe0],
+            &mut self.w_ram[bank],
+            W_RAM_OFFSET + bank * 0x1000,
+        );
+        // echo ram, reads mirror 0xc000..=0xddff and writes go the slow way
+        map_read_only(&mut self.pages[0xe0..0xf0], &self.w_ram[0]);
+        map_read_only(&mut self.pages[0xf0..0xfe], &self.w_ram[bank][..0x0e00]);
+    }
+}
+
+/// A set of the 256 byte pages of the address space.
+#[derive(Clone, Copy)]
+pub(crate) struct PageSet([u64; 4]);
+
+impl PageSet {
+    pub const EMPTY: PageSet = PageSet([0; 4]);
+
+    #[inline(always)]
+    pub fn contains(&self, page: u8) -> bool {
+        self.0[page as usize >> 6] & 1 << (page & 63) != 0
+    }
+
+    pub fn insert(&mut self, page: u8) {
+        self.0[page as usize >> 6] |= 1 << (page & 63);
+    }
+
+    pub fn remove(&mut self, page: u8) {
+        self.0[page as usize >> 6] &= !(1 << (page & 63));
+    }
+
+    pub fn insert_all(&mut self, other: PageSet) {
+        for (word, other) in self.0.iter_mut().zip(other.0) {
+            *word |= other;
+        }
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = u8> + '_ {
+        self.0.iter().enumerate().flat_map(|(i, word)| {
+            let mut word = *word;
+            std::iter::from_fn(move || {
+                if word == 0 {
+                    return None;
+                }
+                let bit = word.trailing_zeros() as usize;
+                word &= word - 1;
+                Some((i * 64 + bit) as u8)
+            })
+        })
+    }
+}
+
+fn map_read_only(pages: &mut [Page], memory: &[u8]) {
+    for (page, memory) in pages.iter_mut().zip(memory.chunks_exact(PAGE_SIZE)) {
+        *page = Page {
+            read: memory.as_ptr(),
+            write: ptr::null_mut(),
+            state_page: 0,
+        };
+    }
+}
+
+fn map_writable(pages: &mut [Page], memory: &mut [u8], state_offset: usize) {
+    let first = state_offset / STATE_PAGE_SIZE;
+    for (i, (page, memory)) in pages
+        .iter_mut()
+        .zip(memory.chunks_exact_mut(PAGE_SIZE))
+        .enumerate()
+    {
+        let memory = memory.as_mut_ptr();
+        *page = Page {
+            read: memory,
+            write: memory,
+            state_page: (first + i) as u16,
+        };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cart::tests::{cgb_rom, rom};
+
+    const LINE: u64 = 114;
+
+    /// A CGB bus with the lcd on and an HDMA of `blocks` tile rows from
+    /// wram to the start of vram just started.
+    fn hdma(blocks: u8) -> Bus {
+        let mut bus = Bus::new(Cart::new(cgb_rom(&[])).unwrap());
+        bus.sync(0);
+        bus.write(0xff40, 0x91);
+        for i in 0..blocks as u16 * 0x10 {
+            bus.write(0xc000 + i, i as u8 ^ 0x5a);
+        }
+        for (addr, value) in [
+            (0xff51, 0xc0),
+            (0xff52, 0x00),
+            (0xff53, 0x00),
+            (0xff54, 0x00),
+        ] {
+            bus.write(addr, value);
+        }
+        bus.write(0xff55, 0x80 | (blocks - 1));
+        bus
+    }
+
+    fn copied(bus: &Bus, blocks: u8) -> bool {
+        let len = blocks as usize * 0x10;
+        (0..len).all(|i| bus.v_ram[0][i] == i as u8 ^ 0x5a)
+    }
+
+    #[test]
+    fn hdma_moves_one_block_per_line() {
+        let mut bus = hdma(8);
+        for line in 1..=8 {
+            bus.sync(line * LINE);
+            let left = (8 - line as u8).checked_sub(1).unwrap_or(0xff);
+            assert_eq!(bus.io_registers[HDMA5], left);
+            assert_eq!(bus.take_stall(), HDMA_BLOCK_CYCLES);
+        }
+        assert!(copied(&bus, 8));
+        bus.sync(12 * LINE);
+        assert_eq!((bus.io_registers[HDMA5], bus.take_stall()), (0xff, 0));
+    }
+
+    #[test]
+    fn hdma_catches_up_on_every_hblank_passed() {
+        let mut bus = hdma(8);
+        // one sync over several lines, as when the cpu sat out a stall
+        bus.sync(5 * LINE);
+        assert_eq!(bus.io_registers[HDMA5], 2);
+        assert_eq!(bus.take_stall(), 5 * HDMA_BLOCK_CYCLES);
+        assert!(copied(&bus, 5));
+        bus.sync(20 * LINE);
+        assert_eq!(bus.io_registers[HDMA5], 0xff);
+        assert!(copied(&bus, 8));
+    }
+
+    #[test]
+    fn keeps_serial_output_only_while_capturing() {
+        let mut bus = Bus::new(Cart::new(rom(0x00, 0, 0x00, &[])).unwrap());
+        let send = |bus: &mut Bus, byte| {
+            bus.write(0xff01, byte);
+            bus.write(0xff02, 0x81);
+        };
+        send(&mut bus, b'a');
+        assert_eq!(bus.take_serial_output(), b"");
+        bus.capture_serial(true);
+        send(&mut bus, b'o');
+        send(&mut bus, b'k');
+        assert_eq!(bus.take_serial_output(), b"ok");
+        assert_eq!(bus.take_serial_output(), b"");
+        send(&mut bus, b'x');
+        bus.capture_serial(false);
+        assert_eq!(bus.take_serial_output(), b"");
+    }
+}
@@ -1,4 +1,15 @@
-use std::fmt::Display;
+use std::{
+    fmt::Display,
+    fs::File,
+    io::{self, Read},
+    path::Path,
+    sync::{Arc, OnceLock},
+};
+
+use crate::battery::{FlushPolicy, Sram};
+use crate::mapper::{Banks, Mapper, Mbc1, Mbc3, Mbc5, NoMapper, MAPPER_STATE_SIZE};
+use crate::rom::Rom;
+use crate::state::{StateError, StateReader, StateWriter, CART_OFFSET, CART_RAM_OFFSET};
 
 #[derive(Debug, Clone, Copy)]
 pub enum MapperType {
@@ -23,8 +34,9 @@ pub enum BootFailure {
     Logo,
 }
 
-#[derive(Debug)]
-struct CartType {
+/// What the cart type byte says is on the board.
+#[derive(Debug, Clone, Copy)]
+pub struct CartType {
     mapper: MapperType,
     ram: bool,
     battery: bool,
@@ -49,114 +61,92 @@ impl CartType {
                 cart_type.battery = true;
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MBC1;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x02 => {
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MBC1;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x01 => {
                 cart_type.mapper = MapperType::MBC1;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x06 => {
                 cart_type.battery = true;
                 cart_type.mapper = MapperType::MBC2;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x05 => {
                 cart_type.mapper = MapperType::MBC2;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x09 => {
                 cart_type.battery = true;
                 cart_type.ram = true;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x08 => {
                 cart_type.ram = true;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x0D => {
                 cart_type.battery = true;
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MMM01;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x0C => {
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MMM01;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x0B => {
                 cart_type.mapper = MapperType::MMM01;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x10 => {
                 cart_type.ram = true;
                 cart_type.timer = true;
                 cart_type.battery = true;
                 cart_type.mapper = MapperType::MBC3;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x0F => {
                 cart_type.timer = true;
                 cart_type.battery = true;
                 cart_type.mapper = MapperType::MBC3;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x13 => {
                 cart_type.battery = true;
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MBC3;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x12 => {
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MBC3;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x11 => {
                 cart_type.mapper = MapperType::MBC3;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x1b => {
                 cart_type.battery = true;
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MBC5;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x1a => {
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MBC5;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x19 => {
                 cart_type.mapper = MapperType::MBC5;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x1e => {
                 cart_type.battery = true;
                 cart_type.rumble = true;
                 cart_type.ram = true;
                 cart_type.mapper = MapperType::MBC5;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x1d => {
                 cart_type.ram = true;
                 cart_type.rumble = true;
                 cart_type.mapper = MapperType::MBC5;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x1c => {
                 cart_type.rumble = true;
                 cart_type.mapper = MapperType::MBC5;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x20 => {
                 cart_type.mapper = MapperType::MBC6;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0x22 => {
                 cart_type.battery = true;
@@ -164,30 +154,37 @@ impl CartType {
                 cart_type.ram = true;
                 cart_type.sensor = true;
                 cart_type.mapper = MapperType::MBC7;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0xfc => {
                 cart_type.mapper = MapperType::PocketCamera;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0xfd => {
                 cart_type.mapper = MapperType::BandaiTama5;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0xfe => {
                 cart_type.mapper = MapperType::HuC3;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             0xff => {
                 cart_type.mapper = MapperType::HuC1;
                 cart_type.ram = true;
                 cart_type.battery = true;
-                return Err(CartError::UnsupportedMapper(cart_type.mapper));
             }
             _ => return Err(CartError::InvalidCartType(code.clone())),
         };
         Ok(cart_type)
     }
+
+    pub fn mapper(&self) -> MapperType {
+        self.mapper
+    }
+
+    /// Whether a `Cart` can run this board.
+    pub fn supported(&self) -> bool {
+        matches!(
+            self.mapper,
+            MapperType::None | MapperType::MBC1 | MapperType::MBC3 | MapperType::MBC5
+        )
+    }
 }
 
 impl Display for CartType {
@@ -213,45 +210,62 @@ impl Display for CartType {
     }
 }
 
-static NINTENDO_LOGO: [u8; 0x30] = [
+/// The logo every header has to carry at 0x104.
+pub static NINTENDO_LOGO: [u8; 0x30] = [
     0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
     0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E, 0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
     0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E,
 ];
 
-pub struct Cart {
-    rom: Vec<u8>,
-    ram: Vec<u8>,
+/// Everything the cart header describes, fixed for the life of the ROM.
+pub struct CartHeader {
     title: String,
     cgb: bool,
     cart_type: CartType,
     licensee: String,
     sgb: bool,
     rom_size: u32,
-    rom_banks: u8,
-    current_rom_bank: u8,
+    rom_banks: u16,
     ram_size: u32,
     ram_banks: u8,
-    current_ram_bank: u8,
     destination: bool,
     version: u8,
+    global_checksum: u16,
+}
+
+/// The immutable half of a cart, shared by every instance running it.
+pub struct CartImage {
+    header: CartHeader,
+    rom: Rom,
+    /// only worked out if asked for, real hardware never checks it
+    global_checksum: OnceLock<u16>,
+}
+
+/// A running cart, only the ram and banking state are per instance.
+pub struct Cart {
+    image: Arc<CartImage>,
+    ram: Sram,
+    mapper: Box<dyn Mapper>,
+    /// what `mapper` selects, refreshed on every register write
+    banks: Banks,
 }
 
 impl Display for Cart {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
-        writeln!(f, "\t title: {}", self.title)?;
-        writeln!(f, "\t cgb: {}", self.cgb)?;
-        writeln!(f, "\t cart type: {}", self.cart_type)?;
-        writeln!(f, "\t licensee: {}", self.licensee)?;
-        writeln!(f, "\t sgb: {}", self.sgb)?;
-        writeln!(f, "\t rom size: {}", self.rom_size)?;
-        writeln!(f, "\t rom banks: {}", self.rom_banks)?;
-        writeln!(f, "\t current rom bank: {}", self.current_rom_bank)?;
-        writeln!(f, "\t ram size: {}", self.ram_size)?;
-        writeln!(f, "\t ram banks: {}", self.ram_banks)?;
-        writeln!(f, "\t current ram bank: {}", self.current_ram_bank)?;
-        writeln!(f, "\t destination: {}", self.destination)?;
-        writeln!(f, "\t version: {}", self.version)?;
+        let header = &self.image.header;
+        writeln!(f, "\t title: {}", header.title)?;
+        writeln!(f, "\t cgb: {}", header.cgb)?;
+        writeln!(f, "\t cart type: {}", header.cart_type)?;
+        writeln!(f, "\t licensee: {}", header.licensee)?;
+        writeln!(f, "\t sgb: {}", header.sgb)?;
+        writeln!(f, "\t rom size: {}", header.rom_size)?;
+        writeln!(f, "\t rom banks: {}", header.rom_banks)?;
+        writeln!(f, "\t current rom bank: {}", self.banks.rom1)?;
+        writeln!(f, "\t ram size: {}", header.ram_size)?;
+        writeln!(f, "\t ram banks: {}", header.ram_banks)?;
+        writeln!(f, "\t current ram bank: {:?}", self.banks.ram)?;
+        writeln!(f, "\t destination: {}", header.destination)?;
+        writeln!(f, "\t version: {}", header.version)?;
         Ok(())
     }
 }
@@ -259,6 +273,13 @@ impl Display for Cart {
 #[derive(Debug, Clone)]
 pub enum CartError {
     MissingCart(String),
+    /// the save file at `path` couldn't be opened, `kind` tells a file in
+    /// use by another cart from one that can't be read
+    SaveFileError {
+        path: String,
+        kind: io::ErrorKind,
+        message: String,
+    },
     InvalidRomSize(u8),
     InvalidRamSize(u8),
     InvalidCartType(u8),
@@ -269,8 +290,8 @@ pub enum CartError {
         expected_checksum: u8,
     },
     GlobalCheckSumFailure {
-        computed_checksum: u8,
-        expected_checksum: u8,
+        computed_checksum: u16,
+        expected_checksum: u16,
     },
     ReadError,
     LoadError,
@@ -283,24 +304,40 @@ impl Display for CartError {
 }
 impl std::error::Error for CartError {}
 
-impl Cart {
-    pub fn new(data: &Vec<u8>) -> Result<Self, CartError> {
-        let mut title: Vec<char> = vec![];
-        let (rom_size, rom_banks) = Cart::get_rom_size(&data[0x0148])?;
-        let mut rom = vec![0; rom_size as usize];
+impl CartHeader {
+    /// Bytes at the start of a ROM the header lives in.
+    pub const SIZE: usize = 0x0150;
 
-        for (i, byte) in data.iter().enumerate() {
-            rom[i] = byte.clone();
+    /// Reads just the header of the ROM at `path`, without mapping the rest.
+    pub fn read(path: impl AsRef<Path>) -> Result<Self, CartError> {
+        let path = path.as_ref();
+        let mut file = match File::open(path) {
+            Ok(file) => file,
+            Err(_) => return Err(CartError::MissingCart(path.display().to_string())),
+        };
+        let mut header = [0; Self::SIZE];
+        match file.read_exact(&mut header) {
+            Ok(()) => CartHeader::parse(&header),
+            Err(_) => Err(CartError::ReadError),
         }
+    }
 
-        for byte in &rom[0x0134..=(0x0134 + 15)] {
-            if *byte == 0x00 {
-                break;
-            }
-            title.insert(title.len(), char::from(byte.clone()));
+    /// Validates the header checksum and logo in the first `SIZE` bytes of
+    /// `rom`, nothing past them is looked at. Carts with a mapper this crate
+    /// can't run still parse, see `CartType::supported`.
+    pub fn parse(rom: &[u8]) -> Result<Self, CartError> {
+        if rom.len() < Self::SIZE {
+            return Err(CartError::ReadError);
         }
+        let (rom_size, rom_banks) = CartHeader::get_rom_size(&rom[0x0148])?;
+
+        let title: String = rom[0x0134..=(0x0134 + 15)]
+            .iter()
+            .take_while(|byte| **byte != 0x00)
+            .map(|byte| char::from(*byte))
+            .collect();
 
-        let (ram_size, ram_banks) = Cart::get_ram_size(&rom[0x0149])?;
+        let (ram_size, ram_banks) = CartHeader::get_ram_size(&rom[0x0149])?;
 
         let mut header_checksum = 0u8;
         for byte in &rom[0x0134..=0x014C] {
@@ -328,71 +365,56 @@ impl Cart {
             sgb: rom[0x0146] == 0x03,
             ram_size,
             ram_banks,
-            ram: vec![0; ram_size as usize],
             cart_type: CartType::new(&rom[0x0147])?,
-            title: title.iter().collect(),
-            current_ram_bank: 0,
-            current_rom_bank: 0,
+            title,
             destination: rom[0x014A] == 0x01,
             version: rom[0x014c],
-            licensee: Cart::get_licensee(&rom[0x014B], &rom[0x0144], &rom[0x0145]),
-            rom,
+            global_checksum: u16::from_be_bytes([rom[0x014e], rom[0x014f]]),
+            licensee: CartHeader::get_licensee(&rom[0x014B], &rom[0x0144], &rom[0x0145]),
         })
     }
 
-    pub fn read(&self, addr: &u16) -> Option<u8> {
-        match addr {
-            // ROM Bank 0
-            0x0000..=0x3fff => match self.rom_size < *addr as u32 {
-                true => None,
-                false => Some(self.rom[*addr as usize]),
-            },
-            // ROM Bank 1..NN
-            0x4000..=0x7fff => {
-                let addr = *addr as u32 + (0x4000 as u32 * self.current_rom_bank as u32);
-                if self.rom_size < addr {
-                    return None;
-                };
-                return Some(self.rom[addr as usize]);
-            }
-            0xA000..=0xBFFF => {
-                let addr = *addr as u32 + (0x2000 as u32 * self.current_ram_bank as u32) - 0xA000;
-                if self.ram_size < addr {
-                    return None;
-                }
-                return Some(self.ram[addr as usize]);
-            }
-            _ => None,
-        }
+    pub fn title(&self) -> &str {
+        &self.title
+    }
+
+    pub fn cgb(&self) -> bool {
+        self.cgb
+    }
+
+    pub fn licensee(&self) -> &str {
+        &self.licensee
+    }
+
+    pub fn rom_size(&self) -> u32 {
+        self.rom_size
+    }
+
+    pub fn ram_size(&self) -> u32 {
+        self.ram_size
     }
 
-    pub fn write(&mut self, _addr: &u16, _value: u8) {
-        todo!()
-        //match self.cart_type.mapper {
-        //    MapperType::MBC1 => match addr {
-        //        0xA000..=0xBFFF => {
-        //            let addr = *addr as u32 + (0x2000 as u32 * self.current_ram_bank as u32);
-        //            if self.ram_size >= addr {
-        //                self.ram[addr as usize] = value;
-        //            }
-        //        }
-        //        0x0000..=0x1fff => {
-        //            self.ram_enabled = (value & 0x0a) == 0x0a;
-        //        }
-        //        0x2000..=0x3fff => {
-        //            let mut value = value;
-        //            if value == 0x00 || value == 0x20 || value == 0x40 || value == 0x60 {
-        //                value += 1;
-        //            }
-        //            self.current_rom_bank = value;
-        //        }
-        //    },
-        //}
-    }
-
-    fn get_rom_size(code: &u8) -> Result<(u32, u8), CartError> {
+    pub fn cart_type(&self) -> &CartType {
+        &self.cart_type
+    }
+
+    pub fn version(&self) -> u8 {
+        self.version
+    }
+
+    /// The checksum over the whole ROM the header claims.
+    pub fn global_checksum(&self) -> u16 {
+        self.global_checksum
+    }
+
+    /// Whether the cart ram keeps its contents with the power off.
+    pub fn battery(&self) -> bool {
+        self.cart_type.battery
+    }
+
+    fn get_rom_size(code: &u8) -> Result<(u32, u16), CartError> {
         match code {
-            0x00..=0x08 => Ok((0x8000 * (1 << code), 2u8 << code)),
+            0x00..=0x08 => Ok((0x8000 * (1 << code), 2u16 << code)),
             _ => Err(CartError::InvalidRomSize(code.clone())),
         }
     }
@@ -628,3 +650,329 @@ impl Cart {
         String::from(licensee)
     }
 }
+
+impl CartImage {
+    /// Validates the header of `rom` and wraps it without copying, unless the
+    /// image is shorter than its header claims and has to be padded out.
+    pub fn new(rom: Rom) -> Result<Arc<Self>, CartError> {
+        let header = CartHeader::parse(&rom)?;
+        if !header.cart_type.supported() {
+            return Err(CartError::UnsupportedMapper(header.cart_type.mapper));
+        }
+        let rom = match rom.len() < header.rom_size as usize {
+            true => {
+                let mut padded = vec![0; header.rom_size as usize];
+                padded[..rom.len()].copy_from_slice(&rom);
+                Rom::from(padded)
+            }
+            false => rom,
+        };
+
+        Ok(Arc::new(Self {
+            header,
+            rom,
+            global_checksum: OnceLock::new(),
+        }))
+    }
+
+    pub fn header(&self) -> &CartHeader {
+        &self.header
+    }
+
+    pub fn rom(&self) -> &Rom {
+        &self.rom
+    }
+
+    /// The 16 bit sum of every ROM byte but the checksum itself, computed on
+    /// first use and cached.
+    pub fn global_checksum(&self) -> u16 {
+        *self.global_checksum.get_or_init(|| {
+            let sum = wide_sum(&self.rom) - self.rom[0x014e] as u64 - self.rom[0x014f] as u64;
+            sum as u16
+        })
+    }
+
+    /// Compares `global_checksum` against the header, useful for spotting bad
+    /// dumps even though games boot either way.
+    pub fn check_global_checksum(&self) -> Result<(), CartError> {
+        let (computed, expected) = (self.global_checksum(), self.header.global_checksum);
+        match computed == expected {
+            true => Ok(()),
+            false => Err(CartError::GlobalCheckSumFailure {
+                computed_checksum: computed,
+                expected_checksum: expected,
+            }),
+        }
+    }
+
+    fn mapper(&self) -> Box<dyn Mapper> {
+        let header = &self.header;
+        let (rom_banks, ram_banks) = (header.rom_banks as usize, header.ram_banks as usize);
+        match header.cart_type.mapper {
+            MapperType::MBC1 => Box::new(Mbc1::new(rom_banks, ram_banks)),
+            MapperType::MBC3 => Box::new(Mbc3::new(rom_banks, ram_banks, header.cart_type.timer)),
+            MapperType::MBC5 => Box::new(Mbc5::new(rom_banks, ram_banks, header.cart_type.rumble)),
+            // anything else was turned down by `CartImage::new`
+            _ => Box::new(NoMapper::new(ram_banks)),
+        }
+    }
+}
+
+/// Sums `bytes` into independent lanes the compiler can keep in vector
+/// registers. Lanes can't overflow on anything under 512MiB.
+fn wide_sum(bytes: &[u8]) -> u64 {
+    const LANES: usize = 32;
+    let chunks = bytes.chunks_exact(LANES);
+    let tail: u64 = chunks.remainder().iter().map(|byte| *byte as u64).sum();
+    let mut lanes = [0u32; LANES];
+    for chunk in chunks {
+        for (lane, byte) in lanes.iter_mut().zip(chunk) {
+            *lane += *byte as u32;
+        }
+    }
+    lanes.iter().map(|lane| *lane as u64).sum::<u64>() + tail
+}
+
+impl Cart {
+    pub fn new(rom: Rom) -> Result<Self, CartError> {
+        Ok(Cart::from_image(CartImage::new(rom)?))
+    }
+
+    /// Starts a fresh instance of an already validated image.
+    pub fn from_image(image: Arc<CartImage>) -> Self {
+        let mapper = image.mapper();
+        Self {
+            ram: Sram::new(image.header.ram_size as usize),
+            banks: mapper.banks(),
+            mapper,
+            image,
+        }
+    }
+
+    /// Backs the ram with the save file at `path`, creating it on first use,
+    /// so the game's own writes are what persists it. Has to happen before
+    /// the cart goes into a `Cpu`, carts without battery backed ram come back
+    /// unchanged. A save file can only back one cart at a time, for a
+    /// `Fleet` give each instance its own or none.
+    pub fn with_battery(
+        mut self,
+        path: impl AsRef<Path>,
+        policy: FlushPolicy,
+    ) -> Result<Self, CartError> {
+        let path = path.as_ref();
+        if !self.image.header.battery() || self.ram.is_empty() {
+            return Ok(self);
+        }
+        let ram = match Sram::open(path, self.ram.len(), policy) {
+            Ok(ram) => ram,
+            Err(error) => {
+                return Err(CartError::SaveFileError {
+                    path: path.display().to_string(),
+                    kind: error.kind(),
+                    message: error.to_string(),
+                })
+            }
+        };
+        self.ram = ram;
+        Ok(self)
+    }
+
+    pub fn image(&self) -> &Arc<CartImage> {
+        &self.image
+    }
+
+    pub(crate) fn flush_policy(&self) -> Option<FlushPolicy> {
+        self.ram.policy()
+    }
+
+    /// Waits for the save file to reach the disk, a no-op without one.
+    pub(crate) fn flush_battery(&self) -> io::Result<()> {
+        self.ram.flush()
+    }
+
+    /// Can't fail for a cart address, the rom is padded to its header size
+    /// and the mappers keep their banks inside it.
+    pub fn read(&self, addr: u16) -> u8 {
+        let addr = addr as usize;
+        match addr {
+            0x0000..=0x3fff => self.image.rom[self.banks.rom0 * 0x4000 + addr],
+            0x4000..=0x7fff => self.image.rom[self.banks.rom1 * 0x4000 + addr - 0x4000],
+            0xa000..=0xbfff => match self.banks.ram {
+                Some(bank) => self.ram[bank * 0x2000 + addr - 0xa000],
+                None => self.mapper.read_unmapped(addr as u16),
+            },
+            // open bus, nothing in the cart answers
+            _ => 0xff,
+        }
+    }
+
+    /// Writes to the mapper registers or ram, returning whether the selected
+    /// banks changed and the memory map has to follow. `now` is on the
+    /// single speed clock, the one the MBC3 clock counts.
+    pub(crate) fn write(&mut self, now: u64, addr: u16, value: u8) -> bool {
+        match addr {
+            0x0000..=0x7fff => self.mapper.write_register(now, addr, value),
+            _ => match self.banks.ram {
+                Some(bank) => self.ram[bank * 0x2000 + addr as usize - 0xa000] = value,
+                None => self.mapper.write_unmapped(now, addr, value),
+            },
+        }
+        let banks = self.mapper.banks();
+        let changed = banks != self.banks;
+        self.banks = banks;
+        if changed
+            && addr <= 0x1fff
+            && banks.ram.is_none()
+            && self.ram.policy() == Some(FlushPolicy::OnRamDisable)
+        {
+            // a failed sync is retried the next time, the data is safe in the
+            // page cache meanwhile
+            let _ = self.ram.flush();
+        }
+        changed
+    }
+
+    pub(crate) fn state_size(&self) -> usize {
+        CART_RAM_OFFSET + self.ram.len()
+    }
+
+    pub(crate) fn save_state_header(&self, w: &mut StateWriter) {
+        w.seek(CART_OFFSET);
+        // identifies the game the state belongs to
+        w.bytes(&self.image.rom[0x014d..0x0150]);
+        w.u32(self.ram.len() as u32);
+        self.mapper.save_state(w);
+    }
+
+    pub(crate) fn save_state_memory(&self, w: &mut StateWriter) {
+        w.seek(CART_RAM_OFFSET);
+        w.bytes(&self.ram);
+    }
+
+    pub(crate) fn check_state(&self, r: &mut StateReader) -> Result<(), StateError> {
+        r.seek(CART_OFFSET);
+        if r.bytes(3) != &self.image.rom[0x014d..0x0150] || r.u32() as usize != self.ram.len() {
+            return Err(StateError::WrongCart);
+        }
+        Ok(())
+    }
+
+    pub(crate) fn load_state(&mut self, r: &mut StateReader) {
+        r.seek(CART_OFFSET + 7);
+        self.mapper.load_state(r);
+        self.banks = self.mapper.banks();
+        r.seek(CART_RAM_OFFSET);
+        let len = self.ram.len();
+        self.ram.copy_from_slice(r.bytes(len));
+    }
+
+    pub(crate) fn clone_state_from(&mut self, other: &Cart) -> Result<(), StateError> {
+        if !Arc::ptr_eq(&self.image, &other.image) {
+            return Err(StateError::WrongCart);
+        }
+        // mappers are opaque, their few bytes of registers go through a buffer
+        let mut registers = [0; MAPPER_STATE_SIZE];
+        other
+            .mapper
+            .save_state(&mut StateWriter::new(&mut registers));
+        self.mapper.load_state(&mut StateReader::new(&registers));
+        self.banks = other.banks;
+        self.ram.copy_from_slice(&other.ram);
+        Ok(())
+    }
+
+    pub(crate) fn rom(&self) -> &[u8] {
+        &self.image.rom
+    }
+
+    pub(crate) fn ram(&self) -> &[u8] {
+        &self.ram
+    }
+
+    pub(crate) fn ram_mut(&mut self) -> &mut [u8] {
+        &mut self.ram
+    }
+
+    pub(crate) fn banks(&self) -> Banks {
+        self.banks
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+
+    /// A `rom_code` sized ROM of `cart_type` with a valid header, `ram_code`
+    /// cart ram and `program` at 0x150, jumped to from the entry point.
+    pub(crate) fn rom(cart_type: u8, rom_code: u8, ram_code: u8, program: &[u8]) -> Rom {
+        Rom::from(build(cart_type, rom_code, ram_code, 0x00, program))
+    }
+
+    /// The same as `rom` for a plain 32KiB cart that wants a CGB.
+    pub(crate) fn cgb_rom(program: &[u8]) -> Rom {
+        Rom::from(build(0x00, 0, 0x00, 0x80, program))
+    }
+
+    fn build(cart_type: u8, rom_code: u8, ram_code: u8, cgb: u8, program: &[u8]) -> Vec<u8> {
+        let mut rom = vec![0; 0x8000 << rom_code];
+        rom[0x0100..0x0104].copy_from_slice(&[0x00, 0xc3, 0x50, 0x01]);
+        rom[0x0104..0x0134].copy_from_slice(&NINTENDO_LOGO);
+        rom[0x0134..0x0138].copy_from_slice(b"TEST");
+        rom[0x0143] = cgb;
+        rom[0x0147] = cart_type;
+        rom[0x0148] = rom_code;
+        rom[0x0149] = ram_code;
+        rom[0x014d] = rom[0x0134..=0x014c]
+            .iter()
+            .fold(0u8, |sum, byte| sum.wrapping_sub(*byte).wrapping_sub(1));
+        rom[0x0150..0x0150 + program.len()].copy_from_slice(program);
+        rom
+    }
+
+    #[test]
+    fn parses_header() {
+        let image = CartImage::new(rom(0x13, 2, 0x03, &[])).unwrap();
+        let header = image.header();
+        assert_eq!(header.title(), "TEST");
+        assert_eq!(header.rom_size(), 0x20000);
+        assert_eq!(header.ram_size(), 0x8000);
+        assert!(header.battery());
+        assert!(!header.cgb());
+        assert!(CartHeader::parse(&cgb_rom(&[])).unwrap().cgb());
+    }
+
+    #[test]
+    fn rejects_bad_header_checksum() {
+        let mut bytes = rom(0x00, 0, 0x00, &[]).to_vec();
+        bytes[0x014d] ^= 1;
+        assert!(matches!(
+            CartImage::new(Rom::from(bytes)),
+            Err(CartError::HeaderCheckSumFailure { .. })
+        ));
+    }
+
+    #[test]
+    fn sums_the_global_checksum_in_lanes() {
+        // an odd length leaves a tail past the last full set of lanes
+        let mut bytes = rom(0x00, 0, 0x00, &[]).to_vec();
+        bytes.resize(bytes.len() + 29, 0);
+        for (i, byte) in bytes.iter_mut().enumerate().skip(0x0150) {
+            *byte = (i as u32).wrapping_mul(2_654_435_761).rotate_right(13) as u8;
+        }
+        bytes[0x014e] = 0xff;
+        bytes[0x014f] = 0xff;
+        let plain = bytes
+            .iter()
+            .enumerate()
+            .filter(|(i, _)| !(0x014e..=0x014f).contains(i))
+            .fold(0u16, |sum, (_, byte)| sum.wrapping_add(*byte as u16));
+
+        let image = CartImage::new(Rom::from(bytes.clone())).unwrap();
+        assert_ne!(image.rom().len() % 32, 0);
+        assert_eq!(image.global_checksum(), plain);
+        assert!(image.check_global_checksum().is_err());
+        bytes[0x014e..0x0150].copy_from_slice(&plain.to_be_bytes());
+        let image = CartImage::new(Rom::from(bytes)).unwrap();
+        assert!(image.check_global_checksum().is_ok());
+    }
+}
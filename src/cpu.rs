@@ -1,7 +1,21 @@
-use std::fmt::Display;
+use std::{fmt::Display, io};
 
+use crate::block::{BlockCache, Op, MAX_BLOCK_LEN};
+use crate::bus::Bus;
 use crate::cart::Cart;
+use crate::hash::MemoryHash;
+use crate::joypad::Button;
+use crate::ppu::{Ppu, RenderPolicy};
+use crate::profile::{self, profile};
 use crate::register::Register;
+use crate::ring::Producer;
+use crate::state::{
+    DirtyPages, StateError, StateReader, StateWriter, CPU_OFFSET, HEADER_OFFSET, STATE_MAGIC,
+    STATE_VERSION, V_RAM_OFFSET,
+};
+use crate::timing;
+use crate::trace::trace;
+use crate::tracer::{TraceRecord, Tracer};
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum LoadTarget {
@@ -246,7 +260,7 @@ pub enum BitwiseSource {
     A,
 }
 
-#[derive(Debug)]
+#[derive(Debug, Clone, Copy)]
 pub enum Instruction {
     Nop,
     Stop,
@@ -277,6 +291,8 @@ pub enum Instruction {
     ShiftLeftArithmetic(BitwiseSource),
     Swap(BitwiseSource),
     Bit(u8, BitwiseSource),
+    ResetBit(u8, BitwiseSource),
+    SetBit(u8, BitwiseSource),
     ComplementAccumulator,
     ComplementCarryFlag,
     Return(JumpCondition),
@@ -288,6 +304,55 @@ pub enum Instruction {
     Call(JumpCondition),
     Restart(u16),
     CB,
+    Illegal(u8),
+}
+
+impl Instruction {
+    /// Bytes the handler reads from after the opcode.
+    pub const fn operand_bytes(&self) -> u8 {
+        match self {
+            Instruction::Load(LoadTarget::PCAddr | LoadTarget::PC16Addr, _)
+            | Instruction::Load(_, LoadSource::PCAddr | LoadSource::PC16)
+            | Instruction::Jump(_)
+            | Instruction::Call(_) => 2,
+            Instruction::Load(_, LoadSource::PC | LoadSource::SPE)
+            | Instruction::LoadAccumulator(LoadAccumulatorTarget::PCAddr, _)
+            | Instruction::LoadAccumulator(_, LoadAccumulatorSource::PCAddr)
+            | Instruction::Add(_, AddSource::PC | AddSource::PCe)
+            | Instruction::AddCarry(AddCarrySource::PC)
+            | Instruction::Subtract(SubtractSource::PC)
+            | Instruction::SubtractCarry(SubtractCarrySource::PC)
+            | Instruction::And(AndSource::PC)
+            | Instruction::Or(OrSource::PC)
+            | Instruction::XOr(XOrSource::PC)
+            | Instruction::Compare(CompareSource::PC)
+            | Instruction::JumpRelative(_)
+            | Instruction::Stop
+            | Instruction::CB => 1,
+            _ => 0,
+        }
+    }
+
+    /// Whether straight line decoding has to stop after this instruction,
+    /// either because it moves the program counter or changes how the next
+    /// one runs.
+    pub const fn ends_block(&self) -> bool {
+        matches!(
+            self,
+            Instruction::JumpRelative(_)
+                | Instruction::Jump(_)
+                | Instruction::JumpHL
+                | Instruction::Call(_)
+                | Instruction::Return(_)
+                | Instruction::ReturnInterrupt
+                | Instruction::Restart(_)
+                | Instruction::EnableInterrupts
+                | Instruction::DisableInterrupts
+                | Instruction::Halt
+                | Instruction::Stop
+                | Instruction::Illegal(_)
+        )
+    }
 }
 
 impl Display for Instruction {
@@ -333,18 +398,38 @@ impl Display for Instruction {
             Instruction::ShiftLeftArithmetic(s) => write!(f, "SLA {:?}", s),
             Instruction::Swap(s) => write!(f, "SWAP {:?}", s),
             Instruction::Bit(b, s) => write!(f, "BIT {:#x} {:?}", b, s),
+            Instruction::ResetBit(b, s) => write!(f, "RES {:#x} {:?}", b, s),
+            Instruction::SetBit(b, s) => write!(f, "SET {:#x} {:?}", b, s),
+            Instruction::Illegal(c) => write!(f, "ILLEGAL {:#x}", c),
         }
     }
 }
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum CpuStatus {
-    Running,
-    Halted,
-    Stopped,
-    Errored,
+    Running = 0,
+    Halted = 1,
+    Stopped = 2,
+    Errored = 3,
+}
+
+/// Why a cpu is `CpuStatus::Errored`. The machine stays as it was when it
+/// stopped, an errored instance just doesn't run any further.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CpuError {
+    /// one of the opcodes that lock up a real DMG, pc is left on it
+    IllegalOpcode { opcode: u8, pc: u16 },
+}
+
+impl Display for CpuError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{:#?}", self)?;
+        Ok(())
+    }
 }
 
+impl std::error::Error for CpuError {}
+
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum Interrupt {
     VBlank = 1 << 0,
@@ -362,49 +447,523 @@ pub enum Flag {
     C = 1 << 4,
 }
 
+/// How `run_cycles` and `run_frame` execute code, both give the same results.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Engine {
+    /// fetch and decode every instruction as it runs
+    Interpreter,
+    /// decode straight line runs once and replay them from a cache
+    BlockCache,
+}
+
+/// When memory accesses inside an instruction happen, the cycle count each
+/// instruction adds is the same either way.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum MemoryTiming {
+    /// every access sees the bus as of the end of the previous instruction,
+    /// the whole cost is added in one go
+    Instruction,
+    /// every access gets its own M-cycle with the bus caught up to it, for
+    /// test roms that time reads and writes within an instruction
+    Access,
+}
+
+/// M-cycles from the start of one frame to the next, 154 lines of 114 cycles
+pub const CYCLES_PER_FRAME: u64 = 154 * 114;
+
+pub static INSTRUCTION_TABLE: [Instruction; 256] = Cpu::decode_table(false);
+pub static CB_INSTRUCTION_TABLE: [Instruction; 256] = Cpu::decode_table(true);
+
+/// Runs the body of one opcode, each is its own monomorphized function with
+/// the operands fixed at compile time.
+pub(crate) type Handler = fn(&mut Cpu);
+
+static HANDLERS: [Handler; 256] = Cpu::handler_table(false);
+static CB_HANDLERS: [Handler; 256] = Cpu::handler_table(true);
+
+/// Operand numbering the handlers are generic over, the order the opcodes
+/// encode them in. Plain registers index `Register` directly, so only a few
+/// are named in code.
+#[allow(dead_code)]
+mod r8 {
+    pub const B: u8 = 0;
+    pub const C: u8 = 1;
+    pub const D: u8 = 2;
+    pub const E: u8 = 3;
+    pub const H: u8 = 4;
+    pub const L: u8 = 5;
+    pub const HL_ADDR: u8 = 6;
+    pub const A: u8 = 7;
+    /// the byte after the opcode
+    pub const IMM: u8 = 8;
+}
+
+/// register pairs, AF takes the place of SP for PUSH and POP
+#[allow(dead_code)]
+mod r16 {
+    pub const BC: u8 = 0;
+    pub const DE: u8 = 1;
+    pub const HL: u8 = 2;
+    pub const SP: u8 = 3;
+}
+
+/// pointers of the indirect accumulator loads
+mod ind {
+    pub const BC: u8 = 0;
+    pub const DE: u8 = 1;
+    pub const HL_INC: u8 = 2;
+    pub const HL_DEC: u8 = 3;
+}
+
+mod cond {
+    pub const NZ: u8 = 0;
+    pub const Z: u8 = 1;
+    pub const NC: u8 = 2;
+    pub const C: u8 = 3;
+    pub const ALWAYS: u8 = 4;
+}
+
+mod alu {
+    pub const ADD: u8 = 0;
+    pub const ADC: u8 = 1;
+    pub const SUB: u8 = 2;
+    pub const SBC: u8 = 3;
+    pub const AND: u8 = 4;
+    pub const XOR: u8 = 5;
+    pub const OR: u8 = 6;
+}
+
+mod shift {
+    pub const RLC: u8 = 0;
+    pub const RRC: u8 = 1;
+    pub const RL: u8 = 2;
+    pub const RR: u8 = 3;
+    pub const SLA: u8 = 4;
+    pub const SRA: u8 = 5;
+    pub const SWAP: u8 = 6;
+}
+
+/// Turns a runtime operand into a const generic one, `$handler` is expanded
+/// once per literal with `$name` bound to it.
+macro_rules! select {
+    ($value:expr, $name:ident in [$($n:literal)*] => $handler:expr) => {
+        match $value {
+            $($n => {
+                const $name: u8 = $n;
+                $handler
+            })*
+            _ => unreachable!(),
+        }
+    };
+}
+
 pub struct Cpu {
     status: CpuStatus,
     register: Register,
     program_counter: u16,
     stack_pointer: u16,
-    cart: Cart,
+    bus: Bus,
+    /// cycles `step` still owes the instruction in flight
     step_count: u8,
-    instruction: Instruction,
-    v_ram: [[u8; 0x2000]; 2],
-    v_ram_bank: u8,
-    w_ram: [[u8; 0x2000]; 8],
-    w_ram_bank: u8,
+    handler: Handler,
+    /// cycle the current instruction ends on, penalties push it back
+    deadline: u64,
+    timing: MemoryTiming,
     ime: bool,
-    io_registers: [u8; 0x80],
-    h_ram: [u8; 0x80],
-    ie: u8,
     ime_next: bool,
+    cycles: u64,
+    instructions: u64,
+    engine: Engine,
+    blocks: BlockCache,
+    tracer: Option<Box<Tracer>>,
 }
 
 impl Cpu {
+    /// Advances a single M-cycle. An instruction takes effect on its first
+    /// cycle and the calls after it only spend the rest.
     pub fn step(&mut self) {
-        if CpuStatus::Errored == self.status || self.status == CpuStatus::Stopped {
-            return;
+        match self.status {
+            CpuStatus::Running => (),
+            CpuStatus::Halted | CpuStatus::Stopped => return self.idle(self.cycles + 1),
+            CpuStatus::Errored => return,
+        }
+
+        if self.step_count == 0 {
+            let start = self.cycles;
+            self.execute_one();
+            self.step_count = (self.cycles - start) as u8;
+            self.cycles = start;
+        }
+        self.step_count -= 1;
+        self.cycles += 1;
+        if self.step_count == 0 {
+            self.end_instruction();
+        } else if self.cycles > self.bus.now() {
+            // with `MemoryTiming::Access` the instruction's accesses already
+            // took the bus part of the way, it never goes back
+            self.bus.sync(self.cycles);
+        }
+    }
+
+    /// Runs whole instructions until at least `cycles` M-cycles have passed,
+    /// returning how many actually did.
+    pub fn run_cycles(&mut self, cycles: u64) -> u64 {
+        self.run_until(self.cycles + cycles)
+    }
+
+    /// Runs up to the start of the next frame, returning the M-cycles spent.
+    /// Frames are counted on the ppu's clock, so at double speed a frame
+    /// takes twice the cpu's cycles.
+    pub fn run_frame(&mut self) -> u64 {
+        let frame = self.bus.slow_clock(self.cycles) / CYCLES_PER_FRAME + 1;
+        self.run_until(self.bus.cpu_clock(frame * CYCLES_PER_FRAME))
+    }
+
+    pub fn cycles(&self) -> u64 {
+        self.cycles
+    }
+
+    pub fn status(&self) -> CpuStatus {
+        self.status
+    }
+
+    /// What stopped an errored cpu, worked out from the state it stopped in
+    /// so it survives save states.
+    pub fn error(&self) -> Option<CpuError> {
+        (self.status == CpuStatus::Errored).then(|| CpuError::IllegalOpcode {
+            opcode: self.bus.read(self.program_counter),
+            pc: self.program_counter,
+        })
+    }
+
+    /// Instructions this instance has run, a CB prefixed one counts once.
+    /// Not part of save states.
+    pub fn instructions(&self) -> u64 {
+        self.instructions
+    }
+
+    /// Hashes ram and the io registers, a few microseconds' work.
+    pub fn memory_hash(&self) -> MemoryHash {
+        self.bus.memory_hash()
+    }
+
+    pub fn ppu(&self) -> &Ppu {
+        self.bus.ppu()
+    }
+
+    /// Picks the frames the ppu draws, a headless instance keeps exact video
+    /// timing but skips composing pixels. Applies from the next frame.
+    pub fn set_render_policy(&mut self, policy: RenderPolicy) {
+        self.bus.ppu_mut().set_render_policy(policy);
+    }
+
+    /// Has the next frame drawn regardless of the render policy.
+    pub fn request_frame(&mut self) {
+        self.bus.ppu_mut().request_frame();
+    }
+
+    pub fn engine(&self) -> Engine {
+        self.engine
+    }
+
+    /// Switching engines is allowed at any point, cached blocks are kept.
+    pub fn set_engine(&mut self, engine: Engine) {
+        self.engine = engine;
+    }
+
+    pub fn memory_timing(&self) -> MemoryTiming {
+        self.timing
+    }
+
+    /// Applies from the next instruction, with either engine.
+    pub fn set_memory_timing(&mut self, timing: MemoryTiming) {
+        self.timing = timing;
+    }
+
+    fn run_until(&mut self, target: u64) -> u64 {
+        let start = self.cycles;
+        if CpuStatus::Errored == self.status {
+            return 0;
+        }
+
+        // finish anything a previous step left in flight
+        if self.step_count > 0 {
+            self.cycles += self.step_count as u64;
+            self.step_count = 0;
+            self.end_instruction();
+        }
+
+        match self.engine {
+            Engine::BlockCache => self.run_blocks_until(target),
+            Engine::Interpreter => self.interpret_until(target),
+        }
+
+        self.cycles - start
+    }
+
+    fn interpret_until(&mut self, target: u64) {
+        while self.cycles < target {
+            match self.status {
+                CpuStatus::Running => self.interpret_one(),
+                CpuStatus::Halted | CpuStatus::Stopped => self.idle(target),
+                CpuStatus::Errored => break,
+            }
+        }
+    }
+
+    #[inline(always)]
+    fn interpret_one(&mut self) {
+        self.execute_one();
+        self.end_instruction();
+    }
+
+    /// Fetches and runs the instruction at pc, leaving the clock on the cycle
+    /// it ends on.
+    #[inline(always)]
+    fn execute_one(&mut self) {
+        let start = self.cycles;
+        let pc = self.program_counter;
+        if self.tracer.is_some() {
+            self.trace_instruction();
+        }
+        let opcode = self.fetch() as usize;
+        trace!("Executing Instruction: {}", INSTRUCTION_TABLE[opcode]);
+        profile!(self.profile_instruction(pc, opcode as u8));
+        self.handler = HANDLERS[opcode];
+        self.instructions += 1;
+        self.execute(start, timing::CYCLES[opcode]);
+    }
+
+    /// Runs `handler` as an instruction that started on `start` and costs
+    /// `cycles` before any penalty it charges.
+    #[inline(always)]
+    fn execute(&mut self, start: u64, cycles: u8) {
+        self.deadline = start + cycles as u64;
+        (self.handler)(self);
+        self.cycles = self.deadline;
+    }
+
+    /// Charges `cycles` on top of the current instruction's base cost.
+    #[inline(always)]
+    fn spend(&mut self, cycles: u8) {
+        self.deadline += cycles as u64;
+    }
+
+    /// Moves on to the next M-cycle of the current instruction ahead of a
+    /// memory access or an internal delay that precedes one. Only
+    /// `MemoryTiming::Access` spreads instructions out like this.
+    #[inline(always)]
+    fn tick(&mut self) {
+        if self.timing == MemoryTiming::Access {
+            self.cycles += 1;
+            self.bus.sync(self.cycles);
         }
+    }
 
-        // handle interrupts
+    /// Skips a halted or stopped cpu straight to the next scheduled event, or
+    /// `target` if that comes first. Nothing but an event can wake HALT, and
+    /// STOP only wakes on a button press from outside the run loop.
+    fn idle(&mut self, target: u64) {
+        self.cycles = self.bus.next_event().min(target).max(self.cycles + 1);
+        match self.status {
+            CpuStatus::Halted => {
+                self.end_instruction();
+            }
+            _ => self.bus.sync(self.cycles),
+        }
+    }
 
+    /// Catches the bus up to the cpu and takes any pending interrupt,
+    /// returning whether the cpu jumped to a handler.
+    #[inline(always)]
+    fn end_instruction(&mut self) -> bool {
+        self.bus.sync(self.cycles);
+        if self.bus.stalled() {
+            self.stall();
+        }
+        let serviced = self.bus.pending_interrupts() != 0 && self.service_interrupt();
+        // EI takes effect after the instruction that follows it
         if self.ime_next {
             self.ime = true;
+            self.ime_next = false;
         }
+        serviced
+    }
 
-        // handle instructions
-        if self.step_count == 0 {
-            (self.instruction, self.step_count) =
-                Cpu::get_instruction(&self.read(&self.program_counter));
-            self.program_counter += 1;
+    /// Waits out the time DMA or a speed switch held the cpu, along with
+    /// anything that holds it on through that time.
+    #[cold]
+    fn stall(&mut self) {
+        while self.bus.stalled() {
+            self.cycles += self.bus.take_stall();
+            self.bus.sync(self.cycles);
+        }
+    }
+
+    /// Wakes from HALT on any pending interrupt and, with IME set, calls the
+    /// handler of the highest priority one.
+    fn service_interrupt(&mut self) -> bool {
+        if self.status == CpuStatus::Halted {
+            self.status = CpuStatus::Running;
+        }
+        if !self.ime {
+            return false;
+        }
+
+        let pending = self.bus.pending_interrupts();
+        let interrupt = pending & pending.wrapping_neg();
+        self.bus.acknowledge_interrupt(interrupt);
+        self.ime = false;
+        self.ime_next = false;
+        // two wait states, then the push, then the jump
+        self.deadline = self.cycles + timing::INTERRUPT as u64;
+        self.tick();
+        self.restart(0x40 + 8 * interrupt.trailing_zeros() as u16);
+        self.cycles = self.deadline;
+        self.bus.sync(self.cycles);
+        trace!("servicing interrupt {:#x}", interrupt);
+        true
+    }
+
+    /// Same loop as `interpret_until` but replaying pre-decoded blocks. A
+    /// block is left early when the budget runs out, an interrupt is taken,
+    /// the status changes or the bus reports that code or the memory map
+    /// changed under it, so the instruction stream is exactly what the
+    /// interpreter would run.
+    fn run_blocks_until(&mut self, target: u64) {
+        while self.cycles < target {
+            match self.status {
+                CpuStatus::Running => (),
+                CpuStatus::Halted | CpuStatus::Stopped => {
+                    self.idle(target);
+                    continue;
+                }
+                CpuStatus::Errored => break,
+            }
+            if self.bus.code_event() {
+                self.blocks.invalidate(self.bus.take_code_writes());
+            }
+
+            let Some(ops) = self.lookup_block(self.program_counter) else {
+                self.interpret_one();
+                continue;
+            };
+
+            for index in ops {
+                let op = self.blocks.op(index);
+                let start = self.cycles;
+                if self.tracer.is_some() {
+                    self.trace_instruction();
+                }
+                profile!(match op.opcode_len {
+                    2 => {
+                        self.profile_instruction(self.program_counter, 0xcb);
+                        profile::cb_instruction(op.opcode);
+                    }
+                    _ => self.profile_instruction(self.program_counter, op.opcode),
+                });
+                self.program_counter = self.program_counter.wrapping_add(op.opcode_len as u16);
+                for _ in 0..op.opcode_len {
+                    self.tick();
+                }
+                trace!("Executing Instruction: {}", op.instruction);
+                self.handler = op.handler;
+                self.instructions += 1;
+                self.execute(start, op.cycles);
+
+                if self.end_instruction()
+                    || self.status != CpuStatus::Running
+                    || self.bus.code_event()
+                    || self.cycles >= target
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    #[cold]
+    fn trace_instruction(&mut self) {
+        let pc = self.program_counter;
+        let record = TraceRecord {
+            cycles: self.cycles,
+            pc,
+            sp: self.stack_pointer,
+            af: self.register.get_af(),
+            bc: self.register.get_bc(),
+            de: self.register.get_de(),
+            hl: self.register.get_hl(),
+            pc_mem: self.bus.read_code(pc),
+        };
+        if let Some(tracer) = &mut self.tracer {
+            tracer.record(record);
+        }
+    }
+
+    fn profile_instruction(&self, pc: u16, opcode: u8) {
+        let bank = self.bus.code_region(pc).map(|(bank, _)| bank);
+        profile::instruction(pc, bank, opcode);
+    }
+
+    fn lookup_block(&mut self, pc: u16) -> Option<std::ops::Range<usize>> {
+        let (bank, end) = self.bus.code_region(pc)?;
+        let key = (bank as u32) << 16 | pc as u32;
+        match self.blocks.get(key) {
+            Some(ops) => Some(ops),
+            None => self.decode_block(key, pc, end),
         }
-        if self.step_count > 1 {
-            self.step_count -= 1;
-            return;
+    }
+
+    /// Decodes from `pc` up to the first instruction that ends a block or
+    /// would run past `end`, the last address of the region.
+    fn decode_block(&mut self, key: u32, pc: u16, end: u16) -> Option<std::ops::Range<usize>> {
+        self.blocks.begin();
+        let mut addr = pc;
+        let mut last = pc;
+        loop {
+            let opcode = self.bus.read(addr) as usize;
+            let mut instruction = INSTRUCTION_TABLE[opcode];
+            let mut cycles = timing::CYCLES[opcode];
+            let mut handler = HANDLERS[opcode];
+            let mut opcode_len = 1;
+            let mut last_opcode = opcode as u8;
+            if let Instruction::CB = instruction {
+                if addr == end {
+                    break;
+                }
+                let opcode = self.bus.read(addr + 1) as usize;
+                instruction = CB_INSTRUCTION_TABLE[opcode];
+                (handler, opcode_len, last_opcode) = (CB_HANDLERS[opcode], 2, opcode as u8);
+                cycles += timing::CB_CYCLES[opcode];
+            }
+            let len = opcode_len as u16 + instruction.operand_bytes() as u16;
+            if end - addr < len - 1 {
+                break;
+            }
+
+            self.blocks.push(Op {
+                instruction,
+                opcode: last_opcode,
+                handler,
+                cycles,
+                opcode_len,
+            });
+            last = addr + len - 1;
+            if instruction.ends_block()
+                || self.blocks.pending() == MAX_BLOCK_LEN
+                || end - addr < len
+            {
+                break;
+            }
+            addr += len;
         }
 
-        self.process_instruction();
+        let ram_pages = (pc >= 0x8000).then_some(((pc >> 8) as u8, (last >> 8) as u8));
+        let ops = self.blocks.finish(key, ram_pages)?;
+        if let Some((first, last)) = ram_pages {
+            self.bus.protect_code(first, last);
+        }
+        Some(ops)
     }
 
     pub fn new(cart: Cart) -> Self {
@@ -413,154 +972,233 @@ impl Cpu {
             ime_next: false,
             step_count: 0,
             ime: false,
-            h_ram: [0; 0x80],
-            ie: 0,
-            io_registers: [0; 0x80],
-            instruction: Instruction::Nop,
-            cart,
+            handler: Cpu::nop,
+            deadline: 0,
+            timing: MemoryTiming::Instruction,
+            bus: Bus::new(cart),
             program_counter: 0x000,
             stack_pointer: 0xFFFF,
             register: Register::new(),
-            v_ram: [[0; 0x2000]; 2],
-            v_ram_bank: 0,
-            w_ram: [[0; 0x2000]; 8],
-            w_ram_bank: 1,
+            cycles: 0,
+            instructions: 0,
+            engine: Engine::Interpreter,
+            blocks: BlockCache::new(),
+            tracer: None,
         };
 
         cpu.reset();
         cpu
     }
 
-    pub fn request_interrupt(&mut self, interrupt: Interrupt) {
-        let flags = self.read(&0xff0f);
-        self.write(&0xff0f, flags | interrupt as u8);
+    /// Bytes needed to hold a save state of this machine.
+    pub fn state_size(&self) -> usize {
+        self.bus.state_size()
+    }
+
+    /// Serializes the machine into `buf` without allocating, returning the
+    /// number of bytes written. States can only be taken between instructions.
+    pub fn save_state(&self, buf: &mut [u8]) -> Result<usize, StateError> {
+        let size = self.state_size();
+        if buf.len() < size {
+            return Err(StateError::BufferTooSmall { needed: size });
+        }
+        if self.step_count != 0 {
+            return Err(StateError::MidInstruction);
+        }
+        let mut w = StateWriter::new(&mut buf[..size]);
+        self.write_state_header(&mut w);
+        self.bus.save_state_memory(&mut w);
+        Ok(size)
+    }
+
+    /// Writes only the header pages of a state, the part that isn't covered
+    /// by dirty page tracking.
+    pub(crate) fn save_state_header(&self, buf: &mut [u8]) -> Result<(), StateError> {
+        if self.step_count != 0 {
+            return Err(StateError::MidInstruction);
+        }
+        self.write_state_header(&mut StateWriter::new(buf));
+        Ok(())
+    }
+
+    pub(crate) fn state_page(&self, page: usize) -> &[u8] {
+        self.bus.state_page(page)
+    }
+
+    pub(crate) fn take_dirty_pages(&mut self) -> DirtyPages {
+        self.bus.take_dirty()
     }
 
-    fn process_instruction(&mut self) {
-        println!("Executing Instruction: {}", self.instruction);
+    fn write_state_header(&self, w: &mut StateWriter) {
+        w.seek(HEADER_OFFSET);
+        w.bytes(&[0; V_RAM_OFFSET]);
+        w.seek(HEADER_OFFSET);
+        w.bytes(&STATE_MAGIC);
+        w.u16(STATE_VERSION);
+        w.seek(CPU_OFFSET);
+        w.u8(self.status as u8);
+        w.bool(self.ime);
+        w.bool(self.ime_next);
+        w.u16(self.register.get_af());
+        w.u16(self.register.get_bc());
+        w.u16(self.register.get_de());
+        w.u16(self.register.get_hl());
+        w.u16(self.stack_pointer);
+        w.u16(self.program_counter);
+        w.u64(self.cycles);
+        self.bus.save_state_header(w);
+    }
+
+    pub fn load_state(&mut self, buf: &[u8]) -> Result<(), StateError> {
+        let size = self.state_size();
+        if buf.len() < size {
+            return Err(StateError::BufferTooSmall { needed: size });
+        }
+
+        let mut r = StateReader::state(buf);
+        r.seek(HEADER_OFFSET);
+        if r.array() != STATE_MAGIC {
+            return Err(StateError::InvalidMagic);
+        }
+        let version = r.u16();
+        if version != STATE_VERSION {
+            return Err(StateError::UnsupportedVersion(version));
+        }
+        self.check_state(&mut r)?;
+
+        r.seek(CPU_OFFSET);
+        self.status = match r.u8() {
+            0 => CpuStatus::Running,
+            1 => CpuStatus::Halted,
+            2 => CpuStatus::Stopped,
+            _ => CpuStatus::Errored,
+        };
+        self.ime = r.bool();
+        self.ime_next = r.bool();
+        self.register.set_af(r.u16());
+        self.register.set_bc(r.u16());
+        self.register.set_de(r.u16());
+        self.register.set_hl(r.u16());
+        self.stack_pointer = r.u16();
+        self.program_counter = r.u16();
+        self.cycles = r.u64();
         self.step_count = 0;
-        match self.instruction {
-            Instruction::Compare(source) => self.compare(source),
-            Instruction::XOr(source) => self.xor(source),
-            Instruction::Load(target, source) => self.load(target, source),
-            Instruction::CB => {
-                let (instruction, cycles) =
-                    Cpu::get_cb_instruction(&self.read(&self.program_counter));
-                self.instruction = instruction;
-                self.step_count = cycles;
-                self.program_counter += 1;
-            }
-            Instruction::Bit(bit, source) => self.bit(bit, source),
-            Instruction::JumpRelative(condition) => self.jump_relative(condition),
-            Instruction::EnableInterrupts => self.ime = true,
-            Instruction::DisableInterrupts => self.ime = false,
-            Instruction::LoadAccumulator(target, source) => self.load_accumulator(target, source),
-            Instruction::Increment(target) => self.increment(target),
-            Instruction::Call(condition) => self.call(condition),
-            Instruction::Subtract(source) => self.sub(source),
-            Instruction::Nop => (),
-            Instruction::Push(target) => self.push(target),
-            Instruction::RotateLeft(source) => self.rotate_left(source),
-            Instruction::Pop(target) => self.pop(target),
-            Instruction::Decrement(target) => self.decrement(target),
-            Instruction::Add(target, source) => self.add(target, source),
-            Instruction::AddCarry(source) => self.add_carry(source),
-            Instruction::And(source) => self.and(source),
-            Instruction::ComplementAccumulator => self.complement_accumulator(),
-            Instruction::ComplementCarryFlag => self.complement_carry_flag(),
-            Instruction::DecimalAdjustAccumulator => self.decimal_adjust_accumulator(),
-            Instruction::Halt => self.status = CpuStatus::Halted,
-            Instruction::Stop => {
-                self.program_counter += 1;
-                self.status = CpuStatus::Stopped;
-            }
-            Instruction::Restart(addr) => self.restart(addr),
-            Instruction::Return(condition) => self.ret(condition),
-            Instruction::JumpHL => self.jump_hl(),
-            Instruction::ReturnInterrupt => {
-                self.ret(JumpCondition::None);
-                self.ime = true;
-            }
-            Instruction::RotateLeftCircular(source) => {
-                self.rotate(source, |cpu: &mut Cpu, value: u8| {
-                    let last = value >> 7;
-                    let n = value.rotate_left(1);
-                    cpu.update_flag(Flag::C, last == 0x01);
-                    cpu.update_flag(Flag::Z, n == 0);
-                    cpu.clear_flag(Flag::H);
-                    cpu.clear_flag(Flag::N);
-                    n
-                })
-            }
-            Instruction::RotateRight(source) => self.rotate(source, |cpu: &mut Cpu, value: u8| {
-                let last = value & 0x01;
-                let mut n = value >> 1;
-                if cpu.get_flag(Flag::C) {
-                    n |= 1u8 << 7;
-                }
-                cpu.update_flag(Flag::C, last == 0x01);
-                cpu.update_flag(Flag::Z, n == 0);
-                cpu.clear_flag(Flag::H);
-                cpu.clear_flag(Flag::N);
-                n
-            }),
-            Instruction::RotateRightCircular(source) => {
-                self.rotate(source, |cpu: &mut Cpu, value: u8| {
-                    let last = value & 0x01;
-                    let n = value.rotate_right(1);
-                    cpu.update_flag(Flag::C, last == 0x01);
-                    cpu.update_flag(Flag::Z, n == 0);
-                    cpu.clear_flag(Flag::H);
-                    cpu.clear_flag(Flag::N);
-                    n
-                })
-            }
-            Instruction::SetCarryFlag => {
-                self.set_flag(Flag::C);
-                self.clear_flag(Flag::N);
-                self.clear_flag(Flag::H);
-            }
-            Instruction::ShiftLeftArithmetic(source) => {
-                self.rotate(source, |cpu: &mut Cpu, value: u8| {
-                    let last = value >> 7;
-                    let n = value << 1;
-                    cpu.update_flag(Flag::C, last == 0x01);
-                    cpu.update_flag(Flag::Z, n == 0);
-                    cpu.clear_flag(Flag::H);
-                    cpu.clear_flag(Flag::N);
-                    n
-                })
-            }
-            Instruction::ShiftRightArithmetic(source) => {
-                self.rotate(source, |cpu: &mut Cpu, value: u8| {
-                    let sign = value & 0x80;
-                    let c = value & 0x01;
-                    let n = (value >> 1) & sign;
-                    cpu.update_flag(Flag::C, c == 0x01);
-                    cpu.update_flag(Flag::Z, n == 0);
-                    cpu.clear_flag(Flag::H);
-                    cpu.clear_flag(Flag::N);
-                    n
-                })
-            }
-            Instruction::ShiftRightLogical(source) => {
-                self.rotate(source, |cpu: &mut Cpu, value: u8| {
-                    let c = value & 0x01;
-                    let n = value >> 1;
-                    cpu.update_flag(Flag::C, c == 0x01);
-                    cpu.update_flag(Flag::Z, n == 0);
-                    cpu.clear_flag(Flag::H);
-                    cpu.clear_flag(Flag::N);
-                    n
-                })
-            }
-            Instruction::SubtractCarry(source) => self.sub_carry(source),
-            Instruction::Swap(source) => self.swap(source),
-            Instruction::Or(source) => self.or(source),
-            Instruction::Jump(condition) => self.jump(condition),
+        self.bus.load_state(&mut r, self.cycles);
+        Ok(())
+    }
+
+    /// Turns down a state holding a value no save could have written, before
+    /// anything is restored from it.
+    fn check_state(&self, r: &mut StateReader) -> Result<(), StateError> {
+        r.seek(CPU_OFFSET);
+        r.u8_in(0..=CpuStatus::Errored as u8)?;
+        r.u8_in(0..=1)?;
+        r.u8_in(0..=1)?;
+        // the registers can hold anything
+        r.bytes(12);
+        let now = r.u64();
+        self.bus.check_state(r, now)
+    }
+
+    pub fn save_state_to_vec(&self) -> Result<Vec<u8>, StateError> {
+        let mut buf = vec![0; self.state_size()];
+        self.save_state(&mut buf)?;
+        Ok(buf)
+    }
+
+    /// Forks `other` into this machine with plain copies and no buffer in
+    /// between, both have to be running the same `CartImage`.
+    pub fn clone_state_from(&mut self, other: &Cpu) -> Result<(), StateError> {
+        if other.step_count != 0 {
+            return Err(StateError::MidInstruction);
+        }
+        self.bus.clone_state_from(&other.bus)?;
+        self.status = other.status;
+        self.ime = other.ime;
+        self.ime_next = other.ime_next;
+        self.register = other.register;
+        self.stack_pointer = other.stack_pointer;
+        self.program_counter = other.program_counter;
+        self.cycles = other.cycles;
+        self.step_count = 0;
+        Ok(())
+    }
+
+    /// Sets the held buttons as a mask of `Button` bits. A new press in a
+    /// group P1 selects raises the joypad interrupt and wakes the cpu from
+    /// STOP, presses in the other group do neither.
+    pub fn set_buttons(&mut self, pressed: u8) {
+        if self.bus.set_buttons(pressed) && self.status == CpuStatus::Stopped {
+            self.status = CpuStatus::Running;
         }
     }
 
+    pub fn buttons(&self) -> u8 {
+        self.bus.buttons()
+    }
+
+    /// Reads `addr` the way the running game would see it, without spending
+    /// any time.
+    pub fn peek(&self, addr: u16) -> u8 {
+        self.bus.read(addr)
+    }
+
+    pub fn press(&mut self, button: Button) {
+        self.set_buttons(self.buttons() | button as u8);
+    }
+
+    pub fn release(&mut self, button: Button) {
+        self.set_buttons(self.buttons() & !(button as u8));
+    }
+
+    pub fn request_interrupt(&mut self, interrupt: Interrupt) {
+        self.bus.request_interrupt(interrupt);
+    }
+
+    /// Starts sending interleaved stereo samples at `sample_rate` Hz into
+    /// `samples`, the other end of which an audio thread drains. The
+    /// emulation never waits on it, samples that don't fit are dropped.
+    pub fn attach_audio(&mut self, samples: Producer<i16>, sample_rate: u32) {
+        self.bus.attach_audio(samples, sample_rate);
+    }
+
+    /// Stops making samples, giving back the producer. Length, envelope and
+    /// sweep timing carry on either way.
+    pub fn detach_audio(&mut self) -> Option<Producer<i16>> {
+        self.bus.detach_audio()
+    }
+
+    /// Records the state of the machine at the start of every instruction
+    /// from here on. Either engine records the same trace.
+    pub fn attach_tracer(&mut self, tracer: Tracer) {
+        self.tracer = Some(Box::new(tracer));
+    }
+
+    /// Stops tracing, hand the tracer to `Tracer::finish` to close its file.
+    pub fn detach_tracer(&mut self) -> Option<Tracer> {
+        self.tracer.take().map(|tracer| *tracer)
+    }
+
+    /// Waits for the battery save file, if the cart has one, to reach the
+    /// disk. Dropping the `Cpu` does the same.
+    pub fn flush_battery(&self) -> io::Result<()> {
+        self.bus.flush_battery()
+    }
+
+    /// Keeps the bytes the game sends over the serial port for
+    /// `take_serial_output`, test roms report their results this way. Off by
+    /// default, a game pinging the link port would otherwise grow the buffer
+    /// for as long as nobody takes it.
+    pub fn capture_serial(&mut self, on: bool) {
+        self.bus.capture_serial(on);
+    }
+
+    /// Bytes the game has sent over the serial port since the last call, or
+    /// since capture started. Always empty unless `capture_serial` is on.
+    pub fn take_serial_output(&mut self) -> Vec<u8> {
+        self.bus.take_serial_output()
+    }
+
     fn reset(&mut self) {
         self.status = CpuStatus::Running;
         self.ime = false;
@@ -604,10 +1242,24 @@ impl Cpu {
         self.write(&0xFFFF, 0x00);
     }
 
-    fn get_instruction(byte: &u8) -> (Instruction, u8) {
+    const fn decode_table(cb: bool) -> [Instruction; 256] {
+        let mut table = [Instruction::Nop; 256];
+        let mut byte = 0;
+        while byte < table.len() {
+            table[byte] = if cb {
+                Cpu::get_cb_instruction(&(byte as u8))
+            } else {
+                Cpu::get_instruction(&(byte as u8))
+            };
+            byte += 1;
+        }
+        table
+    }
+
+    pub const fn get_instruction(byte: &u8) -> Instruction {
         match byte {
-            0x00 => (Instruction::Nop, 1),
-            0x10 => (Instruction::Stop, 2),
+            0x00 => Instruction::Nop,
+            0x10 => Instruction::Stop,
             0x01 | 0x11 | 0x21 | 0x31 => {
                 let target = match byte {
                     0x01 => LoadTarget::BC,
@@ -617,7 +1269,7 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Load(target, LoadSource::PC16), 3)
+                Instruction::Load(target, LoadSource::PC16)
             }
             0x02 | 0x12 | 0x22 | 0x32 => {
                 let addr = match byte {
@@ -627,7 +1279,7 @@ impl Cpu {
                     0x32 => LoadTarget::HLAddrDec,
                     _ => panic!("Unreachable Instruction"),
                 };
-                (Instruction::Load(addr, LoadSource::A), 2)
+                Instruction::Load(addr, LoadSource::A)
             }
             0x03 | 0x13 | 0x23 | 0x33 => {
                 let target = match byte {
@@ -638,7 +1290,7 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Increment(target), 2)
+                Instruction::Increment(target)
             }
             0x04 | 0x14 | 0x24 | 0x34 => {
                 let target = match byte {
@@ -647,8 +1299,7 @@ impl Cpu {
                     0x24 => IncrementTarget::H,
                     0x34 | _ => IncrementTarget::HLAddr,
                 };
-                let duration = if *byte == 0x34 { 2 } else { 1 };
-                (Instruction::Increment(target), duration)
+                Instruction::Increment(target)
             }
             0x05 | 0x15 | 0x25 | 0x35 => {
                 let target = match byte {
@@ -658,26 +1309,24 @@ impl Cpu {
                     0x35 => DecrementTarget::HLAddr,
                     _ => panic!("Unreachable Instruction"),
                 };
-                let duration = if *byte == 0x35 { 2 } else { 1 };
-                (Instruction::Decrement(target), duration)
+                Instruction::Decrement(target)
             }
             0x06 | 0x16 | 0x26 | 0x36 => {
                 let target = match byte {
                     0x06 => LoadTarget::B,
                     0x16 => LoadTarget::D,
                     0x26 => LoadTarget::H,
-                    0x36 => LoadTarget::HL,
+                    0x36 => LoadTarget::HLAddr,
                     _ => panic!("Unreachable Instruction"),
                 };
-                let duration = if *byte == 0x36 { 3 } else { 2 };
 
-                (Instruction::Load(target, LoadSource::PC), duration)
+                Instruction::Load(target, LoadSource::PC)
             }
-            0x07 => (Instruction::RotateLeftCircular(BitwiseSource::A), 1),
-            0x17 => (Instruction::RotateLeft(BitwiseSource::A), 1),
-            0x27 => (Instruction::DecimalAdjustAccumulator, 1),
-            0x37 => (Instruction::SetCarryFlag, 1),
-            0x08 => (Instruction::Load(LoadTarget::PC16Addr, LoadSource::SP), 5),
+            0x07 => Instruction::RotateLeftCircular(BitwiseSource::A),
+            0x17 => Instruction::RotateLeft(BitwiseSource::A),
+            0x27 => Instruction::DecimalAdjustAccumulator,
+            0x37 => Instruction::SetCarryFlag,
+            0x08 => Instruction::Load(LoadTarget::PC16Addr, LoadSource::SP),
             0x20 | 0x30 | 0x18 | 0x28 | 0x38 => {
                 let condition = match byte {
                     0x20 => JumpCondition::NZ,
@@ -687,7 +1336,7 @@ impl Cpu {
                     0x38 => JumpCondition::C,
                     _ => panic!("Unreachable Instruction"),
                 };
-                (Instruction::JumpRelative(condition), 2)
+                Instruction::JumpRelative(condition)
             }
             0x09 | 0x19 | 0x29 | 0x39 => {
                 let source = match byte {
@@ -697,7 +1346,7 @@ impl Cpu {
                     0x39 => AddSource::SP,
                     _ => panic!("Unreachable Instruction"),
                 };
-                (Instruction::Add(AddTarget::HL, source), 2)
+                Instruction::Add(AddTarget::HL, source)
             }
             0x0a | 0x1a | 0x2a | 0x3a => {
                 let source = match byte {
@@ -708,7 +1357,7 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Load(LoadTarget::A, source), 2)
+                Instruction::Load(LoadTarget::A, source)
             }
             0x0b | 0x1b | 0x2b | 0x3b => {
                 let target = match byte {
@@ -719,7 +1368,7 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Decrement(target), 2)
+                Instruction::Decrement(target)
             }
             0x0c | 0x1c | 0x2c | 0x3c => {
                 let target = match byte {
@@ -730,7 +1379,7 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Increment(target), 1)
+                Instruction::Increment(target)
             }
             0x0d | 0x1d | 0x2d | 0x3d => {
                 let target = match byte {
@@ -741,7 +1390,7 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Decrement(target), 1)
+                Instruction::Decrement(target)
             }
             0x0e | 0x1e | 0x2e | 0x3e => {
                 let target = match byte {
@@ -752,12 +1401,12 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Load(target, LoadSource::PC), 2)
+                Instruction::Load(target, LoadSource::PC)
             }
-            0x0f => (Instruction::RotateRightCircular(BitwiseSource::A), 1),
-            0x1f => (Instruction::RotateRight(BitwiseSource::A), 1),
-            0x2f => (Instruction::ComplementAccumulator, 1),
-            0x3f => (Instruction::ComplementCarryFlag, 1),
+            0x0f => Instruction::RotateRightCircular(BitwiseSource::A),
+            0x1f => Instruction::RotateRight(BitwiseSource::A),
+            0x2f => Instruction::ComplementAccumulator,
+            0x3f => Instruction::ComplementCarryFlag,
             0x40..=0x75 | 0x77..=0x7f => {
                 let target = match byte {
                     0x40..=0x47 => LoadTarget::B,
@@ -771,7 +1420,7 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let source = match byte & 0x0F {
+                let source = match *byte & 0x0F {
                     0x00 | 0x08 => LoadSource::B,
                     0x01 | 0x09 => LoadSource::C,
                     0x02 | 0x0a => LoadSource::D,
@@ -784,17 +1433,11 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = match byte {
-                    0x70..=0x77 => 2,
-                    _ if (byte & 0x0f) == 0x06 || (byte & 0x0f) == 0x0e => 2,
-                    _ => 1,
-                };
-
-                (Instruction::Load(target, source), cycles)
+                Instruction::Load(target, source)
             }
-            0x76 => (Instruction::Halt, 1),
+            0x76 => Instruction::Halt,
             0x80..=0x87 => {
-                let source = match byte & 0x0f {
+                let source = match *byte & 0x0f {
                     0x00 => AddSource::B,
                     0x01 => AddSource::C,
                     0x02 => AddSource::D,
@@ -806,12 +1449,10 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = if source == AddSource::HLAddr { 2 } else { 1 };
-
-                (Instruction::Add(AddTarget::A, source), cycles)
+                Instruction::Add(AddTarget::A, source)
             }
             0x88..=0x8f => {
-                let source = match byte & 0x0f {
+                let source = match *byte & 0x0f {
                     0x08 => AddCarrySource::B,
                     0x09 => AddCarrySource::C,
                     0x0a => AddCarrySource::D,
@@ -823,16 +1464,10 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = if source == AddCarrySource::HLAddr {
-                    2
-                } else {
-                    1
-                };
-
-                (Instruction::AddCarry(source), cycles)
+                Instruction::AddCarry(source)
             }
             0x90..=0x97 => {
-                let source = match byte & 0x0f {
+                let source = match *byte & 0x0f {
                     0x00 => SubtractSource::B,
                     0x01 => SubtractSource::C,
                     0x02 => SubtractSource::D,
@@ -844,16 +1479,10 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = if source == SubtractSource::HLAddr {
-                    2
-                } else {
-                    1
-                };
-
-                (Instruction::Subtract(source), cycles)
+                Instruction::Subtract(source)
             }
             0x98..=0x9f => {
-                let source = match byte & 0x0f {
+                let source = match *byte & 0x0f {
                     0x08 => SubtractCarrySource::B,
                     0x09 => SubtractCarrySource::C,
                     0x0a => SubtractCarrySource::D,
@@ -865,16 +1494,10 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = if source == SubtractCarrySource::HLAddr {
-                    2
-                } else {
-                    1
-                };
-
-                (Instruction::SubtractCarry(source), cycles)
+                Instruction::SubtractCarry(source)
             }
             0xa0..=0xa7 => {
-                let source = match byte & 0x0f {
+                let source = match *byte & 0x0f {
                     0x00 => AndSource::B,
                     0x01 => AndSource::C,
                     0x02 => AndSource::D,
@@ -886,12 +1509,10 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = if source == AndSource::HLAddr { 2 } else { 1 };
-
-                (Instruction::And(source), cycles)
+                Instruction::And(source)
             }
             0xa8..=0xaf => {
-                let source = match byte & 0x0f {
+                let source = match *byte & 0x0f {
                     0x08 => XOrSource::B,
                     0x09 => XOrSource::C,
                     0x0a => XOrSource::D,
@@ -903,12 +1524,10 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = if source == XOrSource::HLAddr { 2 } else { 1 };
-
-                (Instruction::XOr(source), cycles)
+                Instruction::XOr(source)
             }
             0xb0..=0xb7 => {
-                let source = match byte & 0x0f {
+                let source = match *byte & 0x0f {
                     0x00 => OrSource::B,
                     0x01 => OrSource::C,
                     0x02 => OrSource::D,
@@ -920,12 +1539,10 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = if source == OrSource::HLAddr { 2 } else { 1 };
-
-                (Instruction::Or(source), cycles)
+                Instruction::Or(source)
             }
             0xb8..=0xbf => {
-                let source = match byte & 0x0f {
+                let source = match *byte & 0x0f {
                     0x08 => CompareSource::B,
                     0x09 => CompareSource::C,
                     0x0a => CompareSource::D,
@@ -937,18 +1554,12 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                let cycles = if source == CompareSource::HLAddr {
-                    2
-                } else {
-                    1
-                };
-
-                (Instruction::Compare(source), cycles)
+                Instruction::Compare(source)
             }
-            0xc0 => (Instruction::Return(JumpCondition::NZ), 2),
-            0xd0 => (Instruction::Return(JumpCondition::NC), 2),
+            0xc0 => Instruction::Return(JumpCondition::NZ),
+            0xd0 => Instruction::Return(JumpCondition::NC),
             0xc1 | 0xd1 | 0xe1 | 0xf1 => {
-                let target = match byte & 0xF0 {
+                let target = match *byte & 0xF0 {
                     0xc0 => PopTarget::BC,
                     0xd0 => PopTarget::DE,
                     0xe0 => PopTarget::HL,
@@ -956,10 +1567,10 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Pop(target), 3)
+                Instruction::Pop(target)
             }
             0xc5 | 0xd5 | 0xe5 | 0xf5 => {
-                let target = match byte & 0xF0 {
+                let target = match *byte & 0xF0 {
                     0xc0 => PushTarget::BC,
                     0xd0 => PushTarget::DE,
                     0xe0 => PushTarget::HL,
@@ -967,83 +1578,69 @@ impl Cpu {
                     _ => panic!("Unreachable Instruction"),
                 };
 
-                (Instruction::Push(target), 3)
-            }
-            0xc2 => (Instruction::Jump(JumpCondition::NZ), 3),
-            0xd2 => (Instruction::Jump(JumpCondition::NC), 3),
-            0xc3 => (Instruction::Jump(JumpCondition::None), 4),
-            0xe0 => (
-                Instruction::LoadAccumulator(
-                    LoadAccumulatorTarget::PCAddr,
-                    LoadAccumulatorSource::A,
-                ),
-                3,
-            ),
-            0xf0 => (
-                Instruction::LoadAccumulator(
-                    LoadAccumulatorTarget::A,
-                    LoadAccumulatorSource::PCAddr,
-                ),
-                3,
-            ),
-            0xe2 => (
-                Instruction::LoadAccumulator(
-                    LoadAccumulatorTarget::CAddr,
-                    LoadAccumulatorSource::A,
-                ),
-                2,
+                Instruction::Push(target)
+            }
+            0xc2 => Instruction::Jump(JumpCondition::NZ),
+            0xd2 => Instruction::Jump(JumpCondition::NC),
+            0xc3 => Instruction::Jump(JumpCondition::None),
+            0xe0 => Instruction::LoadAccumulator(
+                LoadAccumulatorTarget::PCAddr,
+                LoadAccumulatorSource::A,
             ),
-            0xf2 => (
-                Instruction::LoadAccumulator(
-                    LoadAccumulatorTarget::A,
-                    LoadAccumulatorSource::CAddr,
-                ),
-                2,
+            0xf0 => Instruction::LoadAccumulator(
+                LoadAccumulatorTarget::A,
+                LoadAccumulatorSource::PCAddr,
             ),
-            0xf3 => (Instruction::DisableInterrupts, 1),
-            0xc4 => (Instruction::Call(JumpCondition::NZ), 3),
-            0xd4 => (Instruction::Call(JumpCondition::NC), 3),
-            0xc6 => (Instruction::Add(AddTarget::A, AddSource::PC), 2),
-            0xd6 => (Instruction::Subtract(SubtractSource::PC), 2),
-            0xe6 => (Instruction::And(AndSource::PC), 2),
-            0xf6 => (Instruction::Or(OrSource::PC), 2),
-            0xc7 => (Instruction::Restart(0x00), 4),
-            0xd7 => (Instruction::Restart(0x10), 4),
-            0xe7 => (Instruction::Restart(0x20), 4),
-            0xf7 => (Instruction::Restart(0x30), 4),
-            0xc8 => (Instruction::Return(JumpCondition::Z), 2),
-            0xd8 => (Instruction::Return(JumpCondition::C), 2),
-            0xe8 => (Instruction::Add(AddTarget::SP, AddSource::E), 4),
-            0xf8 => (Instruction::Load(LoadTarget::HL, LoadSource::SPE), 3),
-            0xc9 => (Instruction::Return(JumpCondition::None), 4),
-            0xd9 => (Instruction::ReturnInterrupt, 4),
-            0xe9 => (Instruction::JumpHL, 1),
-            0xf9 => (Instruction::Load(LoadTarget::SP, LoadSource::HL), 2),
-            0xca => (Instruction::Jump(JumpCondition::Z), 3),
-            0xda => (Instruction::Jump(JumpCondition::C), 3),
-            0xea => (Instruction::Load(LoadTarget::PCAddr, LoadSource::A), 4),
-            0xfa => (Instruction::Load(LoadTarget::A, LoadSource::PCAddr), 4),
-            0xcb => (Instruction::CB, 1),
-            0xfb => (Instruction::EnableInterrupts, 1),
-            0xcc => (Instruction::Call(JumpCondition::Z), 3),
-            0xdc => (Instruction::Call(JumpCondition::C), 3),
-            0xcd => (Instruction::Call(JumpCondition::C), 6),
-            0xce => (Instruction::AddCarry(AddCarrySource::PC), 2),
-            0xde => (Instruction::SubtractCarry(SubtractCarrySource::PC), 2),
-            0xee => (Instruction::XOr(XOrSource::PC), 2),
-            0xfe => (Instruction::Compare(CompareSource::PC), 2),
-            0xcf => (Instruction::Restart(0x08), 4),
-            0xdf => (Instruction::Restart(0x18), 4),
-            0xef => (Instruction::Restart(0x28), 4),
-            0xff => (Instruction::Restart(0x38), 4),
+            0xe2 => {
+                Instruction::LoadAccumulator(LoadAccumulatorTarget::CAddr, LoadAccumulatorSource::A)
+            }
+            0xf2 => {
+                Instruction::LoadAccumulator(LoadAccumulatorTarget::A, LoadAccumulatorSource::CAddr)
+            }
+            0xf3 => Instruction::DisableInterrupts,
+            0xc4 => Instruction::Call(JumpCondition::NZ),
+            0xd4 => Instruction::Call(JumpCondition::NC),
+            0xc6 => Instruction::Add(AddTarget::A, AddSource::PC),
+            0xd6 => Instruction::Subtract(SubtractSource::PC),
+            0xe6 => Instruction::And(AndSource::PC),
+            0xf6 => Instruction::Or(OrSource::PC),
+            0xc7 => Instruction::Restart(0x00),
+            0xd7 => Instruction::Restart(0x10),
+            0xe7 => Instruction::Restart(0x20),
+            0xf7 => Instruction::Restart(0x30),
+            0xc8 => Instruction::Return(JumpCondition::Z),
+            0xd8 => Instruction::Return(JumpCondition::C),
+            0xe8 => Instruction::Add(AddTarget::SP, AddSource::PCe),
+            0xf8 => Instruction::Load(LoadTarget::HL, LoadSource::SPE),
+            0xc9 => Instruction::Return(JumpCondition::None),
+            0xd9 => Instruction::ReturnInterrupt,
+            0xe9 => Instruction::JumpHL,
+            0xf9 => Instruction::Load(LoadTarget::SP, LoadSource::HL),
+            0xca => Instruction::Jump(JumpCondition::Z),
+            0xda => Instruction::Jump(JumpCondition::C),
+            0xea => Instruction::Load(LoadTarget::PCAddr, LoadSource::A),
+            0xfa => Instruction::Load(LoadTarget::A, LoadSource::PCAddr),
+            0xcb => Instruction::CB,
+            0xfb => Instruction::EnableInterrupts,
+            0xcc => Instruction::Call(JumpCondition::Z),
+            0xdc => Instruction::Call(JumpCondition::C),
+            0xcd => Instruction::Call(JumpCondition::None),
+            0xce => Instruction::AddCarry(AddCarrySource::PC),
+            0xde => Instruction::SubtractCarry(SubtractCarrySource::PC),
+            0xee => Instruction::XOr(XOrSource::PC),
+            0xfe => Instruction::Compare(CompareSource::PC),
+            0xcf => Instruction::Restart(0x08),
+            0xdf => Instruction::Restart(0x18),
+            0xef => Instruction::Restart(0x28),
+            0xff => Instruction::Restart(0x38),
             0xd3 | 0xe3 | 0xe4 | 0xf4 | 0xdb | 0xeb | 0xec | 0xfc | 0xdd | 0xed | 0xfd => {
-                panic!("Unknown Instruction Code: {:#x}", byte)
+                Instruction::Illegal(*byte)
             }
         }
     }
 
-    fn get_cb_instruction(byte: &u8) -> (Instruction, u8) {
-        let source = match byte & 0x0F {
+    pub const fn get_cb_instruction(byte: &u8) -> Instruction {
+        let source = match *byte & 0x0F {
             0x00 | 0x08 => BitwiseSource::B,
             0x01 | 0x09 => BitwiseSource::C,
             0x02 | 0x0a => BitwiseSource::D,
@@ -1054,746 +1651,97 @@ impl Cpu {
             0x07 | 0x0f => BitwiseSource::A,
             _ => panic!("Unreachable Instruction"),
         };
-        let cycles = if source == BitwiseSource::HLAddr {
-            3
-        } else {
-            1
-        };
         match byte {
-            0x00..=0x07 => (Instruction::RotateLeftCircular(source), cycles),
-            0x08..=0x0f => (Instruction::RotateRightCircular(source), cycles),
-            0x10..=0x17 => (Instruction::RotateLeft(source), cycles),
-            0x18..=0x1f => (Instruction::RotateRight(source), cycles),
-            0x20..=0x27 => (Instruction::ShiftLeftArithmetic(source), cycles),
-            0x28..=0x2f => (Instruction::ShiftRightArithmetic(source), cycles),
-            0x30..=0x37 => (Instruction::Swap(source), cycles),
-            0x38..=0x3f => (Instruction::ShiftRightLogical(source), cycles),
-            0x40..=0x47 => (Instruction::Bit(0, source), cycles),
-            0x48..=0x4f => (Instruction::Bit(1, source), cycles),
-            0x50..=0x57 => (Instruction::Bit(2, source), cycles),
-            0x58..=0x5f => (Instruction::Bit(3, source), cycles),
-            0x60..=0x67 => (Instruction::Bit(4, source), cycles),
-            0x68..=0x6f => (Instruction::Bit(5, source), cycles),
-            0x70..=0x77 => (Instruction::Bit(6, source), cycles),
-            0x78..=0x7f => (Instruction::Bit(7, source), cycles),
-            _ => panic!("Unknown Instruction: {:#x}", byte),
+            0x00..=0x07 => Instruction::RotateLeftCircular(source),
+            0x08..=0x0f => Instruction::RotateRightCircular(source),
+            0x10..=0x17 => Instruction::RotateLeft(source),
+            0x18..=0x1f => Instruction::RotateRight(source),
+            0x20..=0x27 => Instruction::ShiftLeftArithmetic(source),
+            0x28..=0x2f => Instruction::ShiftRightArithmetic(source),
+            0x30..=0x37 => Instruction::Swap(source),
+            0x38..=0x3f => Instruction::ShiftRightLogical(source),
+            0x40..=0x47 => Instruction::Bit(0, source),
+            0x48..=0x4f => Instruction::Bit(1, source),
+            0x50..=0x57 => Instruction::Bit(2, source),
+            0x58..=0x5f => Instruction::Bit(3, source),
+            0x60..=0x67 => Instruction::Bit(4, source),
+            0x68..=0x6f => Instruction::Bit(5, source),
+            0x70..=0x77 => Instruction::Bit(6, source),
+            0x78..=0x7f => Instruction::Bit(7, source),
+            0x80..=0xbf => Instruction::ResetBit((*byte >> 3) & 0x07, source),
+            0xc0..=0xff => Instruction::SetBit((*byte >> 3) & 0x07, source),
         }
     }
 
     fn write(&mut self, addr: &u16, value: u8) {
-        match addr {
-            0x0000..=0x7fff => panic!("attempting to write to cart rom"),
-            0x8000..=0x9fff => {
-                self.v_ram[(self.v_ram_bank & 1) as usize][(addr - 0x8000) as usize] = value
-            }
-            0xa000..=0xbfff => self.cart.write(addr, value),
-            0xc000..=0xcfff => {
-                self.w_ram[0][(addr - 0xc000) as usize] = value;
-            }
-            0xd000..=0xdfff => {
-                self.w_ram[self.w_ram_bank as usize][(addr - 0xd000) as usize] = value
-            }
-            0xe000..=0xfdff => panic!("attempting to write to echo ram"),
-            0xfe00..=0xfe9f => println!("writing {:#x} to {:#x} OAM", value, addr),
-            0xfea0..=0xfeff => panic!("attempting to write to unusable address"),
-            0xff00..=0xff7f => {
-                self.io_registers[(addr - 0xff00) as usize] = value;
-                if *addr == 0xff4f {
-                    self.v_ram_bank = value & 1;
-                }
-                if *addr == 0xff50 {
-                    self.status = CpuStatus::Stopped;
-                }
-                if *addr == 0xff70 {
-                    self.w_ram_bank = value;
-                }
-            }
-            0xff80..=0xfffe => {
-                self.h_ram[(addr - 0xff80) as usize] = value;
-            }
-            0xffff => self.ie = value,
-        }
-        println!("writing {:#x} to {:#x}", value, addr);
+        profile!(profile::access(*addr, true));
+        self.tick();
+        self.bus.write(*addr, value);
+        trace!("writing {:#x} to {:#x}", value, addr);
     }
 
-    fn read(&self, addr: &u16) -> u8 {
-        return match addr {
-            0x0000..=0x7fff | 0xA000..=0xBfff => self
-                .cart
-                .read(addr)
-                .expect("failed to read from cart: {addr}"),
-            0x8000..=0x9fff => self.v_ram[self.v_ram_bank as usize][(addr - 0x8000) as usize],
-            0xC000..=0xCfff => self.w_ram[0][(addr - 0xC000) as usize],
-            0xd000..=0xdfff => self.w_ram[self.w_ram_bank as usize][(addr - 0xd000) as usize],
-            0xe000..=0xefff => self.w_ram[0][(addr - 0xe000) as usize],
-            0xf000..=0xfdff => self.w_ram[self.w_ram_bank as usize][(addr - 0xf000) as usize],
-            0xfea0..=0xfeff => {
-                println!("accessing unusable memory: {}", addr);
-                0xff
-            }
-            0xff0..=0xff7f => self.io_registers[(addr - 0xff0) as usize],
-            0xff80..=0xfffe => self.h_ram[(addr - 0xff80) as usize],
-            0xffff => self.ie,
-        };
+    fn read(&mut self, addr: &u16) -> u8 {
+        profile!(profile::access(*addr, false));
+        self.tick();
+        self.bus.read(*addr)
     }
 
-    fn rotate_left(&mut self, source: BitwiseSource) {
-        let c = match source {
-            BitwiseSource::B => {
-                let c = self.register.get_b() >> 7;
-                self.register.set_b(self.register.get_b() << 1);
-                c
-            }
-            BitwiseSource::C => {
-                let c = self.register.get_c() >> 7;
-                self.register.set_c(self.register.get_c() << 1);
-                c
-            }
-            BitwiseSource::D => {
-                let c = self.register.get_d() >> 7;
-                self.register.set_d(self.register.get_d() << 1);
-                c
-            }
-            BitwiseSource::E => {
-                let c = self.register.get_e() >> 7;
-                self.register.set_e(self.register.get_e() << 1);
-                c
-            }
-            BitwiseSource::H => {
-                let c = self.register.get_h() >> 7;
-                self.register.set_h(self.register.get_h() << 1);
-                c
-            }
-            BitwiseSource::L => {
-                let c = self.register.get_l() >> 7;
-                self.register.set_l(self.register.get_l() << 1);
-                c
-            }
-            BitwiseSource::A => {
-                let c = self.register.get_a() >> 7;
-                self.register.set_a(self.register.get_a() << 1);
-                c
-            }
-            BitwiseSource::HLAddr => {
-                let n = self.read(&self.register.get_hl());
-                let c = n >> 7;
-                self.write(&self.register.get_hl(), n << 1);
-                c
-            }
-        };
-
-        self.update_flag(Flag::C, c == 1);
+    fn get_flag(&self, flag: Flag) -> bool {
+        self.register.get_f() & flag as u8 == flag as u8
     }
 
-    fn pop(&mut self, target: PopTarget) {
-        let n = self.read(&self.stack_pointer) as u16;
-        self.stack_pointer += 1;
-        let n = n | (self.read(&self.stack_pointer) as u16) << 8;
-        self.stack_pointer += 1;
-
-        match target {
-            PopTarget::BC => self.register.set_bc(n),
-            PopTarget::DE => self.register.set_de(n),
-            PopTarget::HL => self.register.set_hl(n),
-            PopTarget::AF => self.register.set_af(n),
-        };
+    #[inline(always)]
+    fn zero_flag(value: u8) -> u8 {
+        ((value == 0) as u8) << 7
     }
 
-    fn push(&mut self, target: PushTarget) {
-        let (msb, lsb) = match target {
-            PushTarget::BC => (self.register.get_b(), self.register.get_c()),
-            PushTarget::DE => (self.register.get_d(), self.register.get_e()),
-            PushTarget::HL => (self.register.get_h(), self.register.get_l()),
-            PushTarget::AF => (self.register.get_a(), self.register.get_f()),
-        };
-
-        self.stack_pointer -= 1;
-        self.write(&self.stack_pointer.clone(), msb);
-        self.stack_pointer -= 1;
-        self.write(&self.stack_pointer.clone(), lsb);
+    /// `a + b + carry` and the whole F byte for it. H and C fall out of the
+    /// 16 bit sum, bit 4 of `a ^ b ^ result` is the carry into the high nibble.
+    #[inline(always)]
+    fn add_flags(a: u8, b: u8, carry: u8) -> (u8, u8) {
+        let wide = a as u16 + b as u16 + carry as u16;
+        let result = wide as u8;
+        let h = (a ^ b ^ result) & 0x10;
+        (
+            result,
+            Cpu::zero_flag(result) | h << 1 | (wide >> 4) as u8 & 0x10,
+        )
     }
 
-    fn jump_relative(&mut self, condition: JumpCondition) {
-        if condition == JumpCondition::None {
-            let e = self.read(&self.program_counter) as i8;
-            self.program_counter += 1;
-            self.program_counter = (self.program_counter as i16 + e as i16) as u16;
-            println!("jump to: {:#x}", self.program_counter);
-            return;
-        }
-
-        let condition = match condition {
-            JumpCondition::None => unreachable!(),
-            JumpCondition::Z => self.get_flag(Flag::Z),
-            JumpCondition::C => self.get_flag(Flag::C),
-            JumpCondition::NZ => !self.get_flag(Flag::Z),
-            JumpCondition::NC => !self.get_flag(Flag::C),
-        };
-
-        if condition {
-            self.instruction = Instruction::JumpRelative(JumpCondition::None);
-            self.step_count = 1;
-        } else {
-            self.program_counter += 1;
-        }
+    /// `a - b - carry` and the whole F byte for it, a borrow leaves the high
+    /// byte of the 16 bit difference set.
+    #[inline(always)]
+    fn sub_flags(a: u8, b: u8, carry: u8) -> (u8, u8) {
+        let wide = (a as u16).wrapping_sub(b as u16).wrapping_sub(carry as u16);
+        let result = wide as u8;
+        let h = (a ^ b ^ result) & 0x10;
+        let flags = Cpu::zero_flag(result) | Flag::N as u8 | h << 1 | (wide >> 4) as u8 & 0x10;
+        (result, flags)
     }
 
-    fn call(&mut self, condition: JumpCondition) {
-        if condition == JumpCondition::None {
-            let addr = self.read(&self.program_counter) as u16;
-            self.program_counter += 1;
-            let addr = addr | (self.read(&self.program_counter) as u16) << 8;
-            self.program_counter += 1;
-
-            self.restart(addr);
-            return;
-        }
-
-        let condition = match condition {
-            JumpCondition::None => unreachable!(),
-            JumpCondition::Z => self.get_flag(Flag::Z),
-            JumpCondition::C => self.get_flag(Flag::C),
-            JumpCondition::NZ => !self.get_flag(Flag::Z),
-            JumpCondition::NC => !self.get_flag(Flag::C),
-        };
+    /// INC leaves C alone.
+    #[inline(always)]
+    fn increment_flags(&self, value: u8) -> (u8, u8) {
+        let result = value.wrapping_add(1);
+        let h = ((result & 0xf == 0) as u8) << 5;
+        let carry = self.register.get_f() & Flag::C as u8;
+        (result, Cpu::zero_flag(result) | h | carry)
+    }
 
-        if condition {
-            self.instruction = Instruction::Call(JumpCondition::None);
-            self.step_count = 3;
-        } else {
-            self.program_counter += 3;
-        }
+    /// DEC leaves C alone.
+    #[inline(always)]
+    fn decrement_flags(&self, value: u8) -> (u8, u8) {
+        let result = value.wrapping_sub(1);
+        let h = ((result & 0xf == 0xf) as u8) << 5;
+        let carry = self.register.get_f() & Flag::C as u8;
+        (result, Cpu::zero_flag(result) | Flag::N as u8 | h | carry)
     }
 
-    fn sub(&mut self, source: SubtractSource) {
-        let source = match source {
-            SubtractSource::A => self.register.get_a(),
-            SubtractSource::B => self.register.get_b(),
-            SubtractSource::C => self.register.get_c(),
-            SubtractSource::D => self.register.get_d(),
-            SubtractSource::E => self.register.get_e(),
-            SubtractSource::H => self.register.get_h(),
-            SubtractSource::L => self.register.get_l(),
-            SubtractSource::PC => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n
-            }
-            SubtractSource::HLAddr => self.read(&self.register.get_hl()),
-        };
-        let (result, c, h) = Cpu::subtract(&self.register.get_a(), &source);
-
-        self.register.set_a(result);
-        self.update_flag(Flag::C, c);
-        self.update_flag(Flag::H, h);
-        self.set_flag(Flag::N);
-        self.update_flag(Flag::Z, result == 0);
-    }
-
-    fn bit(&mut self, bit: u8, source: BitwiseSource) {
-        let source = match source {
-            BitwiseSource::B => self.register.get_b(),
-            BitwiseSource::C => self.register.get_c(),
-            BitwiseSource::D => self.register.get_d(),
-            BitwiseSource::E => self.register.get_e(),
-            BitwiseSource::H => self.register.get_h(),
-            BitwiseSource::L => self.register.get_l(),
-            BitwiseSource::A => self.register.get_a(),
-            BitwiseSource::HLAddr => self.read(&self.register.get_hl()),
-        };
-
-        self.update_flag(Flag::Z, ((source >> bit) & 1) == 0);
-        self.set_flag(Flag::H);
-        self.clear_flag(Flag::N);
-    }
-
-    fn compare(&mut self, source: CompareSource) {
-        let value = match source {
-            CompareSource::A => self.register.get_a(),
-            CompareSource::B => self.register.get_b(),
-            CompareSource::C => self.register.get_c(),
-            CompareSource::D => self.register.get_d(),
-            CompareSource::E => self.register.get_e(),
-            CompareSource::H => self.register.get_h(),
-            CompareSource::L => self.register.get_l(),
-            CompareSource::HLAddr => self.read(&self.register.get_hl()),
-            CompareSource::PC => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n
-            }
-        };
-
-        let (result, c, h) = Cpu::subtract(&self.register.get_a(), &value);
-        println!(
-            "Comparing: {} - {} = {}",
-            self.register.get_a(),
-            value,
-            result
-        );
-        self.update_flag(Flag::Z, result == 0);
-        self.update_flag(Flag::N, true);
-        self.update_flag(Flag::H, h);
-        self.update_flag(Flag::C, c);
-    }
-
-    fn load(&mut self, target: LoadTarget, source: LoadSource) {
-        let source: u16 = match source {
-            LoadSource::PCAddr => {
-                let lsb = self.read(&self.program_counter);
-                self.program_counter += 1;
-                let msb = self.read(&self.program_counter);
-                self.program_counter += 1;
-                let n = (msb as u16) << 8 | lsb as u16;
-                self.read(&n) as u16
-            }
-            LoadSource::HL => self.register.get_hl(),
-            LoadSource::SPE => {
-                let e = self.read(&self.program_counter) as i8;
-                self.program_counter += 1;
-                (self.stack_pointer as i16 + e as i16) as u16
-            }
-            LoadSource::BCAddr => self.read(&self.register.get_bc()) as u16,
-            LoadSource::DEAddr => self.read(&self.register.get_de()) as u16,
-            LoadSource::HLAddrInc => {
-                let hl = self.register.get_hl();
-                let n = self.read(&hl);
-                self.register.set_hl(hl + 1);
-                n as u16
-            }
-            LoadSource::HLAddrDec => {
-                let hl = self.register.get_hl();
-                let n = self.read(&hl);
-                self.register.set_hl(hl - 1);
-                n as u16
-            }
-            LoadSource::SP => self.stack_pointer,
-            LoadSource::PC => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n as u16
-            }
-            LoadSource::PC16 => {
-                let lsb = self.read(&self.program_counter);
-                self.program_counter += 1;
-                let msb = self.read(&self.program_counter);
-                self.program_counter += 1;
-                (msb as u16) << 8 | lsb as u16
-            }
-            LoadSource::A => self.register.get_a() as u16,
-            LoadSource::B => self.register.get_b() as u16,
-            LoadSource::C => self.register.get_c() as u16,
-            LoadSource::D => self.register.get_d() as u16,
-            LoadSource::E => self.register.get_e() as u16,
-            LoadSource::H => self.register.get_h() as u16,
-            LoadSource::L => self.register.get_l() as u16,
-            LoadSource::HLAddr => self.read(&self.register.get_hl()) as u16,
-        };
-
-        match target {
-            LoadTarget::A => self.register.set_a(source as u8),
-            LoadTarget::B => self.register.set_b(source as u8),
-            LoadTarget::C => self.register.set_c(source as u8),
-            LoadTarget::D => self.register.set_d(source as u8),
-            LoadTarget::E => self.register.set_e(source as u8),
-            LoadTarget::H => self.register.set_h(source as u8),
-            LoadTarget::L => self.register.set_l(source as u8),
-            LoadTarget::BC => self.register.set_bc(source),
-            LoadTarget::DE => self.register.set_de(source),
-            LoadTarget::HL => self.register.set_hl(source),
-            LoadTarget::SP => self.stack_pointer = source,
-            LoadTarget::BCAddr => self.write(&self.register.get_bc(), source as u8),
-            LoadTarget::DEAddr => self.write(&self.register.get_de(), source as u8),
-            LoadTarget::HLAddrInc => {
-                let hl = self.register.get_hl();
-                self.write(&hl, source as u8);
-                self.register.set_hl(hl + 1);
-            }
-            LoadTarget::HLAddrDec => {
-                let hl = self.register.get_hl();
-                self.write(&hl, source as u8);
-                self.register.set_hl(hl - 1);
-            }
-            LoadTarget::HLAddr => self.write(&self.register.get_hl(), source as u8),
-            LoadTarget::PCAddr => {
-                let lsb = self.read(&self.program_counter);
-                self.program_counter += 1;
-                let msb = self.read(&self.program_counter);
-                self.program_counter += 1;
-                let n = (msb as u16) << 8 | lsb as u16;
-                self.write(&n, source as u8);
-            }
-            LoadTarget::PC16Addr => {
-                let lsb = self.read(&self.program_counter);
-                self.program_counter += 1;
-                let msb = self.read(&self.program_counter);
-                self.program_counter += 1;
-                let n = (msb as u16) << 8 | lsb as u16;
-                self.write(&n, source as u8);
-                let n = n + 1;
-                self.write(&n, (source >> 8) as u8)
-            }
-        };
-    }
-
-    fn load_accumulator(&mut self, target: LoadAccumulatorTarget, source: LoadAccumulatorSource) {
-        let source = match source {
-            LoadAccumulatorSource::A => self.register.get_a(),
-            LoadAccumulatorSource::PCAddr => {
-                let n = self.read(&self.program_counter) as u16;
-                self.program_counter += 1;
-                self.read(&(0xFF00 | n))
-            }
-            LoadAccumulatorSource::CAddr => self.read(&(0xFF00 | (self.register.get_c() as u16))),
-        };
-
-        match target {
-            LoadAccumulatorTarget::PCAddr => {
-                let n = 0xFF00 | self.read(&self.program_counter) as u16;
-                self.program_counter += 1;
-                self.write(&n, source);
-            }
-            LoadAccumulatorTarget::A => self.register.set_a(source),
-            LoadAccumulatorTarget::CAddr => {
-                let addr = ((0xFF as u16) << 8) | (self.register.get_c() as u16);
-                self.write(&addr, source);
-            }
-        };
-    }
-
-    fn increment(&mut self, target: IncrementTarget) {
-        match target {
-            IncrementTarget::BC => {
-                let (result, _) = self.register.get_bc().overflowing_add(1);
-                self.register.set_bc(result);
-            }
-            IncrementTarget::DE => {
-                let (result, _) = self.register.get_de().overflowing_add(1);
-                self.register.set_de(result);
-            }
-            IncrementTarget::HL => {
-                let (result, _) = self.register.get_hl().overflowing_add(1);
-                self.register.set_hl(result);
-            }
-            IncrementTarget::SP => {
-                let (result, _) = self.stack_pointer.overflowing_add(1);
-                self.stack_pointer = result;
-            }
-            IncrementTarget::B => {
-                let (results, _, h) = Cpu::addition(&self.register.get_b(), &1);
-                self.register.set_b(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.clear_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            IncrementTarget::D => {
-                let (results, _, h) = Cpu::addition(&self.register.get_d(), &1);
-                self.register.set_d(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.clear_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            IncrementTarget::H => {
-                let (results, _, h) = Cpu::addition(&self.register.get_h(), &1);
-                self.register.set_h(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.clear_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            IncrementTarget::C => {
-                let (results, _, h) = Cpu::addition(&self.register.get_c(), &1);
-                self.register.set_c(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.clear_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            IncrementTarget::E => {
-                let (results, _, h) = Cpu::addition(&self.register.get_e(), &1);
-                self.register.set_e(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.clear_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            IncrementTarget::L => {
-                let (results, _, h) = Cpu::addition(&self.register.get_l(), &1);
-                self.register.set_l(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.clear_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            IncrementTarget::A => {
-                let (results, _, h) = Cpu::addition(&self.register.get_a(), &1);
-                self.register.set_a(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.clear_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            IncrementTarget::HLAddr => {
-                let addr = self.register.get_hl();
-                let (results, _, h) = Cpu::addition(&self.read(&addr), &1);
-                self.write(&addr, results);
-                self.update_flag(Flag::Z, results == 0);
-                self.clear_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-        }
-    }
-
-    fn xor(&mut self, source: XOrSource) {
-        let source = match source {
-            XOrSource::PC => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n
-            }
-            XOrSource::A => self.register.get_a(),
-            XOrSource::B => self.register.get_b(),
-            XOrSource::C => self.register.get_c(),
-            XOrSource::D => self.register.get_d(),
-            XOrSource::E => self.register.get_e(),
-            XOrSource::H => self.register.get_h(),
-            XOrSource::L => self.register.get_l(),
-            XOrSource::HLAddr => self.read(&self.register.get_hl()),
-        };
-        let xor = self.register.get_a() ^ source;
-
-        let mut results = 0u8;
-        if xor == 0 {
-            results |= Flag::Z as u8;
-        }
-        self.register.set_a(xor);
-        self.register.set_f(results);
-    }
-
-    fn update_flag(&mut self, flag: Flag, value: bool) {
-        if value {
-            self.set_flag(flag);
-        } else {
-            self.clear_flag(flag);
-        }
-    }
-
-    fn set_flag(&mut self, flag: Flag) {
-        self.register.set_f(self.register.get_f() | flag as u8);
-    }
-
-    fn clear_flag(&mut self, flag: Flag) {
-        self.register.set_f(self.register.get_f() & !(flag as u8));
-    }
-
-    fn get_flag(&self, flag: Flag) -> bool {
-        self.register.get_f() & flag as u8 == flag as u8
-    }
-
-    fn addition(a: &u8, b: &u8) -> (u8, bool, bool) {
-        let (results, overflow) = a.overflowing_add(*b);
-
-        (results, overflow, (results ^ a ^ b) & 0x10 == 0x10)
-    }
-
-    fn subtract(a: &u8, b: &u8) -> (u8, bool, bool) {
-        let (results, overflow) = a.overflowing_sub(*b);
-
-        (results, overflow, (results ^ a ^ b) & 0x10 != 0x10)
-    }
-
-    fn decrement(&mut self, target: DecrementTarget) {
-        match target {
-            DecrementTarget::BC => {
-                let (result, _) = self.register.get_bc().overflowing_sub(1);
-                self.register.set_bc(result);
-            }
-            DecrementTarget::DE => {
-                let (result, _) = self.register.get_de().overflowing_sub(1);
-                self.register.set_de(result);
-            }
-            DecrementTarget::HL => {
-                let (result, _) = self.register.get_hl().overflowing_sub(1);
-                self.register.set_hl(result);
-            }
-            DecrementTarget::SP => {
-                let (result, _) = self.stack_pointer.overflowing_sub(1);
-                self.stack_pointer = result;
-            }
-            DecrementTarget::B => {
-                let (results, _, h) = Cpu::subtract(&self.register.get_b(), &1);
-                self.register.set_b(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.set_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            DecrementTarget::D => {
-                let (results, _, h) = Cpu::subtract(&self.register.get_d(), &1);
-                self.register.set_d(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.set_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            DecrementTarget::H => {
-                let (results, _, h) = Cpu::subtract(&self.register.get_h(), &1);
-                self.register.set_h(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.set_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            DecrementTarget::C => {
-                let (results, _, h) = Cpu::subtract(&self.register.get_c(), &1);
-                self.register.set_c(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.set_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            DecrementTarget::E => {
-                let (results, _, h) = Cpu::subtract(&self.register.get_e(), &1);
-                self.register.set_e(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.set_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            DecrementTarget::L => {
-                let (results, _, h) = Cpu::subtract(&self.register.get_l(), &1);
-                self.register.set_l(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.set_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            DecrementTarget::A => {
-                let (results, _, h) = Cpu::subtract(&self.register.get_a(), &1);
-                self.register.set_a(results);
-                self.update_flag(Flag::Z, results == 0);
-                self.set_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-            DecrementTarget::HLAddr => {
-                let addr = self.register.get_hl();
-                let (results, _, h) = Cpu::subtract(&self.read(&addr), &1);
-                self.write(&addr, results);
-                self.update_flag(Flag::Z, results == 0);
-                self.set_flag(Flag::N);
-                self.update_flag(Flag::H, h);
-            }
-        }
-    }
-
-    fn add(&mut self, target: AddTarget, source: AddSource) {
-        let source = match source {
-            AddSource::BC => self.register.get_bc(),
-            AddSource::DE => self.register.get_de(),
-            AddSource::HL => self.register.get_hl(),
-            AddSource::SP => self.stack_pointer,
-            AddSource::A => self.register.get_a() as u16,
-            AddSource::B => self.register.get_b() as u16,
-            AddSource::C => self.register.get_c() as u16,
-            AddSource::D => self.register.get_d() as u16,
-            AddSource::E => self.register.get_e() as u16,
-            AddSource::H => self.register.get_h() as u16,
-            AddSource::L => self.register.get_l() as u16,
-            AddSource::PC | AddSource::PCe => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n as u16
-            }
-            AddSource::HLAddr => self.read(&self.register.get_hl()) as u16,
-        };
-
-        match target {
-            AddTarget::SP => {
-                let n = source as i8;
-                let (result, _) = self.stack_pointer.overflowing_add_signed(n as i16);
-                self.update_flag(
-                    Flag::H,
-                    (result as i16 ^ self.stack_pointer as i16 ^ n as i16) & 0x10 == 0x10,
-                );
-                self.update_flag(
-                    Flag::C,
-                    (result as i16 ^ self.stack_pointer as i16 ^ n as i16) & 0x100 == 0x100,
-                );
-                self.clear_flag(Flag::Z);
-                self.clear_flag(Flag::N);
-                self.stack_pointer = result;
-            }
-            AddTarget::A => {
-                let (result, c, h) = Cpu::addition(&self.register.get_a(), &(source as u8));
-                self.register.set_a(result);
-                self.update_flag(Flag::C, c);
-                self.update_flag(Flag::H, h);
-                self.update_flag(Flag::Z, result == 0);
-                self.clear_flag(Flag::N);
-            }
-            AddTarget::HL => {
-                let (result, c) = self.register.get_hl().overflowing_add(source);
-                let h = (result ^ self.register.get_hl() ^ source) & 0x1000 == 0x1000;
-                self.update_flag(Flag::C, c);
-                self.update_flag(Flag::H, h);
-                self.register.set_hl(result);
-                self.clear_flag(Flag::Z);
-                self.clear_flag(Flag::N);
-            }
-        };
-    }
-
-    fn add_carry(&mut self, source: AddCarrySource) {
-        let source = match source {
-            AddCarrySource::PC => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n
-            }
-            AddCarrySource::A => self.register.get_a(),
-            AddCarrySource::B => self.register.get_b(),
-            AddCarrySource::C => self.register.get_c(),
-            AddCarrySource::D => self.register.get_d(),
-            AddCarrySource::E => self.register.get_e(),
-            AddCarrySource::H => self.register.get_h(),
-            AddCarrySource::L => self.register.get_l(),
-            AddCarrySource::HLAddr => self.read(&self.register.get_hl()),
-        };
-        let source = source + self.get_flag(Flag::C) as u8;
-        let (result, c, h) = Cpu::addition(&self.register.get_a(), &source);
-        self.register.set_a(result);
-        self.update_flag(Flag::C, c);
-        self.update_flag(Flag::H, h);
-        self.update_flag(Flag::Z, result == 0);
-        self.clear_flag(Flag::N);
-    }
-
-    fn and(&mut self, source: AndSource) {
-        let source = match source {
-            AndSource::PC => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n
-            }
-            AndSource::A => self.register.get_a(),
-            AndSource::B => self.register.get_b(),
-            AndSource::C => self.register.get_c(),
-            AndSource::D => self.register.get_d(),
-            AndSource::E => self.register.get_e(),
-            AndSource::H => self.register.get_h(),
-            AndSource::L => self.register.get_l(),
-            AndSource::HLAddr => self.read(&self.register.get_hl()),
-        };
-
-        let results = self.register.get_a() & source;
-        self.register.set_a(results);
-
-        self.set_flag(Flag::H);
-        self.clear_flag(Flag::N);
-        self.clear_flag(Flag::C);
-        self.update_flag(Flag::Z, results == 0);
-    }
-
-    fn complement_accumulator(&mut self) {
-        self.register.set_a(!self.register.get_a());
-        self.set_flag(Flag::N);
-        self.set_flag(Flag::H);
-    }
-
-    fn complement_carry_flag(&mut self) {
-        self.update_flag(Flag::C, !self.get_flag(Flag::C));
-        self.clear_flag(Flag::N);
-        self.clear_flag(Flag::H);
-    }
+    /// Rotates and shifts only set Z and the bit shifted out.
+    #[inline(always)]
+    fn shift_flags(result: u8, carry: u8) -> u8 {
+        Cpu::zero_flag(result) | carry << 4
+    }
 
     fn decimal_adjust_accumulator(&mut self) {
         let mut c = false;
@@ -1866,208 +1814,972 @@ impl Cpu {
             }
         }
         let (results, _) = self.register.get_a().overflowing_add(n);
-        self.clear_flag(Flag::H);
-        self.update_flag(Flag::C, c);
-        self.update_flag(Flag::Z, results == 0);
+        let subtract = self.register.get_f() & Flag::N as u8;
+        self.register
+            .set_f(Cpu::zero_flag(results) | subtract | (c as u8) << 4);
         self.register.set_a(results);
     }
 
+    /// Pushes pc and jumps, after the internal cycle every push starts with.
     fn restart(&mut self, addr: u16) {
-        self.stack_pointer -= 1;
+        self.tick();
+        self.stack_pointer = self.stack_pointer.wrapping_sub(1);
         self.write(
             &self.stack_pointer.clone(),
             (self.program_counter >> 8) as u8,
         );
-        self.stack_pointer -= 1;
+        self.stack_pointer = self.stack_pointer.wrapping_sub(1);
         self.write(&self.stack_pointer.clone(), self.program_counter as u8);
 
         self.program_counter = addr;
     }
 
-    fn ret(&mut self, condition: JumpCondition) {
-        if condition == JumpCondition::None {
-            let n = self.read(&self.stack_pointer) as u16;
-            self.stack_pointer += 1;
-            let n = n | ((self.read(&self.stack_pointer) as u16) << 8);
-            self.stack_pointer += 1;
-            self.program_counter = n;
-        };
+    const fn handler_table(cb: bool) -> [Handler; 256] {
+        let mut table: [Handler; 256] = [Cpu::nop; 256];
+        let mut byte = 0;
+        while byte < table.len() {
+            table[byte] = if cb {
+                Cpu::cb_handler(byte as u8)
+            } else {
+                Cpu::handler(byte as u8)
+            };
+            byte += 1;
+        }
+        table
+    }
 
-        let condition = match condition {
-            JumpCondition::None => unreachable!(),
-            JumpCondition::Z => self.get_flag(Flag::Z),
-            JumpCondition::C => self.get_flag(Flag::C),
-            JumpCondition::NZ => !self.get_flag(Flag::Z),
-            JumpCondition::NC => !self.get_flag(Flag::C),
-        };
+    /// The handler for each opcode, laid out like `get_instruction` but with
+    /// the operands picked out of the opcode bits as const generic arguments.
+    const fn handler(opcode: u8) -> Handler {
+        let (y, z, pair) = (opcode >> 3 & 7, opcode & 7, opcode >> 4 & 3);
+        match opcode {
+            0x00 => Cpu::nop,
+            0x10 => Cpu::stop,
+            0x76 => Cpu::halt,
+            0xf3 => Cpu::disable_interrupts,
+            0xfb => Cpu::enable_interrupts,
+            0xcb => Cpu::prefix,
+            0x01 | 0x11 | 0x21 | 0x31 => select!(pair, P in [0 1 2 3] => Cpu::load_wide::<P>),
+            0x02 | 0x12 | 0x22 | 0x32 => {
+                select!(pair, P in [0 1 2 3] => Cpu::load_indirect::<P, true>)
+            }
+            0x0a | 0x1a | 0x2a | 0x3a => {
+                select!(pair, P in [0 1 2 3] => Cpu::load_indirect::<P, false>)
+            }
+            0x03 | 0x13 | 0x23 | 0x33 => {
+                select!(pair, P in [0 1 2 3] => Cpu::increment_wide::<P>)
+            }
+            0x0b | 0x1b | 0x2b | 0x3b => {
+                select!(pair, P in [0 1 2 3] => Cpu::decrement_wide::<P>)
+            }
+            0x09 | 0x19 | 0x29 | 0x39 => select!(pair, P in [0 1 2 3] => Cpu::add_hl::<P>),
+            0x08 => Cpu::store_stack_pointer,
+            0x04 | 0x14 | 0x24 | 0x34 | 0x0c | 0x1c | 0x2c | 0x3c => {
+                select!(y, R in [0 1 2 3 4 5 6 7] => Cpu::increment::<R>)
+            }
+            0x05 | 0x15 | 0x25 | 0x35 | 0x0d | 0x1d | 0x2d | 0x3d => {
+                select!(y, R in [0 1 2 3 4 5 6 7] => Cpu::decrement::<R>)
+            }
+            0x06 | 0x16 | 0x26 | 0x36 | 0x0e | 0x1e | 0x2e | 0x3e => {
+                select!(y, R in [0 1 2 3 4 5 6 7] => Cpu::load::<R, { r8::IMM }>)
+            }
+            0x07 => Cpu::rotate_accumulator::<{ shift::RLC }>,
+            0x0f => Cpu::rotate_accumulator::<{ shift::RRC }>,
+            0x17 => Cpu::rotate_accumulator::<{ shift::RL }>,
+            0x1f => Cpu::rotate_accumulator::<{ shift::RR }>,
+            0x27 => Cpu::decimal_adjust_accumulator,
+            0x2f => Cpu::complement_accumulator,
+            0x37 => Cpu::set_carry_flag,
+            0x3f => Cpu::complement_carry_flag,
+            0x18 => Cpu::jump_relative::<{ cond::ALWAYS }>,
+            0x20 | 0x28 | 0x30 | 0x38 => {
+                select!(y - 4, COND in [0 1 2 3] => Cpu::jump_relative::<COND>)
+            }
+            0x40..=0x7f => select!(y, DST in [0 1 2 3 4 5 6 7] => {
+                select!(z, SRC in [0 1 2 3 4 5 6 7] => Cpu::load::<DST, SRC>)
+            }),
+            0x80..=0xbf => select!(y, OP in [0 1 2 3 4 5 6 7] => {
+                select!(z, SRC in [0 1 2 3 4 5 6 7] => Cpu::alu::<OP, SRC>)
+            }),
+            0xc6 | 0xce | 0xd6 | 0xde | 0xe6 | 0xee | 0xf6 | 0xfe => {
+                select!(y, OP in [0 1 2 3 4 5 6 7] => Cpu::alu::<OP, { r8::IMM }>)
+            }
+            0xc0 | 0xc8 | 0xd0 | 0xd8 => select!(y, COND in [0 1 2 3] => Cpu::ret::<COND>),
+            0xc9 => Cpu::ret::<{ cond::ALWAYS }>,
+            0xd9 => Cpu::return_interrupt,
+            0xc2 | 0xca | 0xd2 | 0xda => select!(y, COND in [0 1 2 3] => Cpu::jump::<COND>),
+            0xc3 => Cpu::jump::<{ cond::ALWAYS }>,
+            0xe9 => Cpu::jump_hl,
+            0xc4 | 0xcc | 0xd4 | 0xdc => select!(y, COND in [0 1 2 3] => Cpu::call::<COND>),
+            0xcd => Cpu::call::<{ cond::ALWAYS }>,
+            0xc1 | 0xd1 | 0xe1 | 0xf1 => select!(pair, P in [0 1 2 3] => Cpu::pop::<P>),
+            0xc5 | 0xd5 | 0xe5 | 0xf5 => select!(pair, P in [0 1 2 3] => Cpu::push::<P>),
+            0xc7 | 0xcf | 0xd7 | 0xdf | 0xe7 | 0xef | 0xf7 | 0xff => {
+                select!(opcode & 0x38, VECTOR in [0x00 0x08 0x10 0x18 0x20 0x28 0x30 0x38] => {
+                    Cpu::restart_vector::<VECTOR>
+                })
+            }
+            0xe0 => Cpu::load_high::<{ r8::IMM }, true>,
+            0xf0 => Cpu::load_high::<{ r8::IMM }, false>,
+            0xe2 => Cpu::load_high::<{ r8::C }, true>,
+            0xf2 => Cpu::load_high::<{ r8::C }, false>,
+            0xea => Cpu::load_absolute::<true>,
+            0xfa => Cpu::load_absolute::<false>,
+            0xe8 => Cpu::add_sp,
+            0xf8 => Cpu::load_hl_sp,
+            0xf9 => Cpu::load_sp_hl,
+            _ => {
+                select!(opcode, OPCODE in [0xd3 0xdb 0xdd 0xe3 0xe4 0xeb 0xec 0xed 0xf4 0xfc 0xfd] => {
+                    Cpu::illegal::<OPCODE>
+                })
+            }
+        }
+    }
 
-        if condition {
-            self.instruction = Instruction::Return(JumpCondition::None);
-            self.step_count = 3;
+    const fn cb_handler(opcode: u8) -> Handler {
+        let (y, z) = (opcode >> 3 & 7, opcode & 7);
+        match opcode >> 6 {
+            0 => select!(y, OP in [0 1 2 3 4 5 6 7] => {
+                select!(z, R in [0 1 2 3 4 5 6 7] => Cpu::shift::<OP, R>)
+            }),
+            1 => select!(y, BIT in [0 1 2 3 4 5 6 7] => {
+                select!(z, R in [0 1 2 3 4 5 6 7] => Cpu::bit::<BIT, R>)
+            }),
+            2 => select!(y, BIT in [0 1 2 3 4 5 6 7] => {
+                select!(z, R in [0 1 2 3 4 5 6 7] => Cpu::reset_bit::<BIT, R>)
+            }),
+            _ => select!(y, BIT in [0 1 2 3 4 5 6 7] => {
+                select!(z, R in [0 1 2 3 4 5 6 7] => Cpu::set_bit::<BIT, R>)
+            }),
         }
     }
 
-    fn jump_hl(&mut self) {
-        self.program_counter = self.register.get_hl();
+    #[inline(always)]
+    fn fetch(&mut self) -> u8 {
+        let n = self.read(&self.program_counter.clone());
+        self.program_counter = self.program_counter.wrapping_add(1);
+        n
+    }
+
+    #[inline(always)]
+    fn fetch_wide(&mut self) -> u16 {
+        let lsb = self.fetch();
+        let msb = self.fetch();
+        (msb as u16) << 8 | lsb as u16
+    }
+
+    #[inline(always)]
+    fn get_r8<const R: u8>(&mut self) -> u8 {
+        match R {
+            r8::HL_ADDR => self.read(&self.register.get_hl()),
+            r8::IMM => self.fetch(),
+            _ => self.register.get(R),
+        }
+    }
+
+    #[inline(always)]
+    fn set_r8<const R: u8>(&mut self, value: u8) {
+        match R {
+            r8::HL_ADDR => self.write(&self.register.get_hl(), value),
+            _ => self.register.set(R, value),
+        }
+    }
+
+    #[inline(always)]
+    fn get_r16<const P: u8>(&self) -> u16 {
+        match P {
+            r16::SP => self.stack_pointer,
+            _ => self.register.get_pair(P),
+        }
+    }
+
+    #[inline(always)]
+    fn set_r16<const P: u8>(&mut self, value: u16) {
+        match P {
+            r16::SP => self.stack_pointer = value,
+            _ => self.register.set_pair(P, value),
+        }
+    }
+
+    #[inline(always)]
+    fn condition<const COND: u8>(&self) -> bool {
+        let f = self.register.get_f();
+        match COND {
+            cond::NZ => f & Flag::Z as u8 == 0,
+            cond::Z => f & Flag::Z as u8 != 0,
+            cond::NC => f & Flag::C as u8 == 0,
+            cond::C => f & Flag::C as u8 != 0,
+            _ => true,
+        }
     }
 
-    fn jump(&mut self, condition: JumpCondition) {
-        if condition == JumpCondition::None {
-            let n = self.read(&self.program_counter) as u16;
-            self.program_counter += 1;
-            let n = n | ((self.read(&self.program_counter) as u16) << 8);
-            self.program_counter = n;
+    fn nop(&mut self) {}
+
+    fn stop(&mut self) {
+        self.program_counter = self.program_counter.wrapping_add(1);
+        if !self.bus.switch_speed() {
+            self.status = CpuStatus::Stopped;
         }
+    }
+
+    fn halt(&mut self) {
+        self.status = CpuStatus::Halted;
+    }
+
+    fn disable_interrupts(&mut self) {
+        self.ime = false;
+        self.ime_next = false;
+    }
+
+    fn enable_interrupts(&mut self) {
+        self.ime_next = true;
+    }
+
+    /// Runs the CB opcode that follows as part of the same instruction.
+    fn prefix(&mut self) {
+        let opcode = self.fetch() as usize;
+        trace!("Executing Instruction: {}", CB_INSTRUCTION_TABLE[opcode]);
+        profile!(profile::cb_instruction(opcode as u8));
+        self.handler = CB_HANDLERS[opcode];
+        self.spend(timing::CB_CYCLES[opcode]);
+        (self.handler)(self);
+    }
+
+    fn illegal<const OPCODE: u8>(&mut self) {
+        trace!("illegal opcode {:#x}", OPCODE);
+        self.program_counter = self.program_counter.wrapping_sub(1);
+        self.status = CpuStatus::Errored;
+    }
+
+    fn load<const DST: u8, const SRC: u8>(&mut self) {
+        let value = self.get_r8::<SRC>();
+        self.set_r8::<DST>(value);
+    }
+
+    fn load_wide<const P: u8>(&mut self) {
+        let value = self.fetch_wide();
+        self.set_r16::<P>(value);
+    }
 
-        let condition = match condition {
-            JumpCondition::None => unreachable!(),
-            JumpCondition::Z => self.get_flag(Flag::Z),
-            JumpCondition::C => self.get_flag(Flag::C),
-            JumpCondition::NZ => !self.get_flag(Flag::Z),
-            JumpCondition::NC => !self.get_flag(Flag::C),
+    /// LD to or from the byte at BC, DE, HL+ or HL-.
+    fn load_indirect<const P: u8, const STORE: bool>(&mut self) {
+        let addr = match P {
+            ind::BC => self.register.get_bc(),
+            ind::DE => self.register.get_de(),
+            _ => self.register.get_hl(),
         };
+        if STORE {
+            self.write(&addr, self.register.get_a());
+        } else {
+            let value = self.read(&addr);
+            self.register.set_a(value);
+        }
+        match P {
+            ind::HL_INC => self.register.set_hl(addr.wrapping_add(1)),
+            ind::HL_DEC => self.register.set_hl(addr.wrapping_sub(1)),
+            _ => (),
+        }
+    }
 
-        if condition {
-            self.instruction = Instruction::Jump(JumpCondition::None);
-            self.step_count = 1;
+    /// LDH to or from 0xff00 plus the next byte or C.
+    fn load_high<const PORT: u8, const STORE: bool>(&mut self) {
+        let addr = 0xff00 | self.get_r8::<PORT>() as u16;
+        if STORE {
+            self.write(&addr, self.register.get_a());
         } else {
-            self.program_counter += 2;
+            let value = self.read(&addr);
+            self.register.set_a(value);
         }
     }
 
-    fn rotate(&mut self, source: BitwiseSource, rotate: impl Fn(&mut Cpu, u8) -> u8) {
-        match source {
-            BitwiseSource::B => {
-                let n = rotate(self, self.register.get_b());
-                self.register.set_b(n);
-            }
-            BitwiseSource::C => {
-                let n = rotate(self, self.register.get_c());
-                self.register.set_c(n);
-            }
-            BitwiseSource::D => {
-                let n = rotate(self, self.register.get_d());
-                self.register.set_d(n);
-            }
-            BitwiseSource::E => {
-                let n = rotate(self, self.register.get_e());
-                self.register.set_e(n);
-            }
-            BitwiseSource::H => {
-                let n = rotate(self, self.register.get_h());
-                self.register.set_h(n);
+    fn load_absolute<const STORE: bool>(&mut self) {
+        let addr = self.fetch_wide();
+        if STORE {
+            self.write(&addr, self.register.get_a());
+        } else {
+            let value = self.read(&addr);
+            self.register.set_a(value);
+        }
+    }
+
+    fn store_stack_pointer(&mut self) {
+        let addr = self.fetch_wide();
+        self.write(&addr, self.stack_pointer as u8);
+        self.write(&addr.wrapping_add(1), (self.stack_pointer >> 8) as u8);
+    }
+
+    fn load_hl_sp(&mut self) {
+        let result = self.offset_stack_pointer();
+        self.register.set_hl(result);
+    }
+
+    fn load_sp_hl(&mut self) {
+        self.stack_pointer = self.register.get_hl();
+    }
+
+    fn pop<const P: u8>(&mut self) {
+        let n = self.read(&self.stack_pointer.clone()) as u16;
+        self.stack_pointer = self.stack_pointer.wrapping_add(1);
+        let n = n | (self.read(&self.stack_pointer.clone()) as u16) << 8;
+        self.stack_pointer = self.stack_pointer.wrapping_add(1);
+        // the pair numbering swaps SP for AF here
+        self.register.set_pair(P, n);
+    }
+
+    fn push<const P: u8>(&mut self) {
+        let [msb, lsb] = self.register.get_pair(P).to_be_bytes();
+
+        self.tick();
+        self.stack_pointer = self.stack_pointer.wrapping_sub(1);
+        self.write(&self.stack_pointer.clone(), msb);
+        self.stack_pointer = self.stack_pointer.wrapping_sub(1);
+        self.write(&self.stack_pointer.clone(), lsb);
+    }
+
+    fn alu<const OP: u8, const SRC: u8>(&mut self) {
+        let value = self.get_r8::<SRC>();
+        let a = self.register.get_a();
+        let carry = self.get_flag(Flag::C) as u8;
+        let (result, flags) = match OP {
+            alu::ADD => Cpu::add_flags(a, value, 0),
+            alu::ADC => Cpu::add_flags(a, value, carry),
+            alu::SUB => Cpu::sub_flags(a, value, 0),
+            alu::SBC => Cpu::sub_flags(a, value, carry),
+            alu::AND => (a & value, Cpu::zero_flag(a & value) | Flag::H as u8),
+            alu::XOR => (a ^ value, Cpu::zero_flag(a ^ value)),
+            alu::OR => (a | value, Cpu::zero_flag(a | value)),
+            _ => (a, Cpu::sub_flags(a, value, 0).1),
+        };
+        self.register.set_a(result);
+        self.register.set_f(flags);
+    }
+
+    fn increment<const R: u8>(&mut self) {
+        let value = self.get_r8::<R>();
+        let (result, flags) = self.increment_flags(value);
+        self.set_r8::<R>(result);
+        self.register.set_f(flags);
+    }
+
+    fn decrement<const R: u8>(&mut self) {
+        let value = self.get_r8::<R>();
+        let (result, flags) = self.decrement_flags(value);
+        self.set_r8::<R>(result);
+        self.register.set_f(flags);
+    }
+
+    fn increment_wide<const P: u8>(&mut self) {
+        self.set_r16::<P>(self.get_r16::<P>().wrapping_add(1));
+    }
+
+    fn decrement_wide<const P: u8>(&mut self) {
+        self.set_r16::<P>(self.get_r16::<P>().wrapping_sub(1));
+    }
+
+    fn add_hl<const P: u8>(&mut self) {
+        let source = self.get_r16::<P>();
+        let (result, c) = self.register.get_hl().overflowing_add(source);
+        let h = (result ^ self.register.get_hl() ^ source) & 0x1000;
+        let z = self.register.get_f() & Flag::Z as u8;
+        self.register.set_f(z | (h >> 7) as u8 | (c as u8) << 4);
+        self.register.set_hl(result);
+    }
+
+    fn add_sp(&mut self) {
+        self.stack_pointer = self.offset_stack_pointer();
+    }
+
+    /// SP plus the signed immediate, shared by ADD SP and LD HL, SP+e. H and
+    /// C come from adding the low byte unsigned, Z and N are cleared.
+    #[inline(always)]
+    fn offset_stack_pointer(&mut self) -> u16 {
+        let n = self.fetch() as i8;
+        let result = self.stack_pointer.wrapping_add_signed(n as i16);
+        let carries = result ^ self.stack_pointer ^ n as i16 as u16;
+        let flags = (carries & 0x10) << 1 | (carries & 0x100) >> 4;
+        self.register.set_f(flags as u8);
+        result
+    }
+
+    fn complement_accumulator(&mut self) {
+        self.register.set_a(!self.register.get_a());
+        let flags = self.register.get_f() | Flag::N as u8 | Flag::H as u8;
+        self.register.set_f(flags);
+    }
+
+    fn set_carry_flag(&mut self) {
+        let z = self.register.get_f() & Flag::Z as u8;
+        self.register.set_f(z | Flag::C as u8);
+    }
+
+    fn complement_carry_flag(&mut self) {
+        let flags = self.register.get_f();
+        self.register
+            .set_f((flags & (Flag::Z as u8 | Flag::C as u8)) ^ Flag::C as u8);
+    }
+
+    /// The rotates and shifts of the CB page.
+    fn shift<const OP: u8, const R: u8>(&mut self) {
+        let value = self.get_r8::<R>();
+        let carry = (self.register.get_f() & Flag::C as u8) >> 4;
+        let (result, out) = match OP {
+            shift::RLC => (value.rotate_left(1), value >> 7),
+            shift::RRC => (value.rotate_right(1), value & 0x01),
+            shift::RL => (value << 1 | carry, value >> 7),
+            shift::RR => (value >> 1 | carry << 7, value & 0x01),
+            shift::SLA => (value << 1, value >> 7),
+            shift::SRA => (value >> 1 | value & 0x80, value & 0x01),
+            shift::SWAP => (value.rotate_left(4), 0),
+            _ => (value >> 1, value & 0x01),
+        };
+        self.register.set_f(Cpu::shift_flags(result, out));
+        self.set_r8::<R>(result);
+    }
+
+    /// RLCA, RRCA, RLA and RRA, the CB rotates of A but with Z always clear.
+    fn rotate_accumulator<const OP: u8>(&mut self) {
+        self.shift::<OP, { r8::A }>();
+        let carry = self.register.get_f() & Flag::C as u8;
+        self.register.set_f(carry);
+    }
+
+    fn bit<const BIT: u8, const R: u8>(&mut self) {
+        let value = self.get_r8::<R>();
+        let carry = self.register.get_f() & Flag::C as u8;
+        self.register
+            .set_f(Cpu::zero_flag(value & 1 << BIT) | Flag::H as u8 | carry);
+    }
+
+    fn reset_bit<const BIT: u8, const R: u8>(&mut self) {
+        let value = self.get_r8::<R>();
+        self.set_r8::<R>(value & !(1 << BIT));
+    }
+
+    fn set_bit<const BIT: u8, const R: u8>(&mut self) {
+        let value = self.get_r8::<R>();
+        self.set_r8::<R>(value | 1 << BIT);
+    }
+
+    /// Conditional branches cost their not taken time up front and charge
+    /// the rest when the condition holds.
+    fn jump_relative<const COND: u8>(&mut self) {
+        let e = self.fetch() as i8;
+        if self.condition::<COND>() {
+            self.program_counter = self.program_counter.wrapping_add_signed(e as i16);
+            trace!("jump to: {:#x}", self.program_counter);
+            if COND != cond::ALWAYS {
+                self.spend(timing::JUMP_TAKEN);
             }
-            BitwiseSource::L => {
-                let n = rotate(self, self.register.get_l());
-                self.register.set_l(n);
+        }
+    }
+
+    fn jump<const COND: u8>(&mut self) {
+        let addr = self.fetch_wide();
+        if self.condition::<COND>() {
+            self.program_counter = addr;
+            if COND != cond::ALWAYS {
+                self.spend(timing::JUMP_TAKEN);
             }
-            BitwiseSource::A => {
-                let n = rotate(self, self.register.get_a());
-                self.register.set_a(n);
+        }
+    }
+
+    fn jump_hl(&mut self) {
+        self.program_counter = self.register.get_hl();
+    }
+
+    fn call<const COND: u8>(&mut self) {
+        let addr = self.fetch_wide();
+        if self.condition::<COND>() {
+            self.restart(addr);
+            if COND != cond::ALWAYS {
+                self.spend(timing::CALL_TAKEN);
             }
-            BitwiseSource::HLAddr => {
-                let n = rotate(self, self.read(&self.register.get_hl()));
-                self.write(&self.register.get_hl(), n);
+        }
+    }
+
+    fn ret<const COND: u8>(&mut self) {
+        if COND != cond::ALWAYS {
+            // checking the condition takes a cycle of its own
+            self.tick();
+            if !self.condition::<COND>() {
+                return;
             }
-        };
+            self.spend(timing::RETURN_TAKEN);
+        }
+        let n = self.read(&self.stack_pointer.clone()) as u16;
+        self.stack_pointer = self.stack_pointer.wrapping_add(1);
+        let n = n | ((self.read(&self.stack_pointer.clone()) as u16) << 8);
+        self.stack_pointer = self.stack_pointer.wrapping_add(1);
+        self.program_counter = n;
     }
 
-    fn sub_carry(&mut self, source: SubtractCarrySource) {
-        let source = match source {
-            SubtractCarrySource::PC => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n
-            }
-            SubtractCarrySource::A => self.register.get_a(),
-            SubtractCarrySource::B => self.register.get_b(),
-            SubtractCarrySource::C => self.register.get_c(),
-            SubtractCarrySource::D => self.register.get_d(),
-            SubtractCarrySource::E => self.register.get_e(),
-            SubtractCarrySource::H => self.register.get_h(),
-            SubtractCarrySource::L => self.register.get_l(),
-            SubtractCarrySource::HLAddr => self.read(&self.register.get_hl()),
-        };
-        let source = source + self.get_flag(Flag::C) as u8;
+    fn return_interrupt(&mut self) {
+        self.ret::<{ cond::ALWAYS }>();
+        self.ime = true;
+    }
 
-        let (result, c, h) = Cpu::subtract(&self.register.get_a(), &source);
+    fn restart_vector<const VECTOR: u8>(&mut self) {
+        self.restart(VECTOR as u16);
+    }
+}
 
-        self.register.set_a(result);
-        self.update_flag(Flag::C, c);
-        self.update_flag(Flag::H, h);
-        self.update_flag(Flag::Z, result == 0);
-        self.set_flag(Flag::N);
-    }
-
-    fn swap(&mut self, source: BitwiseSource) {
-        let swap = |cpu: &mut Cpu, value: u8| {
-            cpu.clear_flag(Flag::C);
-            cpu.clear_flag(Flag::H);
-            cpu.clear_flag(Flag::N);
-            cpu.update_flag(Flag::Z, value == 0);
-
-            let lower = value >> 4;
-            let upper = value << 4;
-            lower | upper
-        };
-        match source {
-            BitwiseSource::B => {
-                let n = swap(self, self.register.get_b());
-                self.register.set_b(n);
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cart::{
+        tests::{cgb_rom, rom},
+        CartImage,
+    };
+    use crate::rom::Rom;
+
+    const Z: u8 = Flag::Z as u8;
+    const N: u8 = Flag::N as u8;
+    const H: u8 = Flag::H as u8;
+    const C: u8 = Flag::C as u8;
+
+    /// Operands spread over the nibble and sign boundaries.
+    const VALUES: [u8; 10] = [0x00, 0x01, 0x0f, 0x10, 0x7f, 0x80, 0x8f, 0x99, 0xf0, 0xff];
+
+    fn flags(z: bool, n: bool, h: bool, c: bool) -> u8 {
+        (z as u8) << 7 | (n as u8) << 6 | (h as u8) << 5 | (c as u8) << 4
+    }
+
+    fn machine(program: &[u8]) -> Cpu {
+        Cpu::new(Cart::new(rom(0x00, 0, 0x00, program)).unwrap())
+    }
+
+    /// Runs the instruction at 0x150 once more with A and F as given and
+    /// `operand` in register field `r`, work ram at HL holding it for (HL).
+    fn execute(cpu: &mut Cpu, r: u8, operand: u8, a: u8, f: u8) {
+        cpu.program_counter = 0x150;
+        cpu.register.set_a(a);
+        cpu.register.set_f(f);
+        match r {
+            r8::HL_ADDR => {
+                cpu.register.set_hl(0xc000);
+                cpu.bus.write(0xc000, operand);
+            }
+            r => cpu.register.set(r, operand),
+        }
+        cpu.run_cycles(1);
+    }
+
+    fn operand(cpu: &Cpu, r: u8) -> u8 {
+        match r {
+            r8::HL_ADDR => cpu.bus.read(0xc000),
+            r => cpu.register.get(r),
+        }
+    }
+
+    fn reference_alu(op: u8, a: u8, b: u8, carry: u8) -> (u8, u8) {
+        let (a16, b16, c16) = (a as u16, b as u16, carry as u16);
+        match op {
+            alu::ADD | alu::ADC => {
+                let carry = if op == alu::ADC { carry } else { 0 };
+                let sum = a16 + b16 + carry as u16;
+                let h = (a & 0xf) + (b & 0xf) + carry > 0xf;
+                (sum as u8, flags(sum as u8 == 0, false, h, sum > 0xff))
+            }
+            alu::AND => (a & b, flags(a & b == 0, false, true, false)),
+            alu::XOR => (a ^ b, flags(a ^ b == 0, false, false, false)),
+            alu::OR => (a | b, flags(a | b == 0, false, false, false)),
+            _ => {
+                let c16 = if op == alu::SBC { c16 } else { 0 };
+                let result = a.wrapping_sub(b).wrapping_sub(c16 as u8);
+                let h = ((a & 0xf) as u16) < (b & 0xf) as u16 + c16;
+                let f = flags(result == 0, true, h, a16 < b16 + c16);
+                // CP only keeps the flags
+                (if op == 7 { a } else { result }, f)
+            }
+        }
+    }
+
+    #[test]
+    fn alu_flags() {
+        for opcode in 0x80..=0xbfu8 {
+            let (op, r) = (opcode >> 3 & 7, opcode & 7);
+            let mut cpu = machine(&[opcode]);
+            for (a, b, carry) in VALUES
+                .iter()
+                .flat_map(|a| VALUES.iter().map(move |b| (*a, *b)))
+                .flat_map(|(a, b)| [(a, b, 0), (a, b, 1)])
+            {
+                // A as the operand is the same byte on both sides
+                let a = if r == r8::A { b } else { a };
+                execute(&mut cpu, r, b, a, carry << 4);
+                let expected = reference_alu(op, a, b, carry);
+                let got = (cpu.register.get_a(), cpu.register.get_f());
+                assert_eq!(
+                    got, expected,
+                    "{opcode:#04x} a={a:#04x} b={b:#04x} c={carry}"
+                );
             }
-            BitwiseSource::C => {
-                let n = swap(self, self.register.get_c());
-                self.register.set_c(n);
+        }
+        for opcode in [0xc6u8, 0xce, 0xd6, 0xde, 0xe6, 0xee, 0xf6, 0xfe] {
+            for b in VALUES {
+                let mut cpu = machine(&[opcode, b]);
+                for (a, carry) in VALUES.iter().flat_map(|a| [(*a, 0), (*a, 1)]) {
+                    execute(&mut cpu, r8::B, 0, a, carry << 4);
+                    let expected = reference_alu(opcode >> 3 & 7, a, b, carry);
+                    let got = (cpu.register.get_a(), cpu.register.get_f());
+                    assert_eq!(
+                        got, expected,
+                        "{opcode:#04x} a={a:#04x} b={b:#04x} c={carry}"
+                    );
+                }
             }
-            BitwiseSource::D => {
-                let n = swap(self, self.register.get_d());
-                self.register.set_d(n);
+        }
+    }
+
+    #[test]
+    fn increment_and_decrement_keep_carry() {
+        for r in 0..8u8 {
+            let mut inc = machine(&[0x04 | r << 3]);
+            let mut dec = machine(&[0x05 | r << 3]);
+            for (value, f) in (0..=0xffu8).flat_map(|v| [(v, 0), (v, Z | N | H | C)]) {
+                execute(&mut inc, r, value, value, f);
+                let result = value.wrapping_add(1);
+                let expected = flags(result == 0, false, value & 0xf == 0xf, f & C != 0);
+                assert_eq!((operand(&inc, r), inc.register.get_f()), (result, expected));
+
+                execute(&mut dec, r, value, value, f);
+                let result = value.wrapping_sub(1);
+                let expected = flags(result == 0, true, value & 0xf == 0, f & C != 0);
+                assert_eq!((operand(&dec, r), dec.register.get_f()), (result, expected));
             }
-            BitwiseSource::E => {
-                let n = swap(self, self.register.get_e());
-                self.register.set_e(n);
+        }
+    }
+
+    #[test]
+    fn add_hl_keeps_zero() {
+        let wide = [
+            0x0000u16, 0x0001, 0x0fff, 0x1000, 0x7fff, 0x8000, 0xf000, 0xffff,
+        ];
+        for pair in 0..4u8 {
+            let mut cpu = machine(&[0x09 | pair << 4]);
+            for (hl, source, f) in wide
+                .iter()
+                .flat_map(|hl| wide.iter().map(move |source| (*hl, *source)))
+                .flat_map(|(hl, source)| [(hl, source, 0), (hl, source, Z | N | H | C)])
+            {
+                match pair {
+                    r16::SP => cpu.stack_pointer = source,
+                    _ => cpu.register.set_pair(pair, source),
+                }
+                cpu.register.set_hl(hl);
+                let source = if pair == 2 { hl } else { source };
+                cpu.program_counter = 0x150;
+                cpu.register.set_f(f);
+                cpu.run_cycles(1);
+
+                let (sum, c) = hl.overflowing_add(source);
+                let h = (hl & 0xfff) + (source & 0xfff) > 0xfff;
+                let expected = flags(f & Z != 0, false, h, c);
+                assert_eq!(
+                    (cpu.register.get_hl(), cpu.register.get_f()),
+                    (sum, expected)
+                );
             }
-            BitwiseSource::H => {
-                let n = swap(self, self.register.get_h());
-                self.register.set_h(n);
+        }
+    }
+
+    #[test]
+    fn stack_pointer_offsets() {
+        let sps = [0x0000u16, 0x000f, 0x00ff, 0x0f0f, 0xc0f8, 0xfff8, 0xffff];
+        for (opcode, e) in [0xe8u8, 0xf8]
+            .into_iter()
+            .flat_map(|op| VALUES.map(|e| (op, e)))
+        {
+            let mut cpu = machine(&[opcode, e]);
+            for (sp, f) in sps.iter().flat_map(|sp| [(*sp, 0), (*sp, Z | N | H | C)]) {
+                cpu.stack_pointer = sp;
+                cpu.register.set_hl(0x1234);
+                cpu.program_counter = 0x150;
+                cpu.register.set_f(f);
+                cpu.run_cycles(1);
+
+                let result = sp.wrapping_add_signed(e as i8 as i16);
+                let h = (sp & 0xf) + (e & 0xf) as u16 > 0xf;
+                let c = (sp & 0xff) + e as u16 > 0xff;
+                assert_eq!(cpu.register.get_f(), flags(false, false, h, c));
+                let (target, other) = match opcode {
+                    0xe8 => (cpu.stack_pointer, cpu.register.get_hl()),
+                    _ => (cpu.register.get_hl(), cpu.stack_pointer),
+                };
+                assert_eq!(target, result, "{opcode:#04x} sp={sp:#06x} e={e:#04x}");
+                assert_eq!(other, if opcode == 0xe8 { 0x1234 } else { sp });
             }
-            BitwiseSource::L => {
-                let n = swap(self, self.register.get_l());
-                self.register.set_l(n);
+        }
+    }
+
+    /// DAA after adding or subtracting any two BCD bytes, the only inputs it
+    /// is defined for.
+    #[test]
+    fn decimal_adjust() {
+        let bcd = |n: u8| ((n / 10) << 4) | (n % 10);
+        for (opcode, subtract) in [(0x80u8, false), (0x90, true)] {
+            let mut cpu = machine(&[opcode, 0x27]);
+            for (x, y) in (0..100u8).flat_map(|x| (0..100u8).map(move |y| (x, y))) {
+                execute(&mut cpu, r8::B, bcd(y), bcd(x), 0);
+                cpu.run_cycles(1);
+                let (result, c) = match subtract {
+                    false => ((x + y) % 100, x + y >= 100),
+                    true => ((x + 100 - y) % 100, x < y),
+                };
+                let expected = flags(result == 0, subtract, false, c);
+                let got = (cpu.register.get_a(), cpu.register.get_f());
+                assert_eq!(got, (bcd(result), expected), "{opcode:#04x} {x} {y}");
             }
-            BitwiseSource::A => {
-                let n = swap(self, self.register.get_a());
-                self.register.set_a(n);
+        }
+    }
+
+    #[test]
+    fn accumulator_flag_ops() {
+        let (mut cpl, mut scf, mut ccf) = (machine(&[0x2f]), machine(&[0x37]), machine(&[0x3f]));
+        for f in (0..16u8).map(|f| f << 4) {
+            execute(&mut cpl, r8::A, 0x5a, 0x5a, f);
+            assert_eq!(cpl.register.get_a(), 0xa5);
+            assert_eq!(cpl.register.get_f(), f & (Z | C) | N | H);
+            execute(&mut scf, r8::A, 0x5a, 0x5a, f);
+            assert_eq!(scf.register.get_f(), f & Z | C);
+            execute(&mut ccf, r8::A, 0x5a, 0x5a, f);
+            assert_eq!(ccf.register.get_f(), f & Z | (f & C ^ C));
+        }
+    }
+
+    fn reference_shift(op: u8, value: u8, carry: u8) -> (u8, u8) {
+        match op {
+            shift::RLC => (value.rotate_left(1), value >> 7),
+            shift::RRC => (value.rotate_right(1), value & 1),
+            shift::RL => (value << 1 | carry, value >> 7),
+            shift::RR => (value >> 1 | carry << 7, value & 1),
+            shift::SLA => (value << 1, value >> 7),
+            shift::SRA => ((value as i8 >> 1) as u8, value & 1),
+            shift::SWAP => (value.rotate_left(4), 0),
+            _ => (value >> 1, value & 1),
+        }
+    }
+
+    #[test]
+    fn rotates_of_a_clear_zero() {
+        for (opcode, op) in [
+            (0x07u8, shift::RLC),
+            (0x0f, shift::RRC),
+            (0x17, shift::RL),
+            (0x1f, shift::RR),
+        ] {
+            let mut cpu = machine(&[opcode]);
+            for (value, carry) in (0..=0xffu8).flat_map(|v| [(v, 0), (v, 1)]) {
+                execute(&mut cpu, r8::A, value, value, Z | N | H | carry << 4);
+                let (result, out) = reference_shift(op, value, carry);
+                let got = (cpu.register.get_a(), cpu.register.get_f());
+                assert_eq!(
+                    got,
+                    (result, out << 4),
+                    "{opcode:#04x} a={value:#04x} c={carry}"
+                );
             }
-            BitwiseSource::HLAddr => {
-                let n = swap(self, self.read(&self.register.get_hl()));
-                self.write(&self.register.get_hl(), n);
+        }
+    }
+
+    #[test]
+    fn cb_shift_flags() {
+        for opcode in 0x00..=0x3fu8 {
+            let (op, r) = (opcode >> 3, opcode & 7);
+            let mut cpu = machine(&[0xcb, opcode]);
+            for (value, carry) in (0..=0xffu8).flat_map(|v| [(v, 0), (v, 1)]) {
+                execute(&mut cpu, r, value, value, N | H | carry << 4);
+                let (result, out) = reference_shift(op, value, carry);
+                let expected = flags(result == 0, false, false, out != 0);
+                let got = (operand(&cpu, r), cpu.register.get_f());
+                assert_eq!(
+                    got,
+                    (result, expected),
+                    "cb {opcode:#04x} v={value:#04x} c={carry}"
+                );
             }
         }
     }
 
-    fn or(&mut self, source: OrSource) {
-        let source = match source {
-            OrSource::PC => {
-                let n = self.read(&self.program_counter);
-                self.program_counter += 1;
-                n
+    #[test]
+    fn cb_bit_flags() {
+        for opcode in 0x40..=0xffu8 {
+            let (bit, r) = (opcode >> 3 & 7, opcode & 7);
+            let mut cpu = machine(&[0xcb, opcode]);
+            for (value, f) in VALUES.iter().flat_map(|v| [(*v, 0), (*v, Z | N | H | C)]) {
+                execute(&mut cpu, r, value, value, f);
+                let expected = match opcode >> 6 {
+                    // BIT sets Z to the bit's complement and keeps C
+                    1 => flags(value & 1 << bit == 0, false, true, f & C != 0),
+                    // RES and SET leave the flags be
+                    _ => f,
+                };
+                assert_eq!(
+                    cpu.register.get_f(),
+                    expected,
+                    "cb {opcode:#04x} v={value:#04x}"
+                );
             }
-            OrSource::A => self.register.get_a(),
-            OrSource::B => self.register.get_b(),
-            OrSource::C => self.register.get_c(),
-            OrSource::D => self.register.get_d(),
-            OrSource::E => self.register.get_e(),
-            OrSource::H => self.register.get_h(),
-            OrSource::L => self.register.get_l(),
-            OrSource::HLAddr => self.read(&self.register.get_hl()),
-        };
+        }
+    }
 
-        let n = self.register.get_a() | source;
-        self.clear_flag(Flag::C);
-        self.clear_flag(Flag::N);
-        self.clear_flag(Flag::H);
-        self.update_flag(Flag::Z, n == 0);
-        self.register.set_a(n);
+    #[test]
+    fn boot_rom_disable_is_a_plain_write() {
+        // ld a, 1; ldh (0x50), a; nop
+        let mut cpu = machine(&[0x3e, 0x01, 0xe0, 0x50, 0x00]);
+        cpu.program_counter = 0x150;
+        cpu.run_cycles(6);
+        assert_eq!(cpu.status(), CpuStatus::Running);
+        assert_eq!(cpu.program_counter, 0x155);
+    }
+
+    #[test]
+    fn stop_wakes_on_a_selected_press() {
+        // ld a, 0x10; ldh (0x00), a; stop
+        let mut cpu = machine(&[0x3e, 0x10, 0xe0, 0x00, 0x10, 0x00]);
+        cpu.program_counter = 0x150;
+        cpu.run_cycles(6);
+        assert_eq!(cpu.status(), CpuStatus::Stopped);
+        // P1 only selects the buttons, not the directions
+        cpu.press(Button::Down);
+        assert_eq!(cpu.status(), CpuStatus::Stopped);
+        cpu.press(Button::Start);
+        assert_eq!(cpu.status(), CpuStatus::Running);
+    }
+
+    #[test]
+    fn stepping_never_winds_the_bus_back() {
+        let program = [
+            0x3e, 0x01, // ld a, 1
+            0xe0, 0x4d, // ldh (0x4d), a
+            0x10, 0x00, // stop, switching to double speed
+            0x21, 0x00, 0xc0, // ld hl, 0xc000
+            0x34, // inc (hl)
+            0xf0, 0x44, // ldh a, (0x44)
+            0x22, // ld (hl+), a
+            0x18, 0xfa, // jr -6
+        ];
+        let image = CartImage::new(cgb_rom(&program)).unwrap();
+        let mut stepped = Cpu::new(Cart::from_image(image.clone()));
+        let mut run = Cpu::new(Cart::from_image(image));
+        for cpu in [&mut stepped, &mut run] {
+            cpu.set_memory_timing(MemoryTiming::Access);
+            cpu.program_counter = 0x150;
+        }
+        run.run_cycles(20000);
+        assert_eq!(run.peek(0xff4d) & 0x80, 0x80);
+
+        let mut now = stepped.bus.now();
+        while stepped.cycles() < run.cycles() {
+            stepped.step();
+            assert!(stepped.bus.now() >= now);
+            assert!(stepped.bus.now() <= stepped.cycles() + stepped.step_count as u64);
+            now = stepped.bus.now();
+        }
+        let state = |cpu: &Cpu| cpu.save_state_to_vec().unwrap();
+        assert_eq!(state(&stepped), state(&run));
+    }
+
+    #[test]
+    fn pop_af_masks_low_nibble() {
+        let mut cpu = machine(&[0xf1]);
+        cpu.stack_pointer = 0xc100;
+        cpu.bus.write(0xc100, 0xff);
+        cpu.bus.write(0xc101, 0x12);
+        cpu.program_counter = 0x150;
+        cpu.run_cycles(1);
+        assert_eq!(cpu.register.get_af(), 0x12f0);
+    }
+
+    /// Busy with everything the block cache has to get right: calls into
+    /// code whose opcode it keeps rewriting in work ram, loops, halts and
+    /// the VBlank and timer interrupts breaking into blocks, each counting
+    /// in high ram.
+    fn block_rom() -> Rom {
+        let program = [
+            0x31, 0xf0, 0xdf, // ld sp, 0xdff0
+            0x21, 0x00, 0xc1, // ld hl, 0xc100
+            0x36, 0x3e, // ld (hl), "ld a, n"
+            0x23, // inc hl
+            0x36, 0x00, // ld (hl), n
+            0x23, // inc hl
+            0x36, 0xc9, // ld (hl), "ret"
+            0x3e, 0x05, // ld a, 0x05
+            0xe0, 0x07, // ldh (TAC), a
+            0x3e, 0x05, // ld a, 0x05
+            0xe0, 0xff, // ldh (IE), a
+            0xfb, // ei
+            0xcd, 0x00, 0xc1, // loop: call 0xc100
+            0x47, // ld b, a
+            0x21, 0x01, 0xc1, // ld hl, 0xc101
+            0x34, // inc (hl)
+            0x2b, // dec hl
+            0x7e, // ld a, (hl)
+            0xee, 0x38, // xor 0x38, between "ld a, n" and "ld b, n"
+            0x77, // ld (hl), a
+            0xcd, 0x90, 0x01, // call 0x0190
+            0x78, // ld a, b
+            0xe6, 0x0f, // and 0x0f
+            0x20, 0xeb, // jr nz, loop
+            0x76, // halt
+            0x0c, // inc c
+            0x79, // ld a, c
+            0xea, 0x00, 0xc2, // ld (0xc200), a
+            0x18, 0xe3, // jr loop
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            // 0x0190: scatters a mix of b over 0xc300..0xc308
+            0x21, 0x00, 0xc3, // ld hl, 0xc300
+            0x78, // ld a, b
+            0x85, // add a, l
+            0x16, 0x08, // ld d, 8
+            0x22, // ld (hl+), a
+            0xcb, 0x27, // sla a
+            0xce, 0x03, // adc a, 3
+            0x15, // dec d
+            0x20, 0xf8, // jr nz, -8
+            0xc9, // ret
+        ];
+        let mut bytes = rom(0x00, 0, 0x00, &program).to_vec();
+        for (vector, counter) in [(0x40, 0x81), (0x50, 0x80)] {
+            bytes[vector..vector + 8].copy_from_slice(&[
+                0xf5, // push af
+                0xf0, counter, // ldh a, (counter)
+                0x3c,    // inc a
+                0xe0, counter, // ldh (counter), a
+                0xf1,    // pop af
+                0xd9,    // reti
+            ]);
+        }
+        Rom::from(bytes)
+    }
+
+    #[test]
+    fn block_cache_matches_the_interpreter() {
+        let image = CartImage::new(block_rom()).unwrap();
+        let mut interpreter = Cpu::new(Cart::from_image(image.clone()));
+        let mut blocks = Cpu::new(Cart::from_image(image));
+        interpreter.set_engine(Engine::Interpreter);
+        blocks.set_engine(Engine::BlockCache);
+
+        let state = |cpu: &Cpu| cpu.save_state_to_vec().unwrap();
+        // odd run lengths end blocks in awkward places
+        for cycles in [1, 7, 100, 1234, CYCLES_PER_FRAME, 4321, 99_999] {
+            interpreter.run_cycles(cycles);
+            blocks.run_cycles(cycles);
+            assert_eq!(blocks.cycles(), interpreter.cycles());
+            assert_eq!(blocks.instructions(), interpreter.instructions());
+            assert_eq!(blocks.memory_hash(), interpreter.memory_hash());
+            assert!(state(&blocks) == state(&interpreter));
+        }
+        for _ in 0..4 {
+            interpreter.run_frame();
+            blocks.run_frame();
+            assert!(state(&blocks) == state(&interpreter));
+            assert_eq!(blocks.ppu().frame(), interpreter.ppu().frame());
+        }
+        // the program got as far as everything it's there to exercise
+        assert!(blocks.peek(0xc101) > 0x10);
+        assert!(blocks.peek(0xc200) > 0);
+        assert!(blocks.peek(0xff80) > 0 && blocks.peek(0xff81) > 0);
     }
 }
@@ -0,0 +1,519 @@
+//! The C ABI, declared in `include/cash_gb.h`.
+//!
+//! Everything a training loop needs per step goes through one call for the
+//! whole batch: inputs come in and frames and ram bytes go out through
+//! arrays the caller allocated once, so nothing crosses the boundary per
+//! instance or per frame and nothing is allocated per call.
+//!
+//! Functions return `CASH_GB_OK` or one of the negative error codes, none of
+//! them unwind into the caller.
+
+use std::{
+    ffi::{c_char, CStr},
+    ptr, slice,
+    sync::Arc,
+};
+
+use crate::cart::CartImage;
+use crate::cpu::Cpu;
+use crate::fleet::Fleet;
+use crate::ppu::{RenderPolicy, SCREEN_HEIGHT, SCREEN_WIDTH};
+use crate::rom::Rom;
+use crate::state::StateError;
+
+pub const CASH_GB_OK: i32 = 0;
+pub const CASH_GB_NULL: i32 = -1;
+pub const CASH_GB_BAD_INDEX: i32 = -2;
+pub const CASH_GB_BUFFER_TOO_SMALL: i32 = -3;
+pub const CASH_GB_BAD_STATE: i32 = -4;
+pub const CASH_GB_WRONG_CART: i32 = -5;
+pub const CASH_GB_MID_INSTRUCTION: i32 = -6;
+
+const FRAME_BYTES: usize = SCREEN_WIDTH * SCREEN_HEIGHT;
+
+/// A validated ROM, shared by every batch made from it.
+pub struct CashGbImage(Arc<CartImage>);
+
+/// Instances of one image run together across threads, each with the
+/// addresses picked by `cash_gb_batch_observe` to report after a run.
+pub struct CashGbBatch {
+    fleet: Fleet,
+    observed: Vec<u16>,
+}
+
+/// Caller memory written by several worker threads, each to its own part.
+#[derive(Clone, Copy)]
+struct Out(*mut u8);
+
+// SAFETY: every instance writes only its own disjoint stretch of the buffer
+unsafe impl Send for Out {}
+unsafe impl Sync for Out {}
+
+impl Out {
+    /// Through a method so closures take the whole wrapper, not the pointer.
+    fn get(&self) -> *mut u8 {
+        self.0
+    }
+}
+
+fn state_error(error: StateError) -> i32 {
+    match error {
+        StateError::BufferTooSmall { .. } => CASH_GB_BUFFER_TOO_SMALL,
+        StateError::InvalidMagic
+        | StateError::UnsupportedVersion(_)
+        | StateError::Corrupt { .. } => CASH_GB_BAD_STATE,
+        StateError::WrongCart => CASH_GB_WRONG_CART,
+        StateError::MidInstruction => CASH_GB_MID_INSTRUCTION,
+    }
+}
+
+/// Maps the ROM at `path`, null if it can't be read or isn't a valid cart.
+///
+/// # Safety
+/// `path` is null or a nul terminated string.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_image_open(path: *const c_char) -> *mut CashGbImage {
+    if path.is_null() {
+        return ptr::null_mut();
+    }
+    let Ok(path) = CStr::from_ptr(path).to_str() else {
+        return ptr::null_mut();
+    };
+    match Rom::open(path).and_then(CartImage::new) {
+        Ok(image) => Box::into_raw(Box::new(CashGbImage(image))),
+        Err(_) => ptr::null_mut(),
+    }
+}
+
+/// Copies `len` bytes of ROM from `rom`, null if they aren't a valid cart.
+///
+/// # Safety
+/// `rom` is null or points at `len` readable bytes.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_image_from_bytes(rom: *const u8, len: usize) -> *mut CashGbImage {
+    if rom.is_null() {
+        return ptr::null_mut();
+    }
+    let rom = Rom::from(slice::from_raw_parts(rom, len).to_vec());
+    match CartImage::new(rom) {
+        Ok(image) => Box::into_raw(Box::new(CashGbImage(image))),
+        Err(_) => ptr::null_mut(),
+    }
+}
+
+/// Batches made from the image keep it alive, it can be freed right after.
+///
+/// # Safety
+/// `image` is null or came from `cash_gb_image_open` or
+/// `cash_gb_image_from_bytes` and hasn't been freed.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_image_free(image: *mut CashGbImage) {
+    if !image.is_null() {
+        drop(Box::from_raw(image));
+    }
+}
+
+/// Powers on `count` instances of `image`, run on up to `threads` threads
+/// or one per core for 0.
+///
+/// # Safety
+/// `image` is null or a live image.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_batch_new(
+    image: *const CashGbImage,
+    count: usize,
+    threads: usize,
+) -> *mut CashGbBatch {
+    let Some(image) = image.as_ref() else {
+        return ptr::null_mut();
+    };
+    let mut fleet = Fleet::new(&image.0, count);
+    if threads != 0 {
+        fleet = fleet.with_threads(threads);
+    }
+    let batch = CashGbBatch {
+        fleet,
+        observed: vec![],
+    };
+    Box::into_raw(Box::new(batch))
+}
+
+/// # Safety
+/// `batch` is null or came from `cash_gb_batch_new` and hasn't been freed.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_batch_free(batch: *mut CashGbBatch) {
+    if !batch.is_null() {
+        drop(Box::from_raw(batch));
+    }
+}
+
+/// # Safety
+/// `batch` is null or a live batch.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_batch_len(batch: *const CashGbBatch) -> usize {
+    batch
+        .as_ref()
+        .map_or(0, |batch| batch.fleet.instances().len())
+}
+
+/// Draws every `every`th frame of each instance, 0 for none. Timing is
+/// exact either way, skipped frames leave the last drawn one in place.
+///
+/// # Safety
+/// `batch` is null or a live batch.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_batch_render_every(batch: *mut CashGbBatch, every: u32) -> i32 {
+    let Some(batch) = batch.as_mut() else {
+        return CASH_GB_NULL;
+    };
+    let policy = match every {
+        0 => RenderPolicy::Never,
+        1 => RenderPolicy::Always,
+        n => RenderPolicy::EveryNth(n),
+    };
+    for cpu in batch.fleet.instances_mut() {
+        cpu.set_render_policy(policy);
+    }
+    CASH_GB_OK
+}
+
+/// Picks the `count` addresses whose bytes `cash_gb_batch_run_frames`
+/// reports for every instance, in this order. Banked memory reads through
+/// whichever bank the game has selected.
+///
+/// # Safety
+/// `batch` is null or a live batch, `addrs` points at `count` addresses or
+/// is null with `count` 0.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_batch_observe(
+    batch: *mut CashGbBatch,
+    addrs: *const u16,
+    count: usize,
+) -> i32 {
+    let Some(batch) = batch.as_mut() else {
+        return CASH_GB_NULL;
+    };
+    batch.observed = match count {
+        0 => vec![],
+        _ if addrs.is_null() => return CASH_GB_NULL,
+        _ => slice::from_raw_parts(addrs, count).to_vec(),
+    };
+    CASH_GB_OK
+}
+
+/// Runs `frames` frames of every instance, then writes out what it ended on.
+///
+/// `inputs` holds `frames` button masks per instance, instance by instance,
+/// each held for its frame. Null leaves the buttons as they are. When not
+/// null, `frame_out` gets each instance's last drawn frame as 160x144 DMG
+/// shades and `ram_out` the observed bytes, instance by instance.
+///
+/// # Safety
+/// `batch` is null or a live batch. The non null arrays hold `len` times
+/// `frames` bytes for `inputs`, `len` times 23040 for `frame_out` and
+/// `len` times the observed count for `ram_out`, where `len` is the size
+/// of the batch.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_batch_run_frames(
+    batch: *mut CashGbBatch,
+    frames: u32,
+    inputs: *const u8,
+    frame_out: *mut u8,
+    ram_out: *mut u8,
+) -> i32 {
+    let Some(batch) = batch.as_mut() else {
+        return CASH_GB_NULL;
+    };
+    let frames = frames as usize;
+    let (inputs, frame_out, ram_out) = (Out(inputs.cast_mut()), Out(frame_out), Out(ram_out));
+    let observed = &batch.observed;
+
+    batch.fleet.for_each_indexed(|index, cpu| {
+        // SAFETY: each instance only touches its own part of each array
+        for frame in 0..frames {
+            if !inputs.get().is_null() {
+                cpu.set_buttons(*inputs.get().add(index * frames + frame));
+            }
+            cpu.run_frame();
+        }
+        if !frame_out.get().is_null() {
+            let out =
+                slice::from_raw_parts_mut(frame_out.get().add(index * FRAME_BYTES), FRAME_BYTES);
+            out.copy_from_slice(cpu.ppu().frame());
+        }
+        if !ram_out.get().is_null() {
+            let len = observed.len();
+            let out = slice::from_raw_parts_mut(ram_out.get().add(index * len), len);
+            for (byte, addr) in out.iter_mut().zip(observed) {
+                *byte = cpu.peek(*addr);
+            }
+        }
+    });
+    CASH_GB_OK
+}
+
+fn instance(batch: &CashGbBatch, index: usize) -> Option<&Cpu> {
+    batch.fleet.instances().get(index)
+}
+
+/// Bytes a save state of any instance of the batch needs, 0 for a null batch.
+///
+/// # Safety
+/// `batch` is null or a live batch.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_state_size(batch: *const CashGbBatch) -> usize {
+    batch
+        .as_ref()
+        .and_then(|batch| instance(batch, 0))
+        .map_or(0, Cpu::state_size)
+}
+
+/// Saves instance `index` into the `len` bytes at `buf`.
+///
+/// # Safety
+/// `batch` is null or a live batch, `buf` is null or points at `len`
+/// writable bytes.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_save_state(
+    batch: *const CashGbBatch,
+    index: usize,
+    buf: *mut u8,
+    len: usize,
+) -> i32 {
+    let (Some(batch), false) = (batch.as_ref(), buf.is_null()) else {
+        return CASH_GB_NULL;
+    };
+    let Some(cpu) = instance(batch, index) else {
+        return CASH_GB_BAD_INDEX;
+    };
+    match cpu.save_state(slice::from_raw_parts_mut(buf, len)) {
+        Ok(_) => CASH_GB_OK,
+        Err(error) => state_error(error),
+    }
+}
+
+/// Restores instance `index` from a state of the same cart, saved by any
+/// instance of any batch.
+///
+/// # Safety
+/// `batch` is null or a live batch, `buf` is null or points at `len`
+/// readable bytes.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_load_state(
+    batch: *mut CashGbBatch,
+    index: usize,
+    buf: *const u8,
+    len: usize,
+) -> i32 {
+    let (Some(batch), false) = (batch.as_mut(), buf.is_null()) else {
+        return CASH_GB_NULL;
+    };
+    let Some(cpu) = batch.fleet.instances_mut().get_mut(index) else {
+        return CASH_GB_BAD_INDEX;
+    };
+    match cpu.load_state(slice::from_raw_parts(buf, len)) {
+        Ok(()) => CASH_GB_OK,
+        Err(error) => state_error(error),
+    }
+}
+
+/// Forks instance `from` into every other instance of the batch, the usual
+/// way to restart a whole batch from one saved point.
+///
+/// # Safety
+/// `batch` is null or a live batch.
+#[no_mangle]
+pub unsafe extern "C" fn cash_gb_batch_fork(batch: *mut CashGbBatch, from: usize) -> i32 {
+    let Some(batch) = batch.as_mut() else {
+        return CASH_GB_NULL;
+    };
+    let instances = batch.fleet.instances_mut();
+    if from >= instances.len() {
+        return CASH_GB_BAD_INDEX;
+    }
+    let (before, rest) = instances.split_at_mut(from);
+    let (source, after) = rest.split_first_mut().unwrap();
+    for cpu in before.iter_mut().chain(after) {
+        if let Err(error) = cpu.clone_state_from(source) {
+            return state_error(error);
+        }
+    }
+    CASH_GB_OK
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cart::{tests::rom, Cart};
+
+    /// Copies the direction lines of P1 into BGP, so every frame is drawn in
+    /// the shade of what was held.
+    const SHOW_BUTTONS: [u8; 10] = [
+        0x3e, 0x20, // ld a, 0x20
+        0xe0, 0x00, // ldh (P1), a
+        0xf0, 0x00, // ldh a, (P1)
+        0xe0, 0x47, // ldh (BGP), a
+        0x18, 0xf6, // jr -10
+    ];
+
+    const COUNT: usize = 3;
+    const FRAMES: usize = 2;
+    const OBSERVED: [u16; 2] = [0xff47, 0xff00];
+
+    fn image() -> *mut CashGbImage {
+        let rom = rom(0x00, 0, 0x00, &SHOW_BUTTONS);
+        let image = unsafe { cash_gb_image_from_bytes(rom.as_ptr(), rom.len()) };
+        assert!(!image.is_null());
+        image
+    }
+
+    fn batch() -> *mut CashGbBatch {
+        let image = image();
+        let batch = unsafe { cash_gb_batch_new(image, COUNT, 2) };
+        // the batch keeps the image alive
+        unsafe { cash_gb_image_free(image) };
+        assert!(!batch.is_null());
+        batch
+    }
+
+    fn state(batch: *const CashGbBatch, index: usize) -> Vec<u8> {
+        let mut buf = vec![0; unsafe { cash_gb_state_size(batch) }];
+        let result = unsafe { cash_gb_save_state(batch, index, buf.as_mut_ptr(), buf.len()) };
+        assert_eq!(result, CASH_GB_OK);
+        buf
+    }
+
+    #[test]
+    fn makes_images_only_of_valid_carts() {
+        let rom = rom(0x00, 0, 0x00, &SHOW_BUTTONS);
+        unsafe {
+            assert!(cash_gb_image_from_bytes(rom.as_ptr(), 0x100).is_null());
+            assert!(cash_gb_image_from_bytes(ptr::null(), rom.len()).is_null());
+            assert!(cash_gb_image_open(ptr::null()).is_null());
+            assert!(cash_gb_batch_new(ptr::null(), COUNT, 0).is_null());
+        }
+        let image = image();
+        unsafe { cash_gb_image_free(image) };
+    }
+
+    #[test]
+    fn runs_each_instance_on_its_own_inputs() {
+        let batch = batch();
+        assert_eq!(unsafe { cash_gb_batch_len(batch) }, COUNT);
+        let result = unsafe { cash_gb_batch_observe(batch, OBSERVED.as_ptr(), OBSERVED.len()) };
+        assert_eq!(result, CASH_GB_OK);
+
+        // right, left and neither held on the last frame
+        let inputs = [[0x00, 0x01], [0x01, 0x02], [0x02, 0x00]];
+        let mut frames = vec![0; COUNT * FRAME_BYTES];
+        let mut ram = vec![0; COUNT * OBSERVED.len()];
+        let result = unsafe {
+            cash_gb_batch_run_frames(
+                batch,
+                FRAMES as u32,
+                inputs.as_flattened().as_ptr(),
+                frames.as_mut_ptr(),
+                ram.as_mut_ptr(),
+            )
+        };
+        assert_eq!(result, CASH_GB_OK);
+
+        let image = CartImage::new(rom(0x00, 0, 0x00, &SHOW_BUTTONS)).unwrap();
+        for (index, buttons) in inputs.iter().enumerate() {
+            let mut cpu = Cpu::new(Cart::from_image(image.clone()));
+            for &held in buttons {
+                cpu.set_buttons(held);
+                cpu.run_frame();
+            }
+            let frame = &frames[index * FRAME_BYTES..][..FRAME_BYTES];
+            assert!(frame == cpu.ppu().frame(), "frame of instance {index}");
+            let observed = OBSERVED.map(|addr| cpu.peek(addr));
+            assert_eq!(ram[index * OBSERVED.len()..][..OBSERVED.len()], observed);
+        }
+        // the last frames differ, so a slice written to the wrong place shows
+        assert_ne!(ram[0], ram[OBSERVED.len()]);
+        assert_ne!(ram[OBSERVED.len()], ram[2 * OBSERVED.len()]);
+        assert_ne!(frames[0], frames[FRAME_BYTES]);
+        assert_ne!(frames[FRAME_BYTES], frames[2 * FRAME_BYTES]);
+        unsafe { cash_gb_batch_free(batch) };
+    }
+
+    #[test]
+    fn saves_loads_and_forks_instances() {
+        let batch = batch();
+        let inputs = [[0x01, 0x01], [0x02, 0x02], [0x04, 0x04]];
+        let result = unsafe {
+            let inputs = inputs.as_flattened().as_ptr();
+            cash_gb_batch_run_frames(batch, 2, inputs, ptr::null_mut(), ptr::null_mut())
+        };
+        assert_eq!(result, CASH_GB_OK);
+
+        let saved = state(batch, 0);
+        let mut buf = saved.clone();
+        unsafe {
+            let (ptr, len) = (buf.as_mut_ptr(), buf.len());
+            assert_eq!(
+                cash_gb_save_state(batch, 0, ptr, len - 1),
+                CASH_GB_BUFFER_TOO_SMALL
+            );
+            assert_eq!(
+                cash_gb_save_state(batch, COUNT, ptr, len),
+                CASH_GB_BAD_INDEX
+            );
+            assert_eq!(
+                cash_gb_load_state(batch, COUNT, ptr, len),
+                CASH_GB_BAD_INDEX
+            );
+        }
+
+        // a corrupt state is turned down and the instance left as it was
+        let before = state(batch, 1);
+        buf[0] ^= 0xff;
+        let result = unsafe { cash_gb_load_state(batch, 1, buf.as_ptr(), buf.len()) };
+        assert_eq!(result, CASH_GB_BAD_STATE);
+        assert_eq!(state(batch, 1), before);
+        let result = unsafe { cash_gb_load_state(batch, 1, saved.as_ptr(), saved.len()) };
+        assert_eq!(result, CASH_GB_OK);
+        assert_eq!(state(batch, 1), saved);
+
+        assert_eq!(
+            unsafe { cash_gb_batch_fork(batch, COUNT) },
+            CASH_GB_BAD_INDEX
+        );
+        assert_ne!(state(batch, 2), state(batch, 0));
+        assert_eq!(unsafe { cash_gb_batch_fork(batch, 2) }, CASH_GB_OK);
+        let forked = state(batch, 2);
+        assert!((0..COUNT).all(|index| state(batch, index) == forked));
+        unsafe { cash_gb_batch_free(batch) };
+    }
+
+    #[test]
+    fn turns_down_null_pointers() {
+        let batch = batch();
+        let null = ptr::null_mut::<CashGbBatch>();
+        let mut buf = [0; 16];
+        unsafe {
+            assert_eq!(cash_gb_batch_len(null), 0);
+            assert_eq!(cash_gb_state_size(null), 0);
+            assert_eq!(cash_gb_batch_render_every(null, 1), CASH_GB_NULL);
+            assert_eq!(cash_gb_batch_observe(null, ptr::null(), 0), CASH_GB_NULL);
+            assert_eq!(cash_gb_batch_observe(batch, ptr::null(), 1), CASH_GB_NULL);
+            let (none, out) = (ptr::null(), ptr::null_mut());
+            assert_eq!(
+                cash_gb_batch_run_frames(null, 1, none, out, out),
+                CASH_GB_NULL
+            );
+            assert_eq!(
+                cash_gb_save_state(null, 0, buf.as_mut_ptr(), 16),
+                CASH_GB_NULL
+            );
+            assert_eq!(cash_gb_save_state(batch, 0, out, 16), CASH_GB_NULL);
+            assert_eq!(cash_gb_load_state(null, 0, buf.as_ptr(), 16), CASH_GB_NULL);
+            assert_eq!(cash_gb_load_state(batch, 0, none, 16), CASH_GB_NULL);
+            assert_eq!(cash_gb_batch_fork(null, 0), CASH_GB_NULL);
+            cash_gb_batch_free(null);
+            cash_gb_image_free(ptr::null_mut());
+            cash_gb_batch_free(batch);
+        }
+    }
+}
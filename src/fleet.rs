@@ -0,0 +1,94 @@
+use std::{num::NonZeroUsize, sync::Arc, thread};
+
+use crate::cart::{Cart, CartImage};
+use crate::cpu::Cpu;
+use crate::ppu::RenderPolicy;
+
+/// Many instances of the same game, stepped together across threads.
+///
+/// Every instance shares the one `CartImage`, so each only costs its own
+/// ram, vram and wram.
+pub struct Fleet {
+    instances: Vec<Cpu>,
+    threads: usize,
+}
+
+impl Fleet {
+    pub fn new(image: &Arc<CartImage>, count: usize) -> Self {
+        Self {
+            instances: (0..count)
+                .map(|_| Cpu::new(Cart::from_image(image.clone())))
+                .collect(),
+            threads: thread::available_parallelism().map_or(1, NonZeroUsize::get),
+        }
+    }
+
+    /// Caps the number of worker threads, the default is one per core.
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        self.threads = threads.max(1);
+        self
+    }
+
+    /// Applies `policy` to every instance, fleets rarely look at more than a
+    /// few of the frames they run.
+    pub fn with_render_policy(mut self, policy: RenderPolicy) -> Self {
+        for cpu in &mut self.instances {
+            cpu.set_render_policy(policy);
+        }
+        self
+    }
+
+    pub fn instances(&self) -> &[Cpu] {
+        &self.instances
+    }
+
+    pub fn instances_mut(&mut self) -> &mut [Cpu] {
+        &mut self.instances
+    }
+
+    pub fn run_frames(&mut self, frames: u32) {
+        self.for_each(|cpu| {
+            for _ in 0..frames {
+                cpu.run_frame();
+            }
+        });
+    }
+
+    pub fn run_cycles(&mut self, cycles: u64) {
+        self.for_each(|cpu| {
+            cpu.run_cycles(cycles);
+        });
+    }
+
+    /// Runs `f` on every instance, splitting them into one contiguous chunk
+    /// per thread so each worker walks its own slice without coordination.
+    pub fn for_each(&mut self, f: impl Fn(&mut Cpu) + Sync) {
+        self.for_each_indexed(|_, cpu| f(cpu));
+    }
+
+    /// `for_each` with the index of each instance passed along, for callers
+    /// keeping per instance data alongside the fleet.
+    pub fn for_each_indexed(&mut self, f: impl Fn(usize, &mut Cpu) + Sync) {
+        if self.instances.is_empty() {
+            return;
+        }
+        let chunk = self.instances.len().div_ceil(self.threads);
+        if chunk == self.instances.len() {
+            for (index, cpu) in self.instances.iter_mut().enumerate() {
+                f(index, cpu);
+            }
+            return;
+        }
+
+        let f = &f;
+        thread::scope(|scope| {
+            for (first, instances) in (0..).step_by(chunk).zip(self.instances.chunks_mut(chunk)) {
+                scope.spawn(move || {
+                    for (offset, cpu) in instances.iter_mut().enumerate() {
+                        f(first + offset, cpu);
+                    }
+                });
+            }
+        });
+    }
+}
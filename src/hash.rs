@@ -0,0 +1,124 @@
+const PRIME_1: u64 = 0x9e3779b185ebca87;
+const PRIME_2: u64 = 0xc2b2ae3d27d4eb4f;
+const PRIME_3: u64 = 0x165667b19e3779f9;
+const PRIME_4: u64 = 0x85ebca77c2b2ae63;
+const PRIME_5: u64 = 0x27d4eb2f165667c5;
+
+/// XXH64 with a seed of 0, stable across builds and platforms.
+///
+/// The bulk of the input goes through four independent lanes of 8 byte
+/// words, which keeps several multiplies in flight at once and hashes a few
+/// bytes per cycle, against one for a byte at a time hash like FNV.
+pub fn xxh64(bytes: &[u8]) -> u64 {
+    let mut stripes = bytes.chunks_exact(32);
+    let mut hash = if bytes.len() >= 32 {
+        let mut lanes = [
+            PRIME_1.wrapping_add(PRIME_2),
+            PRIME_2,
+            0,
+            0u64.wrapping_sub(PRIME_1),
+        ];
+        for stripe in &mut stripes {
+            for (lane, word) in lanes.iter_mut().zip(stripe.chunks_exact(8)) {
+                *lane = round(*lane, word_at(word));
+            }
+        }
+        let [a, b, c, d] = lanes;
+        let mut hash = a
+            .rotate_left(1)
+            .wrapping_add(b.rotate_left(7))
+            .wrapping_add(c.rotate_left(12))
+            .wrapping_add(d.rotate_left(18));
+        for lane in lanes {
+            hash = (hash ^ round(0, lane))
+                .wrapping_mul(PRIME_1)
+                .wrapping_add(PRIME_4);
+        }
+        hash
+    } else {
+        PRIME_5
+    };
+    hash = hash.wrapping_add(bytes.len() as u64);
+
+    let rest = stripes.remainder();
+    let mut words = rest.chunks_exact(8);
+    for word in &mut words {
+        hash = (hash ^ round(0, word_at(word)))
+            .rotate_left(27)
+            .wrapping_mul(PRIME_1)
+            .wrapping_add(PRIME_4);
+    }
+    let mut rest = words.remainder();
+    if rest.len() >= 4 {
+        let half = u32::from_le_bytes(rest[..4].try_into().unwrap()) as u64;
+        hash = (hash ^ half.wrapping_mul(PRIME_1))
+            .rotate_left(23)
+            .wrapping_mul(PRIME_2)
+            .wrapping_add(PRIME_3);
+        rest = &rest[4..];
+    }
+    for byte in rest {
+        hash = (hash ^ (*byte as u64).wrapping_mul(PRIME_5))
+            .rotate_left(11)
+            .wrapping_mul(PRIME_1);
+    }
+
+    hash ^= hash >> 33;
+    hash = hash.wrapping_mul(PRIME_2);
+    hash ^= hash >> 29;
+    hash = hash.wrapping_mul(PRIME_3);
+    hash ^ hash >> 32
+}
+
+#[inline(always)]
+fn round(lane: u64, word: u64) -> u64 {
+    lane.wrapping_add(word.wrapping_mul(PRIME_2))
+        .rotate_left(31)
+        .wrapping_mul(PRIME_1)
+}
+
+#[inline(always)]
+fn word_at(bytes: &[u8]) -> u64 {
+    u64::from_le_bytes(bytes.try_into().unwrap())
+}
+
+/// Hashes of the memory a run leaves behind, region by region so a
+/// mismatch says where to look.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct MemoryHash {
+    pub w_ram: u64,
+    pub v_ram: u64,
+    pub h_ram: u64,
+    pub io_registers: u64,
+    pub cart_ram: u64,
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// The buffer of the xxHash sanity checks, bytes of a squared counter.
+    fn sanity_buffer() -> Vec<u8> {
+        let mut generator = 2654435761u32;
+        (0..101)
+            .map(|_| {
+                let byte = (generator >> 24) as u8;
+                generator = generator.wrapping_mul(generator);
+                byte
+            })
+            .collect()
+    }
+
+    #[test]
+    fn matches_the_reference() {
+        let buffer = sanity_buffer();
+        assert_eq!(xxh64(&[]), 0xef46db3751d8e999);
+        assert_eq!(xxh64(&buffer[..1]), 0x4fce394cc88952d8);
+        assert_eq!(xxh64(&buffer[..14]), 0xcffa8db881bc3a3d);
+        assert_eq!(xxh64(&buffer), 0x0eab543384f878ad);
+        assert_eq!(xxh64(b"a"), 0xd24ec4f1a98c6e5b);
+        assert_eq!(xxh64(b"abc"), 0x44bc2cf5ad770999);
+        let spam = b"Nobody inspects the spammish repetition";
+        assert_eq!(xxh64(spam), 0xfbcea83c8a378bf1);
+    }
+}
@@ -0,0 +1,127 @@
+use crate::state::{StateError, StateReader, StateWriter, JOYPAD_OFFSET};
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Button {
+    Right = 1 << 0,
+    Left = 1 << 1,
+    Up = 1 << 2,
+    Down = 1 << 3,
+    A = 1 << 4,
+    B = 1 << 5,
+    Select = 1 << 6,
+    Start = 1 << 7,
+}
+
+/// The P1 register over the current button state, one bit per `Button`.
+#[derive(Clone, Copy)]
+pub(crate) struct Joypad {
+    pressed: u8,
+    select: u8,
+}
+
+impl Joypad {
+    pub fn new() -> Self {
+        Self {
+            pressed: 0,
+            select: 0x30,
+        }
+    }
+
+    pub fn pressed(&self) -> u8 {
+        self.pressed
+    }
+
+    pub fn read(&self) -> u8 {
+        0xc0 | self.select | (!self.lines(self.pressed) & 0x0f)
+    }
+
+    /// Selects the button groups P1 reads, returning whether that took a
+    /// line low for a button already held and the interrupt should fire.
+    pub fn write(&mut self, value: u8) -> bool {
+        let before = self.lines(self.pressed);
+        self.select = value & 0x30;
+        self.lines(self.pressed) & !before != 0
+    }
+
+    /// Replaces the pressed buttons, returning whether a selected line went
+    /// low and the joypad interrupt should fire.
+    pub fn set(&mut self, pressed: u8) -> bool {
+        let before = self.lines(self.pressed);
+        self.pressed = pressed;
+        self.lines(pressed) & !before != 0
+    }
+
+    /// Low nibble of P1 with 1 for pressed, from whichever groups are selected.
+    fn lines(&self, pressed: u8) -> u8 {
+        let mut lines = 0;
+        if self.select & 0x10 == 0 {
+            lines |= pressed & 0x0f;
+        }
+        if self.select & 0x20 == 0 {
+            lines |= pressed >> 4;
+        }
+        lines
+    }
+
+    pub fn save_state(&self, w: &mut StateWriter) {
+        w.seek(JOYPAD_OFFSET);
+        w.u8(self.pressed);
+        w.u8(self.select);
+    }
+
+    pub fn check_state(&self, r: &mut StateReader) -> Result<(), StateError> {
+        r.seek(JOYPAD_OFFSET + 1);
+        let offset = JOYPAD_OFFSET + 1;
+        match r.u8() & !0x30 {
+            0 => Ok(()),
+            _ => Err(StateError::Corrupt { offset }),
+        }
+    }
+
+    pub fn load_state(&mut self, r: &mut StateReader) {
+        r.seek(JOYPAD_OFFSET);
+        self.pressed = r.u8();
+        self.select = r.u8() & 0x30;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const DIRECTIONS: u8 = 0x20;
+    const BUTTONS: u8 = 0x10;
+
+    #[test]
+    fn only_selected_presses_raise_interrupts() {
+        let mut joypad = Joypad::new();
+        assert!(!joypad.set(Button::A as u8));
+        assert!(!joypad.write(DIRECTIONS));
+        assert!(!joypad.set(Button::A as u8 | Button::B as u8));
+        assert!(joypad.set(Button::A as u8 | Button::B as u8 | Button::Up as u8));
+        assert_eq!(joypad.read() & 0x0f, 0x0b);
+    }
+
+    #[test]
+    fn selecting_a_held_group_raises_an_interrupt() {
+        let mut joypad = Joypad::new();
+        joypad.set(Button::Start as u8);
+        assert!(joypad.write(BUTTONS));
+        assert_eq!(joypad.read() & 0x0f, 0x07);
+        // still low, no new edge
+        assert!(!joypad.write(BUTTONS));
+        assert!(!joypad.write(0x30));
+        assert!(!joypad.write(DIRECTIONS));
+    }
+
+    #[test]
+    fn shared_lines_fall_once() {
+        let mut joypad = Joypad::new();
+        joypad.write(0x00);
+        assert!(joypad.set(Button::Right as u8));
+        // A pulls down the same line Right already holds low
+        assert!(!joypad.set(Button::Right as u8 | Button::A as u8));
+        assert!(!joypad.set(Button::A as u8));
+        assert!(joypad.set(Button::A as u8 | Button::B as u8));
+    }
+}
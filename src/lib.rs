@@ -1,25 +1,44 @@
-use std::{fs::File, io::Read, path::Path};
+use std::sync::Arc;
 
-use cart::{Cart, CartError};
+use cart::{Cart, CartError, CartImage};
+use rom::Rom;
 
+mod apu;
+pub mod battery;
+mod block;
+pub mod bus;
 pub mod cart;
 pub mod cpu;
+pub mod ffi;
+pub mod fleet;
+pub mod hash;
+pub mod joypad;
+pub mod library;
+mod mapper;
+pub mod mmap;
+pub mod pipeline;
+pub mod ppu;
+pub mod profile;
 pub mod register;
+pub mod replay;
+pub mod rewind;
+pub mod ring;
+pub mod rom;
+mod scheduler;
+pub mod state;
+mod timer;
+mod timing;
+pub mod trace;
+pub mod tracer;
 
+/// Maps the ROM at `path`, each call gets its own mapping. To run many carts
+/// over the same image open it once with `Rom::open` and clone the handle.
 pub fn read_cart(path: &str) -> Result<Cart, CartError> {
-    let mut data: Vec<u8> = vec![];
-
-    let file_path = Path::new(path);
-
-    let mut file = match File::open(&file_path) {
-        Ok(file) => file,
-        Err(_) => return Err(CartError::MissingCart(path.to_string())),
-    };
-
-    match file.read_to_end(&mut data) {
-        Ok(_) => (),
-        Err(_) => return Err(CartError::LoadError),
-    };
+    Cart::new(Rom::open(path)?)
+}
 
-    Ok(Cart::new(&data)?)
+/// Maps and validates the ROM at `path` once, ready to be shared by any
+/// number of `Cart::from_image` instances.
+pub fn read_image(path: &str) -> Result<Arc<CartImage>, CartError> {
+    CartImage::new(Rom::open(path)?)
 }
@@ -0,0 +1,98 @@
+use std::{
+    fs, io,
+    num::NonZeroUsize,
+    path::{Path, PathBuf},
+    sync::atomic::{AtomicUsize, Ordering},
+    thread,
+};
+
+use crate::cart::{CartError, CartHeader};
+
+/// File extensions `scan` treats as ROMs.
+const EXTENSIONS: [&str; 3] = ["gb", "gbc", "sgb"];
+
+/// Reads the header of every ROM directly inside `dir` across one thread per
+/// core, without mapping or loading anything past the headers.
+///
+/// Files are handed out one at a time off a shared counter, so a slow disk
+/// read holds up only its own worker. The results come back sorted by path,
+/// a ROM with a broken header still gets an entry with its error.
+pub fn scan(dir: impl AsRef<Path>) -> io::Result<Vec<(PathBuf, Result<CartHeader, CartError>)>> {
+    let mut paths = vec![];
+    for entry in fs::read_dir(dir)? {
+        let path = entry?.path();
+        let rom = path
+            .extension()
+            .and_then(|extension| extension.to_str())
+            .is_some_and(|extension| {
+                EXTENSIONS
+                    .iter()
+                    .any(|rom| extension.eq_ignore_ascii_case(rom))
+            });
+        if rom && path.is_file() {
+            paths.push(path);
+        }
+    }
+    paths.sort();
+
+    let threads = thread::available_parallelism().map_or(1, NonZeroUsize::get);
+    let next = AtomicUsize::new(0);
+    let mut headers: Vec<_> = paths.iter().map(|_| None).collect();
+    thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads.min(paths.len()))
+            .map(|_| {
+                scope.spawn(|| {
+                    let mut read = vec![];
+                    loop {
+                        let index = next.fetch_add(1, Ordering::Relaxed);
+                        match paths.get(index) {
+                            Some(path) => read.push((index, CartHeader::read(path))),
+                            None => return read,
+                        }
+                    }
+                })
+            })
+            .collect();
+        for worker in workers {
+            for (index, header) in worker.join().unwrap() {
+                headers[index] = Some(header);
+            }
+        }
+    });
+
+    // every index was claimed by exactly one worker
+    Ok(paths
+        .into_iter()
+        .zip(headers.into_iter().flatten())
+        .collect())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cart::tests::rom;
+
+    #[test]
+    fn scans_roms_in_path_order() {
+        let dir = std::env::temp_dir().join(format!("cash-gb-test-{}.lib", std::process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let mut bad = rom(0x00, 0, 0x00, &[]).to_vec();
+        bad[0x014d] ^= 1;
+        fs::write(dir.join("b.gb"), &*rom(0x00, 0, 0x00, &[])).unwrap();
+        fs::write(dir.join("a.GBC"), &bad).unwrap();
+        fs::write(dir.join("c.sav"), [0; 16]).unwrap();
+
+        let found = scan(&dir).unwrap();
+        fs::remove_dir_all(&dir).unwrap();
+        let names: Vec<_> = found
+            .iter()
+            .map(|(path, _)| path.file_name().unwrap())
+            .collect();
+        assert_eq!(names, ["a.GBC", "b.gb"]);
+        assert!(matches!(
+            found[0].1,
+            Err(CartError::HeaderCheckSumFailure { .. })
+        ));
+        assert_eq!(found[1].1.as_ref().unwrap().title(), "TEST");
+    }
+}
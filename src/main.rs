@@ -1,5 +1,15 @@
-use cash_gb::{cpu::Cpu, read_cart};
-use std::env;
+use cash_gb::{
+    battery::FlushPolicy,
+    cpu::{Cpu, Engine, CYCLES_PER_FRAME},
+    pipeline::{self, Frame, Frontend},
+    profile, read_cart, trace,
+    tracer::{write_doctor_log, TraceReader, Tracer},
+};
+use std::{
+    env,
+    io::{self, BufWriter},
+    path::Path,
+};
 
 fn main() {
     //let cart = match read_cart("/home/cash/dev/cash-gb/roms/dmg_test_prog_ver1.gb") {
@@ -22,20 +32,71 @@ fn main() {
         panic!("missing cart file");
     }
 
+    // turns a binary trace back into a gameboy-doctor log on stdout
+    if args[1] == "--doctor" {
+        let Some(path) = args.get(2) else {
+            panic!("missing trace file");
+        };
+        let result = TraceReader::open(path)
+            .and_then(|trace| write_doctor_log(trace, &mut BufWriter::new(io::stdout())));
+        if let Err(error) = result {
+            panic!("error: {}", error);
+        }
+        return;
+    }
+
     if let Some(file) = env::args_os().nth(1) {
-        let cart = match read_cart(&match file.into_string() {
+        let file = match file.into_string() {
             Ok(file) => file,
             Err(error) => panic!("error: {:?}", error),
-        }) {
+        };
+        let save = Path::new(&file).with_extension("sav");
+        let mut cart = match read_cart(&file) {
             Ok(cart) => cart,
             Err(error) => panic!("error: {}", error),
         };
+        // only carts with a battery get a save file next to them
+        if cart.image().header().battery() {
+            cart = match cart.with_battery(&save, FlushPolicy::OnRamDisable) {
+                Ok(cart) => cart,
+                Err(error) => panic!("error: {}", error),
+            };
+        }
         println!("cart read:");
         println!("{}", cart);
         let mut cpu = Cpu::new(cart);
+        if env::var_os("CASH_GB_ENGINE").is_some_and(|engine| engine == "block") {
+            cpu.set_engine(Engine::BlockCache);
+        }
+        if let Some(path) = env::var_os("CASH_GB_RECORD") {
+            match Tracer::create(path) {
+                Ok(tracer) => cpu.attach_tracer(tracer),
+                Err(error) => panic!("error: {}", error),
+            }
+        }
         let steps = 10000000;
-        for _ in 0..=steps {
-            cpu.step();
+        if env::var_os("CASH_GB_PIPELINE").is_some() {
+            // no window or audio device yet, the sinks just count
+            let (mut presented, mut samples) = (0, 0);
+            let frontend = Frontend {
+                present: |_: &Frame| {
+                    presented += 1;
+                    true
+                },
+                play: |played: &[i16]| samples += played.len() / 2,
+                sample_rate: 44100,
+            };
+            let ran = pipeline::run(&mut cpu, steps / CYCLES_PER_FRAME, frontend);
+            println!("ran {ran} frames, presented {presented}, {samples} samples");
+        } else {
+            cpu.run_cycles(steps);
+        }
+        trace::flush();
+        if let Some(Err(error)) = cpu.detach_tracer().map(Tracer::finish) {
+            eprintln!("failed to write trace: {error}");
+        }
+        if let Err(error) = profile::dump() {
+            eprintln!("failed to write profile: {error}");
         }
     }
 }
@@ -0,0 +1,493 @@
+use crate::state::{StateReader, StateWriter};
+
+/// Bytes of register state a mapper may keep in a save state.
+pub(crate) const MAPPER_STATE_SIZE: usize = 0x19;
+/// M-cycles per second of the DMG clock, what the MBC3 clock counts in
+const CYCLES_PER_SECOND: u64 = 1 << 20;
+
+/// The banks a mapper currently selects, already wrapped to the size of the
+/// cart so they can be sliced without checks.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct Banks {
+    /// 16KiB rom bank seen at 0x0000..=0x3fff
+    pub rom0: usize,
+    /// 16KiB rom bank seen at 0x4000..=0x7fff
+    pub rom1: usize,
+    /// 8KiB ram bank seen at 0xa000..=0xbfff, `None` while ram is disabled
+    /// or a mapper register sits there instead
+    pub ram: Option<usize>,
+}
+
+/// The banking logic of a cart. Mappers only work out which banks are
+/// selected, the cart turns that into offsets and the bus into page entries,
+/// so reads never go through here.
+pub(crate) trait Mapper: Send {
+    /// A write to 0x0000..=0x7fff.
+    fn write_register(&mut self, now: u64, addr: u16, value: u8);
+
+    fn banks(&self) -> Banks;
+
+    /// A read of 0xa000..=0xbfff while `banks` has no ram there.
+    fn read_unmapped(&self, _addr: u16) -> u8 {
+        0xff
+    }
+
+    /// A write to 0xa000..=0xbfff while `banks` has no ram there.
+    fn write_unmapped(&mut self, _now: u64, _addr: u16, _value: u8) {}
+
+    /// Writes the registers from the current position, at most
+    /// `MAPPER_STATE_SIZE` bytes.
+    fn save_state(&self, w: &mut StateWriter);
+
+    fn load_state(&mut self, r: &mut StateReader);
+}
+
+/// Bank counts are powers of two, so wrapping is a mask.
+fn ram_bank(enabled: bool, banks: usize, bank: usize) -> Option<usize> {
+    (enabled && banks > 0).then(|| bank & (banks - 1))
+}
+
+/// ROM only carts, with or without a fixed ram chip.
+pub(crate) struct NoMapper {
+    ram_banks: usize,
+}
+
+impl NoMapper {
+    pub fn new(ram_banks: usize) -> Self {
+        Self { ram_banks }
+    }
+}
+
+impl Mapper for NoMapper {
+    fn write_register(&mut self, _now: u64, _addr: u16, _value: u8) {}
+
+    fn banks(&self) -> Banks {
+        Banks {
+            rom0: 0,
+            rom1: 1,
+            ram: ram_bank(true, self.ram_banks, 0),
+        }
+    }
+
+    fn save_state(&self, _w: &mut StateWriter) {}
+
+    fn load_state(&mut self, _r: &mut StateReader) {}
+}
+
+/// Up to 2MiB of rom and 32KiB of ram. The two bit register either extends
+/// the rom bank or, in mode 1, picks the ram bank and the bank at 0x0000.
+pub(crate) struct Mbc1 {
+    rom_mask: usize,
+    ram_banks: usize,
+    ram_enabled: bool,
+    bank1: u8,
+    bank2: u8,
+    mode: bool,
+}
+
+impl Mbc1 {
+    pub fn new(rom_banks: usize, ram_banks: usize) -> Self {
+        Self {
+            rom_mask: rom_banks - 1,
+            ram_banks,
+            ram_enabled: false,
+            bank1: 1,
+            bank2: 0,
+            mode: false,
+        }
+    }
+}
+
+impl Mapper for Mbc1 {
+    fn write_register(&mut self, _now: u64, addr: u16, value: u8) {
+        match addr {
+            0x0000..=0x1fff => self.ram_enabled = value & 0x0f == 0x0a,
+            // bank 0 can't be picked here, which is why 0x20/0x40/0x60 can't
+            // be reached in mode 0
+            0x2000..=0x3fff => self.bank1 = (value & 0x1f).max(1),
+            0x4000..=0x5fff => self.bank2 = value & 0x03,
+            _ => self.mode = value & 0x01 != 0,
+        }
+    }
+
+    fn banks(&self) -> Banks {
+        let high = (self.bank2 as usize) << 5;
+        let mode_bank = if self.mode { self.bank2 as usize } else { 0 };
+        Banks {
+            rom0: if self.mode { high & self.rom_mask } else { 0 },
+            rom1: (high | self.bank1 as usize) & self.rom_mask,
+            ram: ram_bank(self.ram_enabled, self.ram_banks, mode_bank),
+        }
+    }
+
+    fn save_state(&self, w: &mut StateWriter) {
+        w.bool(self.ram_enabled);
+        w.u8(self.bank1);
+        w.u8(self.bank2);
+        w.bool(self.mode);
+    }
+
+    fn load_state(&mut self, r: &mut StateReader) {
+        self.ram_enabled = r.bool();
+        self.bank1 = (r.u8() & 0x1f).max(1);
+        self.bank2 = r.u8() & 0x03;
+        self.mode = r.bool();
+    }
+}
+
+/// Up to 2MiB of rom and 32KiB of ram, plus a real time clock on some carts
+/// that shares the ram window.
+pub(crate) struct Mbc3 {
+    rom_mask: usize,
+    ram_banks: usize,
+    ram_enabled: bool,
+    rom_bank: u8,
+    /// ram bank 0..=3 or clock register 0x08..=0x0c
+    select: u8,
+    /// last byte written to the latch register, 0 then 1 latches the clock
+    latch: u8,
+    rtc: Option<Rtc>,
+}
+
+impl Mbc3 {
+    pub fn new(rom_banks: usize, ram_banks: usize, rtc: bool) -> Self {
+        Self {
+            rom_mask: rom_banks - 1,
+            ram_banks,
+            ram_enabled: false,
+            rom_bank: 1,
+            select: 0,
+            latch: 0xff,
+            rtc: rtc.then(Rtc::new),
+        }
+    }
+
+    fn rtc_register(&self) -> Option<usize> {
+        match self.select {
+            0x08..=0x0c if self.ram_enabled => Some((self.select - 0x08) as usize),
+            _ => None,
+        }
+    }
+}
+
+impl Mapper for Mbc3 {
+    fn write_register(&mut self, now: u64, addr: u16, value: u8) {
+        match addr {
+            0x0000..=0x1fff => self.ram_enabled = value & 0x0f == 0x0a,
+            0x2000..=0x3fff => self.rom_bank = (value & 0x7f).max(1),
+            0x4000..=0x5fff => self.select = value & 0x0f,
+            _ => {
+                if let (0, 1, Some(rtc)) = (self.latch, value, &mut self.rtc) {
+                    rtc.latch(now);
+                }
+                self.latch = value;
+            }
+        }
+    }
+
+    fn banks(&self) -> Banks {
+        let ram = match self.select {
+            0x00..=0x03 => ram_bank(self.ram_enabled, self.ram_banks, self.select as usize),
+            _ => None,
+        };
+        Banks {
+            rom0: 0,
+            rom1: self.rom_bank as usize & self.rom_mask,
+            ram,
+        }
+    }
+
+    fn read_unmapped(&self, _addr: u16) -> u8 {
+        match (&self.rtc, self.rtc_register()) {
+            (Some(rtc), Some(register)) => rtc.latched[register],
+            _ => 0xff,
+        }
+    }
+
+    fn write_unmapped(&mut self, now: u64, _addr: u16, value: u8) {
+        if let (Some(register), Some(rtc)) = (self.rtc_register(), &mut self.rtc) {
+            rtc.write(now, register, value);
+        }
+    }
+
+    fn save_state(&self, w: &mut StateWriter) {
+        w.bool(self.ram_enabled);
+        w.u8(self.rom_bank);
+        w.u8(self.select);
+        w.u8(self.latch);
+        if let Some(rtc) = &self.rtc {
+            rtc.save_state(w);
+        }
+    }
+
+    fn load_state(&mut self, r: &mut StateReader) {
+        self.ram_enabled = r.bool();
+        self.rom_bank = (r.u8() & 0x7f).max(1);
+        self.select = r.u8() & 0x0f;
+        self.latch = r.u8();
+        if let Some(rtc) = &mut self.rtc {
+            rtc.load_state(r);
+        }
+    }
+}
+
+/// The MBC3 clock, worked out from the single speed cycle count so it
+/// stays deterministic and costs nothing until it's latched. It runs on
+/// emulated time, not the host's, and doesn't speed up with the cpu.
+#[derive(Clone, Copy)]
+struct Rtc {
+    /// cycle the clock read zero at while running, or the cycles counted so
+    /// far while halted
+    base: u64,
+    halted: bool,
+    /// day counter overflow, sticky until written
+    carry: bool,
+    /// S, M, H, DL and DH as of the last latch
+    latched: [u8; 5],
+}
+
+impl Rtc {
+    fn new() -> Self {
+        Self {
+            base: 0,
+            halted: false,
+            carry: false,
+            latched: [0; 5],
+        }
+    }
+
+    fn elapsed(&self, now: u64) -> u64 {
+        match self.halted {
+            true => self.base,
+            false => now.wrapping_sub(self.base),
+        }
+    }
+
+    fn set_elapsed(&mut self, now: u64, elapsed: u64) {
+        self.base = match self.halted {
+            true => elapsed,
+            false => now.wrapping_sub(elapsed),
+        };
+    }
+
+    /// The live registers, folding a day counter overflow into the carry.
+    fn registers(&mut self, now: u64) -> [u8; 5] {
+        const WRAP: u64 = 512 * 86400 * CYCLES_PER_SECOND;
+        let mut elapsed = self.elapsed(now);
+        if elapsed >= WRAP {
+            elapsed %= WRAP;
+            self.carry = true;
+            self.set_elapsed(now, elapsed);
+        }
+        let seconds = elapsed / CYCLES_PER_SECOND;
+        let days = seconds / 86400;
+        [
+            (seconds % 60) as u8,
+            (seconds / 60 % 60) as u8,
+            (seconds / 3600 % 24) as u8,
+            days as u8,
+            (days >> 8) as u8 | (self.halted as u8) << 6 | (self.carry as u8) << 7,
+        ]
+    }
+
+    fn latch(&mut self, now: u64) {
+        self.latched = self.registers(now);
+    }
+
+    fn write(&mut self, now: u64, register: usize, value: u8) {
+        let mut registers = self.registers(now);
+        let mut subsecond = self.elapsed(now) % CYCLES_PER_SECOND;
+        registers[register] = value;
+        if register == 0 {
+            // writing the seconds restarts the current one
+            subsecond = 0;
+        }
+        let [seconds, minutes, hours, low, high] = registers.map(|r| r as u64);
+        let days = (high & 0x01) << 8 | low;
+        let seconds =
+            ((days * 24 + (hours & 0x1f)) * 60 + (minutes & 0x3f)) * 60 + (seconds & 0x3f);
+        let elapsed = seconds * CYCLES_PER_SECOND + subsecond;
+
+        // halting freezes the count where it is and resuming picks it up
+        self.halted = high & 0x40 != 0;
+        self.carry = high & 0x80 != 0;
+        self.set_elapsed(now, elapsed);
+    }
+
+    fn save_state(&self, w: &mut StateWriter) {
+        w.u64(self.base);
+        w.u8((self.halted as u8) | (self.carry as u8) << 1);
+        w.bytes(&self.latched);
+    }
+
+    fn load_state(&mut self, r: &mut StateReader) {
+        self.base = r.u64();
+        let flags = r.u8();
+        self.halted = flags & 0x01 != 0;
+        self.carry = flags & 0x02 != 0;
+        self.latched = r.array();
+    }
+}
+
+/// Up to 8MiB of rom and 128KiB of ram, with a plain 9 bit rom bank where
+/// bank 0 is allowed.
+pub(crate) struct Mbc5 {
+    rom_mask: usize,
+    ram_banks: usize,
+    /// rumble carts wire bit 3 of the ram bank to the motor
+    ram_mask: u8,
+    ram_enabled: bool,
+    rom_bank: u16,
+    ram_bank: u8,
+}
+
+impl Mbc5 {
+    pub fn new(rom_banks: usize, ram_banks: usize, rumble: bool) -> Self {
+        Self {
+            rom_mask: rom_banks - 1,
+            ram_banks,
+            ram_mask: if rumble { 0x07 } else { 0x0f },
+            ram_enabled: false,
+            rom_bank: 1,
+            ram_bank: 0,
+        }
+    }
+}
+
+impl Mapper for Mbc5 {
+    fn write_register(&mut self, _now: u64, addr: u16, value: u8) {
+        match addr {
+            0x0000..=0x1fff => self.ram_enabled = value == 0x0a,
+            0x2000..=0x2fff => self.rom_bank = self.rom_bank & 0x100 | value as u16,
+            0x3000..=0x3fff => self.rom_bank = self.rom_bank & 0xff | (value as u16 & 0x01) << 8,
+            0x4000..=0x5fff => self.ram_bank = value & self.ram_mask,
+            _ => (),
+        }
+    }
+
+    fn banks(&self) -> Banks {
+        Banks {
+            rom0: 0,
+            rom1: self.rom_bank as usize & self.rom_mask,
+            ram: ram_bank(self.ram_enabled, self.ram_banks, self.ram_bank as usize),
+        }
+    }
+
+    fn save_state(&self, w: &mut StateWriter) {
+        w.bool(self.ram_enabled);
+        w.u16(self.rom_bank);
+        w.u8(self.ram_bank);
+    }
+
+    fn load_state(&mut self, r: &mut StateReader) {
+        self.ram_enabled = r.bool();
+        self.rom_bank = r.u16() & 0x1ff;
+        self.ram_bank = r.u8() & self.ram_mask;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn write(mapper: &mut impl Mapper, writes: &[(u16, u8)]) -> Banks {
+        for (addr, value) in writes {
+            mapper.write_register(0, *addr, *value);
+        }
+        mapper.banks()
+    }
+
+    fn banks(rom0: usize, rom1: usize, ram: Option<usize>) -> Banks {
+        Banks { rom0, rom1, ram }
+    }
+
+    #[test]
+    fn mbc1_switches_banks() {
+        let mut mbc = Mbc1::new(128, 4);
+        assert_eq!(mbc.banks(), banks(0, 1, None));
+        assert_eq!(write(&mut mbc, &[(0x2000, 0x00)]), banks(0, 1, None));
+        assert_eq!(write(&mut mbc, &[(0x3fff, 0x05)]), banks(0, 5, None));
+        // the low register never selects 0, so 0x20 reads as 0x21
+        assert_eq!(
+            write(&mut mbc, &[(0x4000, 0x01), (0x2000, 0x20)]),
+            banks(0, 0x21, None)
+        );
+        assert_eq!(write(&mut mbc, &[(0x0000, 0x0a)]), banks(0, 0x21, Some(0)));
+        assert_eq!(
+            write(&mut mbc, &[(0x6000, 0x01)]),
+            banks(0x20, 0x21, Some(1))
+        );
+        assert_eq!(write(&mut mbc, &[(0x1fff, 0x00)]), banks(0x20, 0x21, None));
+
+        // selections wrap to the size of the cart
+        let mut mbc = Mbc1::new(8, 1);
+        let writes = [
+            (0x0000, 0x0a),
+            (0x2000, 0x1f),
+            (0x4000, 0x03),
+            (0x6000, 0x01),
+        ];
+        assert_eq!(write(&mut mbc, &writes), banks(0, 7, Some(0)));
+    }
+
+    #[test]
+    fn mbc3_switches_banks() {
+        let mut mbc = Mbc3::new(128, 4, false);
+        assert_eq!(write(&mut mbc, &[(0x2000, 0x00)]), banks(0, 1, None));
+        assert_eq!(write(&mut mbc, &[(0x2000, 0xff)]), banks(0, 0x7f, None));
+        assert_eq!(
+            write(&mut mbc, &[(0x0000, 0x0a), (0x4000, 0x02)]),
+            banks(0, 0x7f, Some(2))
+        );
+        // clock registers take over the ram window, even without a clock
+        assert_eq!(write(&mut mbc, &[(0x4000, 0x08)]), banks(0, 0x7f, None));
+        assert_eq!(mbc.read_unmapped(0xa000), 0xff);
+    }
+
+    #[test]
+    fn mbc3_clock_latches_and_halts() {
+        let second = CYCLES_PER_SECOND;
+        let mut mbc = Mbc3::new(2, 1, true);
+        write(&mut mbc, &[(0x0000, 0x0a), (0x4000, 0x08)]);
+        let latch = |mbc: &mut Mbc3, now| {
+            mbc.write_register(now, 0x6000, 0x00);
+            mbc.write_register(now, 0x6000, 0x01);
+        };
+        let read = |mbc: &mut Mbc3, register| {
+            mbc.write_register(0, 0x4000, register);
+            mbc.read_unmapped(0xa000)
+        };
+
+        latch(&mut mbc, 90 * second);
+        // the latched values hold until the next latch
+        assert_eq!((read(&mut mbc, 0x08), read(&mut mbc, 0x09)), (30, 1));
+        latch(&mut mbc, (86400 + 3661) * second);
+        let time: Vec<_> = (0x08..=0x0c).map(|r| read(&mut mbc, r)).collect();
+        assert_eq!(time, [1, 1, 1, 1, 0]);
+
+        // halted, the clock stays where it was written
+        mbc.write_register(0, 0x4000, 0x0c);
+        mbc.write_unmapped(100_000 * second, 0xa000, 0x40);
+        latch(&mut mbc, 200_000 * second);
+        assert_eq!((read(&mut mbc, 0x0b), read(&mut mbc, 0x0c)), (1, 0x40));
+    }
+
+    #[test]
+    fn mbc5_switches_banks() {
+        let mut mbc = Mbc5::new(512, 16, false);
+        assert_eq!(write(&mut mbc, &[(0x2000, 0x00)]), banks(0, 0, None));
+        assert_eq!(
+            write(&mut mbc, &[(0x3000, 0x01), (0x2000, 0x23)]),
+            banks(0, 0x123, None)
+        );
+        // only exactly 0x0a enables ram
+        assert_eq!(write(&mut mbc, &[(0x0000, 0x1a)]), banks(0, 0x123, None));
+        let writes = [(0x0000, 0x0a), (0x4000, 0x0f)];
+        assert_eq!(write(&mut mbc, &writes), banks(0, 0x123, Some(15)));
+        assert_eq!(write(&mut mbc, &[(0x3000, 0x00)]), banks(0, 0x23, Some(15)));
+
+        // rumble carts lose bit 3 of the ram bank to the motor
+        let mut mbc = Mbc5::new(2, 16, true);
+        assert_eq!(write(&mut mbc, &writes), banks(0, 1, Some(7)));
+    }
+}
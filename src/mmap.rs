@@ -0,0 +1,208 @@
+use std::{
+    fs::File,
+    io,
+    ops::{Deref, DerefMut},
+    slice,
+};
+
+#[cfg(all(unix, target_pointer_width = "64"))]
+mod sys {
+    use std::ffi::c_void;
+
+    pub const PROT_READ: i32 = 1;
+    pub const PROT_WRITE: i32 = 2;
+    pub const MAP_SHARED: i32 = 1;
+    pub const MAP_PRIVATE: i32 = 2;
+    pub const MAP_FAILED: *mut c_void = !0 as *mut c_void;
+    #[cfg(any(target_os = "linux", target_os = "android"))]
+    pub const MS_SYNC: i32 = 4;
+    #[cfg(target_vendor = "apple")]
+    pub const MS_SYNC: i32 = 0x10;
+
+    extern "C" {
+        pub fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: i32,
+            flags: i32,
+            fd: i32,
+            offset: i64,
+        ) -> *mut c_void;
+        pub fn munmap(addr: *mut c_void, len: usize) -> i32;
+        pub fn msync(addr: *mut c_void, len: usize, flags: i32) -> i32;
+    }
+}
+
+/// A read only memory mapping of a whole file.
+///
+/// The mapping is private, but like any mapping the contents are only stable
+/// as long as nothing truncates or rewrites the file underneath it.
+pub struct Mmap {
+    ptr: *const u8,
+    len: usize,
+}
+
+// SAFETY: the mapping is read only and owned by this value
+unsafe impl Send for Mmap {}
+unsafe impl Sync for Mmap {}
+
+impl Mmap {
+    #[cfg(all(unix, target_pointer_width = "64"))]
+    pub fn open(file: &File) -> io::Result<Self> {
+        use std::os::fd::AsRawFd;
+
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "empty file"));
+        }
+
+        // SAFETY: a fresh mapping with no address hint, checked below
+        let ptr = unsafe {
+            sys::mmap(
+                std::ptr::null_mut(),
+                len,
+                sys::PROT_READ,
+                sys::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == sys::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(Self {
+            ptr: ptr as *const u8,
+            len,
+        })
+    }
+
+    #[cfg(not(all(unix, target_pointer_width = "64")))]
+    pub fn open(_file: &File) -> io::Result<Self> {
+        Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "memory mapping is not supported on this platform",
+        ))
+    }
+}
+
+impl Deref for Mmap {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        // SAFETY: ptr..ptr + len is mapped for as long as self lives
+        unsafe { slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        #[cfg(all(unix, target_pointer_width = "64"))]
+        // SAFETY: unmapping exactly what open mapped
+        unsafe {
+            sys::munmap(self.ptr as *mut _, self.len);
+        }
+    }
+}
+
+/// A writable shared mapping of the start of a file, stores land straight
+/// in the page cache and the kernel writes them back on its own.
+pub struct MmapMut {
+    ptr: *mut u8,
+    len: usize,
+}
+
+// SAFETY: the mapping is owned by this value and only reachable through it
+unsafe impl Send for MmapMut {}
+unsafe impl Sync for MmapMut {}
+
+#[cfg(all(
+    target_pointer_width = "64",
+    any(target_os = "linux", target_os = "android", target_vendor = "apple")
+))]
+impl MmapMut {
+    /// Maps the first `len` bytes of `file`, which has to be open for reading
+    /// and writing. Shorter files are zero extended first.
+    pub fn open(file: &File, len: usize) -> io::Result<Self> {
+        use std::os::fd::AsRawFd;
+
+        if len == 0 {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "empty mapping"));
+        }
+        if file.metadata()?.len() < len as u64 {
+            file.set_len(len as u64)?;
+        }
+
+        // SAFETY: a fresh mapping with no address hint, checked below
+        let ptr = unsafe {
+            sys::mmap(
+                std::ptr::null_mut(),
+                len,
+                sys::PROT_READ | sys::PROT_WRITE,
+                sys::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == sys::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(Self {
+            ptr: ptr as *mut u8,
+            len,
+        })
+    }
+
+    /// Blocks until everything written so far is on disk.
+    pub fn flush(&self) -> io::Result<()> {
+        // SAFETY: syncing exactly what open mapped
+        match unsafe { sys::msync(self.ptr as *mut _, self.len, sys::MS_SYNC) } {
+            0 => Ok(()),
+            _ => Err(io::Error::last_os_error()),
+        }
+    }
+}
+
+#[cfg(not(all(
+    target_pointer_width = "64",
+    any(target_os = "linux", target_os = "android", target_vendor = "apple")
+)))]
+impl MmapMut {
+    pub fn open(_file: &File, _len: usize) -> io::Result<Self> {
+        Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "writable mappings are not supported on this platform",
+        ))
+    }
+
+    pub fn flush(&self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+impl Deref for MmapMut {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        // SAFETY: ptr..ptr + len is mapped for as long as self lives
+        unsafe { slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl DerefMut for MmapMut {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        // SAFETY: as above, and &mut self makes the access exclusive
+        unsafe { slice::from_raw_parts_mut(self.ptr, self.len) }
+    }
+}
+
+impl Drop for MmapMut {
+    fn drop(&mut self) {
+        #[cfg(all(unix, target_pointer_width = "64"))]
+        // SAFETY: unmapping exactly what open mapped
+        unsafe {
+            sys::munmap(self.ptr as *mut _, self.len);
+        }
+    }
+}
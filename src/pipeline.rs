@@ -0,0 +1,220 @@
+use std::{
+    cell::UnsafeCell,
+    sync::{
+        atomic::{AtomicBool, AtomicU8, Ordering},
+        Arc,
+    },
+    thread,
+};
+
+use crate::cpu::Cpu;
+use crate::ppu::{SCREEN_HEIGHT, SCREEN_WIDTH};
+use crate::ring;
+
+/// One screen of DMG shades, as `Ppu::frame` hands it out.
+pub type Frame = [u8; SCREEN_WIDTH * SCREEN_HEIGHT];
+
+/// set on the middle buffer index while the reader hasn't taken it
+const FRESH: u8 = 0x04;
+
+struct Buffers {
+    frames: [UnsafeCell<Box<Frame>>; 3],
+    /// index of the buffer neither side holds, plus `FRESH`
+    middle: AtomicU8,
+}
+
+// SAFETY: the writer only touches its back buffer and the reader its front
+// one, a buffer only changes hands through the swap of `middle`
+unsafe impl Sync for Buffers {}
+
+/// A triple buffer of frames. The writer always has a buffer to draw into
+/// and the reader always sees the newest finished frame, each handoff is a
+/// single atomic swap and neither side ever waits.
+pub fn frames() -> (FrameWriter, FrameReader) {
+    let buffers = Arc::new(Buffers {
+        frames: [(); 3].map(|_| UnsafeCell::new(Box::new([0; SCREEN_WIDTH * SCREEN_HEIGHT]))),
+        middle: AtomicU8::new(1),
+    });
+    let writer = FrameWriter {
+        buffers: buffers.clone(),
+        back: 0,
+    };
+    let reader = FrameReader { buffers, front: 2 };
+    (writer, reader)
+}
+
+pub struct FrameWriter {
+    buffers: Arc<Buffers>,
+    back: u8,
+}
+
+impl FrameWriter {
+    pub fn back_mut(&mut self) -> &mut Frame {
+        // SAFETY: the back buffer belongs to the writer until published
+        unsafe { &mut *self.buffers.frames[self.back as usize].get() }
+    }
+
+    /// Hands the back buffer to the reader, taking the middle one to draw
+    /// the next frame into. A frame the reader never took is dropped.
+    pub fn publish(&mut self) {
+        let middle = self
+            .buffers
+            .middle
+            .swap(self.back | FRESH, Ordering::AcqRel);
+        self.back = middle & !FRESH;
+    }
+}
+
+pub struct FrameReader {
+    buffers: Arc<Buffers>,
+    front: u8,
+}
+
+impl FrameReader {
+    /// The newest published frame, or `None` if there's been none since the
+    /// last call.
+    pub fn latest(&mut self) -> Option<&Frame> {
+        if self.buffers.middle.load(Ordering::Relaxed) & FRESH == 0 {
+            return None;
+        }
+        let middle = self.buffers.middle.swap(self.front, Ordering::AcqRel);
+        self.front = middle & !FRESH;
+        Some(self.front())
+    }
+
+    /// The frame taken by the last successful `latest`.
+    pub fn front(&self) -> &Frame {
+        // SAFETY: the front buffer belongs to the reader until swapped back
+        unsafe { &*self.buffers.frames[self.front as usize].get() }
+    }
+}
+
+/// Where a pipelined run sends its output. Both callbacks run on threads of
+/// their own, so blocking in them, on vsync or a full audio device, never
+/// holds up emulation.
+pub struct Frontend<P, A> {
+    /// Called with every frame that's new by the time the last one was
+    /// presented, returning false ends the run.
+    pub present: P,
+    /// Called with interleaved stereo samples as they're made.
+    pub play: A,
+    pub sample_rate: u32,
+}
+
+/// Runs `frames` frames of `cpu` on the calling thread with presentation and
+/// audio on one thread each, returning the frames actually run.
+///
+/// The core never waits on either. Frames go through a triple buffer, late
+/// ones are skipped, and samples through a ring holding a fifth of a second,
+/// which drops what the audio thread doesn't keep up with. Nothing is
+/// allocated per frame. The core runs unthrottled, pacing is up to the
+/// callbacks.
+pub fn run<P, A>(cpu: &mut Cpu, frames: u64, frontend: Frontend<P, A>) -> u64
+where
+    P: FnMut(&Frame) -> bool + Send,
+    A: FnMut(&[i16]) + Send,
+{
+    let Frontend {
+        mut present,
+        mut play,
+        sample_rate,
+    } = frontend;
+    let (mut writer, mut reader) = self::frames();
+    let (samples, mut consumer) = ring::channel(sample_rate as usize / 5 * 2);
+    let running = AtomicBool::new(true);
+    cpu.attach_audio(samples, sample_rate);
+
+    let ran = thread::scope(|scope| {
+        let presenter = scope.spawn(|| {
+            while running.load(Ordering::Acquire) {
+                match reader.latest() {
+                    Some(frame) if !present(frame) => running.store(false, Ordering::Release),
+                    Some(_) => (),
+                    None => thread::park(),
+                }
+            }
+        });
+        let audio = scope.spawn(|| {
+            let mut buffer = vec![0; consumer.capacity()];
+            loop {
+                // one last drain once the core is done
+                let last = !running.load(Ordering::Acquire);
+                match consumer.pop_slice(&mut buffer) {
+                    0 if last => return,
+                    0 => thread::park(),
+                    count => play(&buffer[..count]),
+                }
+            }
+        });
+
+        let mut ran = 0;
+        while ran < frames && running.load(Ordering::Acquire) {
+            cpu.run_frame();
+            ran += 1;
+            if cpu.ppu().last_frame_rendered() {
+                writer.back_mut().copy_from_slice(cpu.ppu().frame());
+                writer.publish();
+                presenter.thread().unpark();
+            }
+            audio.thread().unpark();
+        }
+        running.store(false, Ordering::Release);
+        presenter.thread().unpark();
+        audio.thread().unpark();
+        ran
+    });
+    cpu.detach_audio();
+    ran
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn publish(writer: &mut FrameWriter, shade: u8) {
+        writer.back_mut().fill(shade);
+        writer.publish();
+    }
+
+    #[test]
+    fn reader_gets_the_newest_frame_once() {
+        let (mut writer, mut reader) = frames();
+        assert!(reader.latest().is_none());
+        publish(&mut writer, 1);
+        assert_eq!(reader.latest().unwrap()[0], 1);
+        assert!(reader.latest().is_none());
+        assert_eq!(reader.front()[0], 1);
+
+        // frames the reader never took are dropped
+        for shade in 2..6 {
+            publish(&mut writer, shade);
+        }
+        assert_eq!(reader.latest().unwrap()[0], 5);
+        // drawing never touches the frame the reader holds
+        publish(&mut writer, 6);
+        writer.back_mut().fill(7);
+        assert!(reader.front().iter().all(|shade| *shade == 5));
+        assert_eq!(reader.latest().unwrap()[0], 6);
+    }
+
+    #[test]
+    fn frames_are_never_torn() {
+        let (mut writer, mut reader) = frames();
+        let drawer = thread::spawn(move || {
+            for frame in 0..2000u32 {
+                publish(&mut writer, frame as u8);
+            }
+        });
+        let mut seen = 0;
+        while !drawer.is_finished() || seen == 0 {
+            match reader.latest() {
+                Some(frame) => {
+                    assert!(frame.iter().all(|shade| *shade == frame[0]));
+                    seen += 1;
+                }
+                None => thread::yield_now(),
+            }
+        }
+        drawer.join().unwrap();
+    }
+}
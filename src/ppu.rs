@@ -0,0 +1,669 @@
+use std::ops::Range;
+
+use crate::cpu::Interrupt;
+use crate::state::{StateError, StateReader, StateWriter, PPU_OFFSET};
+
+pub const SCREEN_WIDTH: usize = 160;
+pub const SCREEN_HEIGHT: usize = 144;
+
+// all timings in M-cycles
+const LINE_CYCLES: u64 = 114;
+const OAM_CYCLES: u64 = 20;
+const DRAW_CYCLES: u64 = 43;
+const LINES: u8 = 154;
+
+// io register indexes
+const IF: usize = 0x0f;
+const LCDC: usize = 0x40;
+const STAT: usize = 0x41;
+const SCY: usize = 0x42;
+const SCX: usize = 0x43;
+const LY: usize = 0x44;
+const LYC: usize = 0x45;
+const BGP: usize = 0x47;
+const OBP0: usize = 0x48;
+const OBP1: usize = 0x49;
+const WY: usize = 0x4a;
+const WX: usize = 0x4b;
+
+/// tiles in the tile data of one vram bank
+const BANK_TILES: usize = 384;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Mode {
+    HBlank = 0,
+    VBlank = 1,
+    OamScan = 2,
+    Drawing = 3,
+}
+
+/// Which frames get their pixels composed. Timing, LY/STAT and interrupts
+/// are exact either way, skipped frames just leave the last one in place.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum RenderPolicy {
+    Always,
+    /// headless, only frames asked for with `request_frame` are drawn
+    Never,
+    /// every nth frame counting from 0, plus requested ones
+    EveryNth(u32),
+}
+
+/// Renders whole scanlines at the end of mode 3 rather than dot by dot.
+///
+/// Tiles are decoded once into rows of 8 palette indices and kept until the
+/// bus reports a write to their tile data. A write to a ppu register while
+/// a line is being drawn first renders the line up to that point with the
+/// old value, so mid-line raster effects still land.
+///
+/// The registers themselves live in the bus io registers, the ppu only
+/// holds its position in the frame.
+pub struct Ppu {
+    mode: Mode,
+    /// cycle the current line started on
+    line_start: u64,
+    next_event: u64,
+    window_line: u8,
+    window_used: bool,
+    stat_line: bool,
+    /// pixels of the current line already drawn
+    rendered_x: u8,
+    frames: u64,
+    policy: RenderPolicy,
+    requested: bool,
+    /// whether the frame in progress is being drawn
+    composing: bool,
+    last_composed: bool,
+    line_bg: [u8; SCREEN_WIDTH],
+    tiles: Box<[[u64; 8]; BANK_TILES * 2]>,
+    dirty_tiles: [u64; BANK_TILES * 2 / 64],
+    frame: Box<[u8; SCREEN_WIDTH * SCREEN_HEIGHT]>,
+}
+
+impl Ppu {
+    /// Starts with the lcd off, it comes on with the first LCDC write.
+    pub(crate) fn new() -> Self {
+        Self {
+            mode: Mode::HBlank,
+            line_start: 0,
+            next_event: u64::MAX,
+            window_line: 0,
+            window_used: false,
+            stat_line: false,
+            rendered_x: 0,
+            frames: 0,
+            policy: RenderPolicy::Always,
+            requested: false,
+            composing: true,
+            last_composed: false,
+            line_bg: [0; SCREEN_WIDTH],
+            tiles: Box::new([[0; 8]; BANK_TILES * 2]),
+            dirty_tiles: [u64::MAX; BANK_TILES * 2 / 64],
+            frame: Box::new([0; SCREEN_WIDTH * SCREEN_HEIGHT]),
+        }
+    }
+
+    pub fn mode(&self) -> Mode {
+        self.mode
+    }
+
+    /// Frames finished since power on.
+    pub fn frames(&self) -> u64 {
+        self.frames
+    }
+
+    /// Whether the frame that finished last was drawn, otherwise `frame`
+    /// still holds an older one.
+    pub fn last_frame_rendered(&self) -> bool {
+        self.last_composed
+    }
+
+    pub fn render_policy(&self) -> RenderPolicy {
+        self.policy
+    }
+
+    /// Takes effect from the next frame.
+    pub(crate) fn set_render_policy(&mut self, policy: RenderPolicy) {
+        self.policy = policy;
+    }
+
+    /// Draws the next frame whatever the policy says.
+    pub(crate) fn request_frame(&mut self) {
+        self.requested = true;
+    }
+
+    /// The last drawn frame as DMG shades, 0 is white and 3 black, row by row.
+    pub fn frame(&self) -> &[u8; SCREEN_WIDTH * SCREEN_HEIGHT] {
+        &self.frame
+    }
+
+    #[inline(always)]
+    pub(crate) fn next_event(&self) -> u64 {
+        self.next_event
+    }
+
+    /// Runs every mode change up to `now`.
+    pub(crate) fn advance(
+        &mut self,
+        now: u64,
+        v_ram: &[[u8; 0x2000]; 2],
+        oam: &[u8; 0xa0],
+        io: &mut [u8; 0x80],
+    ) {
+        while now >= self.next_event {
+            match self.mode {
+                Mode::OamScan => {
+                    self.set_mode(Mode::Drawing, io);
+                    self.rendered_x = 0;
+                    self.window_used = false;
+                    self.next_event = self.line_start + OAM_CYCLES + DRAW_CYCLES;
+                }
+                Mode::Drawing => {
+                    self.render(SCREEN_WIDTH as u8, v_ram, oam, io);
+                    if self.window_used {
+                        self.window_line += 1;
+                    }
+                    self.set_mode(Mode::HBlank, io);
+                    self.next_event = self.line_start + LINE_CYCLES;
+                }
+                Mode::HBlank | Mode::VBlank => {
+                    self.line_start += LINE_CYCLES;
+                    self.next_event = self.line_start + LINE_CYCLES;
+                    io[LY] = (io[LY] + 1) % LINES;
+                    match io[LY] as usize {
+                        0 => self.start_frame(io),
+                        SCREEN_HEIGHT => {
+                            self.frames += 1;
+                            self.last_composed = self.composing;
+                            io[IF] |= Interrupt::VBlank as u8;
+                            self.set_mode(Mode::VBlank, io);
+                        }
+                        ly if ly < SCREEN_HEIGHT => {
+                            self.set_mode(Mode::OamScan, io);
+                            self.next_event = self.line_start + OAM_CYCLES;
+                        }
+                        _ => self.update_stat(io),
+                    }
+                }
+            }
+        }
+    }
+
+    /// Handles a write to one of LCDC..=WX, apart from DMA.
+    pub(crate) fn write_register(
+        &mut self,
+        now: u64,
+        index: usize,
+        value: u8,
+        v_ram: &[[u8; 0x2000]; 2],
+        oam: &[u8; 0xa0],
+        io: &mut [u8; 0x80],
+    ) {
+        self.advance(now, v_ram, oam, io);
+        if self.mode == Mode::Drawing {
+            let x = (now - self.line_start - OAM_CYCLES) * 4;
+            self.render(x.min(SCREEN_WIDTH as u64) as u8, v_ram, oam, io);
+        }
+
+        match index {
+            LCDC => {
+                let was_on = io[LCDC] & 0x80 != 0;
+                io[LCDC] = value;
+                match (was_on, value & 0x80 != 0) {
+                    (false, true) => {
+                        self.line_start = now;
+                        self.start_frame(io);
+                    }
+                    (true, false) => {
+                        io[LY] = 0;
+                        io[STAT] &= !0x03;
+                        self.mode = Mode::HBlank;
+                        self.stat_line = false;
+                        self.next_event = u64::MAX;
+                    }
+                    _ => (),
+                }
+            }
+            STAT => io[STAT] = 0x80 | (value & 0x78) | (io[STAT] & 0x07),
+            // read only
+            LY => (),
+            _ => io[index] = value,
+        }
+        if io[LCDC] & 0x80 != 0 {
+            self.update_stat(io);
+        }
+    }
+
+    /// Drops the decoded copy of the tile holding `offset` in vram `bank`.
+    #[inline(always)]
+    pub(crate) fn tile_written(&mut self, bank: usize, offset: usize) {
+        let tile = bank * BANK_TILES + offset / 16;
+        self.dirty_tiles[tile / 64] |= 1 << (tile % 64);
+    }
+
+    fn start_frame(&mut self, io: &mut [u8; 0x80]) {
+        io[LY] = 0;
+        self.window_line = 0;
+        self.composing = self.wants_frame();
+        self.requested = false;
+        self.set_mode(Mode::OamScan, io);
+        self.next_event = self.line_start + OAM_CYCLES;
+    }
+
+    fn set_mode(&mut self, mode: Mode, io: &mut [u8; 0x80]) {
+        self.mode = mode;
+        io[STAT] = (io[STAT] & !0x03) | mode as u8;
+        self.update_stat(io);
+    }
+
+    fn wants_frame(&self) -> bool {
+        self.requested
+            || match self.policy {
+                RenderPolicy::Always => true,
+                RenderPolicy::Never => false,
+                RenderPolicy::EveryNth(n) => self.frames.is_multiple_of(n.max(1) as u64),
+            }
+    }
+
+    /// Refreshes the coincidence flag and raises the STAT interrupt on the
+    /// rising edge of the combined interrupt line.
+    fn update_stat(&mut self, io: &mut [u8; 0x80]) {
+        let coincidence = io[LY] == io[LYC];
+        io[STAT] = (io[STAT] & !0x04) | (coincidence as u8) << 2;
+
+        let stat = io[STAT];
+        let line = (stat & 0x40 != 0 && coincidence)
+            || match self.mode {
+                Mode::HBlank => stat & 0x08 != 0,
+                Mode::VBlank => stat & 0x10 != 0,
+                Mode::OamScan => stat & 0x20 != 0,
+                Mode::Drawing => false,
+            };
+        if line && !self.stat_line {
+            io[IF] |= Interrupt::LCD as u8;
+        }
+        self.stat_line = line;
+    }
+
+    /// Draws the current line from `rendered_x` up to `to`.
+    fn render(&mut self, to: u8, v_ram: &[[u8; 0x2000]; 2], oam: &[u8; 0xa0], io: &[u8; 0x80]) {
+        let (from, to) = (self.rendered_x as usize, to as usize);
+        if from >= to || !self.composing {
+            return;
+        }
+        self.rendered_x = to as u8;
+
+        let ly = io[LY];
+        let lcdc = io[LCDC];
+        let row = ly as usize * SCREEN_WIDTH;
+
+        if lcdc & 0x01 == 0 {
+            self.line_bg[from..to].fill(0);
+        } else {
+            let window_x = io[WX] as usize;
+            let window = lcdc & 0x20 != 0 && ly >= io[WY] && window_x < SCREEN_WIDTH + 7;
+            // the window covers the rest of the line once it starts
+            let split = match window {
+                true => (window_x.saturating_sub(7)).clamp(from, to),
+                false => to,
+            };
+
+            let map = if lcdc & 0x08 != 0 { 0x1c00 } else { 0x1800 };
+            let y = ly.wrapping_add(io[SCY]);
+            let scx = io[SCX];
+            self.render_tiles(
+                from..split,
+                map,
+                y,
+                |x| (x as u8).wrapping_add(scx),
+                v_ram,
+                lcdc,
+            );
+
+            if split < to {
+                let map = if lcdc & 0x40 != 0 { 0x1c00 } else { 0x1800 };
+                let y = self.window_line;
+                // x + 7 - wx, wx below 7 pushes the window left
+                let offset = 7 - window_x as isize;
+                self.render_tiles(
+                    split..to,
+                    map,
+                    y,
+                    |x| (x as isize + offset) as u8,
+                    v_ram,
+                    lcdc,
+                );
+                self.window_used = true;
+            }
+        }
+
+        // with the background off it shows as white whatever the palette
+        let shades = match lcdc & 0x01 != 0 {
+            true => palette(io[BGP]),
+            false => [0; 4],
+        };
+        let frame = &mut self.frame[row..row + SCREEN_WIDTH];
+        for (pixel, index) in frame[from..to].iter_mut().zip(&self.line_bg[from..to]) {
+            *pixel = shades[*index as usize];
+        }
+
+        if lcdc & 0x02 != 0 {
+            self.render_sprites(from, to, v_ram, oam, io);
+        }
+    }
+
+    /// Fills `line_bg[columns]` from the tile map at `map`, `x` gives the
+    /// map column of each screen column.
+    fn render_tiles(
+        &mut self,
+        columns: Range<usize>,
+        map: usize,
+        y: u8,
+        x: impl Fn(usize) -> u8,
+        v_ram: &[[u8; 0x2000]; 2],
+        lcdc: u8,
+    ) {
+        let map_row = map + (y as usize / 8) * 32;
+        let (mut screen_x, to) = (columns.start, columns.end);
+        while screen_x < to {
+            let map_x = x(screen_x);
+            let index = v_ram[0][map_row + map_x as usize / 8];
+            let tile = match lcdc & 0x10 != 0 {
+                true => index as usize,
+                false => (256 + index as i8 as isize) as usize,
+            };
+            let pixels = self.tile_row(tile, y as usize % 8, v_ram).to_le_bytes();
+
+            let fine = map_x as usize % 8;
+            let count = (8 - fine).min(to - screen_x);
+            self.line_bg[screen_x..screen_x + count].copy_from_slice(&pixels[fine..fine + count]);
+            screen_x += count;
+        }
+    }
+
+    fn render_sprites(
+        &mut self,
+        from: usize,
+        to: usize,
+        v_ram: &[[u8; 0x2000]; 2],
+        oam: &[u8; 0xa0],
+        io: &[u8; 0x80],
+    ) {
+        let ly = io[LY] as usize;
+        let height = if io[LCDC] & 0x04 != 0 { 16 } else { 8 };
+
+        // the first 10 sprites on the line in oam order, then by x for the
+        // dmg priority rules
+        let mut sprites = [(0u8, 0u8); 10];
+        let mut count = 0;
+        for (index, sprite) in oam.chunks_exact(4).enumerate() {
+            let top = sprite[0] as usize;
+            if ly + 16 >= top && ly + 16 < top + height {
+                sprites[count] = (sprite[1], index as u8);
+                count += 1;
+                if count == sprites.len() {
+                    break;
+                }
+            }
+        }
+        let sprites = &mut sprites[..count];
+        sprites.sort_unstable();
+
+        let palettes = [palette(io[OBP0]), palette(io[OBP1])];
+        let row = ly * SCREEN_WIDTH;
+        let mut claimed = [false; SCREEN_WIDTH];
+        for &(x, index) in sprites.iter() {
+            let sprite = &oam[index as usize * 4..index as usize * 4 + 4];
+            let attributes = sprite[3];
+
+            let mut line = ly + 16 - sprite[0] as usize;
+            if attributes & 0x40 != 0 {
+                line = height - 1 - line;
+            }
+            let tile = match height {
+                16 => (sprite[2] & 0xfe) as usize + line / 8,
+                _ => sprite[2] as usize,
+            };
+            let mut pixels = self.tile_row(tile, line % 8, v_ram);
+            if attributes & 0x20 != 0 {
+                pixels = pixels.swap_bytes();
+            }
+
+            let shades = palettes[(attributes >> 4 & 1) as usize];
+            let behind = attributes & 0x80 != 0;
+            for (i, index) in pixels.to_le_bytes().into_iter().enumerate() {
+                let screen_x = x as usize + i;
+                if screen_x < 8 || !(from + 8..to + 8).contains(&screen_x) {
+                    continue;
+                }
+                let screen_x = screen_x - 8;
+                if index == 0 || claimed[screen_x] {
+                    continue;
+                }
+                claimed[screen_x] = true;
+                if !(behind && self.line_bg[screen_x] != 0) {
+                    self.frame[row + screen_x] = shades[index as usize];
+                }
+            }
+        }
+    }
+
+    /// Row `y` of `tile` in vram bank 0 as 8 palette indices, leftmost pixel
+    /// in the low byte.
+    #[inline(always)]
+    fn tile_row(&mut self, tile: usize, y: usize, v_ram: &[[u8; 0x2000]; 2]) -> u64 {
+        if self.dirty_tiles[tile / 64] & 1 << (tile % 64) != 0 {
+            self.decode_tile(tile, v_ram);
+        }
+        self.tiles[tile][y]
+    }
+
+    #[cold]
+    fn decode_tile(&mut self, tile: usize, v_ram: &[[u8; 0x2000]; 2]) {
+        self.dirty_tiles[tile / 64] &= !(1 << (tile % 64));
+        let bank = &v_ram[tile / BANK_TILES];
+        let data = &bank[(tile % BANK_TILES) * 16..][..16];
+        for (row, bytes) in self.tiles[tile].iter_mut().zip(data.chunks_exact(2)) {
+            *row = spread(bytes[0]) | spread(bytes[1]) << 1;
+        }
+    }
+
+    pub(crate) fn save_state(&self, w: &mut StateWriter) {
+        w.seek(PPU_OFFSET);
+        w.u8(self.mode as u8);
+        w.u64(self.line_start);
+        w.u64(self.next_event);
+        w.u8(self.window_line);
+        w.bool(self.window_used);
+        w.bool(self.stat_line);
+        w.u8(self.rendered_x);
+        w.u64(self.frames);
+    }
+
+    pub(crate) fn check_state(&self, r: &mut StateReader) -> Result<(), StateError> {
+        r.seek(PPU_OFFSET);
+        r.u8_in(0..=Mode::Drawing as u8)?;
+        r.bytes(8 * 2 + 1);
+        r.u8_in(0..=1)?;
+        r.u8_in(0..=1)?;
+        r.u8_in(0..=SCREEN_WIDTH as u8)?;
+        Ok(())
+    }
+
+    pub(crate) fn load_state(&mut self, r: &mut StateReader) {
+        r.seek(PPU_OFFSET);
+        self.mode = match r.u8() & 0x03 {
+            0 => Mode::HBlank,
+            1 => Mode::VBlank,
+            2 => Mode::OamScan,
+            _ => Mode::Drawing,
+        };
+        self.line_start = r.u64();
+        self.next_event = r.u64();
+        self.window_line = r.u8();
+        self.window_used = r.bool();
+        self.stat_line = r.bool();
+        self.rendered_x = r.u8();
+        self.frames = r.u64();
+        // lines before the load are gone, draw the rest if this frame counts
+        self.composing = self.wants_frame();
+        self.dirty_tiles = [u64::MAX; BANK_TILES * 2 / 64];
+    }
+
+    pub(crate) fn clone_state_from(&mut self, other: &Ppu) {
+        self.mode = other.mode;
+        self.line_start = other.line_start;
+        self.next_event = other.next_event;
+        self.window_line = other.window_line;
+        self.window_used = other.window_used;
+        self.stat_line = other.stat_line;
+        self.rendered_x = other.rendered_x;
+        self.frames = other.frames;
+        self.composing = other.composing;
+        self.last_composed = other.last_composed;
+        self.line_bg = other.line_bg;
+        self.frame.copy_from_slice(&other.frame[..]);
+        self.dirty_tiles = [u64::MAX; BANK_TILES * 2 / 64];
+    }
+}
+
+/// Shade of each of the 4 colour indices.
+fn palette(register: u8) -> [u8; 4] {
+    [
+        register & 3,
+        register >> 2 & 3,
+        register >> 4 & 3,
+        register >> 6 & 3,
+    ]
+}
+
+/// Spreads the bits of `byte` into the low bit of each byte of the result,
+/// msb into the lowest byte, so a 2bpp tile row decodes without a loop.
+#[inline(always)]
+fn spread(byte: u8) -> u64 {
+    let bits = (byte as u64 * 0x0101_0101_0101_0101) & 0x0102_0408_1020_4080;
+    ((bits + 0x7f7f_7f7f_7f7f_7f7f) & 0x8080_8080_8080_8080) >> 7
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A ppu with the lcd on from cycle 0 and the memory it draws from.
+    struct Screen {
+        ppu: Ppu,
+        v_ram: Box<[[u8; 0x2000]; 2]>,
+        oam: [u8; 0xa0],
+        io: [u8; 0x80],
+    }
+
+    impl Screen {
+        fn new(lcdc: u8) -> Self {
+            let mut screen = Self {
+                ppu: Ppu::new(),
+                v_ram: Box::new([[0; 0x2000]; 2]),
+                oam: [0; 0xa0],
+                io: [0; 0x80],
+            };
+            screen.write(0, BGP, 0xe4);
+            screen.write(0, LCDC, lcdc);
+            screen
+        }
+
+        fn write(&mut self, now: u64, index: usize, value: u8) {
+            let Screen {
+                ppu,
+                v_ram,
+                oam,
+                io,
+            } = self;
+            ppu.write_register(now, index, value, v_ram, oam, io);
+        }
+
+        /// Sets row `y` of `tile` the way a vram write through the bus does.
+        fn write_tile_row(&mut self, tile: usize, y: usize, low: u8, high: u8) {
+            let offset = tile * 16 + y * 2;
+            self.v_ram[0][offset..offset + 2].copy_from_slice(&[low, high]);
+            self.ppu.tile_written(0, offset);
+            self.ppu.tile_written(0, offset + 1);
+        }
+
+        /// Runs to the end of mode 3 on `ly`, returning the drawn line.
+        fn draw_line(&mut self, ly: usize) -> [u8; SCREEN_WIDTH] {
+            let end = ly as u64 * LINE_CYCLES + OAM_CYCLES + DRAW_CYCLES;
+            let Screen {
+                ppu,
+                v_ram,
+                oam,
+                io,
+            } = self;
+            ppu.advance(end, v_ram, oam, io);
+            self.ppu.frame[ly * SCREEN_WIDTH..][..SCREEN_WIDTH]
+                .try_into()
+                .unwrap()
+        }
+    }
+
+    /// The palette indices of a 2bpp row, one bit plane at a time.
+    fn naive_row(low: u8, high: u8) -> [u8; 8] {
+        std::array::from_fn(|x| (low >> (7 - x) & 1) | (high >> (7 - x) & 1) << 1)
+    }
+
+    #[test]
+    fn spreads_every_tile_row() {
+        for low in 0..=255 {
+            for high in 0..=255 {
+                let row = spread(low) | spread(high) << 1;
+                assert_eq!(
+                    row.to_le_bytes(),
+                    naive_row(low, high),
+                    "{low:#x} {high:#x}"
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn draws_a_tile_and_redraws_it_once_written() {
+        let mut screen = Screen::new(0x91);
+        screen.write_tile_row(0, 0, 0x0f, 0x33);
+        let line = screen.draw_line(0);
+        let row = naive_row(0x0f, 0x33);
+        assert!(line.chunks_exact(8).all(|tile| tile == row));
+
+        // line 8 draws row 0 of the next map row, tile 0 again
+        screen.write_tile_row(0, 0, 0xa5, 0x3c);
+        let line = screen.draw_line(8);
+        let row = naive_row(0xa5, 0x3c);
+        assert!(line.chunks_exact(8).all(|tile| tile == row));
+    }
+
+    #[test]
+    fn scx_written_mid_line_moves_only_the_rest() {
+        let mut screen = Screen::new(0x91);
+        screen.write_tile_row(0, 0, 0xf0, 0x00);
+        // 10 cycles into mode 3, 40 pixels drawn
+        screen.write(OAM_CYCLES + 10, SCX, 4);
+        let line = screen.draw_line(0);
+        for (x, &pixel) in line.iter().enumerate() {
+            let scx = if x < 40 { 0 } else { 4 };
+            assert_eq!(pixel, ((x + scx) % 8 < 4) as u8, "pixel {x}");
+        }
+    }
+
+    #[test]
+    fn sprites_lower_on_x_win_and_hide_behind_the_background() {
+        let mut screen = Screen::new(0x93);
+        screen.write(0, OBP0, 0xe4);
+        screen.write(0, OBP1, 0x80);
+        screen.write_tile_row(0, 0, 0x0f, 0x00);
+        screen.write_tile_row(1, 0, 0xff, 0xff);
+        // sprite 0 sits on 4..12 behind the background in OBP1, sprite 1 on
+        // 0..8 further left
+        screen.oam[..8].copy_from_slice(&[16, 12, 1, 0x90, 16, 8, 1, 0x00]);
+        let line = screen.draw_line(0);
+        assert_eq!(line[..8], [3; 8]);
+        assert_eq!(line[8..12], [2; 4]);
+        assert_eq!(line[12..16], [1; 4]);
+        assert_eq!(line[16..20], [0; 4]);
+    }
+}
@@ -0,0 +1,235 @@
+use std::io;
+
+#[cfg(feature = "profile")]
+mod counters {
+    use std::{
+        env,
+        fs::File,
+        io::{self, BufWriter, Write},
+        sync::atomic::{AtomicU64, Ordering},
+    };
+
+    use crate::cpu::{Instruction, CB_INSTRUCTION_TABLE, INSTRUCTION_TABLE};
+
+    /// bytes of rom per pc hotspot bucket
+    const BUCKET: usize = 64;
+    /// enough for the 512 banks of an 8MiB MBC5 cart
+    const ROM_BANKS: usize = 512;
+
+    const REGIONS: [&str; 12] = [
+        "rom0", "romx", "vram", "sram", "wram0", "wramx", "echo", "oam", "unusable", "io", "hram",
+        "ie",
+    ];
+
+    // plain statics rather than per thread, so every instance of a fleet
+    // lands in the one dump
+    static OPCODES: [AtomicU64; 256] = [const { AtomicU64::new(0) }; 256];
+    static CB_OPCODES: [AtomicU64; 256] = [const { AtomicU64::new(0) }; 256];
+    /// reads then writes, by region
+    static ACCESSES: [[AtomicU64; REGIONS.len()]; 2] =
+        [const { [const { AtomicU64::new(0) }; REGIONS.len()] }; 2];
+    static ROM_PC: [[AtomicU64; 0x4000 / BUCKET]; ROM_BANKS] =
+        [const { [const { AtomicU64::new(0) }; 0x4000 / BUCKET] }; ROM_BANKS];
+    /// code running from anywhere past the rom, by page
+    static RAM_PC: [AtomicU64; 0x80] = [const { AtomicU64::new(0) }; 0x80];
+
+    fn count(counter: &AtomicU64) {
+        counter.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn instruction(pc: u16, bank: Option<u16>, opcode: u8) {
+        count(&OPCODES[opcode as usize]);
+        match (pc, bank) {
+            (0x0000..=0x7fff, Some(bank)) => {
+                let bucket = (pc as usize & 0x3fff) / BUCKET;
+                count(&ROM_PC[bank as usize % ROM_BANKS][bucket]);
+            }
+            _ => count(&RAM_PC[pc.wrapping_sub(0x8000) as usize >> 8 & 0x7f]),
+        }
+    }
+
+    pub fn cb_instruction(opcode: u8) {
+        count(&CB_OPCODES[opcode as usize]);
+    }
+
+    pub fn access(addr: u16, write: bool) {
+        let region = match addr {
+            0x0000..=0x3fff => 0,
+            0x4000..=0x7fff => 1,
+            0x8000..=0x9fff => 2,
+            0xa000..=0xbfff => 3,
+            0xc000..=0xcfff => 4,
+            0xd000..=0xdfff => 5,
+            0xe000..=0xfdff => 6,
+            0xfe00..=0xfe9f => 7,
+            0xfea0..=0xfeff => 8,
+            0xff00..=0xff7f => 9,
+            0xff80..=0xfffe => 10,
+            0xffff => 11,
+        };
+        count(&ACCESSES[write as usize][region]);
+    }
+
+    /// The function `Cpu::handler` picks for `opcode`.
+    fn handler_name(opcode: u8) -> &'static str {
+        match opcode {
+            0x00 => "nop",
+            0x10 => "stop",
+            0x76 => "halt",
+            0xf3 => "disable_interrupts",
+            0xfb => "enable_interrupts",
+            0xcb => "prefix",
+            0x01 | 0x11 | 0x21 | 0x31 => "load_wide",
+            0x02 | 0x12 | 0x22 | 0x32 | 0x0a | 0x1a | 0x2a | 0x3a => "load_indirect",
+            0x03 | 0x13 | 0x23 | 0x33 => "increment_wide",
+            0x0b | 0x1b | 0x2b | 0x3b => "decrement_wide",
+            0x09 | 0x19 | 0x29 | 0x39 => "add_hl",
+            0x08 => "store_stack_pointer",
+            0x04 | 0x14 | 0x24 | 0x34 | 0x0c | 0x1c | 0x2c | 0x3c => "increment",
+            0x05 | 0x15 | 0x25 | 0x35 | 0x0d | 0x1d | 0x2d | 0x3d => "decrement",
+            0x06 | 0x16 | 0x26 | 0x36 | 0x0e | 0x1e | 0x2e | 0x3e | 0x40..=0x7f => "load",
+            0x07 | 0x0f | 0x17 | 0x1f => "shift",
+            0x27 => "decimal_adjust_accumulator",
+            0x2f => "complement_accumulator",
+            0x37 => "set_carry_flag",
+            0x3f => "complement_carry_flag",
+            0x18 | 0x20 | 0x28 | 0x30 | 0x38 => "jump_relative",
+            0x80..=0xbf | 0xc6 | 0xce | 0xd6 | 0xde | 0xe6 | 0xee | 0xf6 | 0xfe => "alu",
+            0xc0 | 0xc8 | 0xd0 | 0xd8 | 0xc9 => "ret",
+            0xd9 => "return_interrupt",
+            0xc2 | 0xca | 0xd2 | 0xda | 0xc3 => "jump",
+            0xe9 => "jump_hl",
+            0xc4 | 0xcc | 0xd4 | 0xdc | 0xcd => "call",
+            0xc1 | 0xd1 | 0xe1 | 0xf1 => "pop",
+            0xc5 | 0xd5 | 0xe5 | 0xf5 => "push",
+            0xc7 | 0xcf | 0xd7 | 0xdf | 0xe7 | 0xef | 0xf7 | 0xff => "restart_vector",
+            0xe0 | 0xf0 | 0xe2 | 0xf2 => "load_high",
+            0xea | 0xfa => "load_absolute",
+            0xe8 => "add_sp",
+            0xf8 => "load_hl_sp",
+            0xf9 => "load_sp_hl",
+            _ => "illegal",
+        }
+    }
+
+    fn cb_handler_name(opcode: u8) -> &'static str {
+        ["shift", "bit", "reset_bit", "set_bit"][opcode as usize >> 6]
+    }
+
+    fn variant(instruction: &Instruction) -> String {
+        let mut name = format!("{:?}", instruction);
+        name.truncate(name.find('(').unwrap_or(name.len()));
+        name
+    }
+
+    /// Adds `count` to `key`, keeping keys in the order first seen.
+    fn tally(totals: &mut Vec<(String, u64)>, key: String, count: u64) {
+        match totals.iter_mut().find(|(seen, _)| *seen == key) {
+            Some((_, total)) => *total += count,
+            None => totals.push((key, count)),
+        }
+    }
+
+    pub fn dump() -> io::Result<()> {
+        let path = env::var_os("CASH_GB_PROFILE").unwrap_or("profile.csv".into());
+        let mut out = BufWriter::new(File::create(path)?);
+        writeln!(out, "kind,key,count")?;
+
+        let (mut variants, mut handlers) = (vec![], vec![]);
+        let tables = [
+            (
+                &OPCODES,
+                "opcode",
+                &INSTRUCTION_TABLE,
+                handler_name as fn(u8) -> _,
+            ),
+            (
+                &CB_OPCODES,
+                "cb_opcode",
+                &CB_INSTRUCTION_TABLE,
+                cb_handler_name,
+            ),
+        ];
+        for (counts, kind, instructions, handler) in tables {
+            for (opcode, counter) in counts.iter().enumerate() {
+                let count = counter.load(Ordering::Relaxed);
+                if count == 0 {
+                    continue;
+                }
+                writeln!(out, "{kind},{opcode:#04x},{count}")?;
+                // the prefix is its own instruction, its CB opcode is too
+                tally(&mut variants, variant(&instructions[opcode]), count);
+                tally(&mut handlers, handler(opcode as u8).to_string(), count);
+            }
+        }
+        for (name, count) in variants {
+            writeln!(out, "instruction,{name},{count}")?;
+        }
+        for (name, count) in handlers {
+            writeln!(out, "handler,{name},{count}")?;
+        }
+
+        for (kind, accesses) in ["read", "write"].iter().zip(&ACCESSES) {
+            for (region, counter) in REGIONS.iter().zip(accesses) {
+                writeln!(out, "{kind},{region},{}", counter.load(Ordering::Relaxed))?;
+            }
+        }
+
+        for (bank, buckets) in ROM_PC.iter().enumerate() {
+            for (bucket, counter) in buckets.iter().enumerate() {
+                let count = counter.load(Ordering::Relaxed);
+                // offsets into the bank, wherever it was mapped
+                if count != 0 {
+                    writeln!(out, "pc,rom:{bank:#x}+{:#06x},{count}", bucket * BUCKET)?;
+                }
+            }
+        }
+        for (page, counter) in RAM_PC.iter().enumerate() {
+            let count = counter.load(Ordering::Relaxed);
+            if count != 0 {
+                writeln!(out, "pc,{:#06x},{count}", 0x8000 + page * 0x100)?;
+            }
+        }
+        out.flush()
+    }
+}
+
+/// Runs its statement only when the `profile` feature is enabled.
+///
+/// Like `trace!` the check is a `cfg!`, so without the feature the counting
+/// and whatever it takes to work out its arguments compile away.
+macro_rules! profile {
+    ($($arg:tt)*) => {
+        if cfg!(feature = "profile") {
+            $($arg)*;
+        }
+    };
+}
+
+pub(crate) use profile;
+
+#[inline(always)]
+pub(crate) fn instruction(_pc: u16, _bank: Option<u16>, _opcode: u8) {
+    #[cfg(feature = "profile")]
+    counters::instruction(_pc, _bank, _opcode);
+}
+
+#[inline(always)]
+pub(crate) fn cb_instruction(_opcode: u8) {
+    #[cfg(feature = "profile")]
+    counters::cb_instruction(_opcode);
+}
+
+#[inline(always)]
+pub(crate) fn access(_addr: u16, _write: bool) {
+    #[cfg(feature = "profile")]
+    counters::access(_addr, _write);
+}
+
+/// Writes every count so far to `CASH_GB_PROFILE`, or `profile.csv`, as
+/// `kind,key,count` lines. Does nothing without the `profile` feature.
+pub fn dump() -> io::Result<()> {
+    #[cfg(feature = "profile")]
+    counters::dump()?;
+    Ok(())
+}
@@ -1,113 +1,165 @@
+// byte indexes, the order opcodes encode 8 bit operands in with F taking
+// the slot of (HL)
+const B: usize = 0;
+const C: usize = 1;
+const D: usize = 2;
+const E: usize = 3;
+const H: usize = 4;
+const L: usize = 5;
+const F: usize = 6;
+const A: usize = 7;
+
+/// The eight 8 bit registers in one array, indexed straight by the
+/// register field of an opcode.
+///
+/// The 16 bit pairs are views over neighbouring bytes in the order opcodes
+/// number them: BC, DE and HL high byte first, and AF as F then A so it
+/// reads the same little endian way round.
 #[derive(Clone, Copy)]
 pub struct Register {
-    af: u16,
-    bc: u16,
-    de: u16,
-    hl: u16,
+    bytes: [u8; 8],
 }
 
 impl Register {
     pub fn new() -> Self {
-        Self {
-            af: 0,
-            bc: 0,
-            de: 0,
-            hl: 0,
+        Self { bytes: [0; 8] }
+    }
+
+    /// The 8 bit register an opcode encodes as `index`, 6 is F.
+    #[inline(always)]
+    pub fn get(&self, index: u8) -> u8 {
+        self.bytes[index as usize & 7]
+    }
+
+    #[inline(always)]
+    pub fn set(&mut self, index: u8, value: u8) {
+        match index as usize & 7 {
+            F => self.set_f(value),
+            index => self.bytes[index] = value,
         }
     }
+
+    /// The pair an opcode encodes as `pair`, in BC, DE, HL, AF order.
+    #[inline(always)]
+    pub fn get_pair(&self, pair: u8) -> u16 {
+        match pair & 3 {
+            3 => u16::from_le_bytes([self.bytes[F], self.bytes[A]]),
+            pair => {
+                let high = pair as usize * 2;
+                u16::from_be_bytes([self.bytes[high], self.bytes[high + 1]])
+            }
+        }
+    }
+
+    #[inline(always)]
+    pub fn set_pair(&mut self, pair: u8, value: u16) {
+        match pair & 3 {
+            3 => {
+                let [f, a] = value.to_le_bytes();
+                self.set_f(f);
+                self.bytes[A] = a;
+            }
+            pair => {
+                let high = pair as usize * 2;
+                [self.bytes[high], self.bytes[high + 1]] = value.to_be_bytes();
+            }
+        }
+    }
+
     pub fn get_a(&self) -> u8 {
-        (self.af >> 8) as u8
+        self.bytes[A]
     }
 
     pub fn set_a(&mut self, value: u8) {
-        self.af = (self.af & 0x00fF) | (value as u16) << 8;
+        self.bytes[A] = value;
     }
 
     pub fn get_f(&self) -> u8 {
-        self.af as u8
+        self.bytes[F]
     }
 
+    /// The low nibble of F doesn't exist and always reads 0.
     pub fn set_f(&mut self, value: u8) {
-        self.af = (self.af & 0xff00) | value as u16;
+        self.bytes[F] = value & 0xf0;
     }
 
     pub fn get_af(&self) -> u16 {
-        self.af
+        self.get_pair(3)
     }
 
     pub fn set_af(&mut self, value: u16) {
-        self.af = value;
+        self.set_pair(3, value);
     }
 
     pub fn get_b(&self) -> u8 {
-        (self.bc >> 8) as u8
+        self.bytes[B]
     }
 
     pub fn set_b(&mut self, value: u8) {
-        self.bc = (self.bc & 0x00ff) | value as u16;
+        self.bytes[B] = value;
     }
 
     pub fn get_c(&self) -> u8 {
-        self.bc as u8
+        self.bytes[C]
     }
 
     pub fn set_c(&mut self, value: u8) {
-        self.bc = (self.bc & 0xff00) | value as u16;
+        self.bytes[C] = value;
     }
 
     pub fn get_bc(&self) -> u16 {
-        self.bc
+        self.get_pair(0)
     }
 
     pub fn set_bc(&mut self, value: u16) {
-        self.bc = value;
+        self.set_pair(0, value);
     }
 
     pub fn get_d(&self) -> u8 {
-        (self.de >> 8) as u8
+        self.bytes[D]
     }
 
     pub fn set_d(&mut self, value: u8) {
-        self.de = (self.de & 0x00ff) | value as u16;
+        self.bytes[D] = value;
     }
 
     pub fn get_e(&self) -> u8 {
-        self.de as u8
+        self.bytes[E]
     }
 
     pub fn set_e(&mut self, value: u8) {
-        self.de = (self.de & 0xff00) | value as u16;
+        self.bytes[E] = value;
     }
 
     pub fn get_de(&self) -> u16 {
-        self.de
+        self.get_pair(1)
     }
 
     pub fn set_de(&mut self, value: u16) {
-        self.de = value;
+        self.set_pair(1, value);
     }
 
     pub fn get_h(&self) -> u8 {
-        (self.hl >> 8) as u8
+        self.bytes[H]
     }
 
     pub fn set_h(&mut self, value: u8) {
-        self.hl = (self.hl & 0x00ff) | value as u16;
+        self.bytes[H] = value;
     }
 
     pub fn get_l(&self) -> u8 {
-        self.hl as u8
+        self.bytes[L]
     }
 
     pub fn set_l(&mut self, value: u8) {
-        self.hl = (self.hl & 0xff00) | value as u16;
+        self.bytes[L] = value;
     }
 
     pub fn get_hl(&self) -> u16 {
-        self.hl
+        self.get_pair(2)
     }
 
     pub fn set_hl(&mut self, value: u16) {
-        self.hl = value;
+        self.set_pair(2, value);
     }
 }
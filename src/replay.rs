@@ -0,0 +1,605 @@
+use std::{
+    fmt::Display,
+    io::{self, Read, Write},
+};
+
+use crate::cpu::Cpu;
+use crate::hash::MemoryHash;
+use crate::ppu::{SCREEN_HEIGHT, SCREEN_WIDTH};
+use crate::state::StateError;
+
+const LOG_MAGIC: [u8; 4] = *b"CGBI";
+const LOG_VERSION: u8 = 1;
+
+// event tags
+const INPUT: u8 = 0;
+const CHECKPOINT: u8 = 1;
+
+/// Where a replay starts from.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum ReplayStart {
+    /// a `Cpu` straight out of `Cpu::new`
+    PowerOn,
+    State(Vec<u8>),
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ReplayEvent {
+    /// the held buttons, as a mask of `Button` bits, from `cycle` on
+    Input { cycle: u64, buttons: u8 },
+    /// the hash of the last drawn frame as of `cycle`
+    Checkpoint { cycle: u64, hash: u64 },
+}
+
+impl ReplayEvent {
+    pub fn cycle(&self) -> u64 {
+        match *self {
+            ReplayEvent::Input { cycle, .. } | ReplayEvent::Checkpoint { cycle, .. } => cycle,
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum ReplayError {
+    State(StateError),
+    /// a power on log given a cpu that has already run
+    NotAtPowerOn,
+    /// the run didn't stop on an event's cycle, it either went past it
+    /// mid-instruction, which a deterministic run of the same log never
+    /// does, or the cpu errored before it
+    Missed {
+        cycle: u64,
+        reached: u64,
+    },
+    Desync {
+        cycle: u64,
+        expected: u64,
+        found: u64,
+    },
+    /// memory of a lockstep run's two machines first differed on `cycle`
+    Diverged {
+        cycle: u64,
+        reference: MemoryHash,
+        candidate: MemoryHash,
+    },
+}
+
+impl Display for ReplayError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{:#?}", self)?;
+        Ok(())
+    }
+}
+
+impl std::error::Error for ReplayError {}
+
+impl From<StateError> for ReplayError {
+    fn from(error: StateError) -> Self {
+        ReplayError::State(error)
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ReplayReport {
+    pub cycles: u64,
+    pub instructions: u64,
+    pub checkpoints: usize,
+}
+
+/// A recorded session: a starting point and every joypad change after it,
+/// timed in M-cycles, with frame hashes along the way to check against.
+///
+/// Buttons are only ever read between instructions and the core has no
+/// other input, so running the same log again makes the same machine.
+/// Recording logs the cycle count the change was made at, which is always
+/// an instruction boundary, and a replay stops on exactly that boundary to
+/// make it again.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct InputLog {
+    start: ReplayStart,
+    events: Vec<ReplayEvent>,
+    end: u64,
+}
+
+impl InputLog {
+    pub fn power_on() -> Self {
+        Self {
+            start: ReplayStart::PowerOn,
+            events: vec![],
+            end: 0,
+        }
+    }
+
+    /// Starts recording from wherever `cpu` is now. States don't hold the
+    /// frame being shown, so checkpoints only match up once a whole frame
+    /// has been drawn since.
+    pub fn from_state(cpu: &Cpu) -> Result<Self, StateError> {
+        Ok(Self {
+            start: ReplayStart::State(cpu.save_state_to_vec()?),
+            events: vec![],
+            end: cpu.cycles(),
+        })
+    }
+
+    pub fn start(&self) -> &ReplayStart {
+        &self.start
+    }
+
+    pub fn events(&self) -> &[ReplayEvent] {
+        &self.events
+    }
+
+    /// Cycle the recording ended on.
+    pub fn end(&self) -> u64 {
+        self.end
+    }
+
+    /// Sets the held buttons of `cpu` and logs the change.
+    pub fn set_buttons(&mut self, cpu: &mut Cpu, buttons: u8) {
+        cpu.set_buttons(buttons);
+        self.push(ReplayEvent::Input {
+            cycle: cpu.cycles(),
+            buttons,
+        });
+    }
+
+    /// Logs the hash of the frame `cpu` drew last.
+    pub fn checkpoint(&mut self, cpu: &Cpu) {
+        self.push(ReplayEvent::Checkpoint {
+            cycle: cpu.cycles(),
+            hash: frame_hash(cpu.ppu().frame()),
+        });
+    }
+
+    /// Marks how far the recording ran, a replay runs up to here.
+    pub fn finish(&mut self, cpu: &Cpu) {
+        self.end = self.end.max(cpu.cycles());
+    }
+
+    fn push(&mut self, event: ReplayEvent) {
+        self.end = self.end.max(event.cycle());
+        self.events.push(event);
+    }
+
+    /// Writes the log as a header, the start state if there is one, an event
+    /// tag, varint cycle delta and payload per event and the delta to the
+    /// end.
+    pub fn write_to(&self, out: &mut impl Write) -> io::Result<()> {
+        out.write_all(&LOG_MAGIC)?;
+        out.write_all(&[LOG_VERSION])?;
+        match &self.start {
+            ReplayStart::PowerOn => out.write_all(&[0])?,
+            ReplayStart::State(state) => {
+                out.write_all(&[1])?;
+                out.write_all(&(state.len() as u32).to_le_bytes())?;
+                out.write_all(state)?;
+            }
+        }
+        let mut last = 0;
+        let mut bytes = vec![];
+        for event in &self.events {
+            match *event {
+                ReplayEvent::Input { cycle, buttons } => {
+                    bytes.push(INPUT);
+                    write_varint(&mut bytes, cycle - last);
+                    bytes.push(buttons);
+                    last = cycle;
+                }
+                ReplayEvent::Checkpoint { cycle, hash } => {
+                    bytes.push(CHECKPOINT);
+                    write_varint(&mut bytes, cycle - last);
+                    bytes.extend_from_slice(&hash.to_le_bytes());
+                    last = cycle;
+                }
+            }
+        }
+        out.write_all(&bytes)?;
+        out.write_all(&(self.end - last).to_le_bytes())
+    }
+
+    pub fn read_from(input: &mut impl Read) -> io::Result<Self> {
+        let mut bytes = vec![];
+        input.read_to_end(&mut bytes)?;
+        let invalid = || io::Error::new(io::ErrorKind::InvalidData, "not an input log");
+
+        let mut r = Bytes(&bytes);
+        if r.take(4)? != LOG_MAGIC || r.take(1)? != [LOG_VERSION] {
+            return Err(invalid());
+        }
+        let start = match r.take(1)?[0] {
+            0 => ReplayStart::PowerOn,
+            1 => {
+                let len = u32::from_le_bytes(r.take(4)?.try_into().unwrap());
+                ReplayStart::State(r.take(len as usize)?.to_vec())
+            }
+            _ => return Err(invalid()),
+        };
+        let mut last = 0u64;
+
+        // the delta to the end closes the log
+        let mut events = vec![];
+        while r.0.len() > 8 {
+            let tag = r.take(1)?[0];
+            let cycle = last.wrapping_add(r.varint()?);
+            events.push(match tag {
+                INPUT => ReplayEvent::Input {
+                    cycle,
+                    buttons: r.take(1)?[0],
+                },
+                CHECKPOINT => ReplayEvent::Checkpoint {
+                    cycle,
+                    hash: u64::from_le_bytes(r.take(8)?.try_into().unwrap()),
+                },
+                _ => return Err(invalid()),
+            });
+            last = cycle;
+        }
+        let end = last.wrapping_add(u64::from_le_bytes(r.take(8)?.try_into().unwrap()));
+        Ok(Self { start, events, end })
+    }
+}
+
+struct Bytes<'a>(&'a [u8]);
+
+impl<'a> Bytes<'a> {
+    fn take(&mut self, len: usize) -> io::Result<&'a [u8]> {
+        if self.0.len() < len {
+            return Err(io::ErrorKind::UnexpectedEof.into());
+        }
+        let (taken, rest) = self.0.split_at(len);
+        self.0 = rest;
+        Ok(taken)
+    }
+
+    fn varint(&mut self) -> io::Result<u64> {
+        let mut value = 0;
+        for shift in (0..64).step_by(7) {
+            let byte = self.take(1)?[0];
+            value |= ((byte & 0x7f) as u64) << shift;
+            if byte & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+        Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "bad cycle delta",
+        ))
+    }
+}
+
+fn write_varint(out: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        out.push(value as u8 | 0x80);
+        value >>= 7;
+    }
+    out.push(value as u8);
+}
+
+/// 64 bit FNV-1a of a frame, stable across builds and platforms.
+pub fn frame_hash(frame: &[u8; SCREEN_WIDTH * SCREEN_HEIGHT]) -> u64 {
+    frame.iter().fold(0xcbf29ce484222325, |hash, shade| {
+        (hash ^ *shade as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+/// Runs `log` on `cpu` as fast as it goes, checking every checkpoint on the
+/// way. A power on log needs a `cpu` fresh from `Cpu::new` on the same cart,
+/// the frames it hashes need to be drawn with the same render policy as
+/// when it was recorded.
+pub fn replay(cpu: &mut Cpu, log: &InputLog) -> Result<ReplayReport, ReplayError> {
+    match &log.start {
+        ReplayStart::PowerOn if cpu.cycles() != 0 => return Err(ReplayError::NotAtPowerOn),
+        ReplayStart::PowerOn => (),
+        ReplayStart::State(state) => cpu.load_state(state)?,
+    }
+    let (cycles, instructions) = (cpu.cycles(), cpu.instructions());
+
+    let mut checkpoints = 0;
+    for event in &log.events {
+        run_to(cpu, event.cycle())?;
+        match *event {
+            ReplayEvent::Input { buttons, .. } => cpu.set_buttons(buttons),
+            ReplayEvent::Checkpoint { cycle, hash } => {
+                let found = frame_hash(cpu.ppu().frame());
+                if found != hash {
+                    return Err(ReplayError::Desync {
+                        cycle,
+                        expected: hash,
+                        found,
+                    });
+                }
+                checkpoints += 1;
+            }
+        }
+    }
+    run_to(cpu, log.end)?;
+
+    Ok(ReplayReport {
+        cycles: cpu.cycles() - cycles,
+        instructions: cpu.instructions() - instructions,
+        checkpoints,
+    })
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct LockstepReport {
+    pub cycles: u64,
+    /// memory hash comparisons made
+    pub checks: u64,
+    pub checkpoints: usize,
+}
+
+/// Runs `log` on two machines side by side, usually one per engine, and
+/// compares their memory hashes at least every `interval` M-cycles, as well
+/// as the log's own checkpoints on both.
+///
+/// On a mismatch both go back to where they last agreed and run again an
+/// instruction at a time to find the exact cycle memory first differed on.
+/// Whatever doesn't survive a save state, like stale cached blocks, may not
+/// happen again, then the cycle of the failed check is reported instead. A
+/// candidate that stops on a different cycle is `Missed`. With a frame's
+/// worth of `interval` the hashing and snapshots cost a few percent.
+pub fn lockstep(
+    reference: &mut Cpu,
+    candidate: &mut Cpu,
+    log: &InputLog,
+    interval: u64,
+) -> Result<LockstepReport, ReplayError> {
+    for cpu in [&mut *reference, &mut *candidate] {
+        match &log.start {
+            ReplayStart::PowerOn if cpu.cycles() != 0 => return Err(ReplayError::NotAtPowerOn),
+            ReplayStart::PowerOn => (),
+            ReplayStart::State(state) => cpu.load_state(state)?,
+        }
+    }
+    let start = reference.cycles();
+    let interval = interval.max(1);
+    let mut saved = (
+        reference.save_state_to_vec()?,
+        candidate.save_state_to_vec()?,
+    );
+    let (mut checks, mut checkpoints) = (0, 0);
+
+    let mut events = log.events.iter();
+    loop {
+        let event = events.next();
+        let cycle = event.map_or(log.end, ReplayEvent::cycle);
+        while reference.cycles() < cycle {
+            reference.save_state(&mut saved.0)?;
+            candidate.save_state(&mut saved.1)?;
+            let target = cycle.min(reference.cycles() + interval);
+            reference.run_cycles(target - reference.cycles());
+            candidate.run_cycles(target - candidate.cycles());
+            checks += 1;
+            compare(reference, candidate)
+                .or_else(|error| narrow(reference, candidate, &saved, error))?;
+        }
+        if reference.cycles() != cycle {
+            return Err(ReplayError::Missed {
+                cycle,
+                reached: reference.cycles(),
+            });
+        }
+        match event {
+            None => break,
+            Some(ReplayEvent::Input { buttons, .. }) => {
+                reference.set_buttons(*buttons);
+                candidate.set_buttons(*buttons);
+            }
+            Some(ReplayEvent::Checkpoint { cycle, hash }) => {
+                for cpu in [&*reference, &*candidate] {
+                    let found = frame_hash(cpu.ppu().frame());
+                    if found != *hash {
+                        return Err(ReplayError::Desync {
+                            cycle: *cycle,
+                            expected: *hash,
+                            found,
+                        });
+                    }
+                }
+                checkpoints += 1;
+            }
+        }
+    }
+
+    Ok(LockstepReport {
+        cycles: reference.cycles() - start,
+        checks,
+        checkpoints,
+    })
+}
+
+fn compare(reference: &Cpu, candidate: &Cpu) -> Result<(), ReplayError> {
+    if candidate.cycles() != reference.cycles() {
+        return Err(ReplayError::Missed {
+            cycle: reference.cycles(),
+            reached: candidate.cycles(),
+        });
+    }
+    let (expected, found) = (reference.memory_hash(), candidate.memory_hash());
+    match expected == found {
+        true => Ok(()),
+        false => Err(ReplayError::Diverged {
+            cycle: reference.cycles(),
+            reference: expected,
+            candidate: found,
+        }),
+    }
+}
+
+/// Reruns the stretch since `saved` an instruction at a time, returning the
+/// first mismatch or `error` if there's none.
+fn narrow(
+    reference: &mut Cpu,
+    candidate: &mut Cpu,
+    saved: &(Vec<u8>, Vec<u8>),
+    error: ReplayError,
+) -> Result<(), ReplayError> {
+    let end = reference.cycles();
+    reference.load_state(&saved.0)?;
+    candidate.load_state(&saved.1)?;
+    while reference.cycles() < end {
+        reference.run_cycles(1);
+        candidate.run_cycles(1);
+        compare(reference, candidate)?;
+    }
+    Err(error)
+}
+
+fn run_to(cpu: &mut Cpu, cycle: u64) -> Result<(), ReplayError> {
+    if cycle > cpu.cycles() {
+        cpu.run_cycles(cycle - cpu.cycles());
+    }
+    match cpu.cycles() == cycle {
+        true => Ok(()),
+        false => Err(ReplayError::Missed {
+            cycle,
+            reached: cpu.cycles(),
+        }),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cart::{tests::rom, Cart, CartImage};
+    use crate::cpu::{Engine, CYCLES_PER_FRAME};
+    use crate::state::W_RAM_OFFSET;
+
+    /// Copies the direction lines of P1 into BGP, so every frame shows what
+    /// was held while it was drawn.
+    const SHOW_BUTTONS: [u8; 10] = [
+        0x3e, 0x20, // ld a, 0x20
+        0xe0, 0x00, // ldh (P1), a
+        0xf0, 0x00, // ldh a, (P1)
+        0xe0, 0x47, // ldh (BGP), a
+        0x18, 0xf6, // jr -10
+    ];
+
+    fn machine() -> Cpu {
+        let image = CartImage::new(rom(0x00, 0, 0x00, &SHOW_BUTTONS)).unwrap();
+        Cpu::new(Cart::from_image(image))
+    }
+
+    fn on_engine(engine: Engine) -> Cpu {
+        let mut cpu = machine();
+        cpu.set_engine(engine);
+        cpu
+    }
+
+    /// Records a few frames alternating right and left from wherever `cpu`
+    /// is, with a checkpoint after each.
+    fn record(cpu: &mut Cpu, mut log: InputLog) -> InputLog {
+        for frame in 0..6 {
+            log.set_buttons(cpu, 1 << (frame % 2));
+            cpu.run_frame();
+            log.checkpoint(cpu);
+        }
+        cpu.run_cycles(1000);
+        log.finish(cpu);
+        log
+    }
+
+    fn round_trip(log: &InputLog) -> InputLog {
+        let mut bytes = vec![];
+        log.write_to(&mut bytes).unwrap();
+        InputLog::read_from(&mut bytes.as_slice()).unwrap()
+    }
+
+    #[test]
+    fn writes_and_reads_back() {
+        let mut cpu = machine();
+        let log = record(&mut cpu, InputLog::power_on());
+        assert_eq!(round_trip(&log), log);
+
+        let start = InputLog::from_state(&cpu).unwrap();
+        let log = record(&mut cpu, start);
+        assert!(matches!(log.start(), ReplayStart::State(_)));
+        assert_eq!(round_trip(&log), log);
+
+        let mut bytes = vec![];
+        log.write_to(&mut bytes).unwrap();
+        bytes.pop();
+        assert!(InputLog::read_from(&mut bytes.as_slice()).is_err());
+        bytes[0] ^= 0xff;
+        assert!(InputLog::read_from(&mut bytes.as_slice()).is_err());
+    }
+
+    #[test]
+    fn replays_a_recording() {
+        let mut cpu = machine();
+        let log = round_trip(&record(&mut cpu, InputLog::power_on()));
+        let hashes: Vec<_> = log.events().iter().filter_map(checkpoint_hash).collect();
+        assert_ne!(hashes[0], hashes[1]);
+
+        let mut replayed = machine();
+        let report = replay(&mut replayed, &log).unwrap();
+        assert_eq!(report.cycles, log.end());
+        assert_eq!(report.checkpoints, 6);
+        assert_eq!(
+            replayed.save_state_to_vec().unwrap(),
+            cpu.save_state_to_vec().unwrap()
+        );
+        assert_eq!(replay(&mut replayed, &log), Err(ReplayError::NotAtPowerOn));
+
+        let mut tampered = log.clone();
+        let last = tampered.events.len() - 1;
+        let ReplayEvent::Checkpoint { cycle, hash } = tampered.events[last] else {
+            unreachable!()
+        };
+        tampered.events[last] = ReplayEvent::Checkpoint {
+            cycle,
+            hash: hash ^ 1,
+        };
+        let error = replay(&mut machine(), &tampered).unwrap_err();
+        assert!(matches!(error, ReplayError::Desync { cycle: at, .. } if at == cycle));
+    }
+
+    fn checkpoint_hash(event: &ReplayEvent) -> Option<u64> {
+        match *event {
+            ReplayEvent::Checkpoint { hash, .. } => Some(hash),
+            ReplayEvent::Input { .. } => None,
+        }
+    }
+
+    #[test]
+    fn engines_agree_in_lockstep() {
+        let log = record(&mut machine(), InputLog::power_on());
+        let mut reference = on_engine(Engine::Interpreter);
+        let mut candidate = on_engine(Engine::BlockCache);
+        let report = lockstep(&mut reference, &mut candidate, &log, CYCLES_PER_FRAME).unwrap();
+        assert_eq!(report.cycles, log.end());
+        assert!(report.checks > 0);
+        assert_eq!(report.checkpoints, 6);
+    }
+
+    #[test]
+    fn lockstep_finds_the_first_diverging_instruction() {
+        let log = record(&mut machine(), InputLog::power_on());
+        let mut reference = on_engine(Engine::Interpreter);
+        // the same power on state but for a byte of work ram
+        let mut candidate = on_engine(Engine::BlockCache);
+        let mut state = candidate.save_state_to_vec().unwrap();
+        state[W_RAM_OFFSET] ^= 0xff;
+        candidate.load_state(&state).unwrap();
+
+        // the first check is a frame in, narrowing takes it back to the end
+        // of the first instruction
+        let mut first = machine();
+        first.run_cycles(1);
+        let error = lockstep(&mut reference, &mut candidate, &log, CYCLES_PER_FRAME).unwrap_err();
+        let ReplayError::Diverged {
+            cycle,
+            reference: expected,
+            candidate: found,
+        } = error
+        else {
+            panic!("{error}");
+        };
+        assert_eq!(cycle, first.cycles());
+        assert!(cycle < CYCLES_PER_FRAME);
+        assert_eq!(expected, first.memory_hash());
+        assert_ne!(expected.w_ram, found.w_ram);
+        assert_eq!(expected.io_registers, found.io_registers);
+    }
+}
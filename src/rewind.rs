@@ -0,0 +1,269 @@
+use std::collections::VecDeque;
+
+use crate::cpu::Cpu;
+use crate::state::{StateError, HEADER_PAGES, STATE_PAGE_SIZE};
+
+/// A ring of save states kept as deltas for cheap rewinding.
+///
+/// Only the newest state is held in full. Each push stores the pages that
+/// changed since the previous push, XORed against it and with runs of
+/// unchanged bytes squeezed out, so stepping back is just XORing the newest
+/// delta into the full copy. Pages are found through the bus dirty tracking
+/// rather than by comparing the whole state.
+pub struct Rewind {
+    capacity: usize,
+    snapshot: Vec<u8>,
+    header: Vec<u8>,
+    deltas: VecDeque<Vec<u8>>,
+    spare: Vec<Vec<u8>>,
+}
+
+impl Rewind {
+    /// Keeps up to `capacity` steps of history.
+    pub fn new(capacity: usize) -> Self {
+        Self {
+            capacity,
+            snapshot: vec![],
+            header: vec![0; HEADER_PAGES * STATE_PAGE_SIZE],
+            deltas: VecDeque::with_capacity(capacity),
+            spare: vec![],
+        }
+    }
+
+    /// Records the current state of `cpu` as the newest step.
+    pub fn push(&mut self, cpu: &mut Cpu) -> Result<(), StateError> {
+        if self.snapshot.len() != cpu.state_size() {
+            self.clear();
+            self.snapshot.resize(cpu.state_size(), 0);
+            cpu.save_state(&mut self.snapshot)?;
+            cpu.take_dirty_pages();
+            return Ok(());
+        }
+
+        cpu.save_state_header(&mut self.header)?;
+        let mut delta = self.spare.pop().unwrap_or_default();
+        delta.clear();
+
+        let header = self.header.chunks_exact(STATE_PAGE_SIZE).enumerate();
+        for (page, new) in header {
+            encode_page(&mut self.snapshot, page, new, &mut delta);
+        }
+        for page in cpu.take_dirty_pages().iter() {
+            encode_page(&mut self.snapshot, page, cpu.state_page(page), &mut delta);
+        }
+
+        if self.deltas.len() == self.capacity {
+            if let Some(oldest) = self.deltas.pop_front() {
+                self.spare.push(oldest);
+            }
+        }
+        self.deltas.push_back(delta);
+        Ok(())
+    }
+
+    /// Steps `cpu` back to the previous push. Once the history runs out the
+    /// oldest state is restored and `false` returned.
+    pub fn rewind(&mut self, cpu: &mut Cpu) -> Result<bool, StateError> {
+        let stepped = match self.deltas.pop_back() {
+            Some(delta) => {
+                apply_delta(&mut self.snapshot, &delta);
+                self.spare.push(delta);
+                true
+            }
+            None => false,
+        };
+        cpu.load_state(&self.snapshot)?;
+        Ok(stepped)
+    }
+
+    /// Number of steps that can be rewound.
+    pub fn len(&self) -> usize {
+        self.deltas.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.deltas.is_empty()
+    }
+
+    /// Bytes held by the history, not counting recycled buffers.
+    pub fn memory_usage(&self) -> usize {
+        self.snapshot.len() + self.deltas.iter().map(Vec::len).sum::<usize>()
+    }
+
+    pub fn clear(&mut self) {
+        self.snapshot.clear();
+        self.spare.extend(self.deltas.drain(..));
+    }
+}
+
+/// Appends `page` of the snapshot XOR `new` to `delta` and moves the
+/// snapshot forward to `new`. Pages that didn't actually change are skipped.
+///
+/// A page is its index followed by (skip, len, bytes...) runs covering all
+/// 256 bytes.
+fn encode_page(snapshot: &mut [u8], page: usize, new: &[u8], delta: &mut Vec<u8>) {
+    let old = &mut snapshot[page * STATE_PAGE_SIZE..(page + 1) * STATE_PAGE_SIZE];
+    if old == new {
+        return;
+    }
+
+    delta.extend_from_slice(&(page as u16).to_le_bytes());
+    let mut pos = 0;
+    while pos < STATE_PAGE_SIZE {
+        let skip = old[pos..]
+            .iter()
+            .zip(&new[pos..])
+            .take(0xff)
+            .take_while(|(old, new)| old == new)
+            .count();
+        pos += skip;
+        let len = old[pos..]
+            .iter()
+            .zip(&new[pos..])
+            .take(0xff)
+            .take_while(|(old, new)| old != new)
+            .count();
+        delta.push(skip as u8);
+        delta.push(len as u8);
+        delta.extend(
+            old[pos..pos + len]
+                .iter()
+                .zip(&new[pos..])
+                .map(|(o, n)| o ^ n),
+        );
+        pos += len;
+    }
+    old.copy_from_slice(new);
+}
+
+fn apply_delta(snapshot: &mut [u8], mut delta: &[u8]) {
+    while let [lo, hi, rest @ ..] = delta {
+        let page = u16::from_le_bytes([*lo, *hi]) as usize;
+        let page = &mut snapshot[page * STATE_PAGE_SIZE..(page + 1) * STATE_PAGE_SIZE];
+        delta = rest;
+
+        let mut pos = 0;
+        while pos < STATE_PAGE_SIZE {
+            let (skip, len) = (delta[0] as usize, delta[1] as usize);
+            pos += skip;
+            for (byte, xor) in page[pos..pos + len].iter_mut().zip(&delta[2..2 + len]) {
+                *byte ^= xor;
+            }
+            pos += len;
+            delta = &delta[2 + len..];
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cart::{tests::rom, Cart, CartImage};
+
+    /// Fills work ram with a counter over and over, so machines that ran for
+    /// different times differ on every ram page.
+    const FILL_W_RAM: [u8; 15] = [
+        0x21, 0x00, 0xc0, // ld hl, 0xc000
+        0x04, // inc b
+        0x70, // ld (hl), b
+        0x23, // inc hl
+        0x7c, // ld a, h
+        0xfe, 0xe0, // cp 0xe0
+        0x20, 0xf8, // jr nz, -8
+        0x18, 0xf3, // jr -13
+        0x00, 0x00,
+    ];
+
+    fn machines() -> (Cpu, Cpu) {
+        let image = CartImage::new(rom(0x00, 0, 0x00, &FILL_W_RAM)).unwrap();
+        let (mut a, mut b) = (
+            Cpu::new(Cart::from_image(image.clone())),
+            Cpu::new(Cart::from_image(image)),
+        );
+        a.run_frame();
+        for _ in 0..3 {
+            b.run_frame();
+        }
+        (a, b)
+    }
+
+    fn state(cpu: &Cpu) -> Vec<u8> {
+        cpu.save_state_to_vec().unwrap()
+    }
+
+    #[test]
+    fn rewinds_step_by_step() {
+        let (mut cpu, _) = machines();
+        let mut rewind = Rewind::new(8);
+        let mut states = vec![];
+        for _ in 0..4 {
+            rewind.push(&mut cpu).unwrap();
+            states.push(state(&cpu));
+            cpu.run_frame();
+        }
+        assert_eq!(rewind.len(), 3);
+        // the newest push is what the history steps back from
+        states.pop();
+        while let Some(expected) = states.pop() {
+            assert!(rewind.rewind(&mut cpu).unwrap());
+            assert_eq!(state(&cpu), expected);
+        }
+        assert!(!rewind.rewind(&mut cpu).unwrap());
+        assert_eq!(rewind.len(), 0);
+    }
+
+    #[test]
+    fn drops_the_oldest_step() {
+        let (mut cpu, _) = machines();
+        let mut rewind = Rewind::new(2);
+        let mut states = vec![];
+        for _ in 0..4 {
+            rewind.push(&mut cpu).unwrap();
+            states.push(state(&cpu));
+            cpu.run_frame();
+        }
+        assert_eq!(rewind.len(), 2);
+        rewind.rewind(&mut cpu).unwrap();
+        rewind.rewind(&mut cpu).unwrap();
+        assert!(!rewind.rewind(&mut cpu).unwrap());
+        assert_eq!(state(&cpu), states[1]);
+    }
+
+    #[test]
+    fn survives_a_foreign_load() {
+        let (mut cpu, other) = machines();
+        let mut rewind = Rewind::new(8);
+        rewind.push(&mut cpu).unwrap();
+        let first = state(&cpu);
+
+        let foreign = state(&other);
+        cpu.load_state(&foreign).unwrap();
+        rewind.push(&mut cpu).unwrap();
+        cpu.run_frame();
+        rewind.push(&mut cpu).unwrap();
+
+        rewind.rewind(&mut cpu).unwrap();
+        assert_eq!(state(&cpu), foreign);
+        rewind.rewind(&mut cpu).unwrap();
+        assert_eq!(state(&cpu), first);
+    }
+
+    #[test]
+    fn survives_a_clone() {
+        let (mut cpu, other) = machines();
+        let mut rewind = Rewind::new(8);
+        rewind.push(&mut cpu).unwrap();
+        let first = state(&cpu);
+
+        cpu.clone_state_from(&other).unwrap();
+        let cloned = state(&cpu);
+        rewind.push(&mut cpu).unwrap();
+        cpu.run_frame();
+        rewind.push(&mut cpu).unwrap();
+
+        rewind.rewind(&mut cpu).unwrap();
+        assert_eq!(state(&cpu), cloned);
+        rewind.rewind(&mut cpu).unwrap();
+        assert_eq!(state(&cpu), first);
+    }
+}
@@ -0,0 +1,177 @@
+use std::{
+    cell::UnsafeCell,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc,
+    },
+};
+
+/// Keeps the two indices on their own cache lines so the producer and
+/// consumer cores don't fight over one.
+#[repr(align(64))]
+struct Index(AtomicUsize);
+
+struct Shared<T> {
+    slots: Box<[UnsafeCell<T>]>,
+    /// next slot the consumer reads, only the consumer stores it
+    head: Index,
+    /// next slot the producer writes, only the producer stores it
+    tail: Index,
+}
+
+// SAFETY: a slot is only ever touched by the side that currently owns it,
+// ownership changes hands through the release/acquire pair on head and tail
+unsafe impl<T: Send> Sync for Shared<T> {}
+
+/// A bounded single producer single consumer queue with no locks, neither
+/// side ever waits for the other. The indices only count up and are masked
+/// into the power of two sized buffer.
+pub fn channel<T: Copy + Default>(capacity: usize) -> (Producer<T>, Consumer<T>) {
+    let capacity = capacity.max(1).next_power_of_two();
+    let shared = Arc::new(Shared {
+        slots: (0..capacity)
+            .map(|_| UnsafeCell::new(T::default()))
+            .collect(),
+        head: Index(AtomicUsize::new(0)),
+        tail: Index(AtomicUsize::new(0)),
+    });
+    let producer = Producer {
+        shared: shared.clone(),
+        tail: 0,
+        head: 0,
+    };
+    let consumer = Consumer {
+        shared,
+        head: 0,
+        tail: 0,
+    };
+    (producer, consumer)
+}
+
+pub struct Producer<T> {
+    shared: Arc<Shared<T>>,
+    tail: usize,
+    /// last head seen, refreshed only when the buffer looks full
+    head: usize,
+}
+
+impl<T: Copy> Producer<T> {
+    /// Queues as much of `items` as fits and returns how many that was, the
+    /// rest is dropped rather than waited on.
+    pub fn push_slice(&mut self, items: &[T]) -> usize {
+        let capacity = self.shared.slots.len();
+        if self.tail - self.head + items.len() > capacity {
+            self.head = self.shared.head.0.load(Ordering::Acquire);
+        }
+        let count = items.len().min(capacity - (self.tail - self.head));
+        for (offset, item) in items[..count].iter().enumerate() {
+            let slot = &self.shared.slots[(self.tail + offset) & (capacity - 1)];
+            // SAFETY: slots between head and head + capacity past the tail
+            // belong to the producer until tail is published
+            unsafe { *slot.get() = *item };
+        }
+        self.tail += count;
+        self.shared.tail.0.store(self.tail, Ordering::Release);
+        count
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.shared.slots.len()
+    }
+}
+
+pub struct Consumer<T> {
+    shared: Arc<Shared<T>>,
+    head: usize,
+    /// last tail seen, refreshed only when the buffer looks empty
+    tail: usize,
+}
+
+impl<T: Copy> Consumer<T> {
+    /// Fills as much of `out` as there are queued items, returning the count.
+    pub fn pop_slice(&mut self, out: &mut [T]) -> usize {
+        let capacity = self.shared.slots.len();
+        if self.tail - self.head < out.len() {
+            self.tail = self.shared.tail.0.load(Ordering::Acquire);
+        }
+        let count = out.len().min(self.tail - self.head);
+        for (offset, item) in out[..count].iter_mut().enumerate() {
+            let slot = &self.shared.slots[(self.head + offset) & (capacity - 1)];
+            // SAFETY: slots between head and the published tail belong to
+            // the consumer until head is published
+            *item = unsafe { *slot.get() };
+        }
+        self.head += count;
+        self.shared.head.0.store(self.head, Ordering::Release);
+        count
+    }
+
+    /// Items ready to be popped.
+    pub fn len(&self) -> usize {
+        self.shared.tail.0.load(Ordering::Acquire) - self.head
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.shared.slots.len()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::thread;
+
+    #[test]
+    fn rounds_up_and_drops_what_doesnt_fit() {
+        let (mut producer, mut consumer) = channel::<u32>(5);
+        assert_eq!(producer.capacity(), 8);
+        assert_eq!(producer.push_slice(&[0, 1, 2, 3, 4, 5]), 6);
+        assert_eq!(producer.push_slice(&[6, 7, 8, 9]), 2);
+        assert_eq!(consumer.len(), 8);
+
+        let mut out = [0; 3];
+        assert_eq!(consumer.pop_slice(&mut out), 3);
+        assert_eq!(out, [0, 1, 2]);
+        // the freed slots wrap around to the start of the buffer
+        assert_eq!(producer.push_slice(&[8, 9, 10, 11]), 3);
+        let mut out = [0; 16];
+        assert_eq!(consumer.pop_slice(&mut out), 8);
+        assert_eq!(out[..8], [3, 4, 5, 6, 7, 8, 9, 10]);
+        assert!(consumer.is_empty());
+        assert_eq!(consumer.pop_slice(&mut out), 0);
+    }
+
+    #[test]
+    fn hands_over_in_order_across_threads() {
+        const COUNT: u32 = 20_000;
+        let (mut producer, mut consumer) = channel::<u32>(64);
+        let feeder = thread::spawn(move || {
+            let mut next = 0;
+            while next < COUNT {
+                let batch: Vec<_> = (next..COUNT.min(next + 7)).collect();
+                match producer.push_slice(&batch) {
+                    0 => thread::yield_now(),
+                    count => next += count as u32,
+                }
+            }
+        });
+        let mut expected = 0;
+        let mut out = [0; 5];
+        while expected < COUNT {
+            let count = consumer.pop_slice(&mut out);
+            if count == 0 {
+                thread::yield_now();
+            }
+            for item in &out[..count] {
+                assert_eq!(*item, expected);
+                expected += 1;
+            }
+        }
+        feeder.join().unwrap();
+        assert!(consumer.is_empty());
+    }
+}
@@ -0,0 +1,56 @@
+use std::{fs::File, io::Read, ops::Deref, path::Path, sync::Arc};
+
+use crate::cart::CartError;
+use crate::mmap::Mmap;
+
+/// A read only ROM image, cloning it only bumps a reference count so any
+/// number of carts can share the same bytes.
+#[derive(Clone)]
+pub enum Rom {
+    Shared(Arc<[u8]>),
+    Mapped(Arc<Mmap>),
+}
+
+impl Rom {
+    /// Memory maps the file at `path`, falling back to reading it into memory
+    /// where mapping isn't available.
+    pub fn open(path: &str) -> Result<Self, CartError> {
+        let mut file = match File::open(Path::new(path)) {
+            Ok(file) => file,
+            Err(_) => return Err(CartError::MissingCart(path.to_string())),
+        };
+
+        if let Ok(map) = Mmap::open(&file) {
+            return Ok(Rom::Mapped(Arc::new(map)));
+        }
+
+        let mut data: Vec<u8> = vec![];
+        match file.read_to_end(&mut data) {
+            Ok(_) => Ok(Rom::from(data)),
+            Err(_) => Err(CartError::LoadError),
+        }
+    }
+}
+
+impl Deref for Rom {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            Rom::Shared(data) => data,
+            Rom::Mapped(map) => map,
+        }
+    }
+}
+
+impl From<Arc<[u8]>> for Rom {
+    fn from(data: Arc<[u8]>) -> Self {
+        Rom::Shared(data)
+    }
+}
+
+impl From<Vec<u8>> for Rom {
+    fn from(data: Vec<u8>) -> Self {
+        Rom::Shared(data.into())
+    }
+}
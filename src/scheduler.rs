@@ -0,0 +1,69 @@
+/// Everything that can happen at a set cycle. Each kind has at most one
+/// pending occurrence, rescheduling it replaces the old time.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum Event {
+    Ppu = 0,
+    Timer = 1,
+    Serial = 2,
+    /// the next step of the apu frame sequencer
+    Apu = 3,
+    /// periodic sync of the save file, not part of the emulated machine
+    Battery = 4,
+    /// the end of an OAM DMA, which locks OAM until then
+    Dma = 5,
+}
+
+const EVENTS: [Event; 6] = [
+    Event::Ppu,
+    Event::Timer,
+    Event::Serial,
+    Event::Apu,
+    Event::Battery,
+    Event::Dma,
+];
+
+/// Cycle timestamps of the next occurrence of every event, with the earliest
+/// cached so the per instruction check is a single compare.
+///
+/// With only a handful of event kinds a flat array beats a heap or wheel,
+/// rescheduling is a short scan over one cache line.
+pub(crate) struct Scheduler {
+    times: [u64; EVENTS.len()],
+    next: u64,
+}
+
+impl Scheduler {
+    pub const NEVER: u64 = u64::MAX;
+
+    pub fn new() -> Self {
+        Self {
+            times: [Self::NEVER; EVENTS.len()],
+            next: Self::NEVER,
+        }
+    }
+
+    /// Cycle of the earliest pending event.
+    #[inline(always)]
+    pub fn next(&self) -> u64 {
+        self.next
+    }
+
+    pub fn at(&self, event: Event) -> u64 {
+        self.times[event as usize]
+    }
+
+    pub fn schedule(&mut self, event: Event, at: u64) {
+        self.times[event as usize] = at;
+        self.next = self.times.iter().copied().min().unwrap_or(Self::NEVER);
+    }
+
+    /// Takes the earliest event due by `now` off the schedule.
+    pub fn pop(&mut self, now: u64) -> Option<Event> {
+        if self.next > now {
+            return None;
+        }
+        let index = self.times.iter().position(|time| *time == self.next)?;
+        self.schedule(EVENTS[index], Self::NEVER);
+        Some(EVENTS[index])
+    }
+}
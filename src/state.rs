@@ -0,0 +1,368 @@
+use std::{fmt::Display, ops::RangeInclusive};
+
+/// Save states are a fixed little endian layout with every section starting
+/// on a 256 byte boundary, so a state can be restored with a handful of
+/// straight slice copies and compared or patched page by page.
+pub const STATE_MAGIC: [u8; 4] = *b"CGBS";
+pub const STATE_VERSION: u16 = 7;
+
+pub(crate) const HEADER_OFFSET: usize = 0x0000;
+pub(crate) const IO_OFFSET: usize = 0x0100;
+pub(crate) const H_RAM_OFFSET: usize = 0x0180;
+pub(crate) const OAM_OFFSET: usize = 0x0200;
+pub(crate) const APU_OFFSET: usize = 0x02a0;
+pub(crate) const V_RAM_OFFSET: usize = 0x0300;
+pub(crate) const W_RAM_OFFSET: usize = 0x4300;
+pub(crate) const CART_RAM_OFFSET: usize = 0xc300;
+
+pub(crate) const STATE_PAGE_SIZE: usize = 0x100;
+/// largest possible state, 128KiB of cart ram
+pub(crate) const MAX_STATE_PAGES: usize = (CART_RAM_OFFSET + 0x20000) / STATE_PAGE_SIZE;
+/// pages of the state before the big memory sections, always saved in full
+pub(crate) const HEADER_PAGES: usize = V_RAM_OFFSET / STATE_PAGE_SIZE;
+
+// header fields
+pub(crate) const CPU_OFFSET: usize = HEADER_OFFSET + 0x10;
+pub(crate) const BUS_OFFSET: usize = HEADER_OFFSET + 0x40;
+pub(crate) const CART_OFFSET: usize = HEADER_OFFSET + 0x60;
+pub(crate) const PPU_OFFSET: usize = HEADER_OFFSET + 0x80;
+pub(crate) const TIMER_OFFSET: usize = HEADER_OFFSET + 0xa0;
+pub(crate) const SERIAL_OFFSET: usize = HEADER_OFFSET + 0xc0;
+pub(crate) const JOYPAD_OFFSET: usize = HEADER_OFFSET + 0xd0;
+pub(crate) const DMA_OFFSET: usize = HEADER_OFFSET + 0xe0;
+
+/// Where every section starts, in order. A section runs up to the next one.
+const SECTIONS: [usize; 16] = [
+    HEADER_OFFSET,
+    CPU_OFFSET,
+    BUS_OFFSET,
+    CART_OFFSET,
+    PPU_OFFSET,
+    TIMER_OFFSET,
+    SERIAL_OFFSET,
+    JOYPAD_OFFSET,
+    DMA_OFFSET,
+    IO_OFFSET,
+    H_RAM_OFFSET,
+    OAM_OFFSET,
+    APU_OFFSET,
+    V_RAM_OFFSET,
+    W_RAM_OFFSET,
+    CART_RAM_OFFSET,
+];
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum StateError {
+    BufferTooSmall {
+        needed: usize,
+    },
+    InvalidMagic,
+    UnsupportedVersion(u16),
+    WrongCart,
+    MidInstruction,
+    /// a field holds a value no save could have written, at this offset
+    Corrupt {
+        offset: usize,
+    },
+}
+
+impl Display for StateError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{:#?}", self)?;
+        Ok(())
+    }
+}
+
+impl std::error::Error for StateError {}
+
+/// One bit per state page that has been written since the bits were last
+/// taken. Only pages backing memory the cpu can write directly are tracked,
+/// the header pages are small enough to always be treated as dirty.
+#[derive(Clone, Copy)]
+pub(crate) struct DirtyPages([u64; MAX_STATE_PAGES.div_ceil(64)]);
+
+impl DirtyPages {
+    pub const CLEAN: DirtyPages = DirtyPages([0; MAX_STATE_PAGES.div_ceil(64)]);
+
+    #[inline(always)]
+    pub fn mark(&mut self, page: u16) {
+        self.0[page as usize >> 6] |= 1 << (page & 63);
+    }
+
+    /// Every memory page of a state `size` bytes long, for when the memory
+    /// was replaced wholesale rather than written through the bus.
+    pub fn all(size: usize) -> DirtyPages {
+        let mut pages = DirtyPages::CLEAN;
+        for page in HEADER_PAGES..size / STATE_PAGE_SIZE {
+            pages.mark(page as u16);
+        }
+        pages
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = usize> + '_ {
+        self.0.iter().enumerate().flat_map(|(i, word)| {
+            let mut word = *word;
+            std::iter::from_fn(move || {
+                if word == 0 {
+                    return None;
+                }
+                let bit = word.trailing_zeros() as usize;
+                word &= word - 1;
+                Some(i * 64 + bit)
+            })
+        })
+    }
+}
+
+pub(crate) struct StateWriter<'a> {
+    buf: &'a mut [u8],
+    pos: usize,
+}
+
+impl<'a> StateWriter<'a> {
+    pub fn new(buf: &'a mut [u8]) -> Self {
+        Self { buf, pos: 0 }
+    }
+
+    pub fn seek(&mut self, pos: usize) {
+        self.pos = pos;
+    }
+
+    pub fn u8(&mut self, value: u8) {
+        self.bytes(&[value]);
+    }
+
+    pub fn bool(&mut self, value: bool) {
+        self.u8(value as u8);
+    }
+
+    pub fn u16(&mut self, value: u16) {
+        self.bytes(&value.to_le_bytes());
+    }
+
+    pub fn u32(&mut self, value: u32) {
+        self.bytes(&value.to_le_bytes());
+    }
+
+    pub fn u64(&mut self, value: u64) {
+        self.bytes(&value.to_le_bytes());
+    }
+
+    pub fn bytes(&mut self, value: &[u8]) {
+        self.buf[self.pos..self.pos + value.len()].copy_from_slice(value);
+        self.pos += value.len();
+    }
+}
+
+pub(crate) struct StateReader<'a> {
+    buf: &'a [u8],
+    pos: usize,
+    /// end of the section the last seek landed in, reads can't run past it
+    end: usize,
+    sections: bool,
+}
+
+impl<'a> StateReader<'a> {
+    pub fn new(buf: &'a [u8]) -> Self {
+        let end = buf.len();
+        Self {
+            buf,
+            pos: 0,
+            end,
+            sections: false,
+        }
+    }
+
+    /// A reader over a whole state, which keeps each field it reads inside
+    /// the section it was looked for in.
+    pub fn state(buf: &'a [u8]) -> Self {
+        Self {
+            sections: true,
+            ..Self::new(buf)
+        }
+    }
+
+    pub fn seek(&mut self, pos: usize) {
+        self.pos = pos;
+        if self.sections {
+            let next = SECTIONS.iter().find(|start| **start > pos);
+            self.end = next.map_or(self.buf.len(), |next| *next);
+        }
+    }
+
+    pub fn u8(&mut self) -> u8 {
+        self.bytes(1)[0]
+    }
+
+    /// A byte that has to fall in `range`, like an enum or a bank number.
+    pub fn u8_in(&mut self, range: RangeInclusive<u8>) -> Result<u8, StateError> {
+        let offset = self.pos;
+        let value = self.u8();
+        match range.contains(&value) {
+            true => Ok(value),
+            false => Err(StateError::Corrupt { offset }),
+        }
+    }
+
+    pub fn bool(&mut self) -> bool {
+        self.u8() != 0
+    }
+
+    pub fn u16(&mut self) -> u16 {
+        u16::from_le_bytes(self.array())
+    }
+
+    /// A u16 that has to fall in `range`.
+    pub fn u16_in(&mut self, range: RangeInclusive<u16>) -> Result<u16, StateError> {
+        let offset = self.pos;
+        let value = self.u16();
+        match range.contains(&value) {
+            true => Ok(value),
+            false => Err(StateError::Corrupt { offset }),
+        }
+    }
+
+    pub fn u32(&mut self) -> u32 {
+        u32::from_le_bytes(self.array())
+    }
+
+    pub fn u64(&mut self) -> u64 {
+        u64::from_le_bytes(self.array())
+    }
+
+    pub fn array<const N: usize>(&mut self) -> [u8; N] {
+        self.bytes(N).try_into().unwrap()
+    }
+
+    pub fn bytes(&mut self, len: usize) -> &'a [u8] {
+        debug_assert!(self.pos + len <= self.end, "read past the end of a section");
+        let bytes = &self.buf[self.pos..self.pos + len];
+        self.pos += len;
+        bytes
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cart::{tests::rom, Cart, CartImage};
+    use crate::cpu::Cpu;
+
+    /// Counts through work ram with the timer running, so two points of a run
+    /// differ in the cpu, the ram and the timer.
+    const PROGRAM: [u8; 17] = [
+        0x3e, 0x05, // ld a, 0x05
+        0xe0, 0x07, // ldh (TAC), a
+        0x21, 0x00, 0xc0, // ld hl, 0xc000
+        0x04, // inc b
+        0x70, // ld (hl), b
+        0x23, // inc hl
+        0x7c, // ld a, h
+        0xfe, 0xe0, // cp 0xe0
+        0x20, 0xf8, // jr nz, -8
+        0x18, 0xf3, // jr -13
+    ];
+
+    fn machine(ram_code: u8) -> Cpu {
+        let cart_type = if ram_code == 0 { 0x00 } else { 0x03 };
+        let image = CartImage::new(rom(cart_type, 0, ram_code, &PROGRAM)).unwrap();
+        let mut cpu = Cpu::new(Cart::from_image(image));
+        cpu.run_frame();
+        cpu
+    }
+
+    #[test]
+    fn round_trips() {
+        let mut cpu = machine(0);
+        let saved = cpu.save_state_to_vec().unwrap();
+        let mut twin = machine(0);
+        twin.run_frame();
+        twin.load_state(&saved).unwrap();
+        assert_eq!(twin.save_state_to_vec().unwrap(), saved);
+
+        for _ in 0..3 {
+            cpu.run_frame();
+            twin.run_frame();
+        }
+        assert_eq!(
+            twin.save_state_to_vec().unwrap(),
+            cpu.save_state_to_vec().unwrap()
+        );
+    }
+
+    #[test]
+    fn rejects_foreign_states() {
+        let mut cpu = machine(0);
+        let saved = cpu.save_state_to_vec().unwrap();
+
+        let needed = saved.len();
+        let result = cpu.load_state(&saved[..needed - 1]);
+        assert_eq!(result, Err(StateError::BufferTooSmall { needed }));
+
+        let mut bad = saved.clone();
+        bad[HEADER_OFFSET] ^= 0xff;
+        assert_eq!(cpu.load_state(&bad), Err(StateError::InvalidMagic));
+
+        bad = saved.clone();
+        bad[HEADER_OFFSET + 4..HEADER_OFFSET + 6].copy_from_slice(&99u16.to_le_bytes());
+        assert_eq!(
+            cpu.load_state(&bad),
+            Err(StateError::UnsupportedVersion(99))
+        );
+
+        let other = machine(0x02).save_state_to_vec().unwrap();
+        assert_eq!(cpu.load_state(&other), Err(StateError::WrongCart));
+        assert_eq!(cpu.save_state_to_vec().unwrap(), saved);
+    }
+
+    #[test]
+    fn rejects_corrupt_fields_untouched() {
+        let mut cpu = machine(0);
+        let saved = cpu.save_state_to_vec().unwrap();
+        let cycles = CPU_OFFSET + 15;
+        // the channels, ten bytes each, follow the registers
+        let apu = APU_OFFSET + 0x30;
+        let fields = [
+            (CPU_OFFSET, 4),
+            (CPU_OFFSET + 1, 2),
+            (BUS_OFFSET, 2),
+            (BUS_OFFSET + 1, 0),
+            (PPU_OFFSET, 4),
+            (PPU_OFFSET + 18, 2),
+            (PPU_OFFSET + 20, 161),
+            (TIMER_OFFSET + 18, 0x08),
+            (JOYPAD_OFFSET + 1, 0x01),
+            (apu + 3, 0x10),
+            (apu + 4, 0x08),
+            (apu + 9, 0x08),
+            (apu + 10 + 9, 0x08),
+            (apu + 40, 9),
+            (apu + 46, 0x08),
+        ];
+        for (offset, value) in fields {
+            let mut bad = saved.clone();
+            bad[offset] = value;
+            assert_eq!(cpu.load_state(&bad), Err(StateError::Corrupt { offset }));
+            assert_eq!(cpu.save_state_to_vec().unwrap(), saved);
+        }
+
+        // a sweep shadow past 11 bits would overflow the next sweep
+        let mut bad = saved.clone();
+        bad[apu + 42..apu + 44].copy_from_slice(&0xffffu16.to_le_bytes());
+        let offset = apu + 42;
+        assert_eq!(cpu.load_state(&bad), Err(StateError::Corrupt { offset }));
+        assert_eq!(cpu.save_state_to_vec().unwrap(), saved);
+
+        // the bus and the timer clocks can't be ahead of the cpu's
+        let now = u64::from_le_bytes(saved[cycles..cycles + 8].try_into().unwrap());
+        let clocks = [
+            (BUS_OFFSET + 3, BUS_OFFSET + 3),
+            (TIMER_OFFSET + 8, TIMER_OFFSET),
+        ];
+        for (at, offset) in clocks {
+            let mut bad = saved.clone();
+            bad[at..at + 8].copy_from_slice(&(now + 1).to_le_bytes());
+            assert_eq!(cpu.load_state(&bad), Err(StateError::Corrupt { offset }));
+        }
+    }
+}
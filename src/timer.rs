@@ -0,0 +1,119 @@
+use crate::state::{StateError, StateReader, StateWriter, TIMER_OFFSET};
+
+/// M-cycles per TIMA increment for each TAC clock select.
+const PERIODS: [u64; 4] = [256, 4, 16, 64];
+
+/// DIV and TIMA worked out from timestamps instead of being ticked.
+///
+/// DIV is the top byte of a counter running since `epoch`, and TIMA counts
+/// the edges of its selected bit since `synced`. The only time the timer
+/// needs the cpu's attention is an overflow, which the bus schedules up
+/// front with `overflow_at`.
+#[derive(Clone, Copy)]
+pub(crate) struct Timer {
+    epoch: u64,
+    synced: u64,
+    tima: u8,
+    tma: u8,
+    tac: u8,
+}
+
+impl Timer {
+    pub fn new() -> Self {
+        Self {
+            epoch: 0,
+            synced: 0,
+            tima: 0,
+            tma: 0,
+            tac: 0,
+        }
+    }
+
+    /// Reads 0xff04..=0xff07.
+    pub fn read(&self, now: u64, addr: u16) -> u8 {
+        match addr {
+            0xff04 => (((now - self.epoch) * 4) >> 8) as u8,
+            0xff05 => self.tima(now),
+            0xff06 => self.tma,
+            _ => self.tac | 0xf8,
+        }
+    }
+
+    /// Writes 0xff04..=0xff07, the overflow has to be rescheduled after.
+    pub fn write(&mut self, now: u64, addr: u16, value: u8) {
+        self.tima = self.tima(now);
+        self.synced = now;
+        match addr {
+            0xff04 => self.epoch = now,
+            0xff05 => self.tima = value,
+            0xff06 => self.tma = value,
+            _ => self.tac = value & 0x07,
+        }
+    }
+
+    /// Cycle TIMA next wraps on, if it's running.
+    pub fn overflow_at(&self) -> Option<u64> {
+        if self.tac & 0x04 == 0 {
+            return None;
+        }
+        let period = PERIODS[self.tac as usize & 0x03];
+        let edge = (self.synced - self.epoch) / period + (0x100 - self.tima as u64);
+        Some(self.epoch + edge * period)
+    }
+
+    /// Cycle of the next falling edge of DIV bit 4, or bit 5 in double
+    /// speed, which clocks the apu frame sequencer.
+    pub fn next_apu_tick(&self, now: u64, double_speed: bool) -> u64 {
+        let period = 2048 << double_speed as u64;
+        self.epoch + ((now - self.epoch) / period + 1) * period
+    }
+
+    /// Reloads TIMA from TMA for the overflow at `at`.
+    pub fn overflow(&mut self, at: u64) {
+        self.tima = self.tma;
+        self.synced = at;
+    }
+
+    /// Only valid up to the next overflow, which the scheduler guarantees.
+    fn tima(&self, now: u64) -> u8 {
+        if self.tac & 0x04 == 0 {
+            return self.tima;
+        }
+        let period = PERIODS[self.tac as usize & 0x03];
+        let edges = (now - self.epoch) / period - (self.synced - self.epoch) / period;
+        self.tima.wrapping_add(edges as u8)
+    }
+
+    pub fn save_state(&self, w: &mut StateWriter) {
+        w.seek(TIMER_OFFSET);
+        w.u64(self.epoch);
+        w.u64(self.synced);
+        w.u8(self.tima);
+        w.u8(self.tma);
+        w.u8(self.tac);
+    }
+
+    /// DIV and TIMA count from `epoch` and `synced`, neither can be ahead of
+    /// the clock or the count would run backwards.
+    pub fn check_state(&self, r: &mut StateReader, now: u64) -> Result<(), StateError> {
+        r.seek(TIMER_OFFSET);
+        let (epoch, synced) = (r.u64(), r.u64());
+        if epoch > synced || synced > now {
+            return Err(StateError::Corrupt {
+                offset: TIMER_OFFSET,
+            });
+        }
+        r.bytes(2);
+        r.u8_in(0..=0x07)?;
+        Ok(())
+    }
+
+    pub fn load_state(&mut self, r: &mut StateReader) {
+        r.seek(TIMER_OFFSET);
+        self.epoch = r.u64();
+        self.synced = r.u64();
+        self.tima = r.u8();
+        self.tma = r.u8();
+        self.tac = r.u8() & 0x07;
+    }
+}
@@ -0,0 +1,48 @@
+/// M-cycles of every opcode, conditional branches as if not taken. Illegal
+/// opcodes never finish, they're given one cycle.
+#[rustfmt::skip]
+pub(crate) static CYCLES: [u8; 256] = [
+//  x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xa xb xc xd xe xf
+    1, 3, 2, 2, 1, 1, 2, 1, 5, 2, 2, 2, 1, 1, 2, 1, // 0x
+    1, 3, 2, 2, 1, 1, 2, 1, 3, 2, 2, 2, 1, 1, 2, 1, // 1x
+    2, 3, 2, 2, 1, 1, 2, 1, 2, 2, 2, 2, 1, 1, 2, 1, // 2x
+    2, 3, 2, 2, 3, 3, 3, 1, 2, 2, 2, 2, 1, 1, 2, 1, // 3x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 4x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 5x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 6x
+    2, 2, 2, 2, 2, 2, 1, 2, 1, 1, 1, 1, 1, 1, 2, 1, // 7x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 8x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 9x
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // ax
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // bx
+    2, 3, 3, 4, 3, 4, 2, 4, 2, 4, 3, 1, 3, 6, 2, 4, // cx
+    2, 3, 3, 1, 3, 4, 2, 4, 2, 4, 3, 1, 3, 1, 2, 4, // dx
+    3, 3, 2, 1, 1, 4, 2, 4, 4, 1, 4, 1, 1, 1, 2, 4, // ex
+    3, 3, 2, 1, 1, 4, 2, 4, 3, 2, 4, 1, 1, 1, 2, 4, // fx
+];
+
+/// M-cycles of every CB opcode on top of the prefix itself.
+pub(crate) static CB_CYCLES: [u8; 256] = cb_cycles();
+
+/// Extra M-cycles a taken JR cc or JP cc spends loading the new pc.
+pub(crate) const JUMP_TAKEN: u8 = 1;
+/// Extra M-cycles a taken CALL cc spends pushing the return address.
+pub(crate) const CALL_TAKEN: u8 = 3;
+/// Extra M-cycles a taken RET cc spends popping the return address.
+pub(crate) const RETURN_TAKEN: u8 = 3;
+/// M-cycles from taking an interrupt to the first opcode of its handler.
+pub(crate) const INTERRUPT: u8 = 5;
+
+/// Register operands take one more cycle, (HL) ones a read and, except for
+/// BIT, a write back.
+const fn cb_cycles() -> [u8; 256] {
+    let mut table = [1; 256];
+    let mut byte = 0;
+    while byte < table.len() {
+        if byte & 0x07 == 0x06 {
+            table[byte] = if byte >= 0x40 && byte <= 0x7f { 2 } else { 3 };
+        }
+        byte += 1;
+    }
+    table
+}
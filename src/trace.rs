@@ -0,0 +1,94 @@
+use std::fmt::Arguments;
+
+#[cfg(feature = "trace")]
+mod sink {
+    use std::{
+        cell::RefCell,
+        env,
+        fmt::Arguments,
+        fs::File,
+        io::{self, Write},
+        sync::OnceLock,
+    };
+
+    const CAPACITY: usize = 1 << 16;
+
+    /// The `CASH_GB_TRACE` file, created once however many threads trace
+    /// into it.
+    static FILE: OnceLock<Option<File>> = OnceLock::new();
+
+    /// Lines a thread has traced but not handed over yet, the rest is
+    /// handed over when the thread exits.
+    struct Lines(Vec<u8>);
+
+    impl Lines {
+        /// Writes out the buffered lines in one go, so lines from different
+        /// threads never interleave.
+        fn hand_over(&mut self) {
+            if self.0.is_empty() {
+                return;
+            }
+            let file = FILE.get_or_init(|| {
+                env::var_os("CASH_GB_TRACE").and_then(|path| File::create(path).ok())
+            });
+            let _ = match file.as_ref() {
+                Some(mut file) => file.write_all(&self.0),
+                None => io::stdout().lock().write_all(&self.0),
+            };
+            self.0.clear();
+        }
+    }
+
+    impl Drop for Lines {
+        fn drop(&mut self) {
+            self.hand_over();
+        }
+    }
+
+    // one buffer per thread, so tracing never contends on the file or the
+    // stdout lock; they're only touched when a full buffer is handed over
+    thread_local! {
+        static SINK: RefCell<Lines> = RefCell::new(Lines(Vec::with_capacity(CAPACITY)));
+    }
+
+    pub fn write(args: Arguments) {
+        SINK.with(|sink| {
+            let mut lines = sink.borrow_mut();
+            let _ = writeln!(lines.0, "{}", args);
+            if lines.0.len() >= CAPACITY {
+                lines.hand_over();
+            }
+        });
+    }
+
+    pub fn flush() {
+        SINK.with(|sink| sink.borrow_mut().hand_over());
+    }
+}
+
+/// Writes a trace line when the `trace` feature is enabled.
+///
+/// The call is behind `cfg!`, so without the feature the branch (and the
+/// formatting of its arguments) is removed entirely.
+macro_rules! trace {
+    ($($arg:tt)*) => {
+        if cfg!(feature = "trace") {
+            $crate::trace::write(format_args!($($arg)*));
+        }
+    };
+}
+
+pub(crate) use trace;
+
+#[inline(always)]
+pub fn write(_args: Arguments) {
+    #[cfg(feature = "trace")]
+    sink::write(_args);
+}
+
+/// Flushes the calling thread's trace buffer, traces are otherwise only
+/// written out once the buffer fills.
+pub fn flush() {
+    #[cfg(feature = "trace")]
+    sink::flush();
+}
@@ -0,0 +1,415 @@
+use std::{
+    fs::File,
+    io::{self, BufReader, BufWriter, Read, Write},
+    path::Path,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    thread::{self, JoinHandle},
+    time::Duration,
+};
+
+use crate::ring::{self, Consumer, Producer};
+
+const TRACE_MAGIC: [u8; 4] = *b"CGBT";
+const TRACE_VERSION: u8 = 1;
+/// records the ring holds, a couple of frames worth of instructions
+const RING_CAPACITY: usize = 1 << 16;
+/// records gathered on the cpu's side before they're handed over together
+const BATCH: usize = 256;
+
+// which fields changed since the previous record
+const PC: u8 = 0x01;
+const SP: u8 = 0x02;
+const AF: u8 = 0x04;
+const BC: u8 = 0x08;
+const DE: u8 = 0x10;
+const HL: u8 = 0x20;
+const PC_MEM: u8 = 0x40;
+/// mask, a full cycle delta and every field
+const MAX_ENCODED: usize = 1 + 10 + 6 * 2 + 4;
+
+/// The machine as an instruction starts.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct TraceRecord {
+    pub cycles: u64,
+    pub pc: u16,
+    pub sp: u16,
+    pub af: u16,
+    pub bc: u16,
+    pub de: u16,
+    pub hl: u16,
+    /// the opcode and the three bytes after it
+    pub pc_mem: [u8; 4],
+}
+
+/// Streams `TraceRecord`s to a file off the emulation thread.
+///
+/// Records are batched on the cpu's side and queued through a lock-free
+/// ring to a writer thread, which delta encodes each against the one
+/// before: usually just the cycle delta, pc and opcode bytes, around 10
+/// bytes in place of 24. A trace is only worth comparing if it's complete,
+/// so a full ring makes the cpu yield until the writer catches up rather
+/// than dropping anything.
+pub struct Tracer {
+    records: Producer<TraceRecord>,
+    batch: [TraceRecord; BATCH],
+    len: usize,
+    done: Arc<AtomicBool>,
+    writer: Option<JoinHandle<io::Result<u64>>>,
+}
+
+impl Tracer {
+    pub fn create(path: impl AsRef<Path>) -> io::Result<Self> {
+        let mut out = BufWriter::new(File::create(path)?);
+        out.write_all(&TRACE_MAGIC)?;
+        out.write_all(&[TRACE_VERSION])?;
+
+        let (records, consumer) = ring::channel(RING_CAPACITY);
+        let done = Arc::new(AtomicBool::new(false));
+        let writer = {
+            let done = done.clone();
+            thread::Builder::new()
+                .name("trace writer".into())
+                .spawn(move || drain(consumer, out, &done))?
+        };
+        Ok(Self {
+            records,
+            batch: [TraceRecord::default(); BATCH],
+            len: 0,
+            done,
+            writer: Some(writer),
+        })
+    }
+
+    #[inline(always)]
+    pub(crate) fn record(&mut self, record: TraceRecord) {
+        self.batch[self.len] = record;
+        self.len += 1;
+        if self.len == BATCH {
+            self.hand_over();
+        }
+    }
+
+    fn hand_over(&mut self) {
+        let mut sent = 0;
+        while sent < self.len {
+            sent += self.records.push_slice(&self.batch[sent..self.len]);
+            if sent < self.len {
+                thread::yield_now();
+            }
+        }
+        self.len = 0;
+    }
+
+    /// Writes out everything recorded and closes the file, returning the
+    /// number of records in it.
+    pub fn finish(mut self) -> io::Result<u64> {
+        self.close()
+    }
+
+    fn close(&mut self) -> io::Result<u64> {
+        let Some(writer) = self.writer.take() else {
+            return Ok(0);
+        };
+        self.hand_over();
+        self.done.store(true, Ordering::Release);
+        writer.thread().unpark();
+        match writer.join() {
+            Ok(result) => result,
+            Err(_) => Err(io::Error::other("trace writer panicked")),
+        }
+    }
+}
+
+impl Drop for Tracer {
+    fn drop(&mut self) {
+        // finish is the way to hear about errors
+        let _ = self.close();
+    }
+}
+
+fn drain(
+    mut records: Consumer<TraceRecord>,
+    mut out: BufWriter<File>,
+    done: &AtomicBool,
+) -> io::Result<u64> {
+    let mut buffer = vec![TraceRecord::default(); records.capacity()];
+    let mut encoded = vec![];
+    let mut last = TraceRecord::default();
+    let mut written = 0;
+    loop {
+        // everything is queued by the time done is seen
+        let finished = done.load(Ordering::Acquire);
+        let count = records.pop_slice(&mut buffer);
+        if count == 0 {
+            if finished {
+                out.flush()?;
+                return Ok(written);
+            }
+            thread::park_timeout(Duration::from_millis(1));
+            continue;
+        }
+        encoded.clear();
+        for record in &buffer[..count] {
+            let mut bytes = [0; MAX_ENCODED];
+            let len = encode(&mut bytes, &last, record);
+            encoded.extend_from_slice(&bytes[..len]);
+            last = *record;
+        }
+        out.write_all(&encoded)?;
+        written += count as u64;
+    }
+}
+
+/// Writes `record` as a mask of the fields that differ from `last`, the
+/// cycle delta as a varint and then those fields, returning the length.
+fn encode(out: &mut [u8; MAX_ENCODED], last: &TraceRecord, record: &TraceRecord) -> usize {
+    let mut len = 1;
+    let mut delta = record.cycles.wrapping_sub(last.cycles);
+    while delta >= 0x80 {
+        out[len] = delta as u8 | 0x80;
+        delta >>= 7;
+        len += 1;
+    }
+    out[len] = delta as u8;
+    len += 1;
+
+    let mut mask = 0;
+    let fields = [
+        (PC, last.pc, record.pc),
+        (SP, last.sp, record.sp),
+        (AF, last.af, record.af),
+        (BC, last.bc, record.bc),
+        (DE, last.de, record.de),
+        (HL, last.hl, record.hl),
+    ];
+    for (bit, old, new) in fields {
+        if old != new {
+            mask |= bit;
+            out[len..len + 2].copy_from_slice(&new.to_le_bytes());
+            len += 2;
+        }
+    }
+    if last.pc_mem != record.pc_mem {
+        mask |= PC_MEM;
+        out[len..len + 4].copy_from_slice(&record.pc_mem);
+        len += 4;
+    }
+    out[0] = mask;
+    len
+}
+
+/// Reads the records of a trace written by `Tracer`.
+pub struct TraceReader<R> {
+    input: R,
+    last: TraceRecord,
+}
+
+impl TraceReader<BufReader<File>> {
+    pub fn open(path: impl AsRef<Path>) -> io::Result<Self> {
+        Self::new(BufReader::new(File::open(path)?))
+    }
+}
+
+impl<R: Read> TraceReader<R> {
+    pub fn new(mut input: R) -> io::Result<Self> {
+        let mut header = [0; 5];
+        input.read_exact(&mut header)?;
+        if header[..4] != TRACE_MAGIC || header[4] != TRACE_VERSION {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "not a trace"));
+        }
+        Ok(Self {
+            input,
+            last: TraceRecord::default(),
+        })
+    }
+
+    fn byte(&mut self) -> io::Result<u8> {
+        let mut byte = [0];
+        self.input.read_exact(&mut byte)?;
+        Ok(byte[0])
+    }
+
+    fn next_record(&mut self) -> io::Result<Option<TraceRecord>> {
+        let mask = match self.byte() {
+            Ok(mask) => mask,
+            Err(error) if error.kind() == io::ErrorKind::UnexpectedEof => return Ok(None),
+            Err(error) => return Err(error),
+        };
+        let mut record = self.last;
+
+        let (mut delta, mut shift) = (0u64, 0);
+        loop {
+            let byte = self.byte()?;
+            delta |= ((byte & 0x7f) as u64) << shift;
+            if byte & 0x80 == 0 {
+                break;
+            }
+            shift += 7;
+            if shift >= 64 {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "bad cycle delta",
+                ));
+            }
+        }
+        record.cycles = record.cycles.wrapping_add(delta);
+
+        let fields = [
+            (PC, &mut record.pc),
+            (SP, &mut record.sp),
+            (AF, &mut record.af),
+            (BC, &mut record.bc),
+            (DE, &mut record.de),
+            (HL, &mut record.hl),
+        ];
+        for (bit, field) in fields {
+            if mask & bit != 0 {
+                let mut value = [0; 2];
+                self.input.read_exact(&mut value)?;
+                *field = u16::from_le_bytes(value);
+            }
+        }
+        if mask & PC_MEM != 0 {
+            self.input.read_exact(&mut record.pc_mem)?;
+        }
+        self.last = record;
+        Ok(Some(record))
+    }
+}
+
+impl<R: Read> Iterator for TraceReader<R> {
+    type Item = io::Result<TraceRecord>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        self.next_record().transpose()
+    }
+}
+
+/// Formats a trace as a gameboy-doctor log, one line per instruction.
+pub fn write_doctor_log<R: Read>(trace: TraceReader<R>, out: &mut impl Write) -> io::Result<()> {
+    for record in trace {
+        let r = record?;
+        let [a, f] = r.af.to_be_bytes();
+        let [b, c] = r.bc.to_be_bytes();
+        let [d, e] = r.de.to_be_bytes();
+        let [h, l] = r.hl.to_be_bytes();
+        let m = r.pc_mem;
+        writeln!(
+            out,
+            "A:{a:02X} F:{f:02X} B:{b:02X} C:{c:02X} D:{d:02X} E:{e:02X} H:{h:02X} L:{l:02X} \
+             SP:{:04X} PC:{:04X} PCMEM:{:02X},{:02X},{:02X},{:02X}",
+            r.sp, r.pc, m[0], m[1], m[2], m[3]
+        )?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A trace file of `records` as the writer thread would encode them.
+    fn trace(records: &[TraceRecord]) -> Vec<u8> {
+        let mut bytes = TRACE_MAGIC.to_vec();
+        bytes.push(TRACE_VERSION);
+        let mut last = TraceRecord::default();
+        for record in records {
+            let mut encoded = [0; MAX_ENCODED];
+            let len = encode(&mut encoded, &last, record);
+            bytes.extend_from_slice(&encoded[..len]);
+            last = *record;
+        }
+        bytes
+    }
+
+    fn read(bytes: &[u8]) -> io::Result<Vec<TraceRecord>> {
+        TraceReader::new(bytes)?.collect()
+    }
+
+    const BOOTED: TraceRecord = TraceRecord {
+        cycles: 0,
+        pc: 0x0100,
+        sp: 0xfffe,
+        af: 0x01b0,
+        bc: 0x0013,
+        de: 0x00d8,
+        hl: 0x014d,
+        pc_mem: [0x00, 0xc3, 0x13, 0x02],
+    };
+
+    #[test]
+    fn round_trips() {
+        let every_field = TraceRecord {
+            cycles: 4,
+            pc: 0x0213,
+            sp: 0xdff0,
+            af: 0x1280,
+            bc: 0x3456,
+            de: 0x789a,
+            hl: 0xbcde,
+            pc_mem: [0xcb, 0x11, 0x00, 0xff],
+        };
+        let pc_only = TraceRecord {
+            cycles: 5,
+            pc: 0x0214,
+            ..every_field
+        };
+        let far = TraceRecord {
+            cycles: u64::MAX - 1,
+            ..pc_only
+        };
+        // the clock wrapping round is a small delta again
+        let back = TraceRecord { cycles: 1, ..far };
+        let records = [BOOTED, every_field, every_field, pc_only, far, back];
+        let bytes = trace(&records);
+        assert_eq!(read(&bytes).unwrap(), records);
+
+        // an unchanged record is just its mask and a zero delta
+        let mut encoded = [0; MAX_ENCODED];
+        assert_eq!(encode(&mut encoded, &every_field, &every_field), 2);
+        assert_eq!(encode(&mut encoded, &pc_only, &far), 1 + 10);
+        assert_eq!(encode(&mut encoded, &far, &back), 2);
+    }
+
+    #[test]
+    fn turns_down_bad_traces() {
+        assert_eq!(
+            read(b"CGBX\x01").unwrap_err().kind(),
+            io::ErrorKind::InvalidData
+        );
+
+        let mut bytes = trace(&[]);
+        // a cycle delta running past 64 bits
+        bytes.push(0);
+        bytes.extend_from_slice(&[0xff; 10]);
+        bytes.push(0x01);
+        assert_eq!(read(&bytes).unwrap_err().kind(), io::ErrorKind::InvalidData);
+
+        let mut bytes = trace(&[BOOTED]);
+        bytes.truncate(bytes.len() - 1);
+        assert_eq!(
+            read(&bytes).unwrap_err().kind(),
+            io::ErrorKind::UnexpectedEof
+        );
+        let mut bytes = trace(&[]);
+        bytes.extend_from_slice(&[0, 0x80]);
+        assert_eq!(
+            read(&bytes).unwrap_err().kind(),
+            io::ErrorKind::UnexpectedEof
+        );
+    }
+
+    #[test]
+    fn writes_gameboy_doctor_lines() {
+        let bytes = trace(&[BOOTED]);
+        let mut log = vec![];
+        write_doctor_log(TraceReader::new(bytes.as_slice()).unwrap(), &mut log).unwrap();
+        assert_eq!(
+            String::from_utf8(log).unwrap(),
+            "A:01 F:B0 B:00 C:13 D:00 E:D8 H:01 L:4D SP:FFFE PC:0100 PCMEM:00,C3,13,02\n"
+        );
+    }
+}